@@ -107,6 +107,37 @@ QByteArray QBlowfish::decrypted(const QByteArray &cipherText)
     return QByteArray();
 }
 
+bool QBlowfish::ctrTransform(char *data, int length, quint32 nonce, quint64 startBlock)
+{
+    if (length <= 0) {
+        return true;
+    }
+    if (data == 0 || !init()) {
+        return false;
+    }
+    const quint64 blockCount = (static_cast<quint64>(length) + 7) / 8;
+    if (startBlock + blockCount > Q_UINT64_C(0x100000000)) {
+        qWarning("Cannot transform. The block counter would wrap around.");
+        return false;
+    }
+
+    uchar keystream[8];
+    quint32 counter = static_cast<quint32>(startBlock);
+    for (int i = 0; i < length; i += 8) {
+        quint32 xL = nonce;
+        quint32 xR = counter;
+        coreEncryptWords(&xL, &xR);
+        qToBigEndian<quint32>(xL, keystream);
+        qToBigEndian<quint32>(xR, keystream + 4);
+        int blockLength = qMin(8, length - i);
+        for (int j = 0; j < blockLength; j++) {
+            data[i + j] = static_cast<char>(static_cast<quint8>(data[i + j]) ^ keystream[j]);
+        }
+        counter++;
+    }
+    return true;
+}
+
 /*
   Core encryption code follows. This is an implementation of the Blowfish algorithm as described at:
   http://www.schneier.com/paper-blowfish-fse.html
@@ -167,6 +198,16 @@ bool QBlowfish::init()
         }
     }
 
+    for (int i = 0; i < 18; i++) {
+        m_parrayWords[i] = qFromBigEndian<quint32>(reinterpret_cast<const uchar *>(m_parray.constData() + i * 4));
+    }
+    const QByteArray *sboxes[4] = { &m_sbox1, &m_sbox2, &m_sbox3, &m_sbox4 };
+    for (int s = 0; s < 4; s++) {
+        for (int i = 0; i < 256; i++) {
+            m_sboxWords[s][i] = qFromBigEndian<quint32>(reinterpret_cast<const uchar *>(sboxes[s]->constData() + i * 4));
+        }
+    }
+
     m_initialized = true;
     return true;
 }
@@ -275,3 +316,27 @@ void QBlowfish::coreDecrypt(char *x) // decrypts 8 bytes pointed to by x, result
 
     }
 }
+
+// F(x) = ((S1,a + S2,b mod 2**32) XOR S3,c) + S4,d mod 2**32
+#define QBLOWFISH_F(x) ((((m_sboxWords[0][(x) >> 24] + m_sboxWords[1][((x) >> 16) & 0xff]) \
+                          ^ m_sboxWords[2][((x) >> 8) & 0xff]) + m_sboxWords[3][(x) & 0xff]))
+
+void QBlowfish::coreEncryptWords(quint32 *xL, quint32 *xR) const // same as coreEncrypt(), but on words
+{
+    quint32 l = *xL;
+    quint32 r = *xR;
+
+    // Two rounds per iteration, so that xL and xR need not be swapped
+    for (int i = 0; i < 16; i += 2) {
+        l ^= m_parrayWords[i];
+        r ^= QBLOWFISH_F(l);
+        r ^= m_parrayWords[i + 1];
+        l ^= QBLOWFISH_F(r);
+    }
+
+    // The last round does not swap, so xR = xR XOR P17; xL = xL XOR P18 translates to:
+    *xL = r ^ m_parrayWords[17];
+    *xR = l ^ m_parrayWords[16];
+}
+
+#undef QBLOWFISH_F
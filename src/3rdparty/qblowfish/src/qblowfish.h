@@ -31,16 +31,33 @@ public:
     QByteArray encrypted(const QByteArray &clearText);
     QByteArray decrypted(const QByteArray &cipherText);
 
+    // Counter (CTR) mode
+    // Encrypts / decrypts (it's the same operation) 'length' bytes at 'data' in-place by
+    // XOR-ing them with the keystream block E(nonce || n) for the n-th 8-byte block,
+    // starting with n = startBlock. The nonce and n are 32 bits each, so a stream can be at most
+    // 2^32 blocks (32 GB). A 32-bit nonce is too few bits to pick at random for every stream
+    // under one key; give each stream a key of its own instead.
+    // 'length' need not be a multiple of 8. Padding is not used.
+    // Passing the right startBlock allows any block-aligned part of a stream to be processed on its own.
+    bool ctrTransform(char *data, int length, quint32 nonce, quint64 startBlock = 0);
+
 private:
     // core encrypt/decrypt methods, encrypts/decrypts in-place
     void coreEncrypt(char *x);
     void coreDecrypt(char *x);
 
+    // core encrypt method working on the two 32-bit halves, for bulk encryption
+    void coreEncryptWords(quint32 *xL, quint32 *xR) const;
+
     QByteArray m_key;
     bool m_initialized;
     bool m_paddingEnabled;
     QByteArray m_parray;
     QByteArray m_sbox1, m_sbox2, m_sbox3, m_sbox4;
+
+    // The same p-array and s-boxes, as native-endian words, for coreEncryptWords()
+    quint32 m_parrayWords[18];
+    quint32 m_sboxWords[4][256];
 };
 
 #endif // QBLOWFISH_H
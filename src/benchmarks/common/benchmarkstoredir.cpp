@@ -0,0 +1,77 @@
+/*
+  This file is part of Notekeeper Open and is licensed under the MIT License
+
+  Copyright (C) 2011-2015 Roopesh Chander <roop@roopc.net>
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject
+  to the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+  BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+  ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+  CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+#include "benchmarkstoredir.h"
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QCoreApplication>
+
+BenchmarkStoreDir::BenchmarkStoreDir(const QString &name)
+    : m_path(QDir::tempPath() + QString("/notekeeper-%1-%2").arg(name).arg(QCoreApplication::applicationPid()))
+{
+}
+
+QString BenchmarkStoreDir::path() const
+{
+    return m_path;
+}
+
+bool BenchmarkStoreDir::create()
+{
+    if (!removeDirRecursively(m_path) || !QDir().mkpath(m_path)) {
+        return false;
+    }
+    m_previousCurrentPath = QDir::currentPath();
+    return QDir::setCurrent(m_path);
+}
+
+bool BenchmarkStoreDir::remove()
+{
+    if (!m_previousCurrentPath.isEmpty()) {
+        QDir::setCurrent(m_previousCurrentPath);
+        m_previousCurrentPath.clear();
+    }
+    return removeDirRecursively(m_path);
+}
+
+bool BenchmarkStoreDir::removeDirRecursively(const QString &path)
+{
+    QDir dir(path);
+    if (!dir.exists()) {
+        return true;
+    }
+    foreach (const QFileInfo &fileInfo, dir.entryInfoList(QDir::AllEntries | QDir::Hidden | QDir::System | QDir::NoDotAndDotDot)) {
+        if (fileInfo.isDir() && !fileInfo.isSymLink()) {
+            if (!removeDirRecursively(fileInfo.absoluteFilePath())) {
+                return false;
+            }
+        } else if (!QFile::remove(fileInfo.absoluteFilePath())) {
+            return false;
+        }
+    }
+    return dir.rmdir(path);
+}
@@ -0,0 +1,53 @@
+/*
+  This file is part of Notekeeper Open and is licensed under the MIT License
+
+  Copyright (C) 2011-2015 Roopesh Chander <roop@roopc.net>
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject
+  to the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+  BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+  ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+  CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+
+#ifndef BENCHMARKSTOREDIR_H
+#define BENCHMARKSTOREDIR_H
+
+#include <QString>
+
+// A dir of its own for a benchmark's store. The store is created in the current dir (see
+// StorageManager::resolvedNotesDataLocation()), so create() makes the dir the current dir, and
+// remove() goes back to the previous current dir and removes the dir with the store in it.
+
+class BenchmarkStoreDir
+{
+public:
+    BenchmarkStoreDir(const QString &name); // the dir is <temp dir>/notekeeper-<name>-<pid>
+
+    QString path() const;
+    bool create(); // starts with an empty dir, even if an earlier run left one behind
+    bool remove();
+
+private:
+    static bool removeDirRecursively(const QString &path);
+
+    const QString m_path;
+    QString m_previousCurrentPath;
+};
+
+#endif // BENCHMARKSTOREDIR_H
@@ -0,0 +1,7 @@
+# Shared by the benchmarks: the dir that holds a benchmark's store
+
+INCLUDEPATH += $$PWD
+
+SOURCES += $$PWD/benchmarkstoredir.cpp
+
+HEADERS += $$PWD/benchmarkstoredir.h
@@ -0,0 +1,151 @@
+/*
+  This file is part of Notekeeper Open and is licensed under the MIT License
+
+  Copyright (C) 2011-2015 Roopesh Chander <roop@roopc.net>
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject
+  to the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+  BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+  ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+  CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+
+// Measures getting the summary of a note for the notes list, for notes of 1 KB to 2 MB. noteSummaryData() takes
+// the summary stored at write time. noteSummaryFromContent() does what noteSummaryData() used to do: read the
+// whole content and extract the summary from it.
+
+#include <QtTest/QtTest>
+#include "storage/storagemanager.h"
+#include "evernotemarkup.h"
+#include "benchmarkstoredir.h"
+
+#define ENML_HEADER "<?xml version=\"1.0\" encoding=\"UTF-8\"?>" \
+                    "<!DOCTYPE en-note SYSTEM \"http://xml.evernote.com/pub/enml2.dtd\">" \
+                    "<en-note>"
+#define ENML_FOOTER "</en-note>"
+
+static QByteArray enmlOfSize(int size)
+{
+    QByteArray enml(ENML_HEADER "<div><en-todo checked=\"false\"/>Buy milk</div>");
+    int paragraphNumber = 0;
+    while (enml.size() < size) {
+        enml += "<div>Paragraph " + QByteArray::number(++paragraphNumber)
+                + " of a note that is long enough to need more than a glance at its first few words.</div>";
+    }
+    enml += ENML_FOOTER;
+    return enml;
+}
+
+class NoteSummaryBenchmark : public QObject
+{
+    Q_OBJECT
+public:
+    NoteSummaryBenchmark();
+
+private slots:
+    void initTestCase();
+    void cleanupTestCase();
+    void noteSummaryData_data();
+    void noteSummaryData();
+    void noteSummaryFromContent_data();
+    void noteSummaryFromContent();
+
+private:
+    void addNoteSizes();
+
+    BenchmarkStoreDir m_storeDir;
+    StorageManager *m_storageManager;
+    QHash<int, QString> m_noteIdsBySize;
+};
+
+NoteSummaryBenchmark::NoteSummaryBenchmark()
+    : m_storeDir("note-summary-benchmark")
+    , m_storageManager(0)
+{
+}
+
+void NoteSummaryBenchmark::initTestCase()
+{
+    QVERIFY(m_storeDir.create());
+
+    m_storageManager = new StorageManager;
+    m_storageManager->setActiveUser("benchmark");
+    QList<int> sizes;
+    sizes << 1024 << (16 << 10) << (256 << 10) << (2 << 20);
+    foreach (int size, sizes) {
+        QString noteId = m_storageManager->createNote(QString("Note of %1 bytes").arg(size), enmlOfSize(size));
+        QVERIFY(!noteId.isEmpty());
+        m_noteIdsBySize[size] = noteId;
+    }
+}
+
+void NoteSummaryBenchmark::cleanupTestCase()
+{
+    delete m_storageManager;
+    m_storageManager = 0;
+    if (!m_storeDir.remove()) {
+        qWarning("Could not remove %s", qPrintable(m_storeDir.path()));
+    }
+}
+
+void NoteSummaryBenchmark::addNoteSizes()
+{
+    QTest::addColumn<int>("size");
+    QTest::newRow("1KB") << 1024;
+    QTest::newRow("16KB") << (16 << 10);
+    QTest::newRow("256KB") << (256 << 10);
+    QTest::newRow("2MB") << (2 << 20);
+}
+
+void NoteSummaryBenchmark::noteSummaryData_data()
+{
+    addNoteSizes();
+}
+
+void NoteSummaryBenchmark::noteSummaryData()
+{
+    QFETCH(int, size);
+    const QString noteId = m_noteIdsBySize.value(size);
+    QVariantMap summaryData;
+    QBENCHMARK {
+        summaryData = m_storageManager->noteSummaryData(noteId);
+    }
+    QVERIFY(summaryData.value("ContentSummary").toString().startsWith("Buy milk Paragraph 1"));
+    QCOMPARE(summaryData.value("UncheckedTodoCount").toInt(), 1);
+}
+
+void NoteSummaryBenchmark::noteSummaryFromContent_data()
+{
+    addNoteSizes();
+}
+
+void NoteSummaryBenchmark::noteSummaryFromContent()
+{
+    QFETCH(int, size);
+    const QString noteId = m_noteIdsBySize.value(size);
+    QString contentSummary;
+    QBENCHMARK {
+        QByteArray enmlContent = m_storageManager->noteData(noteId).value("Content").toByteArray();
+        contentSummary = EvernoteMarkup::plainTextFromEnml(enmlContent, 100);
+    }
+    QCOMPARE(contentSummary, m_storageManager->noteSummaryData(noteId).value("ContentSummary").toString());
+}
+
+QTEST_MAIN(NoteSummaryBenchmark)
+
+#include "notesummarybenchmark.moc"
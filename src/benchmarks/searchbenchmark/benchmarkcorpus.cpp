@@ -0,0 +1,220 @@
+/*
+  This file is part of Notekeeper Open and is licensed under the MIT License
+
+  Copyright (C) 2011-2015 Roopesh Chander <roop@roopc.net>
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject
+  to the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+  BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+  ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+  CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+
+#include "benchmarkcorpus.h"
+#include "storage/storagemanager.h"
+#include <QDateTime>
+#include <QHash>
+#include <QStringBuilder>
+#include <qmath.h>
+
+#define VOCABULARY_SIZE 20000
+#define NOTES_PER_IMPORT 500
+
+#define ENML_HEADER "<?xml version=\"1.0\" encoding=\"UTF-8\"?>" \
+                    "<!DOCTYPE en-note SYSTEM \"http://xml.evernote.com/pub/enml2.dtd\">" \
+                    "<en-note>"
+#define ENML_FOOTER "</en-note>"
+
+static const char * const SYLLABLES[] = {
+    "ba", "ke", "ri", "so", "tu", "la", "me", "ni", "po", "gu", "da", "fe", "hi", "jo", "ku", "mar",
+    "nel", "pir", "sot", "vun", "tra", "ble", "cro", "dri", "fla", "gro", "pla", "sti", "wen", "zor", "qua", "yel"
+};
+static const int SYLLABLE_COUNT = int(sizeof(SYLLABLES) / sizeof(SYLLABLES[0]));
+
+// Words planted in the note content, with the share of notes (per mille) that have them
+static const struct { const char *word; int perMille; } PLANTED_WORDS[] = {
+    { "project", 200 },
+    { "meeting", 150 },
+    { "budget", 100 },
+    { "review", 80 },
+    { "recipe", 50 },
+    { "travel", 50 },
+    { "zeppelin", 5 }
+};
+static const int PLANTED_WORD_COUNT = int(sizeof(PLANTED_WORDS) / sizeof(PLANTED_WORDS[0]));
+#define PLANTED_PHRASE "quarterly budget review"
+#define PLANTED_PHRASE_PER_MILLE 20
+#define TITLE_PLANTED_WORD "meeting"
+#define TITLE_PLANTED_WORD_PER_MILLE 50
+#define TODO_PER_MILLE 100
+
+static const char * const NOTEBOOK_NAMES[] = { "Work", "Personal", "Recipes", "Travel", "Archive" };
+static const int NOTEBOOK_COUNT = int(sizeof(NOTEBOOK_NAMES) / sizeof(NOTEBOOK_NAMES[0]));
+static const char * const TAG_NAMES[] = { "urgent", "reference", "ideas", "followup", "family", "finance" };
+static const int TAG_COUNT = int(sizeof(TAG_NAMES) / sizeof(TAG_NAMES[0]));
+
+BenchmarkCorpus::BenchmarkCorpus(int noteCount, quint32 seed)
+    : m_noteCount(noteCount)
+    , m_seed(seed)
+    , m_state(seed? seed : DEFAULT_SEED)
+{
+}
+
+int BenchmarkCorpus::noteCount() const
+{
+    return m_noteCount;
+}
+
+quint32 BenchmarkCorpus::seed() const
+{
+    return m_seed;
+}
+
+void BenchmarkCorpus::createNotes(StorageManager *storageManager)
+{
+    m_state = (m_seed? m_seed : quint32(DEFAULT_SEED));
+    QStringList notebookIds;
+    for (int i = 0; i < NOTEBOOK_COUNT; i++) {
+        notebookIds << storageManager->createNotebook(QString::fromLatin1(NOTEBOOK_NAMES[i]));
+    }
+
+    // Notes are created a note every few hours from the start of 2014, so that date qualifiers match a known share
+    const qint64 baseTime = QDateTime(QDate(2014, 1, 1), QTime(0, 0), Qt::UTC).toMSecsSinceEpoch();
+    QHash<int, QList<QVariantMap> > pendingNotesByNotebook;
+    for (int i = 0; i < m_noteCount; i++) {
+        // Notebooks get unequal shares of the notes, like the first notebook getting about half of them
+        int notebookIndex = qMin(int(-qLn(1.0 - (nextRandom() / 4294967296.0)) * 1.4), NOTEBOOK_COUNT - 1);
+        QList<QVariantMap> &pendingNotes = pendingNotesByNotebook[notebookIndex];
+        pendingNotes << noteData(i, baseTime);
+        if (pendingNotes.count() >= NOTES_PER_IMPORT) {
+            storageManager->createImportedNotes(pendingNotes, notebookIds.at(notebookIndex));
+            pendingNotes.clear();
+        }
+    }
+    for (int notebookIndex = 0; notebookIndex < NOTEBOOK_COUNT; notebookIndex++) {
+        const QList<QVariantMap> &pendingNotes = pendingNotesByNotebook.value(notebookIndex);
+        if (!pendingNotes.isEmpty()) {
+            storageManager->createImportedNotes(pendingNotes, notebookIds.at(notebookIndex));
+        }
+    }
+}
+
+quint32 BenchmarkCorpus::nextRandom()
+{
+    // xorshift32, so that the corpus doesn't depend on the platform's qrand()
+    m_state ^= (m_state << 13);
+    m_state ^= (m_state >> 17);
+    m_state ^= (m_state << 5);
+    return m_state;
+}
+
+int BenchmarkCorpus::randomBelow(int n)
+{
+    return int(nextRandom() % quint32(n));
+}
+
+bool BenchmarkCorpus::randomChance(int perMille)
+{
+    return (randomBelow(1000) < perMille);
+}
+
+QString BenchmarkCorpus::vocabularyWord(int rank) const
+{
+    // Two to four syllables, spelling out the rank, so that every rank has a distinct word
+    QString word = QString::fromLatin1(SYLLABLES[rank % SYLLABLE_COUNT]);
+    rank /= SYLLABLE_COUNT;
+    word += QString::fromLatin1(SYLLABLES[rank % SYLLABLE_COUNT]);
+    rank /= SYLLABLE_COUNT;
+    while (rank > 0) {
+        word += QString::fromLatin1(SYLLABLES[(rank - 1) % SYLLABLE_COUNT]);
+        rank = (rank - 1) / SYLLABLE_COUNT;
+    }
+    return word;
+}
+
+QString BenchmarkCorpus::randomWord()
+{
+    // A log-uniform rank approximates Zipf's law: a few words are very common, most are rare
+    qreal u = nextRandom() / 4294967296.0;
+    int rank = qMin(int(qPow(VOCABULARY_SIZE, u)) - 1, VOCABULARY_SIZE - 1);
+    return vocabularyWord(rank);
+}
+
+QString BenchmarkCorpus::randomWords(int count)
+{
+    QStringList words;
+    for (int i = 0; i < count; i++) {
+        words << randomWord();
+    }
+    return words.join(" ");
+}
+
+QVariantMap BenchmarkCorpus::noteData(int noteIndex, qint64 baseTime)
+{
+    QVariantMap data;
+
+    QString title = randomWords(2 + randomBelow(4));
+    if (randomChance(TITLE_PLANTED_WORD_PER_MILLE)) {
+        title += QLatin1String(" " TITLE_PLANTED_WORD);
+    }
+    data["Title"] = title;
+
+    // 50 to 400 words, in paragraphs of 10 to 40 words, with the planted words and phrase at random paragraphs
+    QStringList paragraphs;
+    int remainingWordCount = 50 + randomBelow(351);
+    while (remainingWordCount > 0) {
+        int paragraphWordCount = qMin(10 + randomBelow(31), remainingWordCount);
+        paragraphs << randomWords(paragraphWordCount);
+        remainingWordCount -= paragraphWordCount;
+    }
+    for (int i = 0; i < PLANTED_WORD_COUNT; i++) {
+        if (randomChance(PLANTED_WORDS[i].perMille)) {
+            paragraphs[randomBelow(paragraphs.count())] += QLatin1String(" ") + QLatin1String(PLANTED_WORDS[i].word);
+        }
+    }
+    if (randomChance(PLANTED_PHRASE_PER_MILLE)) {
+        paragraphs[randomBelow(paragraphs.count())] += QLatin1String(" " PLANTED_PHRASE);
+    }
+    QString content;
+    if (randomChance(TODO_PER_MILLE)) {
+        content += QString("<div><en-todo checked=\"%1\"/>").arg(randomChance(500)? "true" : "false") % randomWords(3) % "</div>";
+    }
+    foreach (const QString &paragraph, paragraphs) {
+        content += QLatin1String("<div>") % paragraph % QLatin1String("</div>");
+    }
+    data["Content"] = QByteArray(ENML_HEADER) + content.toUtf8() + QByteArray(ENML_FOOTER);
+
+    qint64 createdTime = baseTime + qint64(noteIndex) * 3 * 3600 * 1000 + qint64(randomBelow(3 * 3600)) * 1000;
+    qint64 updatedTime = createdTime + qint64(randomBelow(30 * 24 * 3600)) * 1000;
+    data["CreatedTime"] = createdTime;
+    data["UpdatedTime"] = updatedTime;
+
+    QStringList tagNames;
+    int tagCount = randomBelow(4);
+    for (int i = 0; i < tagCount; i++) {
+        QString tagName = QString::fromLatin1(TAG_NAMES[randomBelow(TAG_COUNT)]);
+        if (!tagNames.contains(tagName)) {
+            tagNames << tagName;
+        }
+    }
+    if (!tagNames.isEmpty()) {
+        data["TagNames"] = tagNames;
+    }
+
+    return data;
+}
@@ -0,0 +1,72 @@
+/*
+  This file is part of Notekeeper Open and is licensed under the MIT License
+
+  Copyright (C) 2011-2015 Roopesh Chander <roop@roopc.net>
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject
+  to the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+  BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+  ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+  CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+
+#ifndef BENCHMARKCORPUS_H
+#define BENCHMARKCORPUS_H
+
+#include <QString>
+#include <QStringList>
+#include <QVariantMap>
+
+class StorageManager;
+
+// A corpus of notes generated from a fixed seed, so that every run, on every commit, searches the same notes.
+// The words are drawn from a generated vocabulary with a Zipf-like distribution. A few real words, a phrase,
+// notebooks, tags and to-dos are planted at fixed rates, so that the benchmark queries match predictable shares
+// of the notes. VERSION goes up whenever the generated notes change, since results are comparable only
+// across runs over the same corpus.
+
+class BenchmarkCorpus
+{
+public:
+    enum {
+        VERSION = 1,
+        DEFAULT_SEED = 20150101
+    };
+
+    BenchmarkCorpus(int noteCount, quint32 seed = DEFAULT_SEED);
+    int noteCount() const;
+    quint32 seed() const;
+
+    // Creates the notes, their notebooks and their tags in the active user's store
+    void createNotes(StorageManager *storageManager);
+
+private:
+    quint32 nextRandom();
+    int randomBelow(int n);
+    bool randomChance(int perMille);
+    QString vocabularyWord(int rank) const;
+    QString randomWord();
+    QString randomWords(int count);
+    QVariantMap noteData(int noteIndex, qint64 baseTime);
+
+    const int m_noteCount;
+    const quint32 m_seed;
+    quint32 m_state;
+};
+
+#endif // BENCHMARKCORPUS_H
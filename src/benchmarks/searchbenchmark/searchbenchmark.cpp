@@ -0,0 +1,310 @@
+/*
+  This file is part of Notekeeper Open and is licensed under the MIT License
+
+  Copyright (C) 2011-2015 Roopesh Chander <roop@roopc.net>
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject
+  to the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+  BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+  ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+  CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+
+// Measures local search over a generated corpus (see benchmarkcorpus.h), for a catalogue of queries covering
+// each kind of search term. Every query is run with a warm cache (the store and the search index already
+// loaded) and with a cold cache (a new StorageManager for each run, loading the index from disk). For each,
+// the latency percentiles, the notes the query was evaluated for and the bytes read are printed as a
+// "search-benchmark" line, so that runs on different commits can be compared line by line.
+//
+// Environment variables:
+//   NOTEKEEPER_BENCHMARK_NOTE_COUNT        notes in the corpus (default 5000)
+//   NOTEKEEPER_BENCHMARK_ITERATIONS        timed runs per query with a warm cache (default 30)
+//   NOTEKEEPER_BENCHMARK_COLD_ITERATIONS   timed runs per query with a cold cache (default 10)
+//   NOTEKEEPER_BENCHMARK_DROP_CACHES       if 1, the OS page cache is also dropped before each cold run (needs root)
+
+#include <QtTest/QtTest>
+#include <QFile>
+#include <QElapsedTimer>
+#include <stdio.h>
+#include "storage/storagemanager.h"
+#include "storage/searchindex.h"
+#include "searchlocalnotesthread.h"
+#include "benchmarkcorpus.h"
+#include "benchmarkstoredir.h"
+#include "qplatformdefs.h"
+
+#ifdef Q_OS_LINUX
+#include <unistd.h>
+#endif
+
+#define DEFAULT_NOTE_COUNT 5000
+#define DEFAULT_WARM_ITERATIONS 30
+#define DEFAULT_COLD_ITERATIONS 10
+
+static int intFromEnvironment(const char *name, int defaultValue)
+{
+    bool ok = false;
+    int value = qgetenv(name).toInt(&ok);
+    return ((ok && value > 0)? value : defaultValue);
+}
+
+// Bytes read by the process so far: all reads (rchar) and the reads that reached the disk (read_bytes).
+// Returns false where /proc/self/io is not available.
+static bool readProcessIo(qint64 *charsRead, qint64 *diskBytesRead)
+{
+#ifdef Q_OS_LINUX
+    QFile file("/proc/self/io");
+    if (!file.open(QIODevice::ReadOnly)) {
+        return false;
+    }
+    bool isCharsReadFound = false, isDiskBytesReadFound = false;
+    foreach (const QByteArray &line, file.readAll().split('\n')) {
+        if (line.startsWith("rchar:")) {
+            (*charsRead) = line.mid(6).trimmed().toLongLong(&isCharsReadFound);
+        } else if (line.startsWith("read_bytes:")) {
+            (*diskBytesRead) = line.mid(11).trimmed().toLongLong(&isDiskBytesReadFound);
+        }
+    }
+    return (isCharsReadFound && isDiskBytesReadFound);
+#else
+    Q_UNUSED(charsRead);
+    Q_UNUSED(diskBytesRead);
+    return false;
+#endif
+}
+
+static bool dropPageCache()
+{
+#ifdef Q_OS_LINUX
+    ::sync();
+    QFile file("/proc/sys/vm/drop_caches");
+    if (!file.open(QIODevice::WriteOnly)) {
+        return false;
+    }
+    return (file.write("3\n") == 2);
+#else
+    return false;
+#endif
+}
+
+class SearchBenchmark : public QObject
+{
+    Q_OBJECT
+public:
+    SearchBenchmark();
+
+public slots: // not private, because QTestLib would run private slots as tests
+    void collectMatchingNotes(const QStringList &noteIds);
+
+private slots:
+    void initTestCase();
+    void cleanupTestCase();
+    void searchWarmCache_data();
+    void searchWarmCache();
+    void searchColdCache_data();
+    void searchColdCache();
+
+private:
+    struct QueryRun {
+        qint64 nsecsElapsed;
+        int matchCount;
+        int searchedNotesCount;
+        qint64 charsRead; // -1 if unknown
+        qint64 diskBytesRead; // -1 if unknown
+    };
+
+    void addQueryCatalogue();
+    QueryRun runQuery(StorageManager *storageManager, const QString &query);
+    void reportRuns(const char *mode, const QList<QueryRun> &runs);
+
+    BenchmarkStoreDir m_storeDir;
+    StorageManager *m_warmStorageManager;
+    int m_warmIterationCount, m_coldIterationCount;
+    bool m_isDroppingPageCache;
+    qint64 m_ioReadingOverhead; // the bytes counted for reading /proc/self/io itself
+    int m_collectedMatchCount;
+};
+
+SearchBenchmark::SearchBenchmark()
+    : m_storeDir("search-benchmark")
+    , m_warmStorageManager(0)
+    , m_warmIterationCount(intFromEnvironment("NOTEKEEPER_BENCHMARK_ITERATIONS", DEFAULT_WARM_ITERATIONS))
+    , m_coldIterationCount(intFromEnvironment("NOTEKEEPER_BENCHMARK_COLD_ITERATIONS", DEFAULT_COLD_ITERATIONS))
+    , m_isDroppingPageCache(qgetenv("NOTEKEEPER_BENCHMARK_DROP_CACHES") == "1")
+    , m_ioReadingOverhead(0)
+    , m_collectedMatchCount(0)
+{
+}
+
+void SearchBenchmark::collectMatchingNotes(const QStringList &noteIds)
+{
+    m_collectedMatchCount += noteIds.count();
+}
+
+void SearchBenchmark::initTestCase()
+{
+    QVERIFY(m_storeDir.create());
+
+    BenchmarkCorpus corpus(intFromEnvironment("NOTEKEEPER_BENCHMARK_NOTE_COUNT", DEFAULT_NOTE_COUNT));
+    m_warmStorageManager = new StorageManager;
+    m_warmStorageManager->setActiveUser("benchmark");
+    QElapsedTimer timer;
+    timer.start();
+    corpus.createNotes(m_warmStorageManager);
+    qint64 corpusMsecs = timer.restart();
+    QSharedPointer<SearchIndex> searchIndex = m_warmStorageManager->searchIndex();
+    QVERIFY(!searchIndex.isNull());
+    searchIndex->refresh();
+    QCOMPARE(searchIndex->pendingNoteCount(), 0);
+    qint64 indexingMsecs = timer.elapsed();
+    SearchIndex::Statistics statistics = searchIndex->statistics();
+
+    qint64 charsRead = 0, diskBytesRead = 0, charsReadAgain = 0;
+    if (readProcessIo(&charsRead, &diskBytesRead) && readProcessIo(&charsReadAgain, &diskBytesRead)) {
+        m_ioReadingOverhead = charsReadAgain - charsRead;
+    }
+
+    printf("search-benchmark-corpus\tversion=%d\tseed=%u\tnotes=%d\tterms=%d\tpostings=%lld\tindex_bytes=%lld\t"
+           "create_ms=%lld\tindex_ms=%lld\n",
+           int(BenchmarkCorpus::VERSION), corpus.seed(), statistics.noteCount, statistics.termCount,
+           statistics.postingCount, statistics.diskSize, corpusMsecs, indexingMsecs);
+    fflush(stdout);
+}
+
+void SearchBenchmark::cleanupTestCase()
+{
+    delete m_warmStorageManager;
+    m_warmStorageManager = 0;
+    if (!m_storeDir.remove()) {
+        qWarning("Could not remove %s", qPrintable(m_storeDir.path()));
+    }
+}
+
+void SearchBenchmark::addQueryCatalogue()
+{
+    QTest::addColumn<QString>("query");
+    QTest::newRow("single_common") << QString("project");
+    QTest::newRow("single_rare") << QString("zeppelin");
+    QTest::newRow("multi_2") << QString("project budget");
+    QTest::newRow("multi_4") << QString("meeting project budget review");
+    QTest::newRow("phrase") << QString("\"quarterly budget review\"");
+    QTest::newRow("prefix") << QString("proj*");
+    QTest::newRow("prefix_short") << QString("b*");
+    QTest::newRow("notebook") << QString("notebook:Work project");
+    QTest::newRow("tag") << QString("tag:urgent");
+    QTest::newRow("intitle") << QString("intitle:meeting");
+    QTest::newRow("created") << QString("created:20140601Z");
+    QTest::newRow("todo") << QString("todo:false");
+    QTest::newRow("negation") << QString("project -budget");
+    QTest::newRow("any") << QString("any: zeppelin recipe travel");
+    QTest::newRow("no_match") << QString("xylophonequartz");
+}
+
+SearchBenchmark::QueryRun SearchBenchmark::runQuery(StorageManager *storageManager, const QString &query)
+{
+    SearchLocalNotesThread search(storageManager, query, SearchLocalNotesThread::RecentlyUpdatedFirst, false);
+    connect(&search, SIGNAL(searchLocalNotesMatchingNotes(QStringList)), SLOT(collectMatchingNotes(QStringList)), Qt::DirectConnection);
+    m_collectedMatchCount = 0;
+
+    QueryRun queryRun;
+    qint64 charsReadBefore = 0, diskBytesReadBefore = 0;
+    bool isIoKnown = readProcessIo(&charsReadBefore, &diskBytesReadBefore);
+    QElapsedTimer timer;
+    timer.start();
+    search.run();
+    queryRun.nsecsElapsed = timer.nsecsElapsed();
+    qint64 charsReadAfter = 0, diskBytesReadAfter = 0;
+    isIoKnown = (isIoKnown && readProcessIo(&charsReadAfter, &diskBytesReadAfter));
+
+    queryRun.matchCount = m_collectedMatchCount;
+    queryRun.searchedNotesCount = search.searchedNotesCount();
+    queryRun.charsRead = (isIoKnown? qMax(charsReadAfter - charsReadBefore - m_ioReadingOverhead, qint64(0)) : -1);
+    queryRun.diskBytesRead = (isIoKnown? (diskBytesReadAfter - diskBytesReadBefore) : -1);
+    return queryRun;
+}
+
+static qreal nearestRankPercentile(const QList<qint64> &sortedValues, int percentile)
+{
+    int rank = qMax((percentile * sortedValues.count() + 99) / 100, 1);
+    return sortedValues.at(rank - 1) / 1000000.0;
+}
+
+void SearchBenchmark::reportRuns(const char *mode, const QList<QueryRun> &runs)
+{
+    QList<qint64> nsecs;
+    qint64 charsRead = 0, diskBytesRead = 0;
+    foreach (const QueryRun &queryRun, runs) {
+        nsecs << queryRun.nsecsElapsed;
+        charsRead = ((charsRead < 0 || queryRun.charsRead < 0)? -1 : charsRead + queryRun.charsRead);
+        diskBytesRead = ((diskBytesRead < 0 || queryRun.diskBytesRead < 0)? -1 : diskBytesRead + queryRun.diskBytesRead);
+    }
+    qSort(nsecs);
+    const QueryRun &lastRun = runs.last();
+    printf("search-benchmark\t%s\t%s\truns=%d\tp50_ms=%.3f\tp90_ms=%.3f\tp99_ms=%.3f\tmax_ms=%.3f\t"
+           "matches=%d\tnotes_searched=%d\tbytes_read=%lld\tdisk_bytes_read=%lld\n",
+           mode, QTest::currentDataTag(), runs.count(),
+           nearestRankPercentile(nsecs, 50), nearestRankPercentile(nsecs, 90), nearestRankPercentile(nsecs, 99),
+           nsecs.last() / 1000000.0, lastRun.matchCount, lastRun.searchedNotesCount,
+           (charsRead < 0? charsRead : charsRead / runs.count()),
+           (diskBytesRead < 0? diskBytesRead : diskBytesRead / runs.count()));
+    fflush(stdout);
+    QTest::setBenchmarkResult(nearestRankPercentile(nsecs, 50), QTest::WalltimeMilliseconds);
+}
+
+void SearchBenchmark::searchWarmCache_data()
+{
+    addQueryCatalogue();
+}
+
+void SearchBenchmark::searchWarmCache()
+{
+    QFETCH(QString, query);
+    runQuery(m_warmStorageManager, query); // to load whatever the query reads, untimed
+    QList<QueryRun> runs;
+    for (int i = 0; i < m_warmIterationCount; i++) {
+        runs << runQuery(m_warmStorageManager, query);
+    }
+    reportRuns("warm", runs);
+}
+
+void SearchBenchmark::searchColdCache_data()
+{
+    addQueryCatalogue();
+}
+
+void SearchBenchmark::searchColdCache()
+{
+    QFETCH(QString, query);
+    if (m_isDroppingPageCache && !dropPageCache()) {
+        QSKIP("Could not drop the page cache. Run as root, or unset NOTEKEEPER_BENCHMARK_DROP_CACHES.", SkipAll);
+    }
+    QList<QueryRun> runs;
+    for (int i = 0; i < m_coldIterationCount; i++) {
+        if (m_isDroppingPageCache) {
+            dropPageCache();
+        }
+        // A new StorageManager has none of the store cached, and loads the search index when the query needs it
+        StorageManager storageManager;
+        runs << runQuery(&storageManager, query);
+    }
+    reportRuns("cold", runs);
+}
+
+QTEST_MAIN(SearchBenchmark)
+
+#include "searchbenchmark.moc"
@@ -0,0 +1,40 @@
+# Benchmark for local search over a generated corpus. Build and run from a build dir:
+#   qmake <path-to>/src/benchmarks/searchbenchmark && make && ./searchbenchmark
+# Needs notekeeper_config.h in src, as for building the app.
+
+TEMPLATE = app
+TARGET = searchbenchmark
+
+QT += network
+CONFIG += qtestlib console
+CONFIG -= app_bundle
+
+SRC = $$PWD/../..
+
+INCLUDEPATH += $$SRC $$SRC/storage $$SRC/cloud/evernote/evernotesync
+
+SOURCES += searchbenchmark.cpp \
+    benchmarkcorpus.cpp \
+    $$SRC/searchlocalnotesthread.cpp \
+    $$SRC/storage/storagemanager.cpp \
+    $$SRC/storage/searchindex.cpp \
+    $$SRC/storage/searchtokenizer.cpp \
+    $$SRC/storage/crypto/crypto.cpp \
+    $$SRC/storage/crypto/encryptedfile.cpp \
+    $$SRC/storage/diskcache/shareddiskcache.cpp \
+    $$SRC/cloud/evernote/evernotesync/evernotemarkup.cpp \
+    $$SRC/logger.cpp
+
+HEADERS += benchmarkcorpus.h \
+    $$SRC/searchlocalnotesthread.h \
+    $$SRC/storage/storagemanager.h \
+    $$SRC/storage/searchindex.h \
+    $$SRC/storage/searchtokenizer.h \
+    $$SRC/storage/crypto/crypto.h \
+    $$SRC/storage/crypto/encryptedfile.h \
+    $$SRC/storage/diskcache/shareddiskcache.h \
+    $$SRC/cloud/evernote/evernotesync/evernotemarkup.h \
+    $$SRC/logger.h
+
+include($$SRC/3rdparty/qblowfish/qblowfish.pri)
+include($$PWD/../common/common.pri)
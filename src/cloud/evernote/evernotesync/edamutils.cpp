@@ -25,7 +25,9 @@
 */
 
 #include "edamutils.h"
+#include "storage/crypto/encryptedfile.h"
 #include <QFile>
+#include <QScopedPointer>
 #include <QSize>
 #include <QtDebug>
 
@@ -284,9 +286,9 @@ bool setEdamNoteResources(edam::Note *note, const QVariantList &attachmentMaps,
                 qDebug() << "No filePath found for attachment:" << originalFileName;
                 return false;
             }
-            QFile attachmentFile(filePath);
-            qint32 fileSize = static_cast<qint32>(attachmentFile.size());
-            if ((fileSize != attachmentSize) || (!attachmentFile.open(QFile::ReadOnly))) {
+            QScopedPointer<QIODevice> attachmentFile(EncryptedFile::openForReading(filePath)); // decrypts, if encrypted
+            qint32 fileSize = (attachmentFile.isNull()? -1 : static_cast<qint32>(attachmentFile->size()));
+            if (fileSize != attachmentSize) {
                 qDebug() << "Could not open attachment:" << originalFileName;
                 return false;
             }
@@ -300,8 +302,8 @@ bool setEdamNoteResources(edam::Note *note, const QVariantList &attachmentMaps,
                 return false;
             }
             qint64 totalBytesWritten = 0;
-            while (!attachmentFile.atEnd()) {
-                QByteArray data = attachmentFile.read(1 << 18); // max 256 kb
+            while (!attachmentFile->atEnd()) {
+                QByteArray data = attachmentFile->read(1 << 18); // max 256 kb
                 resource.data.body.append(data.constData(), data.length());
                 totalBytesWritten += data.length();
             }
@@ -26,6 +26,7 @@
 
 #include "evernoteaccess.h"
 #include "storagemanager.h"
+#include "searchindex.h"
 #include "connectionmanager.h"
 #include "evernotesync.h"
 #include "edamutils.h"
@@ -334,7 +335,7 @@ bool EvernoteAccess::fetchNoteAndAttachmentsForOfflineAccess(edam::NoteStoreClie
         foreach (const QVariant &map, m_storageManager->attachmentsData(noteId)) {
             QVariantMap attachment = map.toMap();
             QString filePath = attachment.value("FilePath").toString();
-            if (filePath.isEmpty() || !QFile::exists(filePath)) {
+            if (filePath.isEmpty()) {
                 QString attachmentGuid = attachment.value("guid").toString();
                 QByteArray attachmentHash = attachment.value("Hash").toByteArray();
                 fetchOfflineNoteAttachment(noteId, attachmentGuid, attachmentHash, nwAccessManager);
@@ -431,6 +432,7 @@ static void storeNoteAttachments(const QString &noteId, const edam::Note &note,
             fileName = utf8StringFromStdString(resource.attributes.fileName);
         }
         attachmentDataMap["FileName"] = fileName;
+        attachmentDataMap["HasRecognition"] = bool(resource.__isset.recognition);
         attachmentsData << attachmentDataMap;
         if (mimeType.startsWith("image/")) {
             if (hasImages) {
@@ -582,6 +584,26 @@ void EvernoteAccess::synchronize()
         maxEntries = 10; // so that we make the progressbar move quicker
     }
 
+    // Saved searches weren't synced earlier, so accounts that have synced past them get them listed once
+    if (!m_storageManager->retrieveEvernoteSyncData("SavedSearchesListed").toBool()) {
+        if (usn > 0) {
+            std::vector<edam::SavedSearch> savedSearches;
+            if (!edamListSearches(&noteStore, &savedSearches, authToken)) {
+                m_noteStoreHttpClient = 0;
+                return;
+            }
+            for (std::vector<edam::SavedSearch>::const_iterator savedSearchesIter = savedSearches.begin();
+                 savedSearchesIter != savedSearches.end();
+                 savedSearchesIter++) {
+                const edam::SavedSearch &savedSearch = (*savedSearchesIter);
+                m_storageManager->setSyncedSavedSearchData(latin1StringFromStdString(savedSearch.guid),
+                                                           utf8StringFromStdString(savedSearch.name),
+                                                           utf8StringFromStdString(savedSearch.query));
+            }
+        }
+        m_storageManager->saveEvernoteSyncData("SavedSearchesListed", true);
+    }
+
     // getSyncChunk
     while (usn < maxUsn) {
         edam::SyncChunk syncChunk;
@@ -629,6 +651,16 @@ void EvernoteAccess::synchronize()
             m_storageManager->clearEvernoteSyncIdsList("NoteIdsForUncreatedTag/" % tagGuid);
         }
 
+        // Process saved searches
+        for (std::vector<edam::SavedSearch>::const_iterator savedSearchesIter = syncChunk.searches.begin();
+             savedSearchesIter != syncChunk.searches.end();
+             savedSearchesIter++) {
+            const edam::SavedSearch &savedSearch = (*savedSearchesIter);
+            m_storageManager->setSyncedSavedSearchData(latin1StringFromStdString(savedSearch.guid),
+                                                       utf8StringFromStdString(savedSearch.name),
+                                                       utf8StringFromStdString(savedSearch.query));
+        }
+
         // Process notes
         for (std::vector<edam::Note>::const_iterator notesIter = syncChunk.notes.begin();
              notesIter != syncChunk.notes.end();
@@ -700,6 +732,16 @@ void EvernoteAccess::synchronize()
                 m_storageManager->expungeTag(expungedTagId);
             }
         }
+        for (std::vector<edam::Guid>::const_iterator expungedSearchesGuidIter = syncChunk.expungedSearches.begin();
+             expungedSearchesGuidIter != syncChunk.expungedSearches.end();
+             expungedSearchesGuidIter++) {
+            const edam::Guid &expungedSearchGuidStdStr = (*expungedSearchesGuidIter);
+            QString expungedSearchGuid = latin1StringFromStdString(expungedSearchGuidStdStr);
+            QString expungedSavedSearchId = m_storageManager->savedSearchIdForGuid(expungedSearchGuid);
+            if (!expungedSavedSearchId.isEmpty()) {
+                m_storageManager->expungeSavedSearch(expungedSavedSearchId);
+            }
+        }
 
         // checkpoint how far we've synced
         m_storageManager->saveEvernoteSyncData("USN", usn);
@@ -984,6 +1026,12 @@ void EvernoteAccess::synchronize()
         emit syncProgressChanged(syncProgress(PUSHING_UPDATES, pushedNotesCount, notesToPush.count()));
     }
 
+    // fetch text recognized in attachments, for local search
+    if (!fetchAttachmentsSearchText(&noteStore, authToken)) {
+        m_noteStoreHttpClient = 0;
+        return;
+    }
+
     { // update uploaded-bytes-in-this-cycle
         edam::SyncState syncState;
         if (!edamGetSyncState(&noteStore, &syncState, authToken)) {
@@ -1005,7 +1053,63 @@ void EvernoteAccess::synchronize()
     m_noteStoreHttpClient = 0;
 }
 
-QStringList EvernoteAccess::searchNotes(const QString &words, const QString &notebookId, const QString &tagId)
+// The recognized text is only ever used for searching, so it's not worth holding up the sync for.
+// We fetch a few attachments' worth in each sync (more when on wifi), and continue in the next sync.
+#define MAX_SEARCH_TEXT_FETCHES_PER_SYNC 10
+#define MAX_SEARCH_TEXT_FETCHES_PER_SYNC_ON_WIFI 100
+// A note whose fetch fails goes to the end of the list, so that it doesn't hold up the other notes
+// in later syncs. After this many failures in one sync, the rest is left for the next sync.
+#define MAX_SEARCH_TEXT_FETCH_FAILURES_PER_SYNC 3
+
+bool EvernoteAccess::fetchAttachmentsSearchText(edam::NoteStoreClient *noteStore, const QString &authToken)
+{
+    QStringList noteIds = m_storageManager->retrieveEvernoteSyncIdsList("NoteIdsWithUnfetchedSearchText");
+    if (noteIds.isEmpty()) {
+        return true;
+    }
+    int maxFetchesCount = (m_connectionManager->isIapConfigurationWifi()? MAX_SEARCH_TEXT_FETCHES_PER_SYNC_ON_WIFI : MAX_SEARCH_TEXT_FETCHES_PER_SYNC);
+    int fetchesCount = 0, failuresCount = 0;
+    emit syncStatusMessage("Syncing: Fetching text in images");
+    foreach (const QString &noteId, noteIds) {
+        bool isNoteDone = true, isNoteFailed = false;
+        foreach (const QVariant &attachment, m_storageManager->attachmentsWithUnfetchedSearchText(noteId)) {
+            if (fetchesCount >= maxFetchesCount) {
+                isNoteDone = false;
+                break;
+            }
+            const QVariantMap &map = attachment.toMap();
+            QString searchText;
+            SearchTextFetchResult result = edamGetResourceSearchText(noteStore, &searchText, authToken, map.value("guid").toString());
+            if (result == SearchTextFetchSyncEnded) {
+                return false;
+            } else if (result == SearchTextFetchFailed) {
+                m_storageManager->log(QString("fetchAttachmentsSearchText() failed for note [%1]; fetched=%2").arg(noteId).arg(fetchesCount));
+                isNoteFailed = true;
+                break;
+            }
+            m_storageManager->setAttachmentSearchText(noteId, map.value("Hash").toByteArray(), searchText);
+            fetchesCount++;
+        }
+        if (isNoteFailed) {
+            // To be tried again after the other notes
+            m_storageManager->removeFromEvernoteSyncIdsList("NoteIdsWithUnfetchedSearchText", noteId);
+            m_storageManager->addToEvernoteSyncIdsList("NoteIdsWithUnfetchedSearchText", noteId);
+            failuresCount++;
+            if (failuresCount >= MAX_SEARCH_TEXT_FETCH_FAILURES_PER_SYNC) {
+                break;
+            }
+            continue;
+        }
+        if (!isNoteDone) {
+            break;
+        }
+        m_storageManager->removeFromEvernoteSyncIdsList("NoteIdsWithUnfetchedSearchText", noteId);
+    }
+    m_storageManager->log(QString("fetchAttachmentsSearchText() fetched=%1 failed=%2").arg(fetchesCount).arg(failuresCount));
+    return true;
+}
+
+QStringList EvernoteAccess::searchNotes(const QString &words, const QString &notebookId, const QString &tagId, bool isSkippingLocallySearchableNotes)
 {
     QString authToken = m_storageManager->retrieveEncryptedEvernoteAuthData("authToken");
 
@@ -1044,34 +1148,44 @@ QStringList EvernoteAccess::searchNotes(const QString &words, const QString &not
     noteFilter.__isset.ascending = true;
     noteFilter.__isset.inactive = true;
 
+    // Only the guids are needed. Notes we already have are listed from what's stored locally,
+    // and the rare note we don't have yet is fetched by itself.
+    edam::NotesMetadataResultSpec resultSpec;
+
+    QSharedPointer<SearchIndex> searchIndex = m_storageManager->searchIndex();
     const int maxNotes = 100;
     int offset = 0;
     forever {
-        edam::NoteList noteList;
-        if (!edamFindNotes(&noteStore, &noteList, authToken, noteFilter, offset, maxNotes)) {
+        edam::NotesMetadataList notesMetadataList;
+        if (!edamFindNotesMetadata(&noteStore, &notesMetadataList, authToken, noteFilter, offset, maxNotes, resultSpec)) {
             return QStringList();
         }
         QStringList pagedMatchingNotes;
-        for (std::vector<edam::Note>::const_iterator notesIter = noteList.notes.begin();
-             notesIter != noteList.notes.end();
+        for (std::vector<edam::NoteMetadata>::const_iterator notesIter = notesMetadataList.notes.begin();
+             notesIter != notesMetadataList.notes.end();
              notesIter++) {
-            const edam::Note &note = (*notesIter);
-            QString guid = latin1StringFromStdString(note.guid);
+            QString guid = latin1StringFromStdString(notesIter->guid);
             if (!guid.isEmpty()) {
                 QString noteId = m_storageManager->noteIdForGuid(guid);
                 if (noteId.isEmpty()) { // note was probably created another client after we last synced
+                    edam::Note note;
+                    if (!edamGetNote(&noteStore, &note, authToken, guid, false, false, false, false)) {
+                        return QStringList();
+                    }
                     noteId = storeNoteGist(note, m_storageManager);
                     storeNoteNotebooksTagsTrashedness(noteId, note, m_storageManager);
                     storeNoteAttachments(noteId, note, m_storageManager, false /*isAfterPush*/);
+                } else if (isSkippingLocallySearchableNotes && searchIndex->isContentIndexed(noteId)) {
+                    continue; // the local search has the final say on notes it can search
                 }
                 Q_ASSERT(!noteId.isEmpty());
                 pagedMatchingNotes << noteId;
                 allMatchingNoteIds << noteId;
             }
         }
-        offset += noteList.notes.size();
-        emit serverSearchMatchingNotes(pagedMatchingNotes, ((noteList.totalNotes > 0)? (offset * 100 / noteList.totalNotes) : 100));
-        if (offset >= noteList.totalNotes) {
+        offset += notesMetadataList.notes.size();
+        emit serverSearchMatchingNotes(pagedMatchingNotes, ((notesMetadataList.totalNotes > 0)? (offset * 100 / notesMetadataList.totalNotes) : 100));
+        if (notesMetadataList.notes.empty() || offset >= notesMetadataList.totalNotes) {
             break; // get out of the 'forever' loop
         }
     }
@@ -1337,6 +1451,62 @@ bool EvernoteAccess::edamGetSyncState(edam::NoteStoreClient *noteStore,
     return true;
 }
 
+bool EvernoteAccess::edamListSearches(edam::NoteStoreClient *noteStore,
+                                      std::vector<edam::SavedSearch> *savedSearches, const QString &authToken)
+{
+    try {
+        noteStore->listSearches((*savedSearches), stdStringFromLatin1String(authToken));
+    } catch (const edam::EDAMUserException &e) {
+        if (e.parameter == "authenticationToken") {
+            switch (e.errorCode) {
+            case edam::EDAMErrorCode::AUTH_EXPIRED:
+            case edam::EDAMErrorCode::BAD_DATA_FORMAT:
+            case edam::EDAMErrorCode::DATA_REQUIRED:
+            case edam::EDAMErrorCode::INVALID_AUTH:
+                // in all these cases, we should just try and get another auth token
+                emit authTokenInvalid();
+                emit finished(false, QLatin1String("Unable to login"));
+                return false;
+            default:
+                printUnknownExceptionError("ListSearches", e);
+                emit finished(false, QLatin1String("Unknown error"));
+                return false;
+            }
+        } else {
+            printUnknownExceptionError("ListSearches", e);
+            emit finished(false, QLatin1String("Unknown error"));
+            return false;
+        }
+    } catch (const edam::EDAMSystemException &e) {
+        if (e.errorCode == edam::EDAMErrorCode::RATE_LIMIT_REACHED) {
+            emit rateLimitReached(e.rateLimitDuration);
+            emit finished(false, QLatin1String("Temporarily exceeded Evernote server usage limits"));
+            return false;
+        } else {
+            printUnknownExceptionError("ListSearches", e);
+            emit finished(false, QLatin1String("Unknown error"));
+            return false;
+        }
+    } catch (const thrift::transport::TTransportException &e) {
+        if (e.getType() == thrift::transport::TTransportException::INTERRUPTED) {
+            m_storageManager->log("edamListSearches cancelled");
+            emit finished(false, QLatin1String("Cancelled"));
+        } else if (e.getType() == thrift::transport::TTransportException::TIMED_OUT) {
+            m_storageManager->log("edamListSearches timed out");
+            emit finished(false, QLatin1String("Request timed out. Please check your internet connection."));
+        } else {
+            printUnknownExceptionError("ListSearches", e);
+            emit finished(false, QLatin1String("Unknown error"));
+        }
+        return false;
+    } catch (...) {
+        printUnknownExceptionError("ListSearches");
+        emit finished(false, QLatin1String("Unknown error"));
+        return false;
+    }
+    return true;
+}
+
 bool EvernoteAccess::edamGetSyncChunk(edam::NoteStoreClient *noteStore,
                                     edam::SyncChunk *syncChunk,
                                     const QString &authToken, int usn, int maxEntries, bool fullSync)
@@ -1462,6 +1632,67 @@ bool EvernoteAccess::edamGetNote(edam::NoteStoreClient *noteStore,
     return true;
 }
 
+// Unlike the other wrappers, this ends the sync (emitting finished()) only on login and rate limit errors, or when
+// cancelled. Any other failure only stops the fetching of search text for this sync.
+EvernoteAccess::SearchTextFetchResult EvernoteAccess::edamGetResourceSearchText(edam::NoteStoreClient *noteStore,
+                                                                               QString *searchText,
+                                                                               const QString &authToken, const QString &guid)
+{
+    try {
+        std::string text;
+        noteStore->getResourceSearchText(text, stdStringFromLatin1String(authToken), stdStringFromLatin1String(guid));
+        (*searchText) = utf8StringFromStdString(text);
+    } catch(const edam::EDAMUserException &e) {
+        if (e.parameter == "authenticationToken") {
+            switch (e.errorCode) {
+            case edam::EDAMErrorCode::AUTH_EXPIRED:
+            case edam::EDAMErrorCode::BAD_DATA_FORMAT:
+            case edam::EDAMErrorCode::DATA_REQUIRED:
+            case edam::EDAMErrorCode::INVALID_AUTH:
+                // in all these cases, we should just try and get another auth token
+                emit authTokenInvalid();
+                emit finished(false, QLatin1String("Unable to login"));
+                return SearchTextFetchSyncEnded;
+            default:
+                printUnknownExceptionError("GetResourceSearchText", e);
+                return SearchTextFetchFailed;
+            }
+        } else {
+            printUnknownExceptionError("GetResourceSearchText", e);
+            return SearchTextFetchFailed;
+        }
+    } catch (const edam::EDAMSystemException &e) {
+        if (e.errorCode == edam::EDAMErrorCode::RATE_LIMIT_REACHED) {
+            emit rateLimitReached(e.rateLimitDuration);
+            emit finished(false, QLatin1String("Temporarily exceeded Evernote server usage limits"));
+            return SearchTextFetchSyncEnded;
+        } else {
+            printUnknownExceptionError("GetResourceSearchText", e);
+            return SearchTextFetchFailed;
+        }
+    } catch (const edam::EDAMNotFoundException &e) {
+        // the attachment was removed in the server after we last synced; there's no text to search in
+        printUnknownExceptionError("GetResourceSearchText", e);
+        searchText->clear();
+        return SearchTextFetched;
+    } catch (const thrift::transport::TTransportException &e) {
+        if (e.getType() == thrift::transport::TTransportException::INTERRUPTED) {
+            m_storageManager->log("edamGetResourceSearchText cancelled");
+            emit finished(false, QLatin1String("Cancelled"));
+            return SearchTextFetchSyncEnded;
+        } else if (e.getType() == thrift::transport::TTransportException::TIMED_OUT) {
+            m_storageManager->log("edamGetResourceSearchText timed out");
+        } else {
+            printUnknownExceptionError("GetResourceSearchText", e);
+        }
+        return SearchTextFetchFailed;
+    } catch (...) {
+        printUnknownExceptionError("GetResourceSearchText");
+        return SearchTextFetchFailed;
+    }
+    return SearchTextFetched;
+}
+
 EvernoteAccess::NotePushResult EvernoteAccess::edamCreateNote(edam::NoteStoreClient *noteStore,
                                    edam::Note *note,
                                    const QString &authToken, const edam::Note &noteData)
@@ -1637,6 +1868,68 @@ bool EvernoteAccess::edamFindNotes(edam::NoteStoreClient *noteStore,
     return true;
 }
 
+bool EvernoteAccess::edamFindNotesMetadata(edam::NoteStoreClient *noteStore,
+                                           edam::NotesMetadataList *notesMetadataList,
+                                           const QString &authToken, const edam::NoteFilter &noteFilter, qint32 offset, qint32 maxNotes,
+                                           const edam::NotesMetadataResultSpec &resultSpec)
+{
+    try {
+        noteStore->findNotesMetadata((*notesMetadataList), stdStringFromLatin1String(authToken), noteFilter, offset, maxNotes, resultSpec);
+    } catch(const edam::EDAMUserException &e) {
+        if (e.parameter == "authenticationToken") {
+            switch (e.errorCode) {
+            case edam::EDAMErrorCode::AUTH_EXPIRED:
+            case edam::EDAMErrorCode::BAD_DATA_FORMAT:
+            case edam::EDAMErrorCode::DATA_REQUIRED:
+            case edam::EDAMErrorCode::INVALID_AUTH:
+                // in all these cases, we should just try and get another auth token
+                emit authTokenInvalid();
+                emit finished(false, QLatin1String("Unable to login"));
+                return false;
+            default:
+                printUnknownExceptionError("FindNotesMetadata", e);
+                emit finished(false, QLatin1String("Unknown error"));
+                return false;
+            }
+        } else {
+            printUnknownExceptionError("FindNotesMetadata", e);
+            emit finished(false, QLatin1String("Unknown error"));
+            return false;
+        }
+    } catch (const edam::EDAMSystemException &e) {
+        if (e.errorCode == edam::EDAMErrorCode::RATE_LIMIT_REACHED) {
+            emit rateLimitReached(e.rateLimitDuration);
+            emit finished(false, QLatin1String("Temporarily exceeded Evernote server usage limits"));
+            return false;
+        } else {
+            printUnknownExceptionError("FindNotesMetadata", e);
+            emit finished(false, QLatin1String("Unknown error"));
+            return false;
+        }
+    } catch (const edam::EDAMNotFoundException &e) {
+        printUnknownExceptionError("FindNotesMetadata", e);
+        emit finished(false, QLatin1String("Unknown error"));
+        return false;
+    } catch (const thrift::transport::TTransportException &e) {
+        if (e.getType() == thrift::transport::TTransportException::INTERRUPTED) {
+            m_storageManager->log("edamFindNotesMetadata cancelled");
+            emit finished(false, QLatin1String("Cancelled"));
+        } else if (e.getType() == thrift::transport::TTransportException::TIMED_OUT) {
+            m_storageManager->log("edamFindNotesMetadata timed out");
+            emit finished(false, QLatin1String("Request timed out. Please check your internet connection."));
+        } else {
+            printUnknownExceptionError("FindNotesMetadata", e);
+            emit finished(false, QLatin1String("Unknown error"));
+        }
+        return false;
+    } catch (...) {
+        printUnknownExceptionError("FindNotesMetadata");
+        emit finished(false, QLatin1String("Unknown error"));
+        return false;
+    }
+    return true;
+}
+
 bool EvernoteAccess::edamCreateNotebook(edam::NoteStoreClient *noteStore,
                                       edam::Notebook *notebook,
                                       const QString &authToken, const edam::Notebook &notebookData)
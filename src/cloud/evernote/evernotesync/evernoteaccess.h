@@ -35,6 +35,7 @@
 #include <QStringList>
 #include <QTemporaryFile>
 #include <QtNetwork/QSslError>
+#include <vector>
 
 class StorageManager;
 class ConnectionManager;
@@ -53,6 +54,7 @@ namespace evernote {
         class NoteFilter;
         class Notebook;
         class Tag;
+        class SavedSearch;
     }
 }
 using namespace evernote;
@@ -75,7 +77,9 @@ public:
 
     void synchronize();
 
-    QStringList searchNotes(const QString &words, const QString &notebookId = QString(), const QString &tagId = QString()); // returns note ids
+    // Returns note ids. If isSkippingLocallySearchableNotes is true, notes whose content the local search can read are left out.
+    QStringList searchNotes(const QString &words, const QString &notebookId = QString(), const QString &tagId = QString(),
+                            bool isSkippingLocallySearchableNotes = false);
 
     bool cancel();
 
@@ -111,9 +115,16 @@ private:
         NotePushRateLimitReachedError
     };
 
+    enum SearchTextFetchResult {
+        SearchTextFetched,
+        SearchTextFetchFailed,   // can be tried again in the next sync
+        SearchTextFetchSyncEnded // login or rate limit error, or cancelled; finished() has been emitted
+    };
+
     bool fetchNote(edam::NoteStoreClient *noteStore, const QString &noteId, QNetworkAccessManager *nwAccessManager, QVariantMap *noteData = 0);
     bool updateNoteThumbnail(const QString &noteId, const QString &noteGuid, bool hasImages, bool imagesRemoved, QNetworkAccessManager *nwAccessManager);
     bool fetchNoteAndAttachmentsForOfflineAccess(edam::NoteStoreClient *noteStore, const QString &noteId, QNetworkAccessManager *nwAccessManager);
+    bool fetchAttachmentsSearchText(edam::NoteStoreClient *noteStore, const QString &authToken);
 
     // thin-wrappers around EDAM function calls
     bool edamCheckVersion(edam::UserStoreClient *userStore);
@@ -126,6 +137,8 @@ private:
                           const std::string &consumerSecret, const std::string &consumerKey);
     bool edamGetSyncState(edam::NoteStoreClient *noteStore,
                           edam::SyncState *syncState, const QString &authToken);
+    bool edamListSearches(edam::NoteStoreClient *noteStore,
+                          std::vector<edam::SavedSearch> *savedSearches, const QString &authToken);
     bool edamGetSyncChunk(edam::NoteStoreClient *noteStore,
                           edam::SyncChunk *syncChunk,
                           const QString &authToken, int usn, int maxEntries, bool fullSync);
@@ -142,9 +155,16 @@ private:
                           edam::Note *note,
                           const QString &authToken, const edam::Note &noteData);
 
+    SearchTextFetchResult edamGetResourceSearchText(edam::NoteStoreClient *noteStore,
+                                                    QString *searchText,
+                                                    const QString &authToken, const QString &guid);
     bool edamFindNotes   (edam::NoteStoreClient *noteStore,
                           edam::NoteList *noteList,
                           const QString &authToken, const edam::NoteFilter &noteFilter, qint32 offset, qint32 maxNotes);
+    bool edamFindNotesMetadata(edam::NoteStoreClient *noteStore,
+                               edam::NotesMetadataList *notesMetadataList,
+                               const QString &authToken, const edam::NoteFilter &noteFilter, qint32 offset, qint32 maxNotes,
+                               const edam::NotesMetadataResultSpec &resultSpec);
     bool edamCreateNotebook(edam::NoteStoreClient *noteStore,
                           edam::Notebook *notebook,
                           const QString &authToken, const edam::Notebook &notebookData);
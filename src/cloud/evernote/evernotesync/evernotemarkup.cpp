@@ -45,6 +45,7 @@
 #include "math.h"
 
 #include "evernotemarkup.h"
+#include "searchtokenizer.h"
 #include "richtextnotecss.h"
 #include "html_named_entities.h"
 
@@ -726,46 +727,127 @@ QString EvernoteMarkup::plainTextFromEnml(const QByteArray &enmlData, int maxLen
     return plainText;
 }
 
-static QStringList words(const QString &text)
+bool EvernoteMarkup::contentSummaryFromEnml(const QByteArray &enmlData, int maxLength, QString *summaryText,
+                                            int *checkedTodoCount, int *uncheckedTodoCount, int *attachmentCount)
 {
-    QStringList wordList;
-    QString word;
-    for (int i = 0; i < text.length(); i++) {
-        const QChar c = text.at(i);
-        bool isSeparatorChar = (c.isSpace() || c.isPunct() || c.isSymbol());
-        if (isSeparatorChar) {
-            if (!word.isEmpty()) {
-                wordList << word;
+    HtmlEntityResolver entityResolver;
+    QXmlStreamReader xml(enmlData);
+    xml.setEntityResolver(&entityResolver);
+    QString plainText;
+    int length = 0;
+    int checkedCount = 0, uncheckedCount = 0, enMediaCount = 0;
+    while (!xml.atEnd()) {
+        xml.readNext();
+        if (xml.tokenType() == QXmlStreamReader::DTD) {
+            if (xml.dtdName() != "en-note") {
+                return false;
+            }
+        } else if (xml.tokenType() == QXmlStreamReader::StartElement) {
+            QStringRef tokenNameStrRef = xml.name();
+            if (QLatin1String("en-media") == tokenNameStrRef) {
+                enMediaCount++;
+            } else if (QLatin1String("en-todo") == tokenNameStrRef) {
+                QXmlStreamAttributes attributes = xml.attributes();
+                bool checked = (attributes.hasAttribute("checked") &&
+                                attributes.value("checked").compare("true", Qt::CaseInsensitive) == 0);
+                if (checked) {
+                    checkedCount++;
+                } else {
+                    uncheckedCount++;
+                }
+            }
+        } else if (xml.tokenType() == QXmlStreamReader::Characters) {
+            QString textlet = xml.text().toString().trimmed();
+            if (!textlet.isEmpty()) {
+                if (maxLength < 0 || length <= maxLength) {
+                    if (plainText.isEmpty()) {
+                        plainText = textlet;
+                        length = textlet.length();
+                    } else {
+                        plainText = (plainText % " " % textlet);
+                        length += textlet.length() + 1;
+                    }
+                }
             }
-            word.clear();
-        } else {
-            word.append(c);
         }
     }
-    if (!word.isEmpty()) {
-        wordList << word;
+    if (xml.hasError()) {
+        return false;
     }
-    return wordList;
+    if (summaryText) {
+        (*summaryText) = plainText;
+    }
+    if (checkedTodoCount) {
+        (*checkedTodoCount) = checkedCount;
+    }
+    if (uncheckedTodoCount) {
+        (*uncheckedTodoCount) = uncheckedCount;
+    }
+    if (attachmentCount) {
+        (*attachmentCount) = enMediaCount;
+    }
+    return true;
+}
+
+// Appends textlet to the words, and if plainText is given, to the plain text too
+static void appendPlainTextWords(const QString &textlet, const SearchTokenizer &tokenizer, QStringList *wordList,
+                                 QString *plainText, QVector<QPair<int, int> > *wordRanges)
+{
+    if (!plainText) {
+        tokenizer.appendWords(textlet, wordList);
+        return;
+    }
+    const QString simplifiedTextlet = textlet.simplified();
+    if (simplifiedTextlet.isEmpty()) {
+        return;
+    }
+    if (!plainText->isEmpty()) {
+        plainText->append(QLatin1Char(' '));
+    }
+    tokenizer.appendWords(simplifiedTextlet, wordList, wordRanges, plainText->length());
+    plainText->append(simplifiedTextlet);
 }
 
-QStringList EvernoteMarkup::plainTextWordsFromEnml(const QString &title, const QByteArray &enmlData)
+QStringList EvernoteMarkup::plainTextWordsFromEnml(const QString &title, const QByteArray &enmlData, const SearchTokenizer &tokenizer,
+                                                   int *checkedTodoCount, int *uncheckedTodoCount,
+                                                   QString *plainText, QVector<QPair<int, int> > *wordRanges)
 {
     HtmlEntityResolver entityResolver;
     QXmlStreamReader xml(enmlData);
     xml.setEntityResolver(&entityResolver);
     QStringList wordList;
-    wordList << words(title);
+    if (plainText) {
+        plainText->clear();
+    }
+    appendPlainTextWords(title, tokenizer, &wordList, plainText, wordRanges);
+    int checkedCount = 0, uncheckedCount = 0;
     while (!xml.atEnd()) {
         xml.readNext();
         if (xml.tokenType() == QXmlStreamReader::DTD) {
             if (xml.dtdName() != "en-note") {
+                if (plainText) {
+                    plainText->clear();
+                }
                 return QStringList();
             }
+        } else if (xml.tokenType() == QXmlStreamReader::StartElement) {
+            if (QLatin1String("en-todo") == xml.name()) {
+                if (xml.attributes().value("checked").compare("true", Qt::CaseInsensitive) == 0) {
+                    checkedCount++;
+                } else {
+                    uncheckedCount++;
+                }
+            }
         } else if (xml.tokenType() == QXmlStreamReader::Characters) {
-            QString textlet = xml.text().toString();
-            wordList << words(textlet);
+            appendPlainTextWords(xml.text().toString(), tokenizer, &wordList, plainText, wordRanges);
         }
     }
+    if (checkedTodoCount) {
+        (*checkedTodoCount) = checkedCount;
+    }
+    if (uncheckedTodoCount) {
+        (*uncheckedTodoCount) = uncheckedCount;
+    }
     return wordList;
 }
 
@@ -30,9 +30,17 @@
 #include <QObject>
 #include <QVariantList>
 #include <QStringList>
+#include <QVector>
+#include <QPair>
+
+class SearchTokenizer;
 
 namespace EvernoteMarkup
 {
+    // Should be bumped whenever parseEvernoteMarkup() starts rendering notes differently, so that notes
+    // rendered by an earlier version aren't taken from the rendered notes cache
+    const int HTML_RENDERER_VERSION = 1;
+
     // plainTextToEvernote: Converts plaintext to ENML format
     void enmlFromPlainText(const QString &text, const QVariantList &attachmentsData, QString *title, QByteArray *enmlContent);
 
@@ -46,8 +54,18 @@ namespace EvernoteMarkup
     // get first few words of the note as summary
     QString plainTextFromEnml(const QByteArray &enml, int maxLength = -1);
 
-    // get all words in the note, used when searching for a note
-    QStringList plainTextWordsFromEnml(const QString &title, const QByteArray &enml);
+    // get what the notes list shows of a note, in one pass over the whole note: the first few words (as
+    // plainTextFromEnml() gets them), and the counts of todo checkboxes and attachments.
+    // Returns false if the ENML couldn't be parsed.
+    bool contentSummaryFromEnml(const QByteArray &enml, int maxLength, QString *summaryText,
+                                int *checkedTodoCount, int *uncheckedTodoCount, int *attachmentCount);
+
+    // get all words in the note as split and normalized by the tokenizer, used when searching for a note,
+    // and optionally count the todo checkboxes. If plainText is given, it gets the text of the note with
+    // whitespace simplified, and wordRanges gets the (start, end) of each of the words in it.
+    QStringList plainTextWordsFromEnml(const QString &title, const QByteArray &enml, const SearchTokenizer &tokenizer,
+                                       int *checkedTodoCount = 0, int *uncheckedTodoCount = 0,
+                                       QString *plainText = 0, QVector<QPair<int, int> > *wordRanges = 0);
 
     // update checkbox states in the enml
     bool updateCheckboxStatesInEnml(const QByteArray &enmlContent, const QVariantList &checkboxStates, QByteArray *updatedEnml);
@@ -0,0 +1,235 @@
+/*
+  This file is part of Notekeeper Open and is licensed under the MIT License
+
+  Copyright (C) 2011-2015 Roopesh Chander <roop@roopc.net>
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject
+  to the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+  BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+  ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+  CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+
+#include "enexexportthread.h"
+#include "storage/crypto/encryptedfile.h"
+#include <QFile>
+#include <QScopedPointer>
+#include <QDateTime>
+#include <QSize>
+#include <QStringList>
+#include <QXmlStreamWriter>
+
+// #define DEBUG
+
+#ifdef DEBUG
+#include <QDebug>
+#endif
+
+// Attachment files are read and encoded in chunks of this size.
+// Should be a multiple of 3, so that every chunk encodes to base64 without padding.
+static const qint64 BASE64_CHUNK_SIZE = (3 * 1024 * 16);
+
+static QString enexTimestamp(const QDateTime &dateTime)
+{
+    return dateTime.toUTC().toString("yyyyMMdd'T'HHmmss'Z'");
+}
+
+EnexExportThread::EnexExportThread(StorageManager *storageManager, const QString &filePath, QObject *parent)
+    : QThread(parent), m_storageManager(storageManager), m_filePath(filePath), m_cancelled(false)
+{
+    connect(this, SIGNAL(finished()), SLOT(deleteLater())); // auto-delete
+}
+
+void EnexExportThread::cancel()
+{
+    m_cancelled = true;
+}
+
+void EnexExportThread::run()
+{
+    const QStringList noteIds = m_storageManager->listNoteIds(StorageConstants::AllNotes);
+
+    QFile file(m_filePath);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        emit enexExportFinished(false, QString("Could not open %1 for writing").arg(m_filePath), 0, noteIds.count(), 0);
+        return;
+    }
+
+    QXmlStreamWriter xml(&file);
+    xml.setCodec("UTF-8");
+    xml.writeStartDocument();
+    xml.writeDTD("<!DOCTYPE en-export SYSTEM \"http://xml.evernote.com/pub/evernote-export3.dtd\">");
+    xml.writeStartElement("en-export");
+    xml.writeAttribute("export-date", enexTimestamp(QDateTime::currentDateTime()));
+    xml.writeAttribute("application", "Notekeeper Open");
+    xml.writeAttribute("version", QString("%1.%2.%3").arg((APP_VERSION >> 16) & 0xff).arg((APP_VERSION >> 8) & 0xff).arg(APP_VERSION & 0xff));
+
+    int exportedNotesCount = 0;
+    int unexportedNotesCount = 0;
+    int partlyExportedNotesCount = 0;
+    int processedNotesCount = 0;
+    foreach (const QString &noteId, noteIds) {
+        if (m_cancelled) {
+            file.close();
+            file.remove();
+            emit enexExportFinished(false, "Cancelled", exportedNotesCount, noteIds.count() - exportedNotesCount, partlyExportedNotesCount);
+            return;
+        }
+        if (!noteId.isEmpty()) {
+            NoteExportResult result = writeNote(&xml, noteId);
+            if (result == NoteNotExported) {
+                unexportedNotesCount++;
+            } else {
+                exportedNotesCount++;
+                if (result == NotePartlyExported) {
+                    partlyExportedNotesCount++;
+                }
+            }
+        }
+        if (xml.hasError()) {
+            file.close();
+            file.remove();
+            emit enexExportFinished(false, QString("Error writing to %1").arg(m_filePath), exportedNotesCount, noteIds.count() - exportedNotesCount,
+                                    partlyExportedNotesCount);
+            return;
+        }
+        processedNotesCount++;
+        emit enexExportProgressPercentage(processedNotesCount * 100 / noteIds.count());
+    }
+
+    xml.writeEndElement(); // en-export
+    xml.writeEndDocument();
+    file.close();
+
+    m_storageManager->log(QString("ENEX export: exported %1 notes to [%2], %3 of them without some attachments, %4 notes had no local content")
+                          .arg(exportedNotesCount).arg(m_filePath).arg(partlyExportedNotesCount).arg(unexportedNotesCount));
+    emit enexExportFinished(true, QString(), exportedNotesCount, unexportedNotesCount, partlyExportedNotesCount);
+}
+
+// A note whose attachments aren't all available offline is still written, because its text is worth having.
+// Its <en-media> elements for the missing attachments don't match any <resource>, so it's reported as partly exported.
+EnexExportThread::NoteExportResult EnexExportThread::writeNote(QXmlStreamWriter *xml, const QString &noteId)
+{
+    QVariantMap noteData = m_storageManager->noteData(noteId);
+    if (!noteData.value("ContentDataAvailable").toBool()) {
+        // Content is neither offline nor in the disk cache, so there's nothing to export
+        return NoteNotExported;
+    }
+
+    xml->writeStartElement("note");
+    xml->writeTextElement("title", noteData.value("Title").toString());
+    xml->writeStartElement("content");
+    xml->writeCDATA(QString::fromUtf8(noteData.take("Content").toByteArray()));
+    xml->writeEndElement(); // content
+    xml->writeTextElement("created", enexTimestamp(noteData.value("CreatedTime").toDateTime()));
+    xml->writeTextElement("updated", enexTimestamp(noteData.value("UpdatedTime").toDateTime()));
+    foreach (const QString &tagId, noteData.value("TagIds").toStringList()) {
+        QString name = (tagId.isEmpty()? QString() : m_storageManager->tagName(tagId));
+        if (!name.isEmpty()) {
+            xml->writeTextElement("tag", name);
+        }
+    }
+
+    xml->writeStartElement("note-attributes");
+    if (noteData.value("Attributes/SubjectDate").toLongLong() > 0) {
+        xml->writeTextElement("subject-date", enexTimestamp(QDateTime::fromMSecsSinceEpoch(noteData.value("Attributes/SubjectDate").toLongLong())));
+    }
+    if (noteData.value("Attributes/Latitude").isValid()) {
+        xml->writeTextElement("latitude", QString::number(noteData.value("Attributes/Latitude").toDouble(), 'g', 12));
+    }
+    if (noteData.value("Attributes/Longitude").isValid()) {
+        xml->writeTextElement("longitude", QString::number(noteData.value("Attributes/Longitude").toDouble(), 'g', 12));
+    }
+    const char *stringAttributes[][2] = {
+        { "Attributes/Author", "author" },
+        { "Attributes/Source", "source" },
+        { "Attributes/SourceUrl", "source-url" },
+        { "Attributes/SourceApplication", "source-application" },
+        { "Attributes/ContentClass", "content-class" }
+    };
+    for (unsigned int i = 0; i < (sizeof(stringAttributes) / sizeof(stringAttributes[0])); i++) {
+        QString value = noteData.value(QLatin1String(stringAttributes[i][0])).toString();
+        if (!value.isEmpty()) {
+            xml->writeTextElement(QLatin1String(stringAttributes[i][1]), value);
+        }
+    }
+    xml->writeEndElement(); // note-attributes
+
+    bool isEveryAttachmentWritten = true;
+    foreach (const QVariant &attachment, m_storageManager->attachmentsData(noteId)) {
+        if (m_cancelled) {
+            break;
+        }
+        if (!writeResource(xml, attachment.toMap())) {
+            isEveryAttachmentWritten = false;
+        }
+    }
+
+    xml->writeEndElement(); // note
+    return (isEveryAttachmentWritten? NoteExported : NotePartlyExported);
+}
+
+bool EnexExportThread::writeResource(QXmlStreamWriter *xml, const QVariantMap &attachmentData)
+{
+    const QString filePath = attachmentData.value("FilePath").toString();
+    if (filePath.isEmpty()) {
+        // Attachment is not available offline
+        return false;
+    }
+    QScopedPointer<QIODevice> attachmentFile(EncryptedFile::openForReading(filePath)); // decrypts, if encrypted
+    if (attachmentFile.isNull()) {
+        return false;
+    }
+
+    xml->writeStartElement("resource");
+    xml->writeStartElement("data");
+    xml->writeAttribute("encoding", "base64");
+    while (!attachmentFile->atEnd()) {
+        QByteArray chunk = attachmentFile->read(BASE64_CHUNK_SIZE);
+        if (chunk.isEmpty()) {
+            break;
+        }
+        xml->writeCharacters(QLatin1String(chunk.toBase64().constData()));
+        xml->writeCharacters(QLatin1String("\n"));
+    }
+    attachmentFile->close();
+    xml->writeEndElement(); // data
+
+    xml->writeTextElement("mime", attachmentData.value("MimeType").toString());
+    QSize dimensions = attachmentData.value("Dimensions").toSize();
+    if (dimensions.isValid() && !dimensions.isEmpty()) {
+        xml->writeTextElement("width", QString::number(dimensions.width()));
+        xml->writeTextElement("height", QString::number(dimensions.height()));
+    }
+    int duration = attachmentData.value("Duration").toInt();
+    if (duration > 0) {
+        xml->writeTextElement("duration", QString::number(duration));
+    }
+    QString fileName = attachmentData.value("FileName").toString();
+    if (!fileName.isEmpty()) {
+        xml->writeStartElement("resource-attributes");
+        xml->writeTextElement("file-name", fileName);
+        xml->writeEndElement(); // resource-attributes
+    }
+    xml->writeEndElement(); // resource
+
+#ifdef DEBUG
+    qDebug() << "EnexExportThread: Wrote resource" << filePath;
+#endif
+    return true;
+}
@@ -0,0 +1,70 @@
+/*
+  This file is part of Notekeeper Open and is licensed under the MIT License
+
+  Copyright (C) 2011-2015 Roopesh Chander <roop@roopc.net>
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject
+  to the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+  BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+  ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+  CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+
+#ifndef ENEXEXPORTTHREAD_H
+#define ENEXEXPORTTHREAD_H
+
+#include <QThread>
+#include <QString>
+#include "storage/storagemanager.h"
+
+class QXmlStreamWriter;
+
+// Exports all notes in the local store to an Evernote export (.enex) file.
+// The file is written incrementally, one note at a time, and attachment
+// files are base64-encoded in small chunks, so memory usage does not grow
+// with the size of the store.
+
+class EnexExportThread : public QThread
+{
+    Q_OBJECT
+public:
+    EnexExportThread(StorageManager *storageManager, const QString &filePath, QObject *parent = 0);
+    void run();
+    void cancel();
+signals:
+    void enexExportProgressPercentage(int progressPercentage);
+    // partlyExportedNotesCount: of the exported notes, those written without some of their attachments,
+    // because the attachments weren't available offline
+    void enexExportFinished(bool success, const QString &message, int exportedNotesCount, int unexportedNotesCount,
+                            int partlyExportedNotesCount);
+private:
+    enum NoteExportResult {
+        NoteExported,
+        NotePartlyExported, // without some of its attachments
+        NoteNotExported
+    };
+
+    NoteExportResult writeNote(QXmlStreamWriter *xml, const QString &noteId);
+    bool writeResource(QXmlStreamWriter *xml, const QVariantMap &attachmentData);
+
+    StorageManager * const m_storageManager;
+    const QString m_filePath;
+    bool m_cancelled;
+};
+
+#endif // ENEXEXPORTTHREAD_H
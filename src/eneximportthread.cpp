@@ -0,0 +1,303 @@
+/*
+  This file is part of Notekeeper Open and is licensed under the MIT License
+
+  Copyright (C) 2011-2015 Roopesh Chander <roop@roopc.net>
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject
+  to the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+  BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+  ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+  CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+
+#include "eneximportthread.h"
+#include <QFile>
+#include <QTemporaryFile>
+#include <QDateTime>
+#include <QSize>
+#include <QStringList>
+#include <QStringBuilder>
+#include <QCryptographicHash>
+#include <QXmlStreamReader>
+#include <QtConcurrentRun>
+
+// #define DEBUG
+
+#ifdef DEBUG
+#include <QDebug>
+#endif
+
+// Number of notes committed to the store at a time
+static const int IMPORT_BATCH_SIZE = 50;
+
+static qint64 msecsSinceEpochFromEnexTimestamp(const QString &timestamp)
+{
+    QDateTime dateTime = QDateTime::fromString(timestamp, "yyyyMMdd'T'HHmmss'Z'");
+    if (!dateTime.isValid()) {
+        return 0;
+    }
+    dateTime.setTimeSpec(Qt::UTC);
+    return dateTime.toMSecsSinceEpoch();
+}
+
+// Runs in a thread-pool thread
+static EnexDecodedResource decodeResource(const QByteArray &base64Data, const QString &tempFileTemplate)
+{
+    EnexDecodedResource resource;
+    const QByteArray data = QByteArray::fromBase64(base64Data);
+    if (data.isEmpty()) {
+        return resource;
+    }
+    QTemporaryFile tempFile(tempFileTemplate);
+    if (!tempFile.open() || tempFile.write(data) != data.size()) {
+        return resource;
+    }
+    tempFile.setAutoRemove(false);
+    resource.tempFilePath = tempFile.fileName();
+    resource.md5Hash = QCryptographicHash::hash(data, QCryptographicHash::Md5).toHex();
+    resource.size = data.size();
+    return resource;
+}
+
+EnexImportThread::EnexImportThread(StorageManager *storageManager, const QString &filePath, const QString &notebookName, QObject *parent)
+    : QThread(parent), m_storageManager(storageManager), m_filePath(filePath), m_notebookName(notebookName), m_cancelled(false)
+{
+    connect(this, SIGNAL(finished()), SLOT(deleteLater())); // auto-delete
+}
+
+void EnexImportThread::cancel()
+{
+    m_cancelled = true;
+}
+
+void EnexImportThread::run()
+{
+    QFile file(m_filePath);
+    if (!file.open(QIODevice::ReadOnly)) {
+        emit enexImportFinished(false, QString("Could not open %1").arg(m_filePath), 0);
+        return;
+    }
+    const qint64 fileSize = qMax(file.size(), qint64(1));
+
+    QString notebookId;
+    if (!m_notebookName.isEmpty()) {
+        notebookId = m_storageManager->notebookIdForNotebookName(m_notebookName);
+        if (notebookId.isEmpty()) {
+            notebookId = m_storageManager->createNotebook(m_notebookName);
+        }
+    }
+
+    QXmlStreamReader xml(&file);
+    QList<ParsedNote> committableBatch, currentBatch;
+    int importedNotesCount = 0;
+    int progressPercentage = 0;
+    bool isEnexFile = (xml.readNextStartElement() && xml.name() == "en-export");
+    if (isEnexFile) {
+        while (!m_cancelled && xml.readNextStartElement()) {
+            if (xml.name() == "note") {
+                ParsedNote note;
+                if (readNote(&xml, &note)) {
+                    currentBatch << note;
+                } else {
+                    QList<ParsedNote> erroredNote;
+                    erroredNote << note;
+                    discardBatch(&erroredNote);
+                }
+            } else {
+                xml.skipCurrentElement();
+            }
+            if (currentBatch.count() >= IMPORT_BATCH_SIZE) {
+                // Commit the previous batch while the current batch's attachments are still being decoded
+                importedNotesCount += commitBatch(&committableBatch, notebookId);
+                committableBatch = currentBatch;
+                currentBatch.clear();
+            }
+            int percentage = static_cast<int>(file.pos() * 100 / fileSize);
+            if (percentage != progressPercentage) {
+                progressPercentage = percentage;
+                emit enexImportProgressPercentage(progressPercentage);
+            }
+        }
+    }
+
+    if (m_cancelled) {
+        discardBatch(&committableBatch);
+        discardBatch(&currentBatch);
+    } else {
+        importedNotesCount += commitBatch(&committableBatch, notebookId);
+        importedNotesCount += commitBatch(&currentBatch, notebookId);
+    }
+
+    m_storageManager->log(QString("ENEX import: imported %1 notes from [%2]").arg(importedNotesCount).arg(m_filePath));
+
+    if (m_cancelled) {
+        emit enexImportFinished(false, "Cancelled", importedNotesCount);
+    } else if (!isEnexFile) {
+        emit enexImportFinished(false, "Not an Evernote export file", importedNotesCount);
+    } else if (xml.hasError()) {
+        m_storageManager->log(QString("ENEX import: XML error at line %1: %2").arg(xml.lineNumber()).arg(xml.errorString()));
+        emit enexImportFinished(false, QString("Error reading %1 at line %2").arg(m_filePath).arg(xml.lineNumber()), importedNotesCount);
+    } else {
+        emit enexImportFinished(true, QString(), importedNotesCount);
+    }
+}
+
+bool EnexImportThread::readNote(QXmlStreamReader *xml, ParsedNote *note)
+{
+    QStringList tagNames;
+    while (xml->readNextStartElement()) {
+        const QStringRef name = xml->name();
+        if (name == "title") {
+            note->noteData["Title"] = xml->readElementText();
+        } else if (name == "content") {
+            note->noteData["Content"] = xml->readElementText().toUtf8();
+        } else if (name == "created") {
+            note->noteData["CreatedTime"] = msecsSinceEpochFromEnexTimestamp(xml->readElementText());
+        } else if (name == "updated") {
+            note->noteData["UpdatedTime"] = msecsSinceEpochFromEnexTimestamp(xml->readElementText());
+        } else if (name == "tag") {
+            tagNames << xml->readElementText();
+        } else if (name == "note-attributes") {
+            readNoteAttributes(xml, &note->noteData);
+        } else if (name == "resource") {
+            readResource(xml, note);
+        } else {
+            xml->skipCurrentElement();
+        }
+    }
+    note->noteData["TagNames"] = tagNames;
+    return (!xml->hasError() && note->noteData.contains("Content"));
+}
+
+void EnexImportThread::readNoteAttributes(QXmlStreamReader *xml, QVariantMap *noteData)
+{
+    while (xml->readNextStartElement()) {
+        const QStringRef name = xml->name();
+        if (name == "subject-date") {
+            (*noteData)["Attributes/SubjectDate"] = msecsSinceEpochFromEnexTimestamp(xml->readElementText());
+        } else if (name == "latitude") {
+            (*noteData)["Attributes/Latitude"] = xml->readElementText().toDouble();
+        } else if (name == "longitude") {
+            (*noteData)["Attributes/Longitude"] = xml->readElementText().toDouble();
+        } else if (name == "author") {
+            (*noteData)["Attributes/Author"] = xml->readElementText();
+        } else if (name == "source") {
+            (*noteData)["Attributes/Source"] = xml->readElementText();
+        } else if (name == "source-url") {
+            (*noteData)["Attributes/SourceUrl"] = xml->readElementText();
+        } else if (name == "source-application") {
+            (*noteData)["Attributes/SourceApplication"] = xml->readElementText();
+        } else if (name == "content-class") {
+            (*noteData)["Attributes/ContentClass"] = xml->readElementText();
+        } else {
+            xml->skipCurrentElement();
+        }
+    }
+}
+
+void EnexImportThread::readResource(QXmlStreamReader *xml, ParsedNote *note)
+{
+    QVariantMap resourceData;
+    QByteArray base64Data;
+    int width = 0, height = 0;
+    while (xml->readNextStartElement()) {
+        const QStringRef name = xml->name();
+        if (name == "data") {
+            // Collect the base64 text as latin1 bytes, without building a QString for the whole element
+            while (!xml->atEnd()) {
+                xml->readNext();
+                if (xml->isCharacters()) {
+                    base64Data += xml->text().toString().toLatin1();
+                } else if (xml->isEndElement()) {
+                    break;
+                }
+            }
+        } else if (name == "mime") {
+            resourceData["MimeType"] = xml->readElementText();
+        } else if (name == "width") {
+            width = xml->readElementText().toInt();
+        } else if (name == "height") {
+            height = xml->readElementText().toInt();
+        } else if (name == "duration") {
+            resourceData["Duration"] = xml->readElementText().toInt();
+        } else if (name == "resource-attributes") {
+            while (xml->readNextStartElement()) {
+                if (xml->name() == "file-name") {
+                    resourceData["FileName"] = xml->readElementText();
+                } else {
+                    xml->skipCurrentElement();
+                }
+            }
+        } else {
+            xml->skipCurrentElement();
+        }
+    }
+    if (width > 0 && height > 0) {
+        resourceData["Dimensions"] = QSize(width, height);
+    }
+    if (!base64Data.isEmpty()) {
+        QString tempFileTemplate = m_storageManager->notesDataLocation() % QLatin1String("/notekeeper_import_XXXXXX");
+        note->resourcesData << resourceData;
+        note->decodedResources << QtConcurrent::run(decodeResource, base64Data, tempFileTemplate);
+    }
+}
+
+int EnexImportThread::commitBatch(QList<ParsedNote> *batch, const QString &notebookId)
+{
+    if (batch->isEmpty()) {
+        return 0;
+    }
+    QList<QVariantMap> notesData;
+    for (int i = 0; i < batch->count(); i++) {
+        ParsedNote &note = (*batch)[i];
+        QVariantList attachments;
+        for (int j = 0; j < note.decodedResources.count(); j++) {
+            EnexDecodedResource decoded = note.decodedResources[j].result(); // waits for the decoding to finish
+            if (decoded.tempFilePath.isEmpty()) {
+                continue;
+            }
+            QVariantMap attachment = note.resourcesData.at(j);
+            attachment["TempFilePath"] = decoded.tempFilePath;
+            attachment["Hash"] = decoded.md5Hash;
+            attachment["Size"] = decoded.size;
+            attachments << attachment;
+        }
+        note.noteData["Attachments"] = attachments;
+        notesData << note.noteData;
+    }
+    QStringList noteIds = m_storageManager->createImportedNotes(notesData, notebookId);
+    batch->clear();
+#ifdef DEBUG
+    qDebug() << "EnexImportThread: Committed" << noteIds.count() << "notes";
+#endif
+    return noteIds.count();
+}
+
+void EnexImportThread::discardBatch(QList<ParsedNote> *batch)
+{
+    for (int i = 0; i < batch->count(); i++) {
+        ParsedNote &note = (*batch)[i];
+        for (int j = 0; j < note.decodedResources.count(); j++) {
+            EnexDecodedResource decoded = note.decodedResources[j].result();
+            if (!decoded.tempFilePath.isEmpty()) {
+                QFile::remove(decoded.tempFilePath);
+            }
+        }
+    }
+    batch->clear();
+}
@@ -0,0 +1,82 @@
+/*
+  This file is part of Notekeeper Open and is licensed under the MIT License
+
+  Copyright (C) 2011-2015 Roopesh Chander <roop@roopc.net>
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject
+  to the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+  BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+  ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+  CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+
+#ifndef ENEXIMPORTTHREAD_H
+#define ENEXIMPORTTHREAD_H
+
+#include <QThread>
+#include <QString>
+#include <QList>
+#include <QVariantMap>
+#include <QFuture>
+#include "storage/storagemanager.h"
+
+class QXmlStreamReader;
+
+// Imports notes from an Evernote export (.enex) file.
+// The file is parsed with a streaming XML reader. Attachment data is
+// base64-decoded and hashed on the global thread pool while parsing
+// continues, and the parsed notes are committed to the store in batches.
+// Imported notes are marked as having unpushed changes.
+
+struct EnexDecodedResource
+{
+    EnexDecodedResource() : size(0) { }
+    QString tempFilePath;
+    QByteArray md5Hash;
+    qint64 size;
+};
+
+class EnexImportThread : public QThread
+{
+    Q_OBJECT
+public:
+    EnexImportThread(StorageManager *storageManager, const QString &filePath, const QString &notebookName = QString(), QObject *parent = 0);
+    void run();
+    void cancel();
+signals:
+    void enexImportProgressPercentage(int progressPercentage);
+    void enexImportFinished(bool success, const QString &message, int importedNotesCount);
+private:
+    struct ParsedNote {
+        QVariantMap noteData;
+        QList<QVariantMap> resourcesData;
+        QList<QFuture<EnexDecodedResource> > decodedResources;
+    };
+    bool readNote(QXmlStreamReader *xml, ParsedNote *note);
+    void readNoteAttributes(QXmlStreamReader *xml, QVariantMap *noteData);
+    void readResource(QXmlStreamReader *xml, ParsedNote *note);
+    int commitBatch(QList<ParsedNote> *batch, const QString &notebookId);
+    void discardBatch(QList<ParsedNote> *batch);
+
+    StorageManager * const m_storageManager;
+    const QString m_filePath;
+    const QString m_notebookName;
+    bool m_cancelled;
+};
+
+#endif // ENEXIMPORTTHREAD_H
@@ -143,7 +143,10 @@ SOURCES += main.cpp \
     clipboard.cpp \
     storage/storagemanager.cpp \
     storage/noteslistmodel.cpp \
+    storage/searchindex.cpp \
+    storage/searchtokenizer.cpp \
     storage/crypto/crypto.cpp \
+    storage/crypto/encryptedfile.cpp \
     qmlimageprovider/qmllocalimagethumbnailprovider.cpp \
     qmlimageprovider/qmlnoteimageprovider.cpp \
     connectionmanager.cpp \
@@ -152,6 +155,8 @@ SOURCES += main.cpp \
     storage/diskcache/shareddiskcache.cpp \
     qmlnetworkdiskcache.cpp \
     searchlocalnotesthread.cpp \
+    enexexportthread.cpp \
+    eneximportthread.cpp \
     logger.cpp \
     qmlnetworkcookiejar.cpp \
     qmlnetworkaccessmanager.cpp \
@@ -162,7 +167,10 @@ HEADERS += \
     clipboard.h \
     storage/storagemanager.h \
     storage/noteslistmodel.h \
+    storage/searchindex.h \
+    storage/searchtokenizer.h \
     storage/crypto/crypto.h \
+    storage/crypto/encryptedfile.h \
     qmlimageprovider/qmllocalimagethumbnailprovider.h \
     qmlimageprovider/qmlnoteimageprovider.h \
     connectionmanager.h \
@@ -171,6 +179,8 @@ HEADERS += \
     storage/diskcache/shareddiskcache.h \
     qmlnetworkdiskcache.h \
     searchlocalnotesthread.h \
+    enexexportthread.h \
+    eneximportthread.h \
     logger.h \
     qmlnetworkcookiejar.h \
     qmlnetworkaccessmanager.h \
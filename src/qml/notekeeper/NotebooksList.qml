@@ -86,7 +86,9 @@ Item {
                         property string iconPath: (model.modelData.NotebookType == StorageConstants.FavouritesNotebook?
                                                      "images/list/favourite_green.svg" :
                                                      (model.modelData.NotebookType == StorageConstants.TrashNotebook?
-                                                          "images/list/trash_green.svg" : ""));
+                                                          "images/list/trash_green.svg" :
+                                                          (model.modelData.NotebookType == StorageConstants.SavedSearchNotebook?
+                                                               "images/list/search_green.svg" : "")));
                         height: parent.height
                         width: (iconPath != ""? _UI.graphicSizeSmall + 10 : 0)
                         sourceComponent: (iconPath != ""? iconComponent : undefined)
@@ -130,6 +132,7 @@ Item {
     function loadNotebooksList() {
         qmlDataAccess.startListNotebooks(StorageConstants.FavouritesNotebook |
                                          StorageConstants.NormalNotebook |
+                                         StorageConstants.SavedSearchNotebook |
                                          StorageConstants.TrashNotebook);
     }
 
@@ -141,12 +144,15 @@ Item {
             page.loadFavouriteNotes();
         } else if (modelData.NotebookType == StorageConstants.TrashNotebook) {
             page.loadTrashNotes();
+        } else if (modelData.NotebookType == StorageConstants.SavedSearchNotebook) {
+            page.loadSavedSearchNotes(modelData.NotebookId, modelData.Name);
         }
     }
 
     function gotNotebooksList(notebookTypes, notebooksList) {
         if (notebookTypes == (StorageConstants.FavouritesNotebook |
                               StorageConstants.NormalNotebook |
+                              StorageConstants.SavedSearchNotebook |
                               StorageConstants.TrashNotebook)) {
             listLoader.listModel = notebooksList;
         }
@@ -197,7 +197,8 @@ Item {
                             width: parent.width
                             font.pixelSize: _UI.fontSizeSmall
                             color: _UI.colorNoteTimestamp
-                            text: root.timestampDisplayString(model.display.Timestamp, model.display.MillisecondsSinceEpoch, ", ")
+                            text: root.timestampDisplayString(model.display.Timestamp, model.display.MillisecondsSinceEpoch, ", ") + root.noteCountsDisplayString(model.display, ", ")
+                            elide: Text.ElideRight
                             maximumLineCount: 1
                         }
                         TextLabel {
@@ -214,7 +215,8 @@ Item {
                             id: contentDisplay
                             width: parent.width
                             font.pixelSize: _UI.fontSizeSmall
-                            text: model.display.ContentSummary;
+                            text: (model.display.ContentSnippet != ""? model.display.ContentSnippet : model.display.ContentSummary);
+                            textFormat: (model.display.ContentSnippet != ""? Text.StyledText : Text.PlainText)
                             elide: Text.ElideRight
                             wrapMode: Text.Wrap
                             color: _UI.colorNoteContentSummary
@@ -266,7 +268,9 @@ Item {
                         width: parent.width
                         font.pixelSize: _UI.fontSizeSmall
                         color: _UI.colorNoteTimestamp
-                        text: root.timestampDisplayString(model.display.Timestamp, model.display.MillisecondsSinceEpoch, "\n")
+                        text: root.timestampDisplayString(model.display.Timestamp, model.display.MillisecondsSinceEpoch, "\n") + root.noteCountsDisplayString(model.display, ", ")
+                        elide: Text.ElideRight
+                        wrapMode: Text.Wrap
                         maximumLineCount: 2
                     }
                     TextLabel {
@@ -283,7 +287,8 @@ Item {
                         id: contentDisplay
                         width: parent.width
                         font.pixelSize: _UI.fontSizeSmall
-                        text: model.display.ContentSummary;
+                        text: (model.display.ContentSnippet != ""? model.display.ContentSnippet : model.display.ContentSummary);
+                        textFormat: (model.display.ContentSnippet != ""? Text.StyledText : Text.PlainText)
                         elide: Text.ElideRight
                         wrapMode: Text.Wrap
                         color: _UI.colorNoteContentSummary
@@ -437,15 +442,28 @@ Item {
         loadNotesList(internal.notesListType, internal.collectionObjectId);
     }
 
+    function loadSavedSearchNotes(savedSearchId, savedSearchName) {
+        if (savedSearchId) {
+            internal.notesListType = StorageConstants.SavedSearchNotes;
+            internal.collectionObjectId = savedSearchId;
+            loadNotesList(internal.notesListType, internal.collectionObjectId);
+        }
+    }
+
     function loadSearchLocalNotesResult(words) {
         internal.notesListType = StorageConstants.SearchResultNotes;
         internal.collectionObjectId = words;
         searchNotesListModel.clear();
-        qmlDataAccess.startSearchLocalNotes(words);
+        var isIncludingServer = (qmlDataAccess.retrieveStringSetting("Search/includeServer") == "true");
+        if (isIncludingServer) {
+            qmlDataAccess.startHybridSearchNotes(words);
+        } else {
+            qmlDataAccess.startSearchLocalNotes(words);
+        }
         listLoader.listModel = searchNotesListModel;
         listLoader.item.header = searchResultsHeaderComponent;
         listLoader.item.footer = searchResultsFooterComponent;
-        internal.searchState = internal._LOCAL_SEARCH_IN_PROGRESS;
+        internal.searchState = (isIncludingServer? internal._REMOTE_SEARCH_IN_PROGRESS : internal._LOCAL_SEARCH_IN_PROGRESS);
     }
 
     function loadSearchNotesResult() {
@@ -467,7 +485,8 @@ Item {
             return;
         if (notesListType != internal.notesListType)
             return;
-        if (notesListType == StorageConstants.NotesInNotebook || notesListType == StorageConstants.NotesWithTag) {
+        if (notesListType == StorageConstants.NotesInNotebook || notesListType == StorageConstants.NotesWithTag ||
+                notesListType == StorageConstants.SavedSearchNotes) {
             if (!objectId)
                 return;
             if (!internal.collectionObjectId)
@@ -482,7 +501,8 @@ Item {
     function gotNotesList(notesList) {
         if (internal.notesListType == StorageConstants.NotesInNotebook ||
             internal.notesListType == StorageConstants.FavouriteNotes ||
-            internal.notesListType == StorageConstants.TrashNotes) {
+            internal.notesListType == StorageConstants.TrashNotes ||
+            internal.notesListType == StorageConstants.SavedSearchNotes) {
             listLoader.listModel = notebookNotesListModel;
         } else if (internal.notesListType == StorageConstants.NotesWithTag) {
             listLoader.listModel = tagNotesListModel;
@@ -532,6 +552,19 @@ Item {
         return Qt.formatDateTime(timestamp, "MMM d, yyyy" + joinString + timeFormatStr);
     }
 
+    // The todo and attachment counts stored with the note's summary, to follow the timestamp
+    function noteCountsDisplayString(noteData, joinString) {
+        var counts = [];
+        var todoCount = noteData.CheckedTodoCount + noteData.UncheckedTodoCount;
+        if (todoCount > 0) {
+            counts.push(noteData.CheckedTodoCount + "/" + todoCount + " done");
+        }
+        if (noteData.AttachmentCount > 0) {
+            counts.push(noteData.AttachmentCount + (noteData.AttachmentCount == 1? " attachment" : " attachments"));
+        }
+        return (counts.length > 0? joinString + counts.join(joinString) : "");
+    }
+
     Component.onCompleted: {
         qmlDataAccess.gotNotesList.connect(gotNotesList);
         qmlDataAccess.gotAllNotesList.connect(gotAllNotesList);
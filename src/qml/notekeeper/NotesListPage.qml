@@ -288,6 +288,15 @@ Page {
         internal.notesListType = StorageConstants.TrashNotes;
     }
 
+    function loadSavedSearchNotes(savedSearchId, savedSearchName) {
+        notesList.loadSavedSearchNotes(savedSearchId, savedSearchName);
+        titleBar.text = savedSearchName;
+        titleBar.iconPath = "images/titlebar/search_white.svg";
+        internal.notesListType = StorageConstants.SavedSearchNotes;
+        internal.objectId = savedSearchId;
+        internal.objectName = savedSearchName;
+    }
+
     function loadSearchLocalNotesResult(words) {
         internal.isSearchResultsPage = true;
         notesList.loadSearchLocalNotesResult(words);
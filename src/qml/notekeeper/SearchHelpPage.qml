@@ -150,6 +150,27 @@ Page {
             "<p><b>any: notebook:work finance account</p></b>" +
             "<p>Matches notes in the 'work' notebook that contain either the word \"finance\" or the word \"account\" (any: does not apply to \"notebook:\" terms)</p>" +
 
+
+            "<h3>Dates and attributes</h3>" +
+
+            "<p><b>created:day-7</p></b>" +
+            "<p>Matches notes created in the last 7 days. Also: week, month and year</p>" +
+
+            "<p><b>updated:20150101</p></b>" +
+            "<p>Matches notes updated on or after 1 January 2015</p>" +
+
+            "<p><b>-created:year</p></b>" +
+            "<p>Matches notes created before this year</p>" +
+
+            "<p><b>todo:false</p></b>" +
+            "<p>Matches notes with an unchecked checkbox. Also: todo:true and todo:*</p>" +
+
+            "<p><b>resource:image/*</p></b>" +
+            "<p>Matches notes with an image attached</p>" +
+
+            "<p><b>source:mobile.*</p></b>" +
+            "<p>Matches notes created from a mobile app</p>" +
+
             "</body>";
     }
 }
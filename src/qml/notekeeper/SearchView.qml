@@ -54,21 +54,58 @@ Item {
                             root.startSearch(searchbox.searchText);
                         }
                     }
+                    onSearchTextChanged: {
+                        internal.typedSearchText = searchbox.searchText;
+                        delayedCompletionsLoadTimer.restart();
+                        delayedLiveSearchTimer.restart();
+                    }
                 }
                 Button {
                     anchors.horizontalCenter: parent.horizontalCenter
                     id: searchButton
-                    text: "Search"
+                    text: (internal.isLiveSearchStarted? ("Show " + qmlDataAccess.searchResultsCount + " matching " + (qmlDataAccess.searchResultsCount == 1? "note" : "notes")) : "Search")
                     onClicked: root.startSearch(searchbox.searchText);
                 }
+                SettingsItem {
+                    anchors { left: parent.left; right: parent.right; }
+                    topText: "Most relevant first"
+                    bottomText: (switchChecked? "Best matches are listed first" : "Recently updated notes are listed first")
+                    controlItemType: "switch"
+                    switchChecked: (qmlDataAccess.retrieveStringSetting("Search/sortOrder") != "date")
+                    onSwitchCheckedChanged: qmlDataAccess.saveStringSetting("Search/sortOrder", (switchChecked? "relevance" : "date"));
+                }
+                SettingsItem {
+                    anchors { left: parent.left; right: parent.right; }
+                    topText: "Tolerate typos"
+                    bottomText: "Also find words that differ by a letter or two"
+                    controlItemType: "switch"
+                    switchChecked: (qmlDataAccess.retrieveStringSetting("Search/matchSimilarWords") == "true")
+                    onSwitchCheckedChanged: qmlDataAccess.saveStringSetting("Search/matchSimilarWords", (switchChecked? "true" : "false"));
+                }
+                SettingsItem {
+                    anchors { left: parent.left; right: parent.right; }
+                    topText: "Match plurals"
+                    bottomText: "Also find plural forms of English words. Takes effect after Notekeeper is restarted."
+                    controlItemType: "switch"
+                    switchChecked: (qmlDataAccess.retrieveStringSetting("Search/stemWords") == "true")
+                    onSwitchCheckedChanged: qmlDataAccess.saveStringSetting("Search/stemWords", (switchChecked? "true" : "false"));
+                }
+                SettingsItem {
+                    anchors { left: parent.left; right: parent.right; }
+                    topText: "Also search the server"
+                    bottomText: (switchChecked? "Notes not available offline are searched in Evernote" : "Only notes available offline are searched")
+                    controlItemType: "switch"
+                    switchChecked: (qmlDataAccess.retrieveStringSetting("Search/includeServer") == "true")
+                    onSwitchCheckedChanged: qmlDataAccess.saveStringSetting("Search/includeServer", (switchChecked? "true" : "false"));
+                }
                 Item { // spacer
                     anchors { left: parent.left; right: parent.right; }
                     height: 20
                 }
                 GenericListHeading {
-                    text: "Recent searches"
+                    text: (internal.hasCompletions? "Suggestions" : "Recent searches")
                     horizontalAlignment: Qt.AlignLeft
-                    opacity: (internal.hasRecentSearches? 1 : 0)
+                    opacity: ((internal.hasCompletions || internal.hasRecentSearches)? 1 : 0)
                 }
             }
         }
@@ -95,14 +132,14 @@ Item {
                 }
             }
         }
-        model: internal.recentSearches
+        model: (internal.hasCompletions? internal.completions : internal.recentSearches)
         footer: Component {
             Column {
                 anchors { left: parent.left; right: parent.right; }
                 Column {
                     anchors { left: parent.left; right: parent.right; }
-                    opacity: (internal.hasRecentSearches? 1 : 0)
-                    height: (internal.hasRecentSearches? implicitHeight : 0)
+                    opacity: ((internal.hasRecentSearches && !internal.hasCompletions)? 1 : 0)
+                    height: ((internal.hasRecentSearches && !internal.hasCompletions)? implicitHeight : 0)
                     Item { // spacer
                         anchors { left: parent.left; right: parent.right; }
                         height: 20
@@ -154,6 +191,19 @@ Item {
         id: internal
         property variant recentSearches;
         property bool hasRecentSearches: ((internal.recentSearches && internal.recentSearches.length > 0)? true : false);
+        property string typedSearchText: ""
+        property variant completions;
+        property bool hasCompletions: ((internal.completions && internal.completions.length > 0)? true : false);
+        property bool isLiveSearchStarted: false
+
+        // While typing, the last word is likely to be incomplete
+        function liveSearchQuery(searchText) {
+            var lastWord = searchText.substring(searchText.lastIndexOf(" ") + 1);
+            if (lastWord == "" || lastWord.indexOf(":") >= 0 || lastWord.charAt(lastWord.length - 1) == "*" || lastWord.charAt(lastWord.length - 1) == "\"") {
+                return searchText;
+            }
+            return searchText + "*";
+        }
     }
 
     QueryDialog {
@@ -180,7 +230,36 @@ Item {
         }
     }
 
+    Timer {
+        id: delayedCompletionsLoadTimer
+        running: false
+        repeat: false
+        interval: 200
+        onTriggered: {
+            internal.completions = qmlDataAccess.searchCompletions(internal.typedSearchText);
+        }
+    }
+
+    Timer {
+        id: delayedLiveSearchTimer
+        running: false
+        repeat: false
+        interval: 300
+        onTriggered: {
+            if (internal.typedSearchText.length >= 2) {
+                // Each search while typing only looks at what the one before it matched
+                searchNotesListModel.clear();
+                qmlDataAccess.startSearchLocalNotes(internal.liveSearchQuery(internal.typedSearchText));
+                internal.isLiveSearchStarted = true;
+            } else {
+                internal.isLiveSearchStarted = false;
+            }
+        }
+    }
+
     function startSearch(searchText) {
+        delayedLiveSearchTimer.stop();
+        internal.isLiveSearchStarted = false;
         if (searchText != "") {
             var page = root.pageStack.push(Qt.resolvedUrl("NotesListPage.qml"), { window: root.window });
             page.loadSearchLocalNotesResult(searchText);
@@ -190,6 +269,7 @@ Item {
     }
 
     Component.onCompleted: {
+        qmlDataAccess.prepareSearchIndex();
         delayedRecentSearchesLoadTimer.start();
     }
 }
@@ -31,8 +31,12 @@
 #include "evernotemarkup.h"
 #include "notekeeper_config.h"
 #include "storage/diskcache/shareddiskcache.h"
+#include "storage/crypto/encryptedfile.h"
 #include "storage/noteslistmodel.h"
+#include "storage/searchindex.h"
 #include "searchlocalnotesthread.h"
+#include "enexexportthread.h"
+#include "eneximportthread.h"
 #include "qmlnetworkdiskcache.h"
 #include "qmlnetworkcookiejar.h"
 #include "qexifreader.h"
@@ -52,12 +56,23 @@
 #include <QInputContext>
 #include <QDesktopServices>
 #include <QTransform>
+#include <QScopedPointer>
 #include "qplatformdefs.h"
 
+#include <QCryptographicHash>
+#include <QDataStream>
+
 #ifndef QT_SIMULATOR
 #include "Limits_constants.h"
 #endif
 
+// #define DEBUG
+
+#ifdef DEBUG
+#include <QDebug>
+#include <QElapsedTimer>
+#endif
+
 QmlDataAccess::QmlDataAccess(StorageManager *storageManager, ConnectionManager *connectionManager, QObject *parent)
     : QObject(parent)
     , m_storageManager(storageManager)
@@ -69,6 +84,16 @@ QmlDataAccess::QmlDataAccess(StorageManager *storageManager, ConnectionManager *
     , m_tagNotesListModel(new NotesListModel(storageManager, this))
     , m_searchNotesListModel(new NotesListModel(storageManager, this))
     , m_searchLocalNotesThread(0)
+    , m_searchServerNotesThread(0)
+    , m_isHybridSearch(false)
+    , m_isLocalSearchDone(false)
+    , m_isServerSearchDone(false)
+    , m_localSearchProgressPercentage(0)
+    , m_serverSearchProgressPercentage(0)
+    , m_isLastLocalSearchValid(false)
+    , m_isDeliveringCachedLocalSearch(false)
+    , m_enexExportThread(0)
+    , m_enexImportThread(0)
     , m_searchResultsCount(0)
     , m_unsearchedNotesCount(0)
     , m_searchProgressPercentage(0)
@@ -77,6 +102,7 @@ QmlDataAccess::QmlDataAccess(StorageManager *storageManager, ConnectionManager *
 {
     connect(m_storageManager, SIGNAL(notesListChanged(StorageConstants::NotesListType,QString)), SLOT(storageManagerNotesListChanged(StorageConstants::NotesListType,QString)));
     connect(m_storageManager, SIGNAL(notebooksListChanged()), SIGNAL(notebooksListChanged()));
+    connect(m_storageManager, SIGNAL(savedSearchesListChanged()), SIGNAL(notebooksListChanged())); // listed with the notebooks
     connect(m_storageManager, SIGNAL(tagsListChanged()), SIGNAL(tagsListChanged()));
 
     connect(m_storageManager, SIGNAL(textAddedToLog(QString)), SIGNAL(textAddedToLog(QString)));
@@ -87,6 +113,14 @@ QmlDataAccess::QmlDataAccess(StorageManager *storageManager, ConnectionManager *
     connect(&m_offlineStatusChangedTimer, SIGNAL(timeout()), SLOT(tryResolveOfflineStatusChanges()));
     tryResolveOfflineStatusChanges(); // in case the app quit earlier when the timer was running
 
+    // Saved searches are kept up-to-date in the background, once the notes stop changing for a while
+    m_savedSearchesRefreshTimer.setSingleShot(true);
+    m_savedSearchesRefreshTimer.setInterval(10 * 1000);
+    connect(m_storageManager, SIGNAL(notesChangedForSavedSearches()), &m_savedSearchesRefreshTimer, SLOT(start()));
+    connect(&m_savedSearchesRefreshTimer, SIGNAL(timeout()), SLOT(refreshSavedSearches()));
+
+    m_localSearchCache.setMaxCost(20000); // notes, summed over the cached searches
+
     bool diskCacheSizeOk = false;
     qint64 diskCacheSize = retrieveStringSetting("DiskCache/MaxSize").toLongLong(&diskCacheSizeOk);
     if (diskCacheSizeOk && diskCacheSize > 0) {
@@ -218,7 +252,11 @@ QVariant QmlDataAccess::appendTextToNote(const QString &noteId, const QString &t
 
 static QImage thumbnailFromImageFile(const QString &fileName, int side = 75)
 {
-    QImageReader imageReader(fileName);
+    QScopedPointer<QIODevice> imageFile(EncryptedFile::openForReading(fileName));
+    if (imageFile.isNull()) {
+        return QImage();
+    }
+    QImageReader imageReader(imageFile.data());
     if (!imageReader.canRead()) {
         return QImage();
     }
@@ -319,6 +357,17 @@ void QmlDataAccess::startListNotes(int whichNotes, const QString &objectId /* no
         notesListModel = m_notebookNotesListModel;
     } else if (type == StorageConstants::NotesWithTag) {
         notesListModel = m_tagNotesListModel;
+    } else if (type == StorageConstants::SavedSearchNotes) {
+        notesListModel = m_notebookNotesListModel;
+        // Listed from its stored matching notes, like a notebook, once they're up-to-date
+        QStringList storedNoteIds;
+        if (m_storageManager->hasNotesChangedForSavedSearches() ||
+            !m_storageManager->savedSearchMatchingNoteIds(objectId, &storedNoteIds)) {
+            RefreshSavedSearchesThread *refreshSavedSearchesThread = new RefreshSavedSearchesThread(m_storageManager, objectId, this);
+            connect(refreshSavedSearchesThread, SIGNAL(savedSearchesRefreshed(QString)), SLOT(savedSearchRefreshedForListing(QString)));
+            refreshSavedSearchesThread->start();
+            return;
+        }
     }
     ListNotesThread *listNotesThread = new ListNotesThread(notesListModel, type, objectId, this);
     if (type == StorageConstants::AllNotes) {
@@ -329,6 +378,25 @@ void QmlDataAccess::startListNotes(int whichNotes, const QString &objectId /* no
     listNotesThread->start();
 }
 
+void QmlDataAccess::savedSearchRefreshedForListing(const QString &savedSearchId)
+{
+    ListNotesThread *listNotesThread = new ListNotesThread(m_notebookNotesListModel, StorageConstants::SavedSearchNotes, savedSearchId, this);
+    connect(listNotesThread, SIGNAL(gotNotesList()), SIGNAL(gotNotesList()));
+    listNotesThread->start();
+}
+
+void QmlDataAccess::refreshSavedSearches()
+{
+    RefreshSavedSearchesThread *refreshSavedSearchesThread = new RefreshSavedSearchesThread(m_storageManager, QString(), this);
+    connect(refreshSavedSearchesThread, SIGNAL(savedSearchMatchingNotesChanged(QString)), SLOT(savedSearchMatchingNotesChanged(QString)));
+    refreshSavedSearchesThread->start();
+}
+
+void QmlDataAccess::savedSearchMatchingNotesChanged(const QString &savedSearchId)
+{
+    emit notesListChanged(static_cast<int>(StorageConstants::SavedSearchNotes), savedSearchId);
+}
+
 void QmlDataAccess::startGetNoteData(const QString &noteId)
 {
     GetNoteDataThread *getNoteDataThread = new GetNoteDataThread(m_storageManager, m_evernoteAccess, noteId, this);
@@ -348,11 +416,28 @@ void QmlDataAccess::fetchNoteDataFinished(bool success, const QString &message)
 
 void QmlDataAccess::startSearchLocalNotes(const QString &words)
 {
-    SearchLocalNotesThread *searchLocalNotesThread = new SearchLocalNotesThread(m_storageManager, words, this);
-    connect(searchLocalNotesThread, SIGNAL(searchLocalNotesMatchingNote(QString)), SLOT(searchLocalNotesMatchObtained(QString)));
-    connect(searchLocalNotesThread, SIGNAL(searchLocalNotesProgressPercentage(int)), SLOT(searchLocalNotesProgressPercentageChanged(int)));
-    connect(searchLocalNotesThread, SIGNAL(searchLocalNotesFinished(int)), SLOT(searchLocalNotesThreadFinished(int)));
-    m_searchLocalNotesThread = searchLocalNotesThread;
+    if (m_searchLocalNotesThread) {
+        // A new search supersedes the running one
+        m_searchLocalNotesThread->cancel();
+        m_searchLocalNotesThread = 0;
+    }
+    m_searchServerNotesThread = 0; // a server search can't be cancelled by itself, but its results are ignored
+    m_isHybridSearch = false;
+    m_isLocalSearchDone = false;
+    m_localSearchProgressPercentage = 0;
+    m_isDeliveringCachedLocalSearch = false;
+    // Ranked by relevance unless the user prefers the notes list order
+    bool isSortedByDate = (m_storageManager->retrieveStringSetting("Search/sortOrder") == "date");
+    bool isMatchingSimilarWords = (m_storageManager->retrieveStringSetting("Search/matchSimilarWords") == "true");
+    SearchLocalNotesThread::ResultsOrder resultsOrder = (isSortedByDate? SearchLocalNotesThread::RecentlyUpdatedFirst :
+                                                                         SearchLocalNotesThread::MostRelevantFirst);
+    m_runningLocalSearch.query = words;
+    m_runningLocalSearch.resultsOrder = resultsOrder;
+    m_runningLocalSearch.isMatchingSimilarWords = isMatchingSimilarWords;
+    m_runningLocalSearch.storeGeneration = m_storageManager->storeGeneration();
+    m_runningLocalSearch.matchingNoteIds.clear();
+    m_runningLocalSearch.unsearchedNotesCount = 0;
+    m_searchNotesListModel->setSnippetWords(SearchQuery(words).matchingWords());
     if (m_searchResultsCount != 0) {
         m_searchResultsCount = 0;
         emit searchResultsCountChanged();
@@ -365,12 +450,40 @@ void QmlDataAccess::startSearchLocalNotes(const QString &words)
         m_searchProgressPercentage = 0;
         emit searchProgressPercentageChanged();
     }
+
+    // A search repeated on an unchanged store has the same results
+    const LocalSearchResults *cachedResults = m_localSearchCache.object(localSearchCacheKey(m_runningLocalSearch));
+    if (cachedResults && cachedResults->storeGeneration == m_runningLocalSearch.storeGeneration) {
+        m_runningLocalSearch = (*cachedResults);
+        m_isDeliveringCachedLocalSearch = true;
+        // Delivered from the event loop, like results from a thread would be
+        QTimer::singleShot(0, this, SLOT(deliverCachedLocalSearchResults()));
+        return;
+    }
+
+    SearchLocalNotesThread *searchLocalNotesThread = new SearchLocalNotesThread(m_storageManager, words, resultsOrder, isMatchingSimilarWords, this);
+    // While a query is being typed, each query usually narrows down the one before, so only the notes that
+    // matched the one before need to be searched. Not so with similar words: "meeti" could be a typo
+    // of a word that doesn't start with "meet".
+    if (m_isLastLocalSearchValid && m_lastLocalSearch.storeGeneration == m_runningLocalSearch.storeGeneration &&
+        !isMatchingSimilarWords && !m_lastLocalSearch.isMatchingSimilarWords &&
+        SearchQuery(words).isRefinementOf(SearchQuery(m_lastLocalSearch.query))) {
+        searchLocalNotesThread->refinePreviousResults(m_lastLocalSearch.matchingNoteIds.toSet(), m_lastLocalSearch.unsearchedNotesCount);
+    }
+    connect(searchLocalNotesThread, SIGNAL(searchLocalNotesMatchingNotes(QStringList)), SLOT(searchLocalNotesMatchesObtained(QStringList)));
+    connect(searchLocalNotesThread, SIGNAL(searchLocalNotesProgressPercentage(int)), SLOT(searchLocalNotesProgressPercentageChanged(int)));
+    connect(searchLocalNotesThread, SIGNAL(searchLocalNotesFinished(int)), SLOT(searchLocalNotesThreadFinished(int)));
+    m_searchLocalNotesThread = searchLocalNotesThread;
     searchLocalNotesThread->start();
 }
 
-void QmlDataAccess::searchLocalNotesMatchObtained(const QString &noteId)
+void QmlDataAccess::searchLocalNotesMatchesObtained(const QStringList &noteIds)
 {
-    int matchingNotesCount = m_searchNotesListModel->appendNoteIds(QStringList() << noteId);
+    if (sender() != m_searchLocalNotesThread) {
+        return; // from a superseded search
+    }
+    m_runningLocalSearch.matchingNoteIds << noteIds;
+    int matchingNotesCount = m_searchNotesListModel->appendNoteIds(noteIds);
     if (m_searchResultsCount != matchingNotesCount) {
         m_searchResultsCount = matchingNotesCount;
         emit searchResultsCountChanged();
@@ -379,48 +492,172 @@ void QmlDataAccess::searchLocalNotesMatchObtained(const QString &noteId)
 
 void QmlDataAccess::searchLocalNotesProgressPercentageChanged(int searchProgressPercentage)
 {
-    if (m_searchProgressPercentage != searchProgressPercentage) {
-        m_searchProgressPercentage = searchProgressPercentage;
-        emit searchProgressPercentageChanged();
+    if (sender() != m_searchLocalNotesThread) {
+        return;
     }
+    m_localSearchProgressPercentage = searchProgressPercentage;
+    updateSearchProgressPercentage();
 }
 
 void QmlDataAccess::searchLocalNotesThreadFinished(int unsearchedNotesCount)
 {
+    if (sender() != m_searchLocalNotesThread) {
+        return;
+    }
+    bool isCancelled = m_searchLocalNotesThread->isCancelled();
     m_searchLocalNotesThread = 0;
+    if (isCancelled) {
+        localSearchFinished();
+        return; // the results are incomplete, so they can't be reused
+    }
+    m_runningLocalSearch.unsearchedNotesCount = unsearchedNotesCount;
+    m_lastLocalSearch = m_runningLocalSearch;
+    m_isLastLocalSearchValid = true;
+    m_localSearchCache.insert(localSearchCacheKey(m_runningLocalSearch), new LocalSearchResults(m_runningLocalSearch),
+                              m_runningLocalSearch.matchingNoteIds.count() + 1);
     if (m_unsearchedNotesCount != unsearchedNotesCount) {
         m_unsearchedNotesCount = unsearchedNotesCount;
         emit unsearchedNotesCountChanged();
     }
-    emit searchLocalNotesFinished();
+    localSearchFinished();
 }
 
-void QmlDataAccess::startSearchNotes(const QString &words)
+void QmlDataAccess::deliverCachedLocalSearchResults()
 {
-    SearchServerNotesThread *searchServerNotesThread = new SearchServerNotesThread(m_storageManager, m_evernoteAccess, words, this);
-    connect(searchServerNotesThread, SIGNAL(searchServerNotesResultObtained(QStringList,int)), SLOT(searchServerNotesResultObtained(QStringList,int)));
-    connect(searchServerNotesThread, SIGNAL(searchServerNotesFinished()), SIGNAL(searchServerNotesFinished()));
-    connect(searchServerNotesThread, SIGNAL(authTokenInvalid()), SIGNAL(authTokenInvalid()));
+    if (!m_isDeliveringCachedLocalSearch) {
+        return; // superseded by a later search
+    }
+    m_isDeliveringCachedLocalSearch = false;
+    m_lastLocalSearch = m_runningLocalSearch;
+    m_isLastLocalSearchValid = true;
+    int matchingNotesCount = m_searchNotesListModel->appendNoteIds(m_runningLocalSearch.matchingNoteIds);
+    if (m_searchResultsCount != matchingNotesCount) {
+        m_searchResultsCount = matchingNotesCount;
+        emit searchResultsCountChanged();
+    }
+    if (m_unsearchedNotesCount != m_runningLocalSearch.unsearchedNotesCount) {
+        m_unsearchedNotesCount = m_runningLocalSearch.unsearchedNotesCount;
+        emit unsearchedNotesCountChanged();
+    }
+    localSearchFinished();
+}
 
-    if (m_searchProgressPercentage != 0) {
-        m_searchProgressPercentage = 0;
+// In a hybrid search, the QML is told only when both searches are done, as if it were a server search
+void QmlDataAccess::localSearchFinished()
+{
+    m_isLocalSearchDone = true;
+    if (!m_isHybridSearch) {
+        emit searchLocalNotesFinished();
+    } else if (m_isServerSearchDone) {
+        emit searchServerNotesFinished();
+    }
+}
+
+void QmlDataAccess::updateSearchProgressPercentage()
+{
+    int searchProgressPercentage = (m_isHybridSearch? ((m_isLocalSearchDone? 100 : m_localSearchProgressPercentage) + m_serverSearchProgressPercentage) / 2 :
+                                    m_searchServerNotesThread? m_serverSearchProgressPercentage : m_localSearchProgressPercentage);
+    if (m_searchProgressPercentage != searchProgressPercentage) {
+        m_searchProgressPercentage = searchProgressPercentage;
         emit searchProgressPercentageChanged();
     }
+}
 
+QString QmlDataAccess::localSearchCacheKey(const LocalSearchResults &search)
+{
+    return (QString::number(search.resultsOrder) % QLatin1Char(search.isMatchingSimilarWords? 's' : '-') % QLatin1Char(':') % search.query);
+}
+
+// Asks the server only about the notes that the local search can't read. The results are merged into
+// the local search's results, so notes found by both are listed once.
+void QmlDataAccess::startSearchNotes(const QString &words)
+{
+    SearchServerNotesThread *searchServerNotesThread = new SearchServerNotesThread(m_storageManager, m_evernoteAccess, words,
+                                                                                   true /* isSkippingLocallySearchableNotes */, this);
+    connect(searchServerNotesThread, SIGNAL(searchServerNotesResultObtained(QStringList,int)), SLOT(searchServerNotesResultObtained(QStringList,int)));
+    connect(searchServerNotesThread, SIGNAL(searchServerNotesFinished()), SLOT(searchServerNotesThreadFinished()));
+    connect(searchServerNotesThread, SIGNAL(authTokenInvalid()), SIGNAL(authTokenInvalid()));
+    m_searchServerNotesThread = searchServerNotesThread;
+    m_isServerSearchDone = false;
+    m_serverSearchProgressPercentage = 0;
+    updateSearchProgressPercentage();
     searchServerNotesThread->start();
 }
 
+void QmlDataAccess::startHybridSearchNotes(const QString &words)
+{
+    startSearchLocalNotes(words);
+    m_isHybridSearch = true;
+    startSearchNotes(words);
+}
+
 void QmlDataAccess::searchServerNotesResultObtained(const QStringList &noteIdsList, int searchProgressPercentage)
 {
+    if (sender() != m_searchServerNotesThread) {
+        return; // from a superseded search
+    }
     int matchingNotesCount = m_searchNotesListModel->appendNoteIds(noteIdsList);
     if (m_searchResultsCount != matchingNotesCount) {
         m_searchResultsCount = matchingNotesCount;
         emit searchResultsCountChanged();
     }
-    if (m_searchProgressPercentage != searchProgressPercentage) {
-        m_searchProgressPercentage = searchProgressPercentage;
-        emit searchProgressPercentageChanged();
+    m_serverSearchProgressPercentage = searchProgressPercentage;
+    updateSearchProgressPercentage();
+}
+
+void QmlDataAccess::searchServerNotesThreadFinished()
+{
+    if (sender() != m_searchServerNotesThread) {
+        return;
+    }
+    m_searchServerNotesThread = 0;
+    m_isServerSearchDone = true;
+    if (!m_isHybridSearch || m_isLocalSearchDone) {
+        emit searchServerNotesFinished();
+    }
+}
+
+void QmlDataAccess::startEnexExport(const QString &filePath)
+{
+    if (m_enexExportThread) {
+        return; // an export is already in progress
     }
+    EnexExportThread *enexExportThread = new EnexExportThread(m_storageManager, filePath, this);
+    connect(enexExportThread, SIGNAL(enexExportProgressPercentage(int)), SIGNAL(enexExportProgressPercentage(int)));
+    connect(enexExportThread, SIGNAL(enexExportFinished(bool,QString,int,int,int)), SIGNAL(enexExportFinished(bool,QString,int,int,int)));
+    connect(enexExportThread, SIGNAL(finished()), SLOT(enexExportThreadFinished()));
+    m_enexExportThread = enexExportThread;
+    enexExportThread->start(QThread::LowPriority);
+}
+
+void QmlDataAccess::enexExportThreadFinished()
+{
+    m_enexExportThread = 0;
+}
+
+void QmlDataAccess::startEnexImport(const QString &filePath, const QString &notebookName)
+{
+    if (m_enexImportThread) {
+        return; // an import is already in progress
+    }
+    EnexImportThread *enexImportThread = new EnexImportThread(m_storageManager, filePath, notebookName, this);
+    connect(enexImportThread, SIGNAL(enexImportProgressPercentage(int)), SIGNAL(enexImportProgressPercentage(int)));
+    connect(enexImportThread, SIGNAL(enexImportFinished(bool,QString,int)), SIGNAL(enexImportFinished(bool,QString,int)));
+    connect(enexImportThread, SIGNAL(finished()), SLOT(enexImportThreadFinished()));
+    m_enexImportThread = enexImportThread;
+    enexImportThread->start(QThread::LowPriority);
+}
+
+void QmlDataAccess::enexImportThreadFinished()
+{
+    m_enexImportThread = 0;
+    // Imported notes were added without per-note signals, so the lists have to be reloaded
+    m_allNotesListModel->clearNotesListQuery();
+    m_notebookNotesListModel->clearNotesListQuery();
+    m_tagNotesListModel->clearNotesListQuery();
+    emit notesListChanged(static_cast<int>(StorageConstants::AllNotes), QString());
+    emit notebooksListChanged();
+    emit tagsListChanged();
 }
 
 void QmlDataAccess::startAttachmentDownload(const QString &urlString, const QString &fileName, const QString &fileExtension)
@@ -921,6 +1158,40 @@ QStringList QmlDataAccess::recentSearchQueries()
     return m_storageManager->recentSearchQueries();
 }
 
+// Completes the last word in searchText with words from the local search index
+QStringList QmlDataAccess::searchCompletions(const QString &searchText)
+{
+    QStringList completions;
+    if (searchText.isEmpty() || searchText.at(searchText.length() - 1).isSpace()) {
+        return completions;
+    }
+    int wordStart = searchText.lastIndexOf(QRegExp("\\s")) + 1;
+    QString lastWord = searchText.mid(wordStart);
+    QString qualifierPrefix;
+    if (lastWord.startsWith('-')) {
+        qualifierPrefix = "-";
+        lastWord.remove(0, 1);
+    }
+    if (lastWord.startsWith("intitle:", Qt::CaseInsensitive)) {
+        qualifierPrefix += lastWord.left(8);
+        lastWord.remove(0, 8);
+    }
+    if (lastWord.length() < 2 || lastWord.contains(':') || lastWord.contains('"') || lastWord.contains('*')) {
+        return completions;
+    }
+    QString textBeforeWord = searchText.left(wordStart) + qualifierPrefix;
+    foreach (const QString &term, m_storageManager->searchIndex()->termsWithPrefix(SearchIndex::normalizedWord(lastWord), 5)) {
+        completions << (textBeforeWord + term);
+    }
+    return completions;
+}
+
+void QmlDataAccess::prepareSearchIndex()
+{
+    PrepareSearchIndexThread *prepareSearchIndexThread = new PrepareSearchIndexThread(m_storageManager, this);
+    prepareSearchIndexThread->start(QThread::LowPriority);
+}
+
 void QmlDataAccess::clearRecentSearchQueries()
 {
     m_storageManager->clearRecentSearchQueries();
@@ -974,7 +1245,13 @@ bool QmlDataAccess::cancel()
     if (m_searchLocalNotesThread) {
         m_searchLocalNotesThread->cancel();
     }
-    return (wasBusy || m_searchLocalNotesThread != 0);
+    if (m_enexExportThread) {
+        m_enexExportThread->cancel();
+    }
+    if (m_enexImportThread) {
+        m_enexImportThread->cancel();
+    }
+    return (wasBusy || m_searchLocalNotesThread != 0 || m_enexExportThread != 0 || m_enexImportThread != 0);
 }
 
 void QmlDataAccess::cancelAddingAttachment()
@@ -1201,29 +1478,79 @@ void GetNoteDataThread::run()
     QString attachmentUrlBase = m_storageManager->retrieveEvernoteAuthData("webApiUrlPrefix") % "res";
     QString qmlResourceBase = m_storageManager->property("qmlResourceBase").toString();
 
-    bool isPlainText;
-    QString parsedContent;
-    QVariantList allAttachments, imageAttachments, checkboxStates;
-    QByteArray convertedEnmlContent;
-    bool parsed = EvernoteMarkup::parseEvernoteMarkup(enmlContent, &isPlainText, &parsedContent, true /*shouldReturnHtml*/, attachmentsData, attachmentUrlBase, qmlResourceBase, &allAttachments, &imageAttachments, &checkboxStates, &convertedEnmlContent);
-    data["IsPlainText"] = isPlainText;
-    data["ParsedContent"] = parsedContent;
-    data["AllAttachments"] = allAttachments;
-    data["ImageAttachments"] = imageAttachments;
-    data["CheckboxStates"] = checkboxStates;
-    data["EnmlContent"] = (convertedEnmlContent.isEmpty()? enmlContent : convertedEnmlContent);
-    data["IsEnmlParsingErrored"] = (!parsed);
-    data["NonImageAttachmentsCount"] = qMax(0, allAttachments.count() - imageAttachments.count());
-
-    if (!convertedEnmlContent.isEmpty()) {
-        m_storageManager->log(QString("Info: Wrong XML encoding in note [%1] with title [%2] has been auto-fixed during ENML parsing").arg(data.value("guid").toString()).arg(data.value("Title").toString()));
+#ifdef DEBUG
+    QElapsedTimer renderTime;
+    renderTime.start();
+#endif
+
+    // A note viewed earlier is taken as rendered then, unless something the rendering depends on has changed.
+    // Not when the store is encrypted at rest, because the disk cache isn't.
+    bool isRenderCacheable = (!m_storageManager->isAtRestEncryptionEnabled());
+    QByteArray renderKey;
+    QVariantMap renderedNote;
+    bool isRenderCached = false;
+    if (isRenderCacheable) {
+        renderKey = renderedNoteKey(enmlContent, attachmentsData, attachmentUrlBase, qmlResourceBase);
+        isRenderCached = SharedDiskCache::instance()->retrieveRenderedNote(renderKey, &renderedNote);
+    }
+
+    if (!isRenderCached) {
+        bool isPlainText;
+        QString parsedContent;
+        QVariantList allAttachments, imageAttachments, checkboxStates;
+        QByteArray convertedEnmlContent;
+        bool parsed = EvernoteMarkup::parseEvernoteMarkup(enmlContent, &isPlainText, &parsedContent, true /*shouldReturnHtml*/, attachmentsData, attachmentUrlBase, qmlResourceBase, &allAttachments, &imageAttachments, &checkboxStates, &convertedEnmlContent);
+        renderedNote["IsPlainText"] = isPlainText;
+        renderedNote["ParsedContent"] = parsedContent;
+        renderedNote["AllAttachments"] = allAttachments;
+        renderedNote["ImageAttachments"] = imageAttachments;
+        renderedNote["CheckboxStates"] = checkboxStates;
+        if (!convertedEnmlContent.isEmpty()) {
+            renderedNote["EnmlContent"] = convertedEnmlContent;
+        }
+        renderedNote["IsEnmlParsingErrored"] = (!parsed);
+        renderedNote["NonImageAttachmentsCount"] = qMax(0, allAttachments.count() - imageAttachments.count());
+        if (isRenderCacheable) {
+            SharedDiskCache::instance()->insertRenderedNote(renderKey, renderedNote);
+        }
+
+        if (!convertedEnmlContent.isEmpty()) {
+            m_storageManager->log(QString("Info: Wrong XML encoding in note [%1] with title [%2] has been auto-fixed during ENML parsing").arg(data.value("guid").toString()).arg(data.value("Title").toString()));
+        }
     }
+
+    data["EnmlContent"] = enmlContent; // unless replaced by the converted ENML, below
+    QMapIterator<QString, QVariant> renderedNoteIter(renderedNote);
+    while (renderedNoteIter.hasNext()) {
+        renderedNoteIter.next();
+        data[renderedNoteIter.key()] = renderedNoteIter.value();
+    }
+
+#ifdef DEBUG
+    qDebug() << "GetNoteDataThread: Rendered" << enmlContent.size() << "bytes of ENML" << (isRenderCached? "from the cache" : "by parsing")
+             << "in" << renderTime.elapsed() << "ms";
+#endif
     emit gotNoteData(data);
     return;
 }
 
-SearchServerNotesThread::SearchServerNotesThread(StorageManager *storageManager, EvernoteAccess *evernoteAccess, const QString &words, QObject *parent)
+QByteArray GetNoteDataThread::renderedNoteKey(const QByteArray &enmlContent, const QVariantList &attachmentsData,
+                                              const QString &attachmentUrlBase, const QString &qmlResourceBase)
+{
+    QByteArray renderInputs;
+    QDataStream stream(&renderInputs, QIODevice::WriteOnly);
+    stream.setVersion(QDataStream::Qt_4_7);
+    stream << qint32(EvernoteMarkup::HTML_RENDERER_VERSION) << attachmentsData << attachmentUrlBase << qmlResourceBase;
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    hash.addData(renderInputs);
+    hash.addData(enmlContent);
+    return hash.result();
+}
+
+SearchServerNotesThread::SearchServerNotesThread(StorageManager *storageManager, EvernoteAccess *evernoteAccess, const QString &words,
+                                                 bool isSkippingLocallySearchableNotes, QObject *parent)
     : QThread(parent), m_storageManager(storageManager), m_evernoteAccess(evernoteAccess), m_words(words)
+    , m_isSkippingLocallySearchableNotes(isSkippingLocallySearchableNotes)
 {
     connect(this, SIGNAL(finished()), SLOT(deleteLater())); // auto-delete
 #ifndef QT_SIMULATOR
@@ -1235,7 +1562,7 @@ SearchServerNotesThread::SearchServerNotesThread(StorageManager *storageManager,
 void SearchServerNotesThread::run()
 {
  #ifndef QT_SIMULATOR
-    m_evernoteAccess->searchNotes(m_words);
+    m_evernoteAccess->searchNotes(m_words, QString(), QString(), m_isSkippingLocallySearchableNotes);
 #endif
     emit searchServerNotesFinished();
 }
@@ -1277,16 +1604,16 @@ void AttachmentDownloadThread::run()
     QTemporaryFile tempFile(tempFileNameTemplate);
     QUrl url(m_urlStr);
     if (url.scheme() == "file") { // local url
-        QFile sourceFile(url.toLocalFile());
-        bool ok1 = sourceFile.open(QFile::ReadOnly);
+        QScopedPointer<QIODevice> sourceFile(EncryptedFile::openForReading(url.toLocalFile())); // decrypts, if encrypted
+        bool ok1 = (!sourceFile.isNull());
         bool ok2 = tempFile.open();
         if (!ok1 || !ok2) {
             emit attachmentDownloaded(QString());
             return;
         }
         int bytesCopied = 0;
-        while (!sourceFile.atEnd()) {
-            QByteArray data = sourceFile.read(1 << 18); // max 256 kb
+        while (!sourceFile->atEnd()) {
+            QByteArray data = sourceFile->read(1 << 18); // max 256 kb
             bytesCopied += tempFile.write(data);
             emit attachmentDownloadProgressed(bytesCopied);
         }
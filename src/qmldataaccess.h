@@ -32,6 +32,8 @@
 #include <QVariantMap>
 #include <QSslConfiguration>
 #include <QTimer>
+#include <QSet>
+#include <QCache>
 
 #include "storage/storagemanager.h"
 
@@ -40,8 +42,22 @@ class EvernoteAccess;
 class EvernoteSync;
 class NotesListModel;
 class SearchLocalNotesThread;
+class SearchServerNotesThread;
+class EnexExportThread;
+class EnexImportThread;
 class ImageReadCancelHelper;
 
+// A local search and its results, kept so that a search refining it needs to look only at its results
+struct LocalSearchResults
+{
+    QString query;
+    int resultsOrder; // SearchLocalNotesThread::ResultsOrder
+    bool isMatchingSimilarWords;
+    int storeGeneration; // StorageManager::storeGeneration() when the search started
+    QStringList matchingNoteIds; // in the order they're listed
+    int unsearchedNotesCount;
+};
+
 // Used by the QML code to access notes/notebooks/tags data.
 
 class QmlDataAccess : public QObject
@@ -151,6 +167,8 @@ public slots:
 
     void setRecentSearchQuery(const QString &searchQuery);
     QStringList recentSearchQueries();
+    QStringList searchCompletions(const QString &searchText);
+    void prepareSearchIndex();
     void clearRecentSearchQueries();
 
     bool resetPreeditText() const;
@@ -169,6 +187,9 @@ public slots:
     void startGetNoteData(const QString &noteId);
     void startSearchLocalNotes(const QString &words);
     void startSearchNotes(const QString &words);
+    void startHybridSearchNotes(const QString &words); // searches locally and in the server at the same time
+    void startEnexExport(const QString &filePath);
+    void startEnexImport(const QString &filePath, const QString &notebookName = QString());
     void startAttachmentDownload(const QString &urlString,
                                  const QString &fileName = QString(),       // target fileName, pass empty string to use a temp fileName
                                  const QString &fileExtension = QString()); // when using temp fileName, file extension to use, if any
@@ -191,6 +212,11 @@ signals:
     void gotNoteData(const QVariantMap &noteData);
     void searchLocalNotesFinished();
     void searchServerNotesFinished();
+    void enexExportProgressPercentage(int progressPercentage);
+    void enexExportFinished(bool success, const QString &message, int exportedNotesCount, int unexportedNotesCount,
+                            int partlyExportedNotesCount);
+    void enexImportProgressPercentage(int progressPercentage);
+    void enexImportFinished(bool success, const QString &message, int importedNotesCount);
     void errorFetchingNote(const QString &message);
     void aboutToQuit();
     void aboutToLogout();
@@ -207,20 +233,40 @@ signals:
 
 private slots:
     void storageManagerNotesListChanged(StorageConstants::NotesListType whichNotes, const QString &objectId);
-    void searchLocalNotesMatchObtained(const QString &noteId);
+    void refreshSavedSearches();
+    void savedSearchMatchingNotesChanged(const QString &savedSearchId);
+    void savedSearchRefreshedForListing(const QString &savedSearchId);
+    void deliverCachedLocalSearchResults();
+    void searchLocalNotesMatchesObtained(const QStringList &noteIds);
     void searchLocalNotesProgressPercentageChanged(int searchProgressPercentage);
     void searchLocalNotesThreadFinished(int unsearchedNotesCount);
     void searchServerNotesResultObtained(const QStringList &noteIds, int searchProgressPercentage);
+    void searchServerNotesThreadFinished();
+    void enexExportThreadFinished();
+    void enexImportThreadFinished();
     void fetchNoteDataFinished(bool success, const QString &message);
     void attachmentDownloadProgressed(qint64 bytesDownloaded);
     void updateAddingAttachmentStatus(const QVariantMap &status);
 
 private:
+    static QString localSearchCacheKey(const LocalSearchResults &search);
+    void localSearchFinished();
+    void updateSearchProgressPercentage();
+
     StorageManager *m_storageManager;
     EvernoteAccess *m_evernoteAccess;
     QTimer m_offlineStatusChangedTimer;
+    QTimer m_savedSearchesRefreshTimer;
     NotesListModel *m_allNotesListModel, *m_notebookNotesListModel, *m_tagNotesListModel, *m_searchNotesListModel;
     SearchLocalNotesThread *m_searchLocalNotesThread;
+    SearchServerNotesThread *m_searchServerNotesThread;
+    bool m_isHybridSearch, m_isLocalSearchDone, m_isServerSearchDone;
+    int m_localSearchProgressPercentage, m_serverSearchProgressPercentage;
+    LocalSearchResults m_runningLocalSearch, m_lastLocalSearch;
+    bool m_isLastLocalSearchValid, m_isDeliveringCachedLocalSearch;
+    QCache<QString, LocalSearchResults> m_localSearchCache; // key: localSearchCacheKey(); cost: number of notes
+    EnexExportThread *m_enexExportThread;
+    EnexImportThread *m_enexImportThread;
     int m_searchResultsCount, m_unsearchedNotesCount, m_searchProgressPercentage;
     qint64 m_attachmentDownloadedBytes;
     QVariantMap m_addingAttachmentStatus;
@@ -291,6 +337,10 @@ signals:
     void fetchNoteDataFinished(bool, QString);
     void authTokenInvalid();
 private:
+    // identifies the note as rendered from this data by the current renderer, in the rendered notes cache
+    static QByteArray renderedNoteKey(const QByteArray &enmlContent, const QVariantList &attachmentsData,
+                                      const QString &attachmentUrlBase, const QString &qmlResourceBase);
+
     StorageManager * const m_storageManager;
     EvernoteAccess * const m_evernoteAccess;
     const QString m_noteId;
@@ -300,7 +350,9 @@ class SearchServerNotesThread : public QThread
 {
     Q_OBJECT
 public:
-    SearchServerNotesThread(StorageManager *storageManager, EvernoteAccess *evernoteAccess, const QString &words, QObject *parent = 0);
+    // If isSkippingLocallySearchableNotes is true, only notes that the local search can't read are reported
+    SearchServerNotesThread(StorageManager *storageManager, EvernoteAccess *evernoteAccess, const QString &words,
+                            bool isSkippingLocallySearchableNotes, QObject *parent = 0);
     void run();
 signals:
     void searchServerNotesResultObtained(const QStringList &notesList, int progressPercentage);
@@ -310,6 +362,7 @@ private:
     StorageManager * const m_storageManager;
     EvernoteAccess * const m_evernoteAccess;
     const QString m_words;
+    const bool m_isSkippingLocallySearchableNotes;
 };
 
 class AttachmentDownloadThread : public QThread
@@ -28,6 +28,7 @@
 #include "storagemanager.h"
 #include "connectionmanager.h"
 #include "storage/diskcache/shareddiskcache.h"
+#include "storage/crypto/encryptedfile.h"
 #include "notekeeper_config.h"
 #include <QUrl>
 #include <QImageReader>
@@ -55,8 +56,17 @@ QImage QmlNoteImageProvider::requestImage(const QString &id, QSize *size, const
     QString localFileName = imageUrl.toLocalFile();
     QIODevice *cachedData = 0;
     if (!localFileName.isEmpty()) {
-        // It's a local file
-        imageReader.setFileName(localFileName);
+        // It's a local file, possibly encrypted. When encrypted, only the parts
+        // that the image reader actually reads get decrypted.
+        if (EncryptedFile::isEncryptedFile(localFileName)) {
+            cachedData = EncryptedFile::openForReading(localFileName);
+            if (!cachedData) {
+                return QImage();
+            }
+            imageReader.setDevice(cachedData);
+        } else {
+            imageReader.setFileName(localFileName);
+        }
     } else {
         // It's a web URL
         cachedData = SharedDiskCache::instance()->data(imageUrl);
@@ -84,7 +94,7 @@ QImage QmlNoteImageProvider::requestImage(const QString &id, QSize *size, const
     }
     QSize imageSize = imageReader.size();
     QSize scaledSize = imageSize;
-    if (imageSize.width() > requestedSize.width() || imageSize.height() > requestedSize.height()) {
+    if (requestedSize.isValid() && (imageSize.width() > requestedSize.width() || imageSize.height() > requestedSize.height())) {
         scaledSize.scale(requestedSize, Qt::KeepAspectRatio);
     }
     (*size) = scaledSize;
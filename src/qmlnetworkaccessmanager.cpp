@@ -33,10 +33,62 @@
 #include "notekeeper_config.h"
 #include "loginstatustracker.h"
 #include "diskcache/shareddiskcache.h"
+#include "crypto/encryptedfile.h"
 #include <QNetworkAccessManager>
 #include <QNetworkCookieJar>
 #include <QNetworkCookie>
 #include <QNetworkDiskCache>
+#include <QNetworkReply>
+#include <QMetaObject>
+
+// Serves file:// requests for encrypted files (like images in rich text notes),
+// decrypting the file only as it gets read
+class EncryptedFileReply : public QNetworkReply
+{
+public:
+    EncryptedFileReply(const QNetworkRequest &request, QObject *parent = 0)
+        : QNetworkReply(parent)
+        , m_file(request.url().toLocalFile())
+    {
+        setRequest(request);
+        setUrl(request.url());
+        setOperation(QNetworkAccessManager::GetOperation);
+        if (m_file.open(QIODevice::ReadOnly)) {
+            QIODevice::open(QIODevice::ReadOnly | QIODevice::Unbuffered);
+            setHeader(QNetworkRequest::ContentLengthHeader, m_file.size());
+            QMetaObject::invokeMethod(this, "metaDataChanged", Qt::QueuedConnection);
+            QMetaObject::invokeMethod(this, "readyRead", Qt::QueuedConnection);
+        } else {
+            setError(QNetworkReply::ContentNotFoundError, m_file.errorString());
+        }
+        setFinished(true);
+        QMetaObject::invokeMethod(this, "finished", Qt::QueuedConnection);
+    }
+
+    void abort() {
+        m_file.close();
+        close();
+    }
+
+    bool isSequential() const {
+        return true;
+    }
+
+    qint64 bytesAvailable() const {
+        return (m_file.isOpen()? (m_file.size() - m_file.pos()) : 0) + QIODevice::bytesAvailable();
+    }
+
+protected:
+    qint64 readData(char *data, qint64 maxSize) {
+        if (!m_file.isOpen() || m_file.atEnd()) {
+            return -1;
+        }
+        return m_file.read(data, maxSize);
+    }
+
+private:
+    EncryptedFile m_file;
+};
 
 QmlNetworkAccessManager::QmlNetworkAccessManager(StorageManager *storageManager, LoginStatusTracker *loginStatusTracker, QObject *parent)
     : QNetworkAccessManager(parent)
@@ -84,6 +136,10 @@ void QmlNetworkAccessManager::setCacheAndCookieJarEnabled(bool enabled)
 
 QNetworkReply *QmlNetworkAccessManager::createRequest(QNetworkAccessManager::Operation op, const QNetworkRequest &_req, QIODevice *outgoingData)
 {
+    if (op == QNetworkAccessManager::GetOperation && _req.url().scheme() == "file" &&
+        EncryptedFile::isEncryptedFile(_req.url().toLocalFile())) {
+        return new EncryptedFileReply(_req, this);
+    }
     QNetworkRequest req(_req);
     if (SharedDiskCache::instance()->metaData(req.url()).isValid()) {
         // if available in the cache, force our qnam to use only the cache, and not access the network at all
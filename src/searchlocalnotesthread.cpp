@@ -25,8 +25,21 @@
 */
 
 #include <QStringList>
+#include <QSharedPointer>
+#include <QDateTime>
+#include <QRegExp>
+#include <QtConcurrentRun>
+#include <algorithm>
 #include "searchlocalnotesthread.h"
-#include "evernotemarkup.h"
+#include "storage/searchindex.h"
+#include "storage/searchtokenizer.h"
+
+#define INDEXING_BATCH_SIZE 200      // notes; each batch is read on all cores
+#define MIN_NOTES_PER_PARTITION 256  // matching fewer notes than this isn't worth another thread
+#define FIRST_RESULTS_COUNT 20       // when ranking, these are reported before the rest are sorted
+#define RESULTS_BATCH_SIZE 100       // matching notes are reported in batches of at most this many,
+#define RESULTS_BATCH_INTERVAL 50    // msecs, or as many as are found in this time
+#define PROGRESS_REPORT_INTERVAL 100 // msecs; progress is reported at most this often
 
 SearchQuery::SearchQuery(const QString &queryString)
 {
@@ -41,7 +54,12 @@ QList<SearchTerm> SearchQuery::parseQuery(const QString &queryString)
     bool isNegatedTerm = false;
     for (int i = 0; i < queryString.length(); i++) {
         const QChar c = queryString.at(i);
-        bool isSeparator = (!c.isLetterOrNumber() && c != '_' && c != '"' && c != '-' && c != '*');
+        bool isSeparator;
+        if (SearchTerm::isColumnQualifier(qualifier)) {
+            isSeparator = c.isSpace(); // so that values like "image/png" and "day-1" stay whole
+        } else {
+            isSeparator = (!c.isLetterOrNumber() && c != '_' && c != '"' && c != '-' && c != '*');
+        }
         if (c == '"') {
             bool isQuoteEscaped = (i > 0 && queryString.at(i - 1) == '\\');
             if (!isQuoteEscaped) {
@@ -78,36 +96,173 @@ QList<SearchTerm> SearchQuery::searchTerms() const
     return m_searchTerms;
 }
 
-static QStringList words(const QString &text)
+bool SearchQuery::isAnyTermEnough() const
+{
+    foreach (const SearchTerm &term, m_searchTerms) {
+        if (term.qualifier.compare("any", Qt::CaseInsensitive) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Cheaper terms go first, so that the costlier terms need to look at fewer notes.
+// Terms of the same cost are evaluated in the order they appear in the query.
+QList<int> SearchQuery::plannedTermOrder() const
+{
+    QList<int> order;
+    for (int cost = SearchTerm::MembershipCost; cost <= SearchTerm::ContentCost; cost++) {
+        for (int i = 0; i < m_searchTerms.count(); i++) {
+            if (m_searchTerms.at(i).evaluationCost() == cost) {
+                order << i;
+            }
+        }
+    }
+    return order;
+}
+
+bool SearchQuery::isRefinementOf(const SearchQuery &previousQuery) const
 {
-    QStringList wordList;
-    QString word;
-    for (int i = 0; i < text.length(); i++) {
-        const QChar c = text.at(i);
-        bool isSeparatorChar = (c.isSpace() || c.isPunct() || c.isSymbol());
-        if (isSeparatorChar) {
-            if (!word.isEmpty()) {
-                wordList << word;
+    if (isAnyTermEnough() || previousQuery.isAnyTermEnough()) {
+        return false; // with "any:", more terms could match more notes
+    }
+    foreach (const SearchTerm &previousTerm, previousQuery.m_searchTerms) {
+        bool isImplied = false;
+        foreach (const SearchTerm &term, m_searchTerms) {
+            if (term.implies(previousTerm)) {
+                isImplied = true;
+                break;
             }
-            word.clear();
+        }
+        if (!isImplied) {
+            return false;
+        }
+    }
+    return true;
+}
+
+QStringList SearchQuery::matchingWords() const
+{
+    QStringList words;
+    foreach (const SearchTerm &term, m_searchTerms) {
+        bool isWordTerm = (term.evaluationCost() == SearchTerm::TitleCost || term.evaluationCost() == SearchTerm::ContentCost);
+        if (term.isNegated || !isWordTerm || term.normalizedTextWords.isEmpty()) {
+            continue;
+        }
+        words << term.normalizedTextWords;
+        if (term.isPrefix) {
+            words.last().append('*');
+        }
+    }
+    return words;
+}
+
+bool SearchTerm::implies(const SearchTerm &other) const
+{
+    if (qualifier.compare(other.qualifier, Qt::CaseInsensitive) != 0 || isNegated != other.isNegated) {
+        return false;
+    }
+    if (text == other.text) {
+        return true;
+    }
+    // Otherwise, only a word or phrase being typed out, like "meet*" followed by "meeti*" or "meeting"
+    bool isPhraseTerm = (qualifier.isEmpty() || qualifier.compare("intitle", Qt::CaseInsensitive) == 0 ||
+                         qualifier.compare("tag", Qt::CaseInsensitive) == 0);
+    if (isNegated || !isPhraseTerm || normalizedTextWords.isEmpty() || normalizedTextWords.count() != other.normalizedTextWords.count()) {
+        return false;
+    }
+    const int lastIndex = normalizedTextWords.count() - 1;
+    for (int i = 0; i < lastIndex; i++) {
+        if (normalizedTextWords.at(i) != other.normalizedTextWords.at(i)) {
+            return false;
+        }
+    }
+    if (other.isPrefix) {
+        return normalizedTextWords.at(lastIndex).startsWith(other.normalizedTextWords.at(lastIndex));
+    }
+    return (!isPrefix && normalizedTextWords.at(lastIndex) == other.normalizedTextWords.at(lastIndex));
+}
+
+SearchTerm::EvaluationCost SearchTerm::evaluationCost() const
+{
+    if (qualifier.isEmpty()) {
+        return ContentCost;
+    }
+    if (qualifier.compare("intitle", Qt::CaseInsensitive) == 0) {
+        return TitleCost;
+    }
+    if (isColumnQualifier(qualifier)) {
+        return ColumnCost;
+    }
+    return MembershipCost; // including qualifiers we don't support, which match nothing
+}
+
+bool SearchTerm::isColumnQualifier(const QString &qualifier)
+{
+    return (qualifier.compare("created", Qt::CaseInsensitive) == 0 ||
+            qualifier.compare("updated", Qt::CaseInsensitive) == 0 ||
+            qualifier.compare("todo", Qt::CaseInsensitive) == 0 ||
+            qualifier.compare("resource", Qt::CaseInsensitive) == 0 ||
+            qualifier.compare("source", Qt::CaseInsensitive) == 0);
+}
+
+// Parses dates as in Evernote's search grammar: "day", "week", "month" or "year", optionally followed
+// by "-N" to go N of them back, or an absolute "YYYYMMDD" or "YYYYMMDDTHHMMSS", in local time unless
+// followed by "Z". Weeks start on Sunday.
+static bool searchDateTime(const QString &text, qint64 *msecsSinceEpoch)
+{
+    const QString dateText = text.toLower();
+    QRegExp relativeDate("(day|week|month|year)(?:-(\\d+))?");
+    if (relativeDate.exactMatch(dateText)) {
+        const QString unit = relativeDate.cap(1);
+        const int count = relativeDate.cap(2).toInt();
+        const QDate today = QDate::currentDate();
+        QDate date;
+        if (unit == "day") {
+            date = today.addDays(-count);
+        } else if (unit == "week") {
+            date = today.addDays(-(today.dayOfWeek() % 7) - 7 * count);
+        } else if (unit == "month") {
+            date = QDate(today.year(), today.month(), 1).addMonths(-count);
         } else {
-            word.append(c);
+            date = QDate(today.year(), 1, 1).addYears(-count);
         }
+        (*msecsSinceEpoch) = QDateTime(date, QTime(0, 0)).toMSecsSinceEpoch();
+        return true;
     }
-    if (!word.isEmpty()) {
-        wordList << word;
+    QRegExp absoluteDate("(\\d{8})(?:t(\\d{6}))?(z?)");
+    if (absoluteDate.exactMatch(dateText)) {
+        QDate date = QDate::fromString(absoluteDate.cap(1), "yyyyMMdd");
+        QTime time = (absoluteDate.cap(2).isEmpty()? QTime(0, 0) : QTime::fromString(absoluteDate.cap(2), "hhmmss"));
+        if (!date.isValid() || !time.isValid()) {
+            return false;
+        }
+        Qt::TimeSpec timeSpec = (absoluteDate.cap(3).isEmpty()? Qt::LocalTime : Qt::UTC);
+        (*msecsSinceEpoch) = QDateTime(date, time, timeSpec).toMSecsSinceEpoch();
+        return true;
     }
-    return wordList;
+    return false;
 }
 
-static bool isWordMatch(const QString &termWord, const QString &noteWord, bool wordPrefixMatch)
+SearchTerm::SearchTerm(const QString &q, const QString &t, bool n)
+    : qualifier(q), text(t), isNegated(n), normalizedTextWords(normalizedWords(t)), isPrefix(t.endsWith('*'))
+{
+}
+
+// Split like the notes are, so that a CJK word comes out as the bigrams it's indexed as.
+// The search index stems the words if it stems the words in the notes.
+QStringList SearchTerm::normalizedWords(const QString &text)
+{
+    return SearchTokenizer().words(text);
+}
+
+// Both words should be normalized
+static inline bool isWordMatch(const QString &termWord, const QString &noteWord, bool wordPrefixMatch)
 {
     if (wordPrefixMatch) {
-        return noteWord.simplified().startsWith(termWord.simplified(), Qt::CaseInsensitive);
-    } else {
-        return (noteWord.simplified().compare(termWord.simplified(), Qt::CaseInsensitive) == 0);
+        return noteWord.startsWith(termWord);
     }
-    return false;
+    return (noteWord == termWord);
 }
 
 static bool isSequenceMatch(const QStringList &termWordSequence, const QStringList &noteWordSequence, int ni, bool sequencePrefixMatch)
@@ -139,8 +294,8 @@ bool SearchTerm::isTextMatching(const QStringList &noteWordSequence) const
     if (text.isEmpty()) {
         return false;
     }
-    bool sequencePrefixMatch = text.endsWith('*');
-    QStringList termWordSequence = words(text);
+    const bool sequencePrefixMatch = isPrefix;
+    const QStringList &termWordSequence = normalizedTextWords;
     if (termWordSequence.isEmpty()) {
         return false;
     }
@@ -158,19 +313,130 @@ bool SearchTerm::isTextMatching(const QStringList &noteWordSequence) const
     return matchFound;
 }
 
-SearchLocalNotesThread::SearchLocalNotesThread(StorageManager *storageManager, const QString &searchQuery, QObject *parent)
-    : QThread(parent), m_storageManager(storageManager), m_searchQueryString(searchQuery), m_cancelled(false)
+struct TermMatches
+{
+    QList<SearchTerm> searchTerms;
+    bool isAnyTermEnough;
+    QList<QSet<QString> > matchingNoteIds; // by search term; only among the notes whose match depended on the term
+    QList<bool> matchesAllNotes;           // by search term
+    QSet<QString> contentCandidateNoteIds; // the notes whose match depended on their content
+    QStringList scoringWords;              // if ranking by relevance; as in SearchIndex::relevanceScores()
+    bool isMatchingSimilarWords;
+};
+
+struct PartitionResult
+{
+    QStringList matchingNoteIds;
+    QList<qreal> relevanceScores; // by matching note, if ranking by relevance
+    int unsearchedNotesCount;
+};
+
+struct RankedNote
+{
+    QString noteId;
+    qreal relevanceScore;
+    int listPosition; // in the most-recently-updated order
+};
+
+// Relevance first, and recency if equally relevant
+static bool isRankedHigher(const RankedNote &a, const RankedNote &b)
+{
+    if (a.relevanceScore != b.relevanceScore) {
+        return (a.relevanceScore > b.relevanceScore);
+    }
+    return (a.listPosition < b.listPosition);
+}
+
+// Runs in a thread-pool thread
+static PartitionResult matchingNotesInPartition(const QStringList &noteIds, const TermMatches &termMatches, SearchIndex *searchIndex, const volatile bool *cancelled)
+{
+    const QList<SearchTerm> &searchTerms = termMatches.searchTerms;
+    PartitionResult result;
+    result.unsearchedNotesCount = 0;
+    foreach (const QString &noteId, noteIds) {
+        if (noteId.isEmpty()) {
+            continue;
+        }
+        if (*cancelled) {
+            break;
+        }
+        bool matchedTermExists = false;
+        bool unmatchedTermExists = false;
+        const bool anyTermCanMatch = termMatches.isAnyTermEnough;
+        for (int i = 0; i < searchTerms.count(); i++) {
+            const SearchTerm &term = searchTerms.at(i);
+            bool isTermTextMatched = (termMatches.matchesAllNotes.at(i) || termMatches.matchingNoteIds.at(i).contains(noteId));
+            if (term.isNegated) {
+                if (isTermTextMatched) {
+                    unmatchedTermExists = true;
+                } else {
+                    matchedTermExists = true;
+                }
+            } else {
+                if (isTermTextMatched) {
+                    matchedTermExists = true;
+                } else {
+                    unmatchedTermExists = true;
+                }
+            }
+            if (!anyTermCanMatch && unmatchedTermExists) {
+                break;
+            }
+            if (anyTermCanMatch && matchedTermExists) {
+                break;
+            }
+        }
+        bool noteMatched = ((anyTermCanMatch && matchedTermExists) || (!unmatchedTermExists));
+        if (noteMatched) {
+            result.matchingNoteIds << noteId;
+        } else if (termMatches.contentCandidateNoteIds.contains(noteId) && !searchIndex->isContentIndexed(noteId)) {
+            result.unsearchedNotesCount++;
+        }
+    }
+    if (!termMatches.scoringWords.isEmpty() && !(*cancelled)) {
+        QHash<QString, qreal> scores = searchIndex->relevanceScores(termMatches.scoringWords, result.matchingNoteIds, termMatches.isMatchingSimilarWords);
+        foreach (const QString &noteId, result.matchingNoteIds) {
+            result.relevanceScores << scores.value(noteId);
+        }
+    }
+    return result;
+}
+
+SearchLocalNotesThread::SearchLocalNotesThread(StorageManager *storageManager, const QString &searchQuery, ResultsOrder resultsOrder,
+                                               bool isMatchingSimilarWords, QObject *parent)
+    : QThread(parent), m_storageManager(storageManager), m_searchQueryString(searchQuery), m_resultsOrder(resultsOrder)
+    , m_isMatchingSimilarWords(isMatchingSimilarWords), m_isRefiningPreviousResults(false), m_previousUnsearchedNotesCount(0)
+    , m_reportedProgressPercentage(0), m_searchedNotesCount(0), m_cancelled(false)
 {
     connect(this, SIGNAL(finished()), SLOT(deleteLater())); // auto-delete
 }
 
+void SearchLocalNotesThread::refinePreviousResults(const QSet<QString> &previousMatchingNoteIds, int previousUnsearchedNotesCount)
+{
+    m_isRefiningPreviousResults = true;
+    m_previousMatchingNoteIds = previousMatchingNoteIds;
+    m_previousUnsearchedNotesCount = previousUnsearchedNotesCount;
+}
+
 void SearchLocalNotesThread::cancel()
 {
     m_cancelled = true;
 }
 
+bool SearchLocalNotesThread::isCancelled() const
+{
+    return m_cancelled;
+}
+
+int SearchLocalNotesThread::searchedNotesCount() const
+{
+    return m_searchedNotesCount;
+}
+
 void SearchLocalNotesThread::run()
 {
+    m_resultsBatchTimer.start();
+    m_progressReportTimer.start();
     SearchQuery searchQuery(m_searchQueryString);
     QStringList allNoteIds = m_storageManager->listNoteIds(StorageConstants::AllNotes);
     QStringList noteIdsToSearchIn;
@@ -214,82 +480,337 @@ void SearchLocalNotesThread::run()
         noteIdsToSearchIn = allNoteIds;
     }
 
-    // Process rest of the search terms
-    int unsearchedNotesCount = 0;
-    int searchedNotesCount = 0;
-    foreach (const QString &noteId, noteIdsToSearchIn) {
-        if (noteId.isEmpty()) {
-            continue;
+    if (m_isRefiningPreviousResults) {
+        // Notes that didn't match the previous query can't match this one. The notes that were
+        // unsearched then stay unsearched, because they're not looked at again.
+        QStringList previousMatchingNoteIds;
+        foreach (const QString &noteId, noteIdsToSearchIn) {
+            if (m_previousMatchingNoteIds.contains(noteId)) {
+                previousMatchingNoteIds << noteId;
+            }
         }
-        QVariantMap dataMap = m_storageManager->noteData(noteId);
-        bool contentAvailableLocally = dataMap.value("ContentDataAvailable").toBool();
-        bool matchedTermExists = false;
-        bool unmatchedTermExists = false;
-        bool anyTermCanMatch = false;
-        foreach (const SearchTerm &term, searchQuery.searchTerms()) {
-            bool isTermTextMatched = false;
-            if (term.qualifier.compare("any", Qt::CaseInsensitive) == 0) {
-                anyTermCanMatch = true;
-            } else if (term.qualifier.compare("notebook", Qt::CaseInsensitive) == 0) {
-                // We've already taken care of "notebook:" terms, so it ought to match
-                isTermTextMatched = true;
-            } else if (term.qualifier.compare("tag", Qt::CaseInsensitive) == 0) {
-                QString tagNamesStr = dataMap.value("TagNames").toString();
-                QStringList tagNames;
-                if (!tagNamesStr.isEmpty()) {
-                    tagNames = tagNamesStr.split(',');
-                }
-                foreach (const QString &tagName, tagNames) {
-                    if (term.isTextMatching(words(tagName))) {
-                        isTermTextMatched = true;
-                        break;
-                    }
-                }
-            } else if (term.qualifier.compare("intitle", Qt::CaseInsensitive) == 0) {
-                QString title = dataMap.value("Title").toString();
-                isTermTextMatched = term.isTextMatching(words(title));
-            } else if (term.qualifier.isEmpty()) { // simple text search
-                QString title = dataMap.value("Title").toString();
-                QByteArray content("");
-                if (contentAvailableLocally) {
-                    content = dataMap.value("Content").toByteArray();
-                }
-                QStringList wordsInNote = EvernoteMarkup::plainTextWordsFromEnml(title, content);
-                isTermTextMatched = term.isTextMatching(wordsInNote);
+        noteIdsToSearchIn = previousMatchingNoteIds;
+    }
+    m_searchedNotesCount = noteIdsToSearchIn.count();
+
+    // Find the notes matching each term, cheapest terms first. Each term is evaluated only for the
+    // candidate notes - the notes whose match isn't decided by the terms evaluated before it.
+    QSharedPointer<SearchIndex> searchIndex = m_storageManager->searchIndex();
+    TermMatches termMatches;
+    termMatches.searchTerms = searchQuery.searchTerms();
+    termMatches.isAnyTermEnough = searchQuery.isAnyTermEnough();
+    termMatches.isMatchingSimilarWords = m_isMatchingSimilarWords;
+    for (int i = 0; i < termMatches.searchTerms.count(); i++) {
+        termMatches.matchingNoteIds << QSet<QString>();
+        termMatches.matchesAllNotes << false;
+    }
+    QSet<QString> candidateNoteIds = noteIdsToSearchIn.toSet();
+    candidateNoteIds.remove(QString());
+    int indexingProgressShare = 0; // in percent
+    bool isIndexRefreshed = false;
+    foreach (int i, searchQuery.plannedTermOrder()) {
+        if (candidateNoteIds.isEmpty()) {
+            break; // all notes are decided
+        }
+        const SearchTerm &term = termMatches.searchTerms.at(i);
+        if (term.evaluationCost() >= SearchTerm::ColumnCost && !isIndexRefreshed) {
+            // Content is read only for the notes that are still candidates
+            termMatches.contentCandidateNoteIds = candidateNoteIds;
+            if (!refreshSearchIndex(searchIndex.data(), candidateNoteIds, &indexingProgressShare)) {
+                emit searchLocalNotesFinished(allNoteIds.count());
+                return;
             }
-            if (term.isNegated) {
-                if (isTermTextMatched) {
-                    unmatchedTermExists = true;
-                } else {
-                    matchedTermExists = true;
-                }
+            isIndexRefreshed = true;
+        }
+        bool matchesAllNotes = false;
+        QSet<QString> matchingNoteIds = notesMatchingTerm(term, searchIndex.data(), candidateNoteIds, &matchesAllNotes);
+        // Without "any:", a note that fails a term is decided; with "any:", a note that passes a term is
+        // decided. Either way, the notes that remain candidates are the ones for which the term says
+        // neither "must match" nor "can't match".
+        bool isMatchingNoteUndecided = (termMatches.isAnyTermEnough == term.isNegated);
+        if (matchesAllNotes) {
+            if (!isMatchingNoteUndecided) {
+                candidateNoteIds.clear();
+            }
+        } else if (isMatchingNoteUndecided) {
+            candidateNoteIds = matchingNoteIds;
+        } else {
+            candidateNoteIds.subtract(matchingNoteIds);
+        }
+        termMatches.matchingNoteIds[i] = matchingNoteIds;
+        termMatches.matchesAllNotes[i] = matchesAllNotes;
+        if (m_cancelled) {
+            emit searchLocalNotesFinished(allNoteIds.count());
+            return;
+        }
+    }
+
+    // The words that make a note relevant are the ones it's required to have
+    if (m_resultsOrder == MostRelevantFirst) {
+        termMatches.scoringWords = searchQuery.matchingWords();
+    }
+
+    // Combine the term matches for each note, with the notes partitioned across the cores.
+    // The partitions are contiguous, so reporting them in order keeps the notes in the order they are listed in.
+    int partitionCount = qMax(1, qMin(QThread::idealThreadCount(), noteIdsToSearchIn.count() / MIN_NOTES_PER_PARTITION));
+    QList<QFuture<PartitionResult> > partitions;
+    for (int i = 0; i < partitionCount; i++) {
+        int start = noteIdsToSearchIn.count() * i / partitionCount;
+        int end = noteIdsToSearchIn.count() * (i + 1) / partitionCount;
+        partitions << QtConcurrent::run(matchingNotesInPartition, noteIdsToSearchIn.mid(start, end - start), termMatches, searchIndex.data(), &m_cancelled);
+    }
+    const bool isRanking = (!termMatches.scoringWords.isEmpty());
+    int unsearchedNotesCount = (m_isRefiningPreviousResults? m_previousUnsearchedNotesCount : 0);
+    QVector<RankedNote> firstResults; // a heap, with the lowest ranked of the first results on top
+    QVector<RankedNote> otherResults;
+    int listPosition = 0;
+    for (int i = 0; i < partitions.count(); i++) {
+        PartitionResult result = partitions[i].result();
+        if (m_cancelled) {
+            for (int j = i + 1; j < partitions.count(); j++) {
+                partitions[j].waitForFinished(); // they'd have stopped early too
+            }
+            emit searchLocalNotesFinished(allNoteIds.count());
+            return;
+        }
+        for (int j = 0; j < result.matchingNoteIds.count(); j++) {
+            if (!isRanking) {
+                reportMatchingNote(result.matchingNoteIds.at(j));
+                continue;
+            }
+            RankedNote rankedNote;
+            rankedNote.noteId = result.matchingNoteIds.at(j);
+            rankedNote.relevanceScore = result.relevanceScores.at(j);
+            rankedNote.listPosition = listPosition++;
+            if (firstResults.size() < FIRST_RESULTS_COUNT) {
+                firstResults << rankedNote;
+                std::push_heap(firstResults.begin(), firstResults.end(), isRankedHigher);
+            } else if (isRankedHigher(rankedNote, firstResults.first())) {
+                std::pop_heap(firstResults.begin(), firstResults.end(), isRankedHigher);
+                otherResults << firstResults.last();
+                firstResults.last() = rankedNote;
+                std::push_heap(firstResults.begin(), firstResults.end(), isRankedHigher);
             } else {
-                if (isTermTextMatched) {
-                    matchedTermExists = true;
-                } else {
-                    unmatchedTermExists = true;
-                }
+                otherResults << rankedNote;
             }
-            if (!anyTermCanMatch && unmatchedTermExists) {
+        }
+        unsearchedNotesCount += result.unsearchedNotesCount;
+        reportProgress(indexingProgressShare + ((i + 1) * (100 - indexingProgressShare) / partitions.count()));
+    }
+    if (isRanking) {
+        // Report the first page of results without waiting for the rest to be sorted
+        std::sort_heap(firstResults.begin(), firstResults.end(), isRankedHigher);
+        foreach (const RankedNote &rankedNote, firstResults) {
+            m_pendingMatchingNoteIds << rankedNote.noteId;
+        }
+        deliverMatchingNotes();
+        std::sort(otherResults.begin(), otherResults.end(), isRankedHigher);
+        foreach (const RankedNote &rankedNote, otherResults) {
+            if (m_cancelled) {
                 break;
             }
-            if (anyTermCanMatch && matchedTermExists) {
+            reportMatchingNote(rankedNote.noteId);
+        }
+    }
+    deliverMatchingNotes();
+    emit searchLocalNotesFinished(unsearchedNotesCount);
+}
+
+// Each signal is an event for the UI thread to handle and a change to a list model, so
+// matching notes are coalesced into batches, and progress is reported only so often.
+void SearchLocalNotesThread::reportMatchingNote(const QString &noteId)
+{
+    m_pendingMatchingNoteIds << noteId;
+    if (m_pendingMatchingNoteIds.count() >= RESULTS_BATCH_SIZE || m_resultsBatchTimer.elapsed() >= RESULTS_BATCH_INTERVAL) {
+        deliverMatchingNotes();
+    }
+}
+
+void SearchLocalNotesThread::deliverMatchingNotes()
+{
+    if (!m_pendingMatchingNoteIds.isEmpty()) {
+        emit searchLocalNotesMatchingNotes(m_pendingMatchingNoteIds);
+        m_pendingMatchingNoteIds.clear();
+    }
+    m_resultsBatchTimer.restart();
+}
+
+void SearchLocalNotesThread::reportProgress(int progressPercentage)
+{
+    if (progressPercentage == m_reportedProgressPercentage) {
+        return;
+    }
+    if (progressPercentage < 100 && m_progressReportTimer.elapsed() < PROGRESS_REPORT_INTERVAL) {
+        return;
+    }
+    emit searchLocalNotesProgressPercentage(progressPercentage);
+    m_reportedProgressPercentage = progressPercentage;
+    m_progressReportTimer.restart();
+}
+
+// Brings the index up-to-date for the given notes. Returns false if cancelled.
+bool SearchLocalNotesThread::refreshSearchIndex(SearchIndex *searchIndex, const QSet<QString> &noteIds, int *indexingProgressShare)
+{
+    int pendingNotesCount = searchIndex->pendingNoteCount(&noteIds);
+    const int notesToIndexCount = pendingNotesCount;
+    (*indexingProgressShare) = (notesToIndexCount > 0? 90 : 0);
+    while (pendingNotesCount > 0) {
+        if (m_cancelled) {
+            return false;
+        }
+        pendingNotesCount = searchIndex->refresh(INDEXING_BATCH_SIZE, &m_cancelled, &noteIds);
+        reportProgress((notesToIndexCount - pendingNotesCount) * (*indexingProgressShare) / notesToIndexCount);
+    }
+    return (!m_cancelled);
+}
+
+// Returns the candidate notes that match the term
+QSet<QString> SearchLocalNotesThread::notesMatchingTerm(const SearchTerm &term, SearchIndex *searchIndex, const QSet<QString> &candidateNoteIds, bool *matchesAllNotes)
+{
+    (*matchesAllNotes) = false;
+    QSet<QString> matchingNoteIds;
+    if (term.qualifier.compare("notebook", Qt::CaseInsensitive) == 0) {
+        // We've already taken care of "notebook:" terms, so it ought to match
+        (*matchesAllNotes) = true;
+    } else if (term.qualifier.compare("tag", Qt::CaseInsensitive) == 0) {
+        foreach (const QVariant &tag, m_storageManager->listTags()) {
+            if (m_cancelled) {
                 break;
             }
+            QVariantMap tagMap = tag.toMap();
+            if (term.isTextMatching(SearchTerm::normalizedWords(tagMap.value("Name").toString()))) {
+                matchingNoteIds += m_storageManager->listNoteIds(StorageConstants::NotesWithTag, tagMap.value("TagId").toString()).toSet();
+            }
         }
-        bool noteMatched = ((anyTermCanMatch && matchedTermExists) || (!unmatchedTermExists));
-        if (!contentAvailableLocally && !noteMatched) {
-            unsearchedNotesCount++;
+        matchingNoteIds.intersect(candidateNoteIds);
+    } else if (term.qualifier.compare("intitle", Qt::CaseInsensitive) == 0 || term.qualifier.isEmpty()) {
+        bool isTitleOnly = (!term.qualifier.isEmpty());
+        const QStringList &normalizedTermWords = term.normalizedTextWords;
+        if (normalizedTermWords.isEmpty()) {
+            return matchingNoteIds;
         }
-        if (m_cancelled) {
-            emit searchLocalNotesFinished(allNoteIds.count());
-            return;
+        SearchIndex::Fields fields = (isTitleOnly? SearchIndex::Fields(SearchIndex::TitleField) :
+                                                   SearchIndex::Fields(SearchIndex::TitleField | SearchIndex::ContentField));
+        QSet<QString> indexMatchingNoteIds = searchIndex->notesContainingPhrase(normalizedTermWords, term.isPrefix, fields, m_isMatchingSimilarWords);
+        if (isTitleOnly) {
+            // The index might not be up-to-date for all candidates, but a title is cheap to read from the gist
+            foreach (const QString &noteId, candidateNoteIds) {
+                if (m_cancelled) {
+                    break;
+                }
+                bool isMatching = (searchIndex->isNotePending(noteId)?
+                                       term.isTextMatching(SearchTerm::normalizedWords(m_storageManager->noteTitle(noteId))) :
+                                       indexMatchingNoteIds.contains(noteId));
+                if (isMatching) {
+                    matchingNoteIds << noteId;
+                }
+            }
+        } else {
+            // The index has been refreshed for the candidates
+            matchingNoteIds = indexMatchingNoteIds.intersect(candidateNoteIds);
         }
-        if (noteMatched) {
-            emit searchLocalNotesMatchingNote(noteId);
+    } else if (term.evaluationCost() == SearchTerm::ColumnCost) {
+        // The index has been refreshed for the candidates. A negated created: or updated: term
+        // matches the notes before the time, because the negation is applied when combining.
+        if (term.qualifier.compare("created", Qt::CaseInsensitive) == 0 || term.qualifier.compare("updated", Qt::CaseInsensitive) == 0) {
+            qint64 time = 0;
+            if (!searchDateTime(term.text, &time)) {
+                return matchingNoteIds;
+            }
+            SearchIndex::TimeField field = (term.qualifier.compare("created", Qt::CaseInsensitive) == 0?
+                                                SearchIndex::CreatedTime : SearchIndex::UpdatedTime);
+            matchingNoteIds = searchIndex->notesWithTimeSince(field, time);
+        } else if (term.qualifier.compare("todo", Qt::CaseInsensitive) == 0) {
+            if (term.text.compare("true", Qt::CaseInsensitive) == 0) {
+                matchingNoteIds = searchIndex->notesWithTodos(SearchIndex::CheckedTodo);
+            } else if (term.text.compare("false", Qt::CaseInsensitive) == 0) {
+                matchingNoteIds = searchIndex->notesWithTodos(SearchIndex::UncheckedTodo);
+            } else if (term.text == "*" || term.text.isEmpty()) {
+                matchingNoteIds = searchIndex->notesWithTodos(SearchIndex::AnyTodo);
+            }
+        } else if (!term.text.isEmpty()) {
+            matchingNoteIds = searchIndex->notesWithAttribute(term.qualifier, term.text);
         }
-        searchedNotesCount++;
-        emit searchLocalNotesProgressPercentage(searchedNotesCount * 100 / noteIdsToSearchIn.count());
+        matchingNoteIds.intersect(candidateNoteIds);
     }
-    emit searchLocalNotesFinished(unsearchedNotesCount);
+    return matchingNoteIds;
+}
+
+QMutex RefreshSavedSearchesThread::s_refreshMutex;
+
+RefreshSavedSearchesThread::RefreshSavedSearchesThread(StorageManager *storageManager, const QString &openingSavedSearchId, QObject *parent)
+    : QThread(parent), m_storageManager(storageManager), m_openingSavedSearchId(openingSavedSearchId)
+{
+    connect(this, SIGNAL(finished()), SLOT(deleteLater())); // auto-delete
+}
+
+void RefreshSavedSearchesThread::run()
+{
+    QMutexLocker locker(&s_refreshMutex);
+    Q_UNUSED(locker);
+    QSet<QString> changedNoteIds = m_storageManager->takeNotesChangedForSavedSearches().toSet();
+    foreach (const QString &savedSearchId, m_storageManager->listSavedSearchIds()) {
+        QString query = m_storageManager->savedSearchQuery(savedSearchId);
+        QStringList storedNoteIds, matchingNoteIds;
+        if (m_storageManager->savedSearchMatchingNoteIds(savedSearchId, &storedNoteIds)) {
+            if (changedNoteIds.isEmpty()) {
+                continue;
+            }
+            // The notes that didn't change match as they did before. The order doesn't matter, because
+            // the notes are listed in the order of all notes, like the notes in a notebook.
+            QStringList changedMatchingNoteIds = notesMatchingQuery(query, &changedNoteIds);
+            QSet<QString> changedStoredNoteIds;
+            matchingNoteIds = changedMatchingNoteIds;
+            foreach (const QString &noteId, storedNoteIds) {
+                if (changedNoteIds.contains(noteId)) {
+                    changedStoredNoteIds.insert(noteId);
+                } else {
+                    matchingNoteIds << noteId;
+                }
+            }
+            if (changedMatchingNoteIds.toSet() == changedStoredNoteIds) {
+                continue;
+            }
+        } else if (savedSearchId == m_openingSavedSearchId) {
+            matchingNoteIds = notesMatchingQuery(query, 0);
+        } else {
+            continue; // searched in full when it's opened
+        }
+        m_storageManager->setSavedSearchMatchingNoteIds(savedSearchId, matchingNoteIds);
+        emit savedSearchMatchingNotesChanged(savedSearchId);
+    }
+    m_storageManager->doneRefreshingSavedSearches();
+    emit savedSearchesRefreshed(m_openingSavedSearchId);
+}
+
+QStringList RefreshSavedSearchesThread::notesMatchingQuery(const QString &query, const QSet<QString> *candidateNoteIds)
+{
+    m_collectedNoteIds.clear();
+    if (candidateNoteIds && candidateNoteIds->isEmpty()) {
+        return m_collectedNoteIds;
+    }
+    // Searched in this thread, in the order of all notes, without similar words - like the server does
+    SearchLocalNotesThread search(m_storageManager, query, SearchLocalNotesThread::RecentlyUpdatedFirst, false);
+    if (candidateNoteIds) {
+        search.refinePreviousResults(*candidateNoteIds, 0);
+    }
+    connect(&search, SIGNAL(searchLocalNotesMatchingNotes(QStringList)), SLOT(collectMatchingNotes(QStringList)), Qt::DirectConnection);
+    search.run();
+    return m_collectedNoteIds;
+}
+
+void RefreshSavedSearchesThread::collectMatchingNotes(const QStringList &noteIds)
+{
+    m_collectedNoteIds << noteIds;
+}
+
+PrepareSearchIndexThread::PrepareSearchIndexThread(StorageManager *storageManager, QObject *parent)
+    : QThread(parent), m_storageManager(storageManager)
+{
+    connect(this, SIGNAL(finished()), SLOT(deleteLater())); // auto-delete
+}
+
+void PrepareSearchIndexThread::run()
+{
+    m_storageManager->searchIndex()->refresh();
 }
@@ -31,15 +31,34 @@
 #include <QThread>
 #include <QString>
 #include <QByteArray>
+#include <QSet>
+#include <QStringList>
+#include <QElapsedTimer>
+#include <QMutex>
 #include "storage/storagemanager.h"
 
+class SearchIndex;
+
 struct SearchTerm
 {
-    SearchTerm(const QString &q, const QString &t, bool n) : qualifier(q), text(t), isNegated(n) { }
-    bool isTextMatching(const QStringList &words) const;
+    enum EvaluationCost {
+        MembershipCost = 0, // notebook:, tag: - from the lists of notes
+        TitleCost,          // intitle: - from the note gists
+        ColumnCost,         // created:, updated:, todo:, resource:, source: - from the search index's metadata columns
+        ContentCost         // from the note content
+    };
+
+    SearchTerm(const QString &q, const QString &t, bool n);
+    bool isTextMatching(const QStringList &normalizedNoteWords) const; // words as returned by normalizedWords()
+    EvaluationCost evaluationCost() const;
+    bool implies(const SearchTerm &other) const; // true if every note matching this term also matches the other
+    static QStringList normalizedWords(const QString &text);
+    static bool isColumnQualifier(const QString &qualifier);
     QString qualifier;
     QString text;
     bool isNegated;
+    QStringList normalizedTextWords; // of text, normalized once so that matching only compares
+    bool isPrefix; // text ends with '*'
 };
 
 class SearchQuery
@@ -47,6 +66,14 @@ class SearchQuery
 public:
     SearchQuery(const QString &queryString);
     QList<SearchTerm> searchTerms() const;
+    bool isAnyTermEnough() const; // true if the query has "any:"
+    QList<int> plannedTermOrder() const; // indices of the search terms, in the order they should be evaluated in
+    // True if every note matching this query also matches the previous query - as when a word is being typed
+    // out, or another word is added. Errs on the side of false.
+    bool isRefinementOf(const SearchQuery &previousQuery) const;
+    // The words of the terms that are matched against the title and content, excluding negated terms, in the
+    // form taken by SearchIndex::relevanceScores() and SearchIndex::snippet()
+    QStringList matchingWords() const;
 
 private:
     QList<SearchTerm> parseQuery(const QString &queryString);
@@ -59,17 +86,81 @@ class SearchLocalNotesThread : public QThread
 {
     Q_OBJECT
 public:
-    SearchLocalNotesThread(StorageManager *storageManager, const QString &searchQuery, QObject *parent = 0);
-    void run();
+    // With RecentlyUpdatedFirst, matching notes are reported as each partition of the notes is searched.
+    // With MostRelevantFirst, no note can be reported until every note has been scored, so the first results
+    // come only after the whole search; only the sorting of the results after the first page is deferred.
+    enum ResultsOrder {
+        RecentlyUpdatedFirst,
+        MostRelevantFirst
+    };
+
+    // If isMatchingSimilarWords is true, words in the query also match words that differ from them by a typo or two
+    SearchLocalNotesThread(StorageManager *storageManager, const QString &searchQuery, ResultsOrder resultsOrder,
+                           bool isMatchingSimilarWords, QObject *parent = 0);
+    // Searches only among the notes that matched a previous search whose query this search's query refines.
+    // Should be called before start().
+    void refinePreviousResults(const QSet<QString> &previousMatchingNoteIds, int previousUnsearchedNotesCount);
+    void run(); // can also be called directly, to search in the calling thread
     void cancel();
+    bool isCancelled() const;
+    int searchedNotesCount() const; // the notes the query was evaluated for, once the search is done
 signals:
-    void searchLocalNotesMatchingNote(const QString &noteId);
+    void searchLocalNotesMatchingNotes(const QStringList &noteIds); // in batches, in the order the notes should be listed
     void searchLocalNotesProgressPercentage(int progressPercentage);
     void searchLocalNotesFinished(int unsearchedNotesCount);
 private:
+    QSet<QString> notesMatchingTerm(const SearchTerm &term, SearchIndex *searchIndex, const QSet<QString> &candidateNoteIds, bool *matchesAllNotes);
+    bool refreshSearchIndex(SearchIndex *searchIndex, const QSet<QString> &noteIds, int *indexingProgressShare);
+    void reportMatchingNote(const QString &noteId);
+    void deliverMatchingNotes();
+    void reportProgress(int progressPercentage);
+
     StorageManager * const m_storageManager;
     const QString m_searchQueryString;
-    bool m_cancelled;
+    const ResultsOrder m_resultsOrder;
+    const bool m_isMatchingSimilarWords;
+    bool m_isRefiningPreviousResults;
+    QSet<QString> m_previousMatchingNoteIds;
+    int m_previousUnsearchedNotesCount;
+    QStringList m_pendingMatchingNoteIds;
+    QElapsedTimer m_resultsBatchTimer, m_progressReportTimer;
+    int m_reportedProgressPercentage;
+    int m_searchedNotesCount;
+    volatile bool m_cancelled;
+};
+
+// Brings the stored matching notes of saved searches up-to-date. For a saved search that has them stored, only the
+// notes changed since are searched. One that doesn't (because it's new, or its query changed) is searched in full,
+// but only if it's the saved search being opened.
+class RefreshSavedSearchesThread : public QThread
+{
+    Q_OBJECT
+public:
+    RefreshSavedSearchesThread(StorageManager *storageManager, const QString &openingSavedSearchId = QString(), QObject *parent = 0);
+    void run();
+signals:
+    void savedSearchMatchingNotesChanged(const QString &savedSearchId);
+    void savedSearchesRefreshed(const QString &openingSavedSearchId);
+private slots:
+    void collectMatchingNotes(const QStringList &noteIds);
+private:
+    QStringList notesMatchingQuery(const QString &query, const QSet<QString> *candidateNoteIds /* all notes if null */);
+
+    StorageManager * const m_storageManager;
+    const QString m_openingSavedSearchId;
+    QStringList m_collectedNoteIds;
+    static QMutex s_refreshMutex; // refreshes take the changed notes from the store, so they can't overlap
+};
+
+// Loads the search index and brings it up-to-date, so that it's ready for searches and completions
+class PrepareSearchIndexThread : public QThread
+{
+    Q_OBJECT
+public:
+    PrepareSearchIndexThread(StorageManager *storageManager, QObject *parent = 0);
+    void run();
+private:
+    StorageManager * const m_storageManager;
 };
 
 #endif // SEARCHLOCALNOTESTHREAD_H
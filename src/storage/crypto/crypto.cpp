@@ -28,16 +28,33 @@
 #include "qblowfish.h"
 #include <QByteArray>
 #include <QBuffer>
+#include <QFile>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QScopedPointer>
+#include <QtEndian>
 #include <QtDebug>
 #include <QCryptographicHash>
 
 #include "notekeeper_config.h"
 
-#define CRYPTO_MARKER_32 0xb10f1501
+#define CRYPTO_MARKER_32 0xb10f1501     // Blowfish ECB, with SHA1 of the clear text. Only read, never written.
+#define CRYPTO_MARKER_CTR_32 0xb10f1502 // Blowfish CTR, with HMAC-SHA1 of the cipher text
+
+// Layout of the CTR format:
+//   marker (4 bytes) | salt (8 bytes) | cipher text length (8 bytes) | cipher text | HMAC-SHA1 (20 bytes)
+// All integers are big-endian. The HMAC covers everything that precedes it.
+// The cipher text is encrypted with a key of its own, derived from the salt (see createStreamBlowfish()).
+// A fresh salt is used for every write.
+#define CTR_HEADER_SIZE (4 + 8 + 8)
+#define CTR_MAC_SIZE 20
+#define CTR_CHUNK_SIZE (64 * 1024) // should be a multiple of 8, the blowfish block size
 
 namespace Crypto {
 
 static QBlowfish *s_qblowfish = 0;
+static QByteArray s_macKey;
+static QMutex s_instanceMutex;
 
 static QBlowfish *createBlowfishInstance()
 {
@@ -49,20 +66,244 @@ static QBlowfish *createBlowfishInstance()
     return qblowfish;
 }
 
-bool writeEncryptedSettings(QIODevice &device, const QSettings::SettingsMap &map)
+// The key schedule is computed only once and shared by all callers (settings files are read from multiple threads)
+QBlowfish *blowfishInstance()
+{
+    QMutexLocker locker(&s_instanceMutex);
+    if (s_qblowfish == 0) {
+        s_qblowfish = createBlowfishInstance();
+    }
+    Q_ASSERT(s_qblowfish != 0);
+    return s_qblowfish;
+}
+
+QByteArray macKey()
+{
+    QMutexLocker locker(&s_instanceMutex);
+    if (s_macKey.isEmpty()) {
+        // Derived from, but not the same as, the encryption key
+        QByteArray key = QByteArray::fromHex(ENCRYPTION_KEY);
+        s_macKey = QCryptographicHash::hash(QByteArray("NotekeeperMac:") + key, QCryptographicHash::Sha1);
+    }
+    return s_macKey;
+}
+
+HmacSha1::HmacSha1(const QByteArray &key)
+    : m_innerHash(QCryptographicHash::Sha1)
+{
+    // HMAC-SHA1, as per RFC 2104
+    const int blockSize = 64;
+    QByteArray k = key;
+    if (k.size() > blockSize) {
+        k = QCryptographicHash::hash(k, QCryptographicHash::Sha1);
+    }
+    k.append(QByteArray(blockSize - k.size(), '\0'));
+    QByteArray innerPad(blockSize, '\0');
+    m_outerPad = QByteArray(blockSize, '\0');
+    for (int i = 0; i < blockSize; i++) {
+        innerPad[i] = static_cast<char>(static_cast<quint8>(k.at(i)) ^ 0x36);
+        m_outerPad[i] = static_cast<char>(static_cast<quint8>(k.at(i)) ^ 0x5c);
+    }
+    m_innerHash.addData(innerPad);
+}
+
+void HmacSha1::addData(const char *data, int length)
+{
+    m_innerHash.addData(data, length);
+}
+
+QByteArray HmacSha1::result()
+{
+    QCryptographicHash outerHash(QCryptographicHash::Sha1);
+    outerHash.addData(m_outerPad);
+    outerHash.addData(m_innerHash.result());
+    return outerHash.result();
+}
+
+bool isEqualInConstantTime(const QByteArray &a, const QByteArray &b)
+{
+    if (a.size() != b.size()) {
+        return false;
+    }
+    quint8 difference = 0;
+    for (int i = 0; i < a.size(); i++) {
+        difference |= (static_cast<quint8>(a.at(i)) ^ static_cast<quint8>(b.at(i)));
+    }
+    return (difference == 0);
+}
+
+// Reads only /dev/urandom. Where that's not available, this fails, and so does writing encrypted data, rather
+// than using a salt that can be predicted or repeated.
+bool randomSalt(quint64 *salt)
+{
+    QFile urandom("/dev/urandom");
+    if (!urandom.open(QIODevice::ReadOnly)) {
+        qWarning("Crypto::randomSalt: Cannot open /dev/urandom");
+        return false;
+    }
+    quint64 value = 0;
+    qint64 bytesRead = urandom.read(reinterpret_cast<char *>(&value), sizeof(value));
+    urandom.close();
+    if (bytesRead != sizeof(value)) {
+        qWarning("Crypto::randomSalt: Cannot read /dev/urandom");
+        return false;
+    }
+    (*salt) = value;
+    return true;
+}
+
+// Each stream has a key of its own, HMAC-SHA1(encryption key, salt), so that streams never share keystream
+// unless their 64-bit salts are the same. The caller owns the returned instance.
+QBlowfish *createStreamBlowfish(quint64 salt)
+{
+    uchar saltBytes[8];
+    qToBigEndian<quint64>(salt, saltBytes);
+    HmacSha1 hmac(QByteArray::fromHex(ENCRYPTION_KEY)); // Defined in notekeeper_config.h
+    hmac.addData("NotekeeperStream:", 17);
+    hmac.addData(reinterpret_cast<const char *>(saltBytes), sizeof(saltBytes));
+    QBlowfish *qblowfish = new QBlowfish(hmac.result());
+    qblowfish->init();
+    return qblowfish;
+}
+
+// QIODevice::read() can return fewer bytes than asked for
+static bool readFully(QIODevice &device, char *data, qint64 length)
+{
+    qint64 bytesRead = 0;
+    while (bytesRead < length) {
+        qint64 n = device.read(data + bytesRead, length - bytesRead);
+        if (n <= 0) {
+            return false;
+        }
+        bytesRead += n;
+    }
+    return true;
+}
+
+bool encryptStream(QIODevice &clearTextSource, QIODevice &target)
+{
+    if (clearTextSource.isSequential()) {
+        qWarning("Crypto::encryptStream: Source should be a random-access device");
+        return false;
+    }
+    const qint64 length = clearTextSource.size() - clearTextSource.pos();
+    if (length < 0) {
+        return false;
+    }
+    quint64 salt;
+    if (!randomSalt(&salt)) {
+        return false;
+    }
+    QScopedPointer<QBlowfish> qblowfish(createStreamBlowfish(salt));
+
+    uchar header[CTR_HEADER_SIZE];
+    qToBigEndian<quint32>(CRYPTO_MARKER_CTR_32, header);
+    qToBigEndian<quint64>(salt, header + 4);
+    qToBigEndian<quint64>(static_cast<quint64>(length), header + 12);
+    HmacSha1 hmac(macKey());
+    hmac.addData(reinterpret_cast<const char *>(header), CTR_HEADER_SIZE);
+    if (target.write(reinterpret_cast<const char *>(header), CTR_HEADER_SIZE) != CTR_HEADER_SIZE) {
+        return false;
+    }
+
+    QByteArray chunk(CTR_CHUNK_SIZE, '\0');
+    quint64 blockIndex = 0;
+    qint64 remainingLength = length;
+    while (remainingLength > 0) {
+        int chunkLength = static_cast<int>(qMin<qint64>(CTR_CHUNK_SIZE, remainingLength));
+        if (!readFully(clearTextSource, chunk.data(), chunkLength)) {
+            return false;
+        }
+        if (!qblowfish->ctrTransform(chunk.data(), chunkLength, 0, blockIndex)) { // the key is the stream's own
+            return false;
+        }
+        hmac.addData(chunk.constData(), chunkLength);
+        if (target.write(chunk.constData(), chunkLength) != chunkLength) {
+            return false;
+        }
+        blockIndex += (CTR_CHUNK_SIZE / 8);
+        remainingLength -= chunkLength;
+    }
+
+    QByteArray mac = hmac.result();
+    Q_ASSERT(mac.size() == CTR_MAC_SIZE);
+    return (target.write(mac) == mac.size());
+}
+
+bool decryptStream(QIODevice &source, QIODevice &clearTextTarget)
 {
-    QDataStream out(&device);
-    quint32 marker = CRYPTO_MARKER_32;
-    quint32 dataStreamerVersion = out.version();
-    out << marker;
-    out << dataStreamerVersion;
+    if (source.isSequential()) {
+        qWarning("Crypto::decryptStream: Source should be a random-access device");
+        return false;
+    }
+    const qint64 startPos = source.pos();
+    uchar header[CTR_HEADER_SIZE];
+    if (!readFully(source, reinterpret_cast<char *>(header), CTR_HEADER_SIZE)) {
+        return false;
+    }
+    quint32 marker = qFromBigEndian<quint32>(header);
+    quint64 salt = qFromBigEndian<quint64>(header + 4);
+    qint64 length = static_cast<qint64>(qFromBigEndian<quint64>(header + 12));
+    if (marker != CRYPTO_MARKER_CTR_32 || length < 0 ||
+        (source.size() - startPos) != (CTR_HEADER_SIZE + length + CTR_MAC_SIZE)) {
+        return false;
+    }
+
+    // First pass: Authenticate, so that we never hand out clear text from tampered data
+    QByteArray chunk(CTR_CHUNK_SIZE, '\0');
+    HmacSha1 hmac(macKey());
+    hmac.addData(reinterpret_cast<const char *>(header), CTR_HEADER_SIZE);
+    qint64 remainingLength = length;
+    while (remainingLength > 0) {
+        int chunkLength = static_cast<int>(qMin<qint64>(CTR_CHUNK_SIZE, remainingLength));
+        if (!readFully(source, chunk.data(), chunkLength)) {
+            return false;
+        }
+        hmac.addData(chunk.constData(), chunkLength);
+        remainingLength -= chunkLength;
+    }
+    QByteArray storedMac(CTR_MAC_SIZE, '\0');
+    if (!readFully(source, storedMac.data(), CTR_MAC_SIZE)) {
+        return false;
+    }
+    if (!isEqualInConstantTime(storedMac, hmac.result())) {
+        return false;
+    }
+
+    // Second pass: Decrypt
+    if (!source.seek(startPos + CTR_HEADER_SIZE)) {
+        return false;
+    }
+    QScopedPointer<QBlowfish> qblowfish(createStreamBlowfish(salt));
+    quint64 blockIndex = 0;
+    remainingLength = length;
+    while (remainingLength > 0) {
+        int chunkLength = static_cast<int>(qMin<qint64>(CTR_CHUNK_SIZE, remainingLength));
+        if (!readFully(source, chunk.data(), chunkLength)) {
+            return false;
+        }
+        if (!qblowfish->ctrTransform(chunk.data(), chunkLength, 0, blockIndex)) {
+            return false;
+        }
+        if (clearTextTarget.write(chunk.constData(), chunkLength) != chunkLength) {
+            return false;
+        }
+        blockIndex += (CTR_CHUNK_SIZE / 8);
+        remainingLength -= chunkLength;
+    }
+    source.seek(startPos + CTR_HEADER_SIZE + length + CTR_MAC_SIZE);
+    return true;
+}
 
+bool writeEncryptedSettings(QIODevice &device, const QSettings::SettingsMap &map)
+{
     QBuffer clearTextBuffer;
     bool opened = clearTextBuffer.open(QIODevice::WriteOnly);
     if (!opened) {
         return false;
     }
     QDataStream clearTextData(&clearTextBuffer);
+    clearTextData.setVersion(QDataStream::Qt_4_7);
     QMapIterator<QString, QVariant> iter(map);
     while (iter.hasNext()) {
         iter.next();
@@ -75,58 +316,73 @@ bool writeEncryptedSettings(QIODevice &device, const QSettings::SettingsMap &map
     }
     clearTextBuffer.close();
 
-    QByteArray clearTextBa = clearTextBuffer.buffer();
-    QByteArray sha1sum = QCryptographicHash::hash(clearTextBa, QCryptographicHash::Sha1);
-    clearTextBa.prepend(sha1sum);
-
-    if (s_qblowfish == 0) {
-        s_qblowfish = createBlowfishInstance();
+    opened = clearTextBuffer.open(QIODevice::ReadOnly);
+    if (!opened) {
+        return false;
     }
-    Q_ASSERT(s_qblowfish != 0);
-    QByteArray encryptedBa = s_qblowfish->encrypted(clearTextBa);
-    out << encryptedBa;
+    return encryptStream(clearTextBuffer, device);
+}
 
+static bool readSettingsFromClearText(QByteArray *clearTextBa, int dataStreamerVersion, QSettings::SettingsMap &map)
+{
+    QBuffer clearTextBuffer(clearTextBa);
+    bool opened = clearTextBuffer.open(QIODevice::ReadOnly);
+    if (!opened) {
+        return false;
+    }
+    QDataStream clearTextData(&clearTextBuffer);
+    clearTextData.setVersion(dataStreamerVersion);
+    while (!clearTextData.atEnd()) {
+        QByteArray key, value;
+        clearTextData >> key;
+        clearTextData >> value;
+        QString keyString = QString::fromUtf8(key.constData(), key.length());
+        QString valueString = QString::fromUtf8(value.constData(), value.length());
+        if (!keyString.isEmpty()) {
+            map.insert(keyString, valueString);
+        }
+    }
     return true;
 }
 
 bool readEncryptedSettings(QIODevice &device, QSettings::SettingsMap &map)
 {
-    QDataStream in(&device);
-    quint32 marker;
-    in >> marker;
-    quint32 dataStreamerVersion;
-    in >> dataStreamerVersion;
-    in.setVersion(dataStreamerVersion);
-    if (marker == CRYPTO_MARKER_32) {
-        if (s_qblowfish == 0) {
-            s_qblowfish = createBlowfishInstance();
+    QByteArray markerBa = device.peek(4);
+    if (markerBa.size() != 4) {
+        return false;
+    }
+    quint32 marker = qFromBigEndian<quint32>(reinterpret_cast<const uchar *>(markerBa.constData()));
+
+    if (marker == CRYPTO_MARKER_CTR_32) {
+        QBuffer clearTextBuffer;
+        bool opened = clearTextBuffer.open(QIODevice::WriteOnly);
+        if (!opened) {
+            return false;
+        }
+        if (!decryptStream(device, clearTextBuffer)) {
+            return false;
         }
-        Q_ASSERT(s_qblowfish != 0);
+        clearTextBuffer.close();
+        return readSettingsFromClearText(&clearTextBuffer.buffer(), QDataStream::Qt_4_7, map);
+    }
+
+    if (marker == CRYPTO_MARKER_32) {
+        // Older format. Will get rewritten in the newer format when the settings are next written.
+        QDataStream in(&device);
+        in >> marker;
+        quint32 dataStreamerVersion;
+        in >> dataStreamerVersion;
+        in.setVersion(dataStreamerVersion);
+        QBlowfish *qblowfish = blowfishInstance();
         QByteArray encryptedBa;
         in >> encryptedBa;
-        QByteArray ba = s_qblowfish->decrypted(encryptedBa);
+        QByteArray ba = qblowfish->decrypted(encryptedBa);
         QByteArray sha1sum = ba.mid(0, 20);
         ba = ba.mid(20);
         if (sha1sum.isEmpty() || sha1sum != QCryptographicHash::hash(ba, QCryptographicHash::Sha1)) {
             return false;
         }
-        QBuffer clearTextBuffer(&ba);
-        bool opened = clearTextBuffer.open(QIODevice::ReadOnly);
-        if (!opened) {
-            return false;
-        }
-        QDataStream clearTextData(&clearTextBuffer);
-        while (!clearTextData.atEnd()) {
-            QByteArray key, value;
-            clearTextData >> key;
-            clearTextData >> value;
-            QString keyString = QString::fromUtf8(key.constData(), key.length());
-            QString valueString = QString::fromUtf8(value.constData(), value.length());
-            if (!keyString.isEmpty()) {
-                map.insert(keyString, valueString);
-            }
-        }
-        return true;
+        return readSettingsFromClearText(&ba, dataStreamerVersion, map);
     }
     return false;
 }
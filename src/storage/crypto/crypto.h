@@ -31,9 +31,37 @@
 #include <QByteArray>
 #include <QSettings>
 #include <QIODevice>
+#include <QCryptographicHash>
+
+class QBlowfish;
 
 namespace Crypto {
 
+// Authenticated encryption of arbitrarily large data, processed in chunks.
+// The source devices should be random-access (files or buffers), not sockets.
+// decryptStream() writes nothing to the target if the data fails authentication.
+bool encryptStream(QIODevice &clearTextSource, QIODevice &target);
+bool decryptStream(QIODevice &source, QIODevice &clearTextTarget);
+
+// Building blocks, shared with EncryptedFile
+QBlowfish *blowfishInstance(); // with the key schedule already set up
+QByteArray macKey();
+bool randomSalt(quint64 *salt);
+QBlowfish *createStreamBlowfish(quint64 salt); // for ctrTransform(), with a key derived from the salt
+bool isEqualInConstantTime(const QByteArray &a, const QByteArray &b);
+
+class HmacSha1
+{
+public:
+    HmacSha1(const QByteArray &key);
+    void addData(const char *data, int length);
+    QByteArray result();
+private:
+    QCryptographicHash m_innerHash;
+    QByteArray m_outerPad;
+};
+
+// For use with QSettings::registerFormat()
 bool readEncryptedSettings(QIODevice &device, QSettings::SettingsMap &map);
 bool writeEncryptedSettings(QIODevice &device, const QSettings::SettingsMap &map);
 
@@ -0,0 +1,360 @@
+/*
+  This file is part of Notekeeper Open and is licensed under the MIT License
+
+  Copyright (C) 2011-2015 Roopesh Chander <roop@roopc.net>
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject
+  to the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+  BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+  ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+  CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+
+#include "encryptedfile.h"
+#include "crypto.h"
+#include "qblowfish.h"
+#include <QtEndian>
+#include <QtDebug>
+
+// File layout:
+//   marker (4 bytes) | chunk size (4 bytes) | salt (8 bytes) | chunk 0 | chunk 1 | ... | chunk n
+// where each chunk is:
+//   cipher text (chunk size bytes, or fewer for the last chunk) | HMAC-SHA1 (20 bytes)
+// The cipher text is Blowfish CTR, with a key derived from the salt (see Crypto::createStreamBlowfish()),
+// and with the counter continuing across chunks. Every write of a file uses a fresh salt.
+// The HMAC of a chunk covers the salt, chunk size, chunk index, whether it's the
+// last chunk, and the chunk's cipher text, so chunks cannot be reordered, swapped
+// across files or dropped from the end. There's always at least one (maybe empty) chunk.
+// All integers are big-endian.
+
+#define ENCRYPTED_FILE_MARKER_32 0xb10f1503
+#define ENCRYPTED_FILE_HEADER_SIZE (4 + 4 + 8)
+#define ENCRYPTED_FILE_MAC_SIZE 20
+#define ENCRYPTED_FILE_CHUNK_SIZE (16 * 1024) // should be a multiple of 8, the blowfish block size
+
+EncryptedFile::EncryptedFile(const QString &fileName, QObject *parent)
+    : QIODevice(parent)
+    , m_file(fileName)
+    , m_chunkSize(ENCRYPTED_FILE_CHUNK_SIZE)
+    , m_salt(0)
+    , m_clearTextSize(0)
+    , m_chunkCount(0)
+    , m_pos(0)
+    , m_loadedChunkIndex(-1)
+    , m_writtenChunksCount(0)
+    , m_isCommitted(false)
+{
+}
+
+EncryptedFile::~EncryptedFile()
+{
+    close();
+}
+
+QString EncryptedFile::fileName() const
+{
+    return m_file.fileName();
+}
+
+bool EncryptedFile::open(OpenMode mode)
+{
+    if (isOpen()) {
+        return false;
+    }
+    OpenMode accessMode = (mode & ReadWrite);
+    m_chunk.clear();
+    m_loadedChunkIndex = -1;
+    m_writtenChunksCount = 0;
+    m_isCommitted = false;
+    m_pos = 0;
+
+    if (accessMode == ReadOnly) {
+        if (!m_file.open(QIODevice::ReadOnly)) {
+            setErrorString(m_file.errorString());
+            return false;
+        }
+        uchar header[ENCRYPTED_FILE_HEADER_SIZE];
+        if ((m_file.read(reinterpret_cast<char *>(header), ENCRYPTED_FILE_HEADER_SIZE) != ENCRYPTED_FILE_HEADER_SIZE) ||
+            (qFromBigEndian<quint32>(header) != ENCRYPTED_FILE_MARKER_32)) {
+            setErrorString("Not an encrypted file");
+            m_file.close();
+            return false;
+        }
+        m_chunkSize = static_cast<int>(qFromBigEndian<quint32>(header + 4));
+        m_salt = qFromBigEndian<quint64>(header + 8);
+        const qint64 bodySize = m_file.size() - ENCRYPTED_FILE_HEADER_SIZE;
+        const qint64 fullChunkSize = m_chunkSize + ENCRYPTED_FILE_MAC_SIZE;
+        if (m_chunkSize <= 0 || (m_chunkSize % 8) != 0 || bodySize < ENCRYPTED_FILE_MAC_SIZE) {
+            setErrorString("Encrypted file is corrupt");
+            m_file.close();
+            return false;
+        }
+        m_chunkCount = (bodySize + fullChunkSize - 1) / fullChunkSize;
+        if ((bodySize - (m_chunkCount - 1) * fullChunkSize) < ENCRYPTED_FILE_MAC_SIZE) {
+            setErrorString("Encrypted file is truncated");
+            m_file.close();
+            return false;
+        }
+        m_clearTextSize = bodySize - (m_chunkCount * ENCRYPTED_FILE_MAC_SIZE);
+        m_qblowfish.reset(Crypto::createStreamBlowfish(m_salt));
+    } else if (accessMode == WriteOnly) {
+        if (!Crypto::randomSalt(&m_salt)) {
+            setErrorString("No source of random numbers for encrypting");
+            return false;
+        }
+        if (!m_file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+            setErrorString(m_file.errorString());
+            return false;
+        }
+        m_chunkSize = ENCRYPTED_FILE_CHUNK_SIZE;
+        m_qblowfish.reset(Crypto::createStreamBlowfish(m_salt));
+        uchar header[ENCRYPTED_FILE_HEADER_SIZE];
+        qToBigEndian<quint32>(ENCRYPTED_FILE_MARKER_32, header);
+        qToBigEndian<quint32>(static_cast<quint32>(m_chunkSize), header + 4);
+        qToBigEndian<quint64>(m_salt, header + 8);
+        if (m_file.write(reinterpret_cast<const char *>(header), ENCRYPTED_FILE_HEADER_SIZE) != ENCRYPTED_FILE_HEADER_SIZE) {
+            setErrorString(m_file.errorString());
+            m_file.close();
+            return false;
+        }
+        m_clearTextSize = 0;
+        m_chunk.reserve(m_chunkSize);
+    } else {
+        setErrorString("EncryptedFile can only be opened ReadOnly or WriteOnly");
+        return false;
+    }
+    // We keep track of the position ourselves, so no buffering by QIODevice
+    return QIODevice::open(accessMode | QIODevice::Unbuffered);
+}
+
+bool EncryptedFile::commit()
+{
+    if (!isOpen() || !(openMode() & WriteOnly)) {
+        return false;
+    }
+    if (m_isCommitted) {
+        return true;
+    }
+    m_isCommitted = true;
+    return (writeChunk(true) && m_file.flush());
+}
+
+void EncryptedFile::close()
+{
+    if (!isOpen()) {
+        return;
+    }
+    if (openMode() & WriteOnly) {
+        commit();
+    }
+    QIODevice::close();
+    m_file.close();
+    m_chunk.clear();
+    m_loadedChunkIndex = -1;
+    m_qblowfish.reset();
+}
+
+bool EncryptedFile::isSequential() const
+{
+    return false;
+}
+
+qint64 EncryptedFile::size() const
+{
+    return m_clearTextSize;
+}
+
+bool EncryptedFile::seek(qint64 pos)
+{
+    if (!(openMode() & ReadOnly) || pos < 0 || pos > m_clearTextSize) {
+        return false;
+    }
+    QIODevice::seek(pos);
+    m_pos = pos;
+    return true;
+}
+
+bool EncryptedFile::atEnd() const
+{
+    return (!isOpen() || m_pos >= m_clearTextSize);
+}
+
+qint64 EncryptedFile::readData(char *data, qint64 maxSize)
+{
+    qint64 bytesRead = 0;
+    while (bytesRead < maxSize && m_pos < m_clearTextSize) {
+        qint64 chunkIndex = m_pos / m_chunkSize;
+        if (!loadChunk(chunkIndex)) {
+            return (bytesRead > 0? bytesRead : -1);
+        }
+        int offsetInChunk = static_cast<int>(m_pos - chunkIndex * m_chunkSize);
+        int length = static_cast<int>(qMin<qint64>(m_chunk.size() - offsetInChunk, maxSize - bytesRead));
+        memcpy(data + bytesRead, m_chunk.constData() + offsetInChunk, length);
+        bytesRead += length;
+        m_pos += length;
+    }
+    return bytesRead;
+}
+
+qint64 EncryptedFile::writeData(const char *data, qint64 maxSize)
+{
+    if (m_isCommitted) {
+        return -1;
+    }
+    qint64 bytesWritten = 0;
+    while (bytesWritten < maxSize) {
+        if (m_chunk.size() == m_chunkSize) {
+            // There's more data coming, so this is not the last chunk
+            if (!writeChunk(false)) {
+                return -1;
+            }
+        }
+        int length = static_cast<int>(qMin<qint64>(m_chunkSize - m_chunk.size(), maxSize - bytesWritten));
+        m_chunk.append(data + bytesWritten, length);
+        bytesWritten += length;
+    }
+    m_clearTextSize += bytesWritten;
+    m_pos += bytesWritten;
+    return bytesWritten;
+}
+
+bool EncryptedFile::loadChunk(qint64 chunkIndex)
+{
+    if (chunkIndex == m_loadedChunkIndex) {
+        return true;
+    }
+    if (chunkIndex < 0 || chunkIndex >= m_chunkCount) {
+        return false;
+    }
+    m_loadedChunkIndex = -1;
+    const int length = static_cast<int>(qMin<qint64>(m_chunkSize, m_clearTextSize - chunkIndex * m_chunkSize));
+    if (!m_file.seek(ENCRYPTED_FILE_HEADER_SIZE + chunkIndex * (m_chunkSize + ENCRYPTED_FILE_MAC_SIZE))) {
+        setErrorString(m_file.errorString());
+        return false;
+    }
+    m_chunk.resize(length);
+    if (m_file.read(m_chunk.data(), length) != length) {
+        setErrorString(m_file.errorString());
+        return false;
+    }
+    QByteArray storedMac = m_file.read(ENCRYPTED_FILE_MAC_SIZE);
+    bool isFinalChunk = (chunkIndex == m_chunkCount - 1);
+    if (!Crypto::isEqualInConstantTime(storedMac, chunkMac(chunkIndex, isFinalChunk, m_chunk.constData(), length))) {
+        setErrorString("Encrypted file failed authentication");
+        return false;
+    }
+    if (!m_qblowfish->ctrTransform(m_chunk.data(), length, 0, chunkIndex * (m_chunkSize / 8))) {
+        return false;
+    }
+    m_loadedChunkIndex = chunkIndex;
+    return true;
+}
+
+bool EncryptedFile::writeChunk(bool isFinalChunk)
+{
+    const int length = m_chunk.size();
+    if (!m_qblowfish->ctrTransform(m_chunk.data(), length, 0, m_writtenChunksCount * (m_chunkSize / 8))) {
+        return false;
+    }
+    QByteArray mac = chunkMac(m_writtenChunksCount, isFinalChunk, m_chunk.constData(), length);
+    if (m_file.write(m_chunk.constData(), length) != length || m_file.write(mac) != mac.size()) {
+        setErrorString(m_file.errorString());
+        return false;
+    }
+    m_writtenChunksCount++;
+    m_chunk.resize(0); // keeps the allocation
+    return true;
+}
+
+QByteArray EncryptedFile::chunkMac(qint64 chunkIndex, bool isFinalChunk, const char *cipherText, int length) const
+{
+    uchar prefix[8 + 4 + 8 + 1];
+    qToBigEndian<quint64>(m_salt, prefix);
+    qToBigEndian<quint32>(static_cast<quint32>(m_chunkSize), prefix + 8);
+    qToBigEndian<quint64>(static_cast<quint64>(chunkIndex), prefix + 12);
+    prefix[20] = (isFinalChunk? 1 : 0);
+    Crypto::HmacSha1 hmac(Crypto::macKey());
+    hmac.addData(reinterpret_cast<const char *>(prefix), sizeof(prefix));
+    hmac.addData(cipherText, length);
+    return hmac.result();
+}
+
+bool EncryptedFile::isEncryptedFile(const QString &fileName)
+{
+    QFile file(fileName);
+    if (!file.open(QIODevice::ReadOnly)) {
+        return false;
+    }
+    QByteArray marker = file.read(4);
+    return (marker.size() == 4 &&
+            qFromBigEndian<quint32>(reinterpret_cast<const uchar *>(marker.constData())) == ENCRYPTED_FILE_MARKER_32);
+}
+
+qint64 EncryptedFile::clearTextSize(const QString &fileName)
+{
+    EncryptedFile file(fileName);
+    if (!file.open(QIODevice::ReadOnly)) {
+        return -1;
+    }
+    return file.size();
+}
+
+QIODevice *EncryptedFile::openForReading(const QString &fileName)
+{
+    QIODevice *device = 0;
+    if (isEncryptedFile(fileName)) {
+        device = new EncryptedFile(fileName);
+    } else {
+        device = new QFile(fileName);
+    }
+    if (!device->open(QIODevice::ReadOnly)) {
+        delete device;
+        return 0;
+    }
+    return device;
+}
+
+bool EncryptedFile::encryptToFile(QIODevice *sourceDevice, const QString &targetFileName)
+{
+    if (!sourceDevice || !sourceDevice->isReadable()) {
+        return false;
+    }
+    bool ok = true;
+    {
+        EncryptedFile targetFile(targetFileName);
+        if (!targetFile.open(QIODevice::WriteOnly)) {
+            return false;
+        }
+        QByteArray buffer(ENCRYPTED_FILE_CHUNK_SIZE * 4, '\0');
+        while (ok && !sourceDevice->atEnd()) {
+            qint64 bytesRead = sourceDevice->read(buffer.data(), buffer.size());
+            if (bytesRead < 0) {
+                ok = false;
+            } else if (bytesRead == 0) {
+                break;
+            } else if (targetFile.write(buffer.constData(), bytesRead) != bytesRead) {
+                ok = false;
+            }
+        }
+        ok = (ok && targetFile.commit());
+    }
+    if (!ok) {
+        QFile::remove(targetFileName);
+    }
+    return ok;
+}
@@ -0,0 +1,100 @@
+/*
+  This file is part of Notekeeper Open and is licensed under the MIT License
+
+  Copyright (C) 2011-2015 Roopesh Chander <roop@roopc.net>
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject
+  to the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+  BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+  ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+  CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+
+#ifndef ENCRYPTEDFILE_H
+#define ENCRYPTEDFILE_H
+
+#include <QIODevice>
+#include <QFile>
+#include <QString>
+#include <QByteArray>
+#include <QScopedPointer>
+
+class QBlowfish;
+
+// EncryptedFile stores data encrypted in fixed-size chunks, each of which is
+// authenticated on its own. Any part of the file can therefore be read (and
+// verified) by decrypting only the chunks that cover it.
+// When opened ReadOnly, the file can be seeked to any position.
+// When opened WriteOnly, the file is written sequentially and finalized on close().
+
+class EncryptedFile : public QIODevice
+{
+    Q_OBJECT
+public:
+    EncryptedFile(const QString &fileName, QObject *parent = 0);
+    ~EncryptedFile();
+
+    QString fileName() const;
+
+    bool open(OpenMode mode);
+    void close();
+    bool isSequential() const;
+    qint64 size() const;
+    bool seek(qint64 pos);
+    bool atEnd() const;
+
+    // Returns true if the file at fileName is in the encrypted format
+    static bool isEncryptedFile(const QString &fileName);
+
+    // Returns the size of the clear text in an encrypted file, without decrypting it. Returns -1 if it's not an encrypted file.
+    static qint64 clearTextSize(const QString &fileName);
+
+    // Returns an open device to read the clear text from, be it an EncryptedFile or a plain QFile.
+    // Returns 0 if the file could not be opened. The caller owns the returned device.
+    static QIODevice *openForReading(const QString &fileName);
+
+    // Writes out the last chunk of a file opened WriteOnly. Returns false if the data could not be written.
+    // Called by close() if not called already.
+    bool commit();
+
+    // Writes an encrypted copy of sourceDevice's remaining data into targetFileName
+    static bool encryptToFile(QIODevice *sourceDevice, const QString &targetFileName);
+
+protected:
+    qint64 readData(char *data, qint64 maxSize);
+    qint64 writeData(const char *data, qint64 maxSize);
+
+private:
+    bool loadChunk(qint64 chunkIndex);
+    bool writeChunk(bool isFinalChunk);
+    QByteArray chunkMac(qint64 chunkIndex, bool isFinalChunk, const char *cipherText, int length) const;
+
+    QFile m_file;
+    int m_chunkSize;
+    quint64 m_salt;
+    QScopedPointer<QBlowfish> m_qblowfish; // keyed for this file's salt
+    qint64 m_clearTextSize;
+    qint64 m_chunkCount;
+    qint64 m_pos;
+    QByteArray m_chunk;           // clear text of the current chunk
+    qint64 m_loadedChunkIndex;    // while reading, index of the chunk in m_chunk
+    qint64 m_writtenChunksCount;  // while writing
+    bool m_isCommitted;
+};
+
+#endif // ENCRYPTEDFILE_H
@@ -35,6 +35,10 @@
 #include <QStringBuilder>
 #include <QDateTime>
 #include <QNetworkDiskCache>
+#include <QDataStream>
+
+#define RENDERED_NOTE_CACHE_SIZE (4 << 20) // 4 MB
+#define RENDERED_NOTE_REWRITE_INTERVAL 3600 // secs
 
 // singleton
 
@@ -72,6 +76,12 @@ SharedDiskCache::SharedDiskCache() :
     diskCache->setCacheDirectory(cacheDirectory);
     diskCache->setMaximumCacheSize(SharedDiskCache::s_diskCacheSize);
     m_diskCache = diskCache;
+
+    // Not inside the cache directory, because QNetworkDiskCache counts and expires files in its subdirs too
+    QNetworkDiskCache *renderedNoteCache = new QNetworkDiskCache(this);
+    renderedNoteCache->setCacheDirectory(cacheDirectory % "-RenderedNotes");
+    renderedNoteCache->setMaximumCacheSize(RENDERED_NOTE_CACHE_SIZE);
+    m_renderedNoteCache = renderedNoteCache;
 }
 
 void SharedDiskCache::setMaximumCacheSize(qint64 capacity)
@@ -156,6 +166,7 @@ void SharedDiskCache::clear()
     QMutexLocker mutexLocker(&m_mutex);
     Q_UNUSED(mutexLocker);
     m_diskCache->clear();
+    m_renderedNoteCache->clear();
 }
 
 // for note contents
@@ -312,3 +323,81 @@ bool SharedDiskCache::removeEvernoteNoteAttachment(const QString &webApiUrlPrefi
     QUrl attachmentUrl = QUrl(QString("%1res/%2").arg(webApiUrlPrefix).arg(guid));
     return remove(attachmentUrl);
 }
+
+// for rendered notes
+
+static QUrl renderedNoteUrl(const QByteArray &renderKey)
+{
+    return QUrl(QString::fromLatin1("renderednote://notekeeper/" + renderKey.toHex()));
+}
+
+bool SharedDiskCache::insertRenderedNote(const QByteArray &renderKey, const QVariantMap &renderedNote)
+{
+    QByteArray serializedRenderedNote;
+    QDataStream stream(&serializedRenderedNote, QIODevice::WriteOnly);
+    stream.setVersion(QDataStream::Qt_4_7);
+    stream << renderedNote;
+    return writeRenderedNote(renderedNoteUrl(renderKey), serializedRenderedNote);
+}
+
+bool SharedDiskCache::retrieveRenderedNote(const QByteArray &renderKey, QVariantMap *renderedNote)
+{
+    QUrl url = renderedNoteUrl(renderKey);
+    QByteArray serializedRenderedNote;
+    QDateTime lastWrittenTime;
+    {
+        QMutexLocker mutexLocker(&m_mutex);
+        Q_UNUSED(mutexLocker);
+        QNetworkCacheMetaData meta = m_renderedNoteCache->metaData(url);
+        if (!meta.isValid()) {
+            return false;
+        }
+        QScopedPointer<QIODevice> cacheAccessDevice(m_renderedNoteCache->data(url));
+        if (cacheAccessDevice.isNull() || !cacheAccessDevice->isOpen()) {
+            m_renderedNoteCache->remove(url);
+            return false;
+        }
+        serializedRenderedNote = cacheAccessDevice->readAll();
+        lastWrittenTime = meta.lastModified();
+    }
+
+    QVariantMap map;
+    QDataStream stream(serializedRenderedNote);
+    stream.setVersion(QDataStream::Qt_4_7);
+    stream >> map;
+    if (stream.status() != QDataStream::Ok) {
+        QMutexLocker mutexLocker(&m_mutex);
+        Q_UNUSED(mutexLocker);
+        m_renderedNoteCache->remove(url);
+        return false;
+    }
+
+    // The cache pushes out the entries written earliest, so an entry is written again when it's used, to keep the
+    // recently viewed notes in the cache. But not more than once in a while, to not rewrite a note each time it's opened.
+    if (!lastWrittenTime.isValid() || lastWrittenTime.secsTo(QDateTime::currentDateTime()) > RENDERED_NOTE_REWRITE_INTERVAL) {
+        writeRenderedNote(url, serializedRenderedNote);
+    }
+
+    if (renderedNote) {
+        (*renderedNote) = map;
+    }
+    return true;
+}
+
+bool SharedDiskCache::writeRenderedNote(const QUrl &url, const QByteArray &serializedRenderedNote)
+{
+    QNetworkCacheMetaData meta;
+    meta.setUrl(url);
+    meta.setLastModified(QDateTime::currentDateTime());
+
+    QMutexLocker mutexLocker(&m_mutex);
+    Q_UNUSED(mutexLocker);
+    QIODevice *cacheSaveDevice = m_renderedNoteCache->prepare(meta);
+    if (!cacheSaveDevice || (cacheSaveDevice && !cacheSaveDevice->isOpen())) {
+        m_renderedNoteCache->remove(url);
+        return false;
+    }
+    cacheSaveDevice->write(serializedRenderedNote);
+    m_renderedNoteCache->insert(cacheSaveDevice); // the cache owns the QIODevice* now
+    return true;
+}
@@ -30,8 +30,9 @@
 #include <QAbstractNetworkCache>
 #include <QMutex>
 #include <QFile>
+#include <QVariantMap>
 
-// A disk cache to store note contents and note attachments
+// A disk cache to store note contents and note attachments, and notes as rendered for viewing
 // Thread-safe, Singleton
 
 class SharedDiskCache : public QAbstractNetworkCache
@@ -71,6 +72,11 @@ public:
     bool retrieveEvernoteNoteAttachment(const QString &webApiUrlPrefix, const QString &guid, QFile *target, qint64 size);
     bool removeEvernoteNoteAttachment(const QString &webApiUrlPrefix, const QString &guid);
 
+    // for rendered notes, keyed by a hash of everything the rendering depends on.
+    // Kept apart from the other cached data, so that they don't push out note contents.
+    bool insertRenderedNote(const QByteArray &renderKey, const QVariantMap &renderedNote);
+    bool retrieveRenderedNote(const QByteArray &renderKey, QVariantMap *renderedNote);
+
 private:
     enum CustomCacheAttribute {
         NoteContentMd5Hash = QNetworkRequest::User + 100
@@ -81,8 +87,11 @@ private:
     static qint64 s_diskCacheSize;
     SharedDiskCache();
 
+    bool writeRenderedNote(const QUrl &url, const QByteArray &serializedRenderedNote);
+
     // private data
     QAbstractNetworkCache *m_diskCache;
+    QAbstractNetworkCache *m_renderedNoteCache;
     QMutex m_mutex;
 };
 
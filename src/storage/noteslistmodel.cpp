@@ -27,6 +27,9 @@
 #include "noteslistmodel.h"
 #include <QMutexLocker>
 #include <QDate>
+#include <QTextDocument>
+#include <QStringBuilder>
+#include "searchindex.h"
 
 NotesListModel::NotesListModel(StorageManager *storageManager, QObject *parent)
     : QAbstractListModel(parent)
@@ -43,7 +46,8 @@ NotesListModel::NotesListModel(StorageManager *storageManager, QObject *parent)
 
 void NotesListModel::setNotesListQuery(StorageConstants::NotesListType type, const QString &queryString)
 {
-    if (m_notesListType != type || m_notesListQueryString != queryString) {
+    // The matching notes of a saved search get refreshed without signals for each note, so they're always reloaded
+    if (m_notesListType != type || m_notesListQueryString != queryString || type == StorageConstants::SavedSearchNotes) {
         disconnectTypeDependantSlots();
         m_notesListType = type;
         m_notesListQueryString = queryString;
@@ -57,6 +61,14 @@ void NotesListModel::clearNotesListQuery()
     clear();
     m_notesListType = StorageConstants::NoNotes;
     m_notesListQueryString = "";
+    setSnippetWords(QStringList());
+}
+
+void NotesListModel::setSnippetWords(const QStringList &words)
+{
+    QMutexLocker mutexLocker(&m_mutex);
+    Q_UNUSED(mutexLocker);
+    m_snippetWords = words;
 }
 
 void NotesListModel::load()
@@ -70,6 +82,7 @@ void NotesListModel::load()
     }
     m_mutex.lock();
     m_noteIdsList.clear();
+    m_noteIds.clear();
     m_mutex.unlock();
     if (beginRemoveCalled) {
         endRemoveRows();
@@ -88,7 +101,8 @@ void NotesListModel::load()
             return;
         }
         newIdsList = m_storageManager->listNoteIds(m_notesListType, m_notesListQueryString);
-    } else if (m_notesListType == StorageConstants::NotesWithTag) {
+    } else if (m_notesListType == StorageConstants::NotesWithTag ||
+               m_notesListType == StorageConstants::SavedSearchNotes) {
         if (m_notesListQueryString.isEmpty()) {
             return;
         }
@@ -123,6 +137,7 @@ void NotesListModel::load()
     }
     m_mutex.lock();
     m_noteIdsList = updatedNoteIdsList;
+    m_noteIds = updatedNoteIdsList.toSet();
     m_mutex.unlock();
     if (beginInsertCalled) {
         endInsertRows();
@@ -134,17 +149,16 @@ int NotesListModel::appendNoteIds(const QStringList &_noteIds)
 {
     bool beginInsertCalled = false;
     int noteCountAfterAppending = 0;
-    QStringList noteIds = _noteIds;
+    QStringList noteIds;
+    noteIds.reserve(_noteIds.count());
     // remove duplicate noteIds
     m_mutex.lock();
     int currentNoteCount = m_noteIdsList.count();
-    if (currentNoteCount > 0) {
-        QMutableStringListIterator iter(noteIds);
-        while (iter.hasNext()) {
-            QString noteId = iter.next();
-            if (m_noteIdsList.contains(noteId)) {
-                iter.remove();
-            }
+    QSet<QString> appendedNoteIds;
+    foreach (const QString &noteId, _noteIds) {
+        if (!m_noteIds.contains(noteId) && !appendedNoteIds.contains(noteId)) {
+            appendedNoteIds.insert(noteId);
+            noteIds << noteId;
         }
     }
     m_mutex.unlock();
@@ -155,6 +169,7 @@ int NotesListModel::appendNoteIds(const QStringList &_noteIds)
     }
     m_mutex.lock();
     m_noteIdsList << noteIds;
+    m_noteIds += appendedNoteIds;
     noteCountAfterAppending = m_noteIdsList.count();
     m_mutex.unlock();
     if (beginInsertCalled) {
@@ -174,6 +189,7 @@ void NotesListModel::clear()
     }
     m_mutex.lock();
     m_noteIdsList.clear();
+    m_noteIds.clear();
     m_mutex.unlock();
     if (beginRemoveCalled) {
         endRemoveRows();
@@ -199,7 +215,9 @@ QVariantMap NotesListModel::get(int index) const
     QMutexLocker mutexLocker(&m_mutex);
     Q_UNUSED(mutexLocker);
     QString noteId = m_noteIdsList.at(index);
-    QVariantMap dataMap = m_storageManager->noteSummaryData(noteId);
+    QString snippet = contentSnippet(noteId);
+    QVariantMap dataMap = m_storageManager->noteSummaryData(noteId, snippet.isEmpty() /* isContentSummaryNeeded */);
+    dataMap.insert(QString("ContentSnippet"), snippet);
     QString timestampSection = timestampSectionName(dataMap.value(QString("Timestamp")).toDateTime());
     dataMap.insert(QString("TimestampSectionName"), timestampSection);
     return dataMap;
@@ -213,6 +231,29 @@ QVariant NotesListModel::data(const QModelIndex &index, int role) const
     return QVariant();
 }
 
+// Should be called with m_mutex locked
+QString NotesListModel::contentSnippet(const QString &noteId) const
+{
+    if (m_snippetWords.isEmpty()) {
+        return QString("");
+    }
+    QString text;
+    QList<QPair<int, int> > highlightRanges;
+    if (!m_storageManager->searchIndex()->snippet(noteId, m_snippetWords, &text, &highlightRanges)) {
+        return QString("");
+    }
+    QString html;
+    int pos = 0;
+    for (int i = 0; i < highlightRanges.count(); i++) {
+        const QPair<int, int> &range = highlightRanges.at(i);
+        html += Qt::escape(text.mid(pos, range.first - pos)) % QLatin1String("<b>") %
+                Qt::escape(text.mid(range.first, range.second - range.first)) % QLatin1String("</b>");
+        pos = range.second;
+    }
+    html += Qt::escape(text.mid(pos));
+    return html;
+}
+
 QString NotesListModel::timestampSectionName(const QDateTime &noteTimestamp) const
 {
     int numOfDaysOld = noteTimestamp.daysTo(m_currentDate);
@@ -286,6 +327,7 @@ void NotesListModel::insertNote(const QString &noteId)
     beginInsertRows(QModelIndex(), insertionPos, insertionPos);
     m_mutex.lock();
     m_noteIdsList.insert(insertionPos, noteId);
+    m_noteIds.insert(noteId);
     m_mutex.unlock();
     endInsertRows();
     emit noteCountChanged();
@@ -295,6 +337,7 @@ void NotesListModel::removeNoteAt(int pos)
 {
     beginRemoveRows(QModelIndex(), pos, pos);
     m_mutex.lock();
+    m_noteIds.remove(m_noteIdsList.at(pos));
     m_noteIdsList.removeAt(pos);
     m_mutex.unlock();
     endRemoveRows();
@@ -309,7 +352,7 @@ void NotesListModel::noteCreated(const QString &noteId)
     if (m_notesListType != StorageConstants::AllNotes) {
         return;
     }
-    if (m_noteIdsList.contains(noteId)) {
+    if (m_noteIds.contains(noteId)) {
         return;
     }
     insertNote(noteId);
@@ -31,6 +31,7 @@
 #include <QMutex>
 #include <QDateTime>
 #include <QTimer>
+#include <QSet>
 #include "storage/storagemanager.h"
 
 class NotesListModel : public QAbstractListModel
@@ -42,6 +43,9 @@ public:
     void setNotesListQuery(StorageConstants::NotesListType type, const QString &queryString);
     void clearNotesListQuery();
     int appendNoteIds(const QStringList &noteIds); // returns the total number of noteIds after appending
+    // For search results: the words, as for SearchIndex::snippet(), to show a snippet of each note around.
+    // Notes with a snippet get it as "ContentSnippet", with the words in bold, in place of the content summary.
+    void setSnippetWords(const QStringList &words);
     Q_INVOKABLE void clear();
     int noteCount() const;
 
@@ -71,11 +75,14 @@ private:
     void insertNote(const QString &noteId);
     void removeNoteAt(int pos);
     QString timestampSectionName(const QDateTime &noteTimestamp) const;
+    QString contentSnippet(const QString &noteId) const;
 
     StorageManager *m_storageManager;
     StorageConstants::NotesListType m_notesListType;
     QString m_notesListQueryString;
     QStringList m_noteIdsList;
+    QSet<QString> m_noteIds; // the same notes as in m_noteIdsList, for quick lookups
+    QStringList m_snippetWords;
 
     QDateTime m_currentDate; // kept up-to-date even if the app remains running for >1 day
     QTimer m_refreshCurrentDateTimer;
@@ -0,0 +1,1441 @@
+/*
+  This file is part of Notekeeper Open and is licensed under the MIT License
+
+  Copyright (C) 2011-2015 Roopesh Chander <roop@roopc.net>
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject
+  to the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+  BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+  ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+  CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+
+#include "searchindex.h"
+#include "storagemanager.h"
+#include "crypto/encryptedfile.h"
+#include "cloud/evernote/evernotesync/evernotemarkup.h"
+#include <QFile>
+#include <QFileInfo>
+#include <QDataStream>
+#include <QScopedPointer>
+#include <QStringBuilder>
+#include <QReadLocker>
+#include <QWriteLocker>
+#include <QMutexLocker>
+#include <QtAlgorithms>
+#include <QMap>
+#include <QThread>
+#include <QtConcurrentRun>
+#include <QDateTime>
+#include <qmath.h>
+
+#define SEARCH_INDEX_MAGIC 0x4e4b5349 // "NKSI"
+#define SEARCH_INDEX_FORMAT_VERSION 7 // also changes when normalizedWord() or SearchTokenizer changes
+#define SAVE_AFTER_CHANGES_COUNT 32   // saving rewrites the whole index, so we don't save after every change
+#define MIN_NOTES_PER_PARTITION 8     // reading fewer notes than this isn't worth another thread
+#define SNIPPET_WORD_COUNT 16         // words in a search result's snippet
+#define SNIPPET_LEADING_WORD_COUNT 3  // words in the snippet before the first matching word
+#define MIN_SAVED_DOCUMENT_SIZE (4 + 1 + 4 + 4 + 8 + 8 + 4) // bytes a document takes in the index file, at the least
+
+#define DOCUMENT_CONTENT_INDEXED 0x1
+#define DOCUMENT_HAS_CHECKED_TODO 0x2
+#define DOCUMENT_HAS_UNCHECKED_TODO 0x4
+
+// Relevance ranking
+#define BM25_K1 1.2
+#define BM25_B 0.75
+#define TITLE_WORD_WEIGHT 3               // a word in the title counts as much as this many in the content
+#define RECENCY_BOOST 0.5                 // a note updated just now scores this fraction higher
+#define RECENCY_HALF_LIFE_DAYS 90.0
+
+// Similar words
+#define MIN_SIMILAR_WORD_LENGTH 4         // shorter words have too many neighbours to be useful
+#define LONG_WORD_LENGTH 8                // longer words can have two typos
+
+// #define DEBUG
+
+#ifdef DEBUG
+#include <QDebug>
+#include <QTime>
+#endif
+
+static void appendVarUInt(QByteArray *data, quint32 value)
+{
+    while (value >= 0x80) {
+        data->append(static_cast<char>((value & 0x7f) | 0x80));
+        value >>= 7;
+    }
+    data->append(static_cast<char>(value));
+}
+
+static bool readVarUInt(const QByteArray &data, int *pos, quint32 *value)
+{
+    quint32 result = 0;
+    int shift = 0;
+    while ((*pos) < data.size() && shift < 32) {
+        uchar byte = static_cast<uchar>(data.at(*pos));
+        (*pos)++;
+        result |= (static_cast<quint32>(byte & 0x7f) << shift);
+        if ((byte & 0x80) == 0) {
+            (*value) = result;
+            return true;
+        }
+        shift += 7;
+    }
+    return false;
+}
+
+SearchIndex::SearchIndex(StorageManager *storageManager, const QString &indexDirPath, SearchTokenizer::Options tokenizerOptions)
+    : m_storageManager(storageManager)
+    , m_tokenizer(tokenizerOptions)
+    , m_indexFilePath(indexDirPath % QLatin1String("/searchindex.dat"))
+    , m_journalFilePath(indexDirPath % QLatin1String("/searchindex.journal"))
+    , m_isLoaded(false)
+    , m_removedDocumentCount(0)
+    , m_totalDocumentLength(0)
+    , m_changesSinceSave(0)
+    , m_areTermTrigramsBuilt(false)
+    , m_areDocumentTimesSorted(false)
+{
+}
+
+SearchIndex::~SearchIndex()
+{
+    // Unsaved changes are in the journal, and get reindexed on next use
+}
+
+QString SearchIndex::normalizedWord(const QString &word)
+{
+    const QChar *chars = word.constData();
+    const int length = word.length();
+    bool isAscii = true;
+    for (int i = 0; i < length; i++) {
+        if (chars[i].unicode() >= 0x80) {
+            isAscii = false;
+            break;
+        }
+    }
+    if (isAscii) {
+        // Most words; these need no decomposition
+        QString normalized(length, Qt::Uninitialized);
+        QChar *normalizedChars = normalized.data();
+        int normalizedLength = 0;
+        for (int i = 0; i < length; i++) {
+            ushort c = chars[i].unicode();
+            if (c == ' ' || (c >= '\t' && c <= '\r')) {
+                continue;
+            }
+            normalizedChars[normalizedLength++] = QChar((c >= 'A' && c <= 'Z')? (c + ('a' - 'A')) : c);
+        }
+        normalized.truncate(normalizedLength);
+        return normalized;
+    }
+    QString decomposed = word.normalized(QString::NormalizationForm_KD).toCaseFolded();
+    QString normalized;
+    normalized.reserve(decomposed.length());
+    for (int i = 0; i < decomposed.length(); i++) {
+        const QChar c = decomposed.at(i);
+        QChar::Category category = c.category();
+        if (category == QChar::Mark_NonSpacing || category == QChar::Mark_SpacingCombining ||
+            category == QChar::Mark_Enclosing || c.isSpace()) {
+            continue;
+        }
+        normalized.append(c);
+    }
+    return normalized;
+}
+
+void SearchIndex::markNoteChanged(const QString &noteId)
+{
+    if (noteId.isEmpty()) {
+        return;
+    }
+    QMutexLocker locker(&m_changedNotesLock);
+    if (!m_changedNoteIds.contains(noteId)) {
+        m_changedNoteIds.insert(noteId);
+        appendToJournal(noteId);
+    }
+}
+
+int SearchIndex::pendingNoteCount(const QSet<QString> *noteIds)
+{
+    ensureLoaded();
+    QMutexLocker locker(&m_changedNotesLock);
+    return pendingNoteCountLocked(noteIds);
+}
+
+bool SearchIndex::isNotePending(const QString &noteId)
+{
+    ensureLoaded();
+    QMutexLocker locker(&m_changedNotesLock);
+    return m_changedNoteIds.contains(noteId);
+}
+
+// Should be called with m_changedNotesLock locked
+int SearchIndex::pendingNoteCountLocked(const QSet<QString> *noteIds) const
+{
+    if (!noteIds) {
+        return m_changedNoteIds.count();
+    }
+    int count = 0;
+    foreach (const QString &noteId, (*noteIds)) {
+        if (m_changedNoteIds.contains(noteId)) {
+            count++;
+        }
+    }
+    return count;
+}
+
+int SearchIndex::refresh(int maxNoteCount, const volatile bool *cancelled, const QSet<QString> *onlyNoteIds)
+{
+    QMutexLocker refreshLocker(&m_refreshLock);
+    ensureLoaded();
+
+    QStringList noteIds;
+    {
+        QMutexLocker locker(&m_changedNotesLock);
+        if (onlyNoteIds) {
+            QSet<QString>::const_iterator it = onlyNoteIds->constBegin();
+            while (it != onlyNoteIds->constEnd() && (maxNoteCount < 0 || noteIds.count() < maxNoteCount)) {
+                if (m_changedNoteIds.remove(*it)) {
+                    noteIds << (*it);
+                }
+                ++it;
+            }
+        } else {
+            QSet<QString>::iterator it = m_changedNoteIds.begin();
+            while (it != m_changedNoteIds.end() && (maxNoteCount < 0 || noteIds.count() < maxNoteCount)) {
+                noteIds << (*it);
+                it = m_changedNoteIds.erase(it);
+            }
+        }
+    }
+
+    // Read and tokenize the notes in parallel, without blocking the readers of the index
+    int partitionCount = qMax(1, qMin(QThread::idealThreadCount(), noteIds.count() / MIN_NOTES_PER_PARTITION));
+    QList<QFuture<QList<DocumentTerms> > > partitions;
+    for (int i = 0; i < partitionCount; i++) {
+        int start = noteIds.count() * i / partitionCount;
+        int end = noteIds.count() * (i + 1) / partitionCount;
+        partitions << QtConcurrent::run(this, &SearchIndex::documentTermsForNotes, noteIds.mid(start, end - start), cancelled);
+    }
+    QList<DocumentTerms> documents;
+    for (int i = 0; i < partitions.count(); i++) {
+        documents += partitions[i].result();
+    }
+    if (documents.count() < noteIds.count()) {
+        // Cancelled midway. The notes we didn't get to are still in the journal.
+        QSet<QString> unreadNoteIds = noteIds.toSet();
+        foreach (const DocumentTerms &document, documents) {
+            unreadNoteIds.remove(document.noteId);
+        }
+        QMutexLocker locker(&m_changedNotesLock);
+        m_changedNoteIds += unreadNoteIds;
+    }
+
+    QWriteLocker locker(&m_lock);
+    foreach (const DocumentTerms &document, documents) {
+        removeDocument(document.noteId);
+        if (document.exists) {
+            addDocument(document);
+        }
+    }
+    mergeNewTerms();
+    m_changesSinceSave += documents.count();
+    int pendingCount;
+    {
+        QMutexLocker changedNotesLocker(&m_changedNotesLock);
+        pendingCount = pendingNoteCountLocked(onlyNoteIds);
+    }
+    if (pendingCount == 0 && m_changesSinceSave >= SAVE_AFTER_CHANGES_COUNT) {
+        save();
+    }
+    return pendingCount;
+}
+
+// Runs in a thread-pool thread. Reads the notes in order, stopping early if cancelled.
+QList<SearchIndex::DocumentTerms> SearchIndex::documentTermsForNotes(const QStringList &noteIds, const volatile bool *cancelled) const
+{
+    QList<DocumentTerms> documents;
+    foreach (const QString &noteId, noteIds) {
+        if (cancelled && (*cancelled)) {
+            break;
+        }
+        QString title;
+        QByteArray content;
+        bool isContentAvailable = false;
+        DocumentTerms document;
+        document.noteId = noteId;
+        QVariantMap metadata;
+        document.exists = m_storageManager->searchableNoteData(noteId, &title, &content, &isContentAvailable, &metadata);
+        document.createdTime = metadata.value("CreatedTime").toLongLong();
+        document.updatedTime = metadata.value("UpdatedTime").toLongLong();
+        document.hasCheckedTodo = false;
+        document.hasUncheckedTodo = false;
+        foreach (const QString &mimeType, metadata.value("AttachmentMimeTypes").toStringList()) {
+            document.attributes << (QLatin1String("resource:") + mimeType.toLower());
+        }
+        QString source = metadata.value("Source").toString();
+        if (!source.isEmpty()) {
+            document.attributes << (QLatin1String("source:") + source.toLower());
+        }
+        document.isContentIndexed = (document.exists && isContentAvailable);
+        document.titleLength = 0;
+        document.length = 0;
+        if (document.exists) {
+            // Words are numbered in the order a phrase search sees them: the title followed by the content
+            quint32 position = 0;
+            foreach (const QString &word, EvernoteMarkup::plainTextWordsFromEnml(title, QByteArray(), m_tokenizer)) {
+                TermOccurrences &occurrences = document.terms[word];
+                occurrences.fields |= TitleField;
+                occurrences.positions << position++;
+            }
+            document.titleLength = position;
+            // The plain text is stored for showing snippets of it in search results
+            QString plainText;
+            QVector<QPair<int, int> > wordRanges;
+            if (isContentAvailable && !content.isEmpty()) {
+                int checkedTodoCount = 0, uncheckedTodoCount = 0;
+                QStringList contentWords = EvernoteMarkup::plainTextWordsFromEnml(QString(), content, m_tokenizer, &checkedTodoCount, &uncheckedTodoCount,
+                                                                                  &plainText, &wordRanges);
+                document.hasCheckedTodo = (checkedTodoCount > 0);
+                document.hasUncheckedTodo = (uncheckedTodoCount > 0);
+                foreach (const QString &word, contentWords) {
+                    TermOccurrences &occurrences = document.terms[word];
+                    occurrences.fields |= ContentField;
+                    occurrences.positions << position++;
+                }
+            }
+            m_storageManager->setNoteSearchText(noteId, plainText, wordRanges);
+            // Text recognized in the attachments counts as content. A position is skipped before each
+            // attachment's text so that a phrase can't run across from one text into another.
+            foreach (const QString &searchText, metadata.value("AttachmentSearchTexts").toStringList()) {
+                position++;
+                foreach (const QString &word, m_tokenizer.words(searchText)) {
+                    TermOccurrences &occurrences = document.terms[word];
+                    occurrences.fields |= ContentField;
+                    occurrences.positions << position++;
+                }
+            }
+            document.length = position;
+        }
+        documents << document;
+    }
+    return documents;
+}
+
+QSet<QString> SearchIndex::notesContainingWords(const QStringList &words, bool isLastWordPrefix, Fields fields, bool isMatchingSimilarWords)
+{
+    if (words.isEmpty()) {
+        return QSet<QString>();
+    }
+    ensureLoaded();
+    QReadLocker locker(&m_lock);
+    QList<QList<const Postings*> > wordPostings;
+    return noteIdsForDocuments(documentsHavingAllWords(words, isLastWordPrefix, fields, isMatchingSimilarWords, &wordPostings));
+}
+
+QSet<QString> SearchIndex::notesContainingPhrase(const QStringList &words, bool isLastWordPrefix, Fields fields, bool isMatchingSimilarWords)
+{
+    if (words.isEmpty()) {
+        return QSet<QString>();
+    }
+    ensureLoaded();
+    QReadLocker locker(&m_lock);
+    QList<QList<const Postings*> > wordPostings;
+    QVector<int> candidateDocuments = documentsHavingAllWords(words, isLastWordPrefix, fields, isMatchingSimilarWords, &wordPostings);
+    if (words.count() == 1) {
+        return noteIdsForDocuments(candidateDocuments);
+    }
+
+    // Of the documents having all the words, find those that have the words one after the other
+    bool isTitleOnly = !(fields & ContentField);
+    bool isContentOnly = !(fields & TitleField);
+    QVector<int> matchingDocuments;
+    foreach (int documentNumber, candidateDocuments) {
+        quint32 titleLength = m_documentTitleLengths.at(documentNumber);
+        QList<QVector<quint32> > wordPositions;
+        for (int i = 0; i < wordPostings.count(); i++) {
+            wordPositions << positionsInDocument(wordPostings.at(i), documentNumber);
+        }
+        // Walk the positions of the first word, looking up the positions the other words should be at
+        QVector<int> cursors(wordPositions.count(), 0);
+        bool isPhraseFound = false;
+        foreach (quint32 startPosition, wordPositions.first()) {
+            if (isContentOnly && startPosition < titleLength) {
+                continue;
+            }
+            if (isTitleOnly && (startPosition + words.count() > titleLength)) {
+                break;
+            }
+            bool isMatching = true;
+            for (int i = 1; i < wordPositions.count() && isMatching; i++) {
+                const QVector<quint32> &positions = wordPositions.at(i);
+                int &cursor = cursors[i];
+                quint32 expectedPosition = startPosition + i;
+                while (cursor < positions.size() && positions.at(cursor) < expectedPosition) {
+                    cursor++;
+                }
+                isMatching = (cursor < positions.size() && positions.at(cursor) == expectedPosition);
+            }
+            if (isMatching) {
+                isPhraseFound = true;
+                break;
+            }
+        }
+        if (isPhraseFound) {
+            matchingDocuments << documentNumber;
+        }
+    }
+    return noteIdsForDocuments(matchingDocuments);
+}
+
+bool SearchIndex::snippet(const QString &noteId, const QStringList &words, QString *text, QList<QPair<int, int> > *highlightRanges)
+{
+    if (words.isEmpty()) {
+        return false;
+    }
+    QVector<QPair<quint32, int> > occurrences; // (content word number, index of the word)
+    {
+        QReadLocker locker(&m_lock);
+        if (!m_isLoaded) {
+            return false; // we shouldn't keep the caller waiting while we load
+        }
+        int documentNumber = m_documentNumbers.value(noteId, -1);
+        if (documentNumber < 0 || !(m_documentFlags.at(documentNumber) & DOCUMENT_CONTENT_INDEXED)) {
+            return false;
+        }
+        const quint32 titleLength = m_documentTitleLengths.at(documentNumber);
+        for (int i = 0; i < words.count(); i++) {
+            const QString &word = words.at(i);
+            bool isPrefix = word.endsWith('*');
+            QString term = (isPrefix? word.left(word.length() - 1) : word);
+            if (term.isEmpty()) {
+                continue;
+            }
+            foreach (quint32 position, positionsInDocument(postingsForTerm(term, isPrefix), documentNumber)) {
+                if (position >= titleLength) {
+                    occurrences << qMakePair(position - titleLength, i);
+                }
+            }
+        }
+    }
+    if (occurrences.isEmpty()) {
+        return false;
+    }
+    qSort(occurrences);
+
+    // Slide a window over the occurrences, looking for the one with the most of the different words.
+    // The earliest such window wins.
+    const int windowLength = (SNIPPET_WORD_COUNT - SNIPPET_LEADING_WORD_COUNT);
+    QVector<int> windowWordCounts(words.count(), 0);
+    int windowStart = 0, windowDistinctCount = 0;
+    int bestWindowStart = 0, bestDistinctCount = 0;
+    for (int i = 0; i < occurrences.size(); i++) {
+        if (windowWordCounts[occurrences.at(i).second]++ == 0) {
+            windowDistinctCount++;
+        }
+        while (occurrences.at(i).first - occurrences.at(windowStart).first >= static_cast<quint32>(windowLength)) {
+            if (--windowWordCounts[occurrences.at(windowStart).second] == 0) {
+                windowDistinctCount--;
+            }
+            windowStart++;
+        }
+        if (windowDistinctCount > bestDistinctCount) {
+            bestDistinctCount = windowDistinctCount;
+            bestWindowStart = windowStart;
+        }
+    }
+    const quint32 firstMatchingWord = occurrences.at(bestWindowStart).first;
+    const quint32 firstWord = (firstMatchingWord > SNIPPET_LEADING_WORD_COUNT? firstMatchingWord - SNIPPET_LEADING_WORD_COUNT : 0);
+    const quint32 lastWord = firstWord + SNIPPET_WORD_COUNT - 1;
+
+    QString excerpt;
+    QVector<QPair<int, int> > wordRanges;
+    int wordCount = 0;
+    if (!m_storageManager->noteSearchTextExcerpt(noteId, firstWord, lastWord, &excerpt, &wordRanges, &wordCount)) {
+        return false; // the words matched text recognized in attachments, or the note is being reindexed
+    }
+    const QString ellipsis(QChar(0x2026));
+    const int offset = (firstWord > 0? ellipsis.length() : 0);
+    (*text) = ((firstWord > 0? ellipsis : QString()) + excerpt +
+               (static_cast<int>(firstWord) + wordRanges.size() < wordCount? ellipsis : QString()));
+    highlightRanges->clear();
+    quint32 previousPosition = 0;
+    for (int i = 0; i < occurrences.size(); i++) {
+        const quint32 position = occurrences.at(i).first;
+        if (position < firstWord || position >= firstWord + wordRanges.size() || (i > 0 && position == previousPosition)) {
+            continue;
+        }
+        const QPair<int, int> &range = wordRanges.at(position - firstWord);
+        highlightRanges->append(qMakePair(range.first + offset, range.second + offset));
+        previousPosition = position;
+    }
+    return true;
+}
+
+bool SearchIndex::isContentIndexed(const QString &noteId)
+{
+    ensureLoaded();
+    QReadLocker locker(&m_lock);
+    int documentNumber = m_documentNumbers.value(noteId, -1);
+    if (documentNumber < 0) {
+        return false;
+    }
+    return ((m_documentFlags.at(documentNumber) & DOCUMENT_CONTENT_INDEXED) != 0);
+}
+
+SearchIndex::Statistics SearchIndex::statistics()
+{
+    ensureLoaded();
+    QReadLocker locker(&m_lock);
+    Statistics stats;
+    stats.noteCount = m_documentNumbers.count();
+    stats.termCount = m_postings.count();
+    stats.postingCount = 0;
+    stats.positionCount = 0;
+    QHash<QString, Postings>::const_iterator it;
+    for (it = m_postings.constBegin(); it != m_postings.constEnd(); ++it) {
+        stats.postingCount += it.value().entries.size();
+        stats.positionCount += it.value().positions.size();
+    }
+    stats.trigramEntryCount = 0;
+    {
+        QMutexLocker trigramsLocker(&m_termTrigramsLock);
+        QHash<quint64, QVector<QString> >::const_iterator trigramIter;
+        for (trigramIter = m_termTrigrams.constBegin(); trigramIter != m_termTrigrams.constEnd(); ++trigramIter) {
+            stats.trigramEntryCount += trigramIter.value().size();
+        }
+    }
+    stats.diskSize = QFileInfo(m_indexFilePath).size() + QFileInfo(m_journalFilePath).size();
+    return stats;
+}
+
+// Returns the postings of the word, stemmed like the notes, or of all the terms starting with it, if isPrefix.
+// A prefix isn't stemmed, because stemming would change what was typed (and disagree with termsWithPrefix()).
+QList<const SearchIndex::Postings*> SearchIndex::postingsForTerm(const QString &word, bool isPrefix, bool isMatchingSimilarWords) const
+{
+    const QString term = (isPrefix? word : m_tokenizer.stemmed(word));
+    QList<const Postings*> postingsList;
+    if (!isPrefix) {
+        QHash<QString, Postings>::const_iterator it = m_postings.constFind(term);
+        if (it != m_postings.constEnd()) {
+            postingsList << &it.value();
+        }
+        if (isMatchingSimilarWords) {
+            foreach (const QString &similarTerm, similarTermsLocked(term)) {
+                QHash<QString, Postings>::const_iterator similarIter = m_postings.constFind(similarTerm);
+                if (similarIter != m_postings.constEnd()) {
+                    postingsList << &similarIter.value();
+                }
+            }
+        }
+        return postingsList;
+    }
+    QVector<QString>::const_iterator it = qLowerBound(m_sortedTerms.constBegin(), m_sortedTerms.constEnd(), term);
+    for (; it != m_sortedTerms.constEnd() && it->startsWith(term); ++it) {
+        QHash<QString, Postings>::const_iterator postingsIter = m_postings.constFind(*it);
+        if (postingsIter != m_postings.constEnd()) {
+            postingsList << &postingsIter.value();
+        }
+    }
+    return postingsList;
+}
+
+// The trigrams of a word, with the start and end marked so that they count too.
+// An edit to a word changes at most 3 of its trigrams.
+static QSet<quint64> trigrams(const QString &word)
+{
+    QSet<quint64> trigramSet;
+    const ushort marker = 0;
+    const int paddedLength = word.length() + 3;
+    for (int i = 0; i + 3 <= paddedLength; i++) {
+        quint64 trigram = 0;
+        for (int j = i; j < i + 3; j++) {
+            ushort c = ((j < 2 || j >= word.length() + 2)? marker : word.at(j - 2).unicode());
+            trigram = ((trigram << 16) | c);
+        }
+        trigramSet.insert(trigram);
+    }
+    return trigramSet;
+}
+
+// Optimal string alignment distance (adjacent transpositions count as one edit),
+// giving up with maxDistance + 1 once the distance is sure to exceed maxDistance
+static int boundedEditDistance(const QString &a, const QString &b, int maxDistance)
+{
+    if (qAbs(a.length() - b.length()) > maxDistance) {
+        return maxDistance + 1;
+    }
+    QVector<int> previousPreviousRow(b.length() + 1), previousRow(b.length() + 1), row(b.length() + 1);
+    for (int j = 0; j <= b.length(); j++) {
+        previousRow[j] = j;
+    }
+    for (int i = 1; i <= a.length(); i++) {
+        row[0] = i;
+        int rowMinimum = row[0];
+        for (int j = 1; j <= b.length(); j++) {
+            int cost = (a.at(i - 1) == b.at(j - 1)? 0 : 1);
+            row[j] = qMin(qMin(previousRow[j] + 1, row[j - 1] + 1), previousRow[j - 1] + cost);
+            if (i > 1 && j > 1 && a.at(i - 1) == b.at(j - 2) && a.at(i - 2) == b.at(j - 1)) {
+                row[j] = qMin(row[j], previousPreviousRow[j - 2] + 1);
+            }
+            rowMinimum = qMin(rowMinimum, row[j]);
+        }
+        if (rowMinimum > maxDistance) {
+            return maxDistance + 1;
+        }
+        previousPreviousRow = previousRow;
+        previousRow = row;
+    }
+    return qMin(previousRow[b.length()], maxDistance + 1);
+}
+
+QStringList SearchIndex::similarTerms(const QString &word)
+{
+    ensureLoaded();
+    QReadLocker locker(&m_lock);
+    return similarTermsLocked(word);
+}
+
+// Should be called with m_lock locked
+QStringList SearchIndex::similarTermsLocked(const QString &word) const
+{
+    QStringList similar;
+    if (word.length() < MIN_SIMILAR_WORD_LENGTH) {
+        return similar;
+    }
+    const int maxDistance = (word.length() >= LONG_WORD_LENGTH? 2 : 1);
+    QSet<quint64> wordTrigrams = trigrams(word);
+    const int minSharedTrigramCount = qMax(1, wordTrigrams.count() - 3 * maxDistance);
+
+    // Candidates are the terms sharing enough trigrams with the word
+    QHash<QString, int> sharedTrigramCounts;
+    {
+        QMutexLocker trigramsLocker(&m_termTrigramsLock);
+        if (!m_areTermTrigramsBuilt) {
+            buildTermTrigrams();
+        }
+        foreach (quint64 trigram, wordTrigrams) {
+            QHash<quint64, QVector<QString> >::const_iterator it = m_termTrigrams.constFind(trigram);
+            if (it == m_termTrigrams.constEnd()) {
+                continue;
+            }
+            foreach (const QString &term, it.value()) {
+                if (qAbs(term.length() - word.length()) <= maxDistance) {
+                    sharedTrigramCounts[term]++;
+                }
+            }
+        }
+    }
+    QHash<QString, int>::const_iterator it;
+    for (it = sharedTrigramCounts.constBegin(); it != sharedTrigramCounts.constEnd(); ++it) {
+        if (it.value() >= minSharedTrigramCount && it.key() != word &&
+            boundedEditDistance(word, it.key(), maxDistance) <= maxDistance) {
+            similar << it.key();
+        }
+    }
+    return similar;
+}
+
+// Should be called with m_termTrigramsLock locked, and m_lock locked for reading, or with m_lock locked for writing
+void SearchIndex::buildTermTrigrams() const
+{
+#ifdef DEBUG
+    QTime time;
+    time.start();
+#endif
+    m_termTrigrams.clear();
+    foreach (const QString &term, m_sortedTerms) {
+        addTermTrigrams(term);
+    }
+    m_areTermTrigramsBuilt = true;
+#ifdef DEBUG
+    qDebug() << "SearchIndex: Built trigrams of" << m_sortedTerms.size() << "terms in" << time.elapsed() << "ms";
+#endif
+}
+
+void SearchIndex::addTermTrigrams(const QString &term) const
+{
+    if (term.length() + 2 < MIN_SIMILAR_WORD_LENGTH) {
+        return; // can't be within the edit distance of any word we look up
+    }
+    foreach (quint64 trigram, trigrams(term)) {
+        m_termTrigrams[trigram].append(term);
+    }
+}
+
+QStringList SearchIndex::termsWithPrefix(const QString &prefix, int maxCount)
+{
+    QStringList terms;
+    if (prefix.isEmpty() || maxCount <= 0) {
+        return terms;
+    }
+    QReadLocker locker(&m_lock);
+    if (!m_isLoaded) {
+        return terms; // we shouldn't keep the caller waiting while we load
+    }
+    // Order by the number of documents having the term
+    QMultiMap<int, QString> termsByDocumentCount;
+    QVector<QString>::const_iterator it = qLowerBound(m_sortedTerms.constBegin(), m_sortedTerms.constEnd(), prefix);
+    for (; it != m_sortedTerms.constEnd() && it->startsWith(prefix); ++it) {
+        if ((*it) == prefix) {
+            continue;
+        }
+        termsByDocumentCount.insert(m_postings.value(*it).entries.size(), *it);
+        if (termsByDocumentCount.count() > maxCount) {
+            termsByDocumentCount.erase(termsByDocumentCount.begin());
+        }
+    }
+    QMapIterator<int, QString> iter(termsByDocumentCount);
+    iter.toBack();
+    while (iter.hasPrevious()) {
+        terms << iter.previous().value();
+    }
+    return terms;
+}
+
+QHash<QString, qreal> SearchIndex::relevanceScores(const QStringList &words, const QStringList &noteIds, bool isMatchingSimilarWords)
+{
+    QHash<QString, qreal> scores;
+    scores.reserve(noteIds.count());
+    ensureLoaded();
+    QReadLocker locker(&m_lock);
+    const int liveDocumentCount = m_documentNoteIds.size() - m_removedDocumentCount;
+    if (liveDocumentCount <= 0) {
+        return scores;
+    }
+    const qreal averageLength = qMax(qreal(1), qreal(m_totalDocumentLength) / liveDocumentCount);
+
+    // Rarer words weigh more
+    QList<QList<const Postings*> > wordPostings;
+    QList<qreal> wordWeights;
+    foreach (const QString &word, words) {
+        bool isPrefix = word.endsWith('*');
+        QString term = (isPrefix? word.left(word.length() - 1) : word);
+        if (term.isEmpty()) {
+            continue;
+        }
+        QList<const Postings*> postingsList = postingsForTerm(term, isPrefix, isMatchingSimilarWords);
+        int documentFrequency = 0; // approximate; includes removed documents that aren't compacted yet
+        foreach (const Postings *postings, postingsList) {
+            documentFrequency += postings->entries.size();
+        }
+        if (documentFrequency == 0) {
+            continue;
+        }
+        documentFrequency = qMin(documentFrequency, liveDocumentCount);
+        wordPostings << postingsList;
+        wordWeights << qLn(1 + (liveDocumentCount - documentFrequency + 0.5) / (documentFrequency + 0.5));
+    }
+
+    const qint64 now = QDateTime::currentMSecsSinceEpoch();
+    foreach (const QString &noteId, noteIds) {
+        int documentNumber = m_documentNumbers.value(noteId, -1);
+        if (documentNumber < 0) {
+            scores.insert(noteId, 0);
+            continue;
+        }
+        const quint32 titleLength = m_documentTitleLengths.at(documentNumber);
+        const qreal lengthNormalization = BM25_K1 * (1 - BM25_B + BM25_B * m_documentLengths.at(documentNumber) / averageLength);
+        qreal score = 0;
+        for (int i = 0; i < wordPostings.count(); i++) {
+            QVector<quint32> positions = positionsInDocument(wordPostings.at(i), documentNumber);
+            if (positions.isEmpty()) {
+                continue;
+            }
+            int titleCount = (qLowerBound(positions.constBegin(), positions.constEnd(), titleLength) - positions.constBegin());
+            qreal termFrequency = (positions.size() - titleCount) + TITLE_WORD_WEIGHT * titleCount;
+            score += wordWeights.at(i) * termFrequency * (BM25_K1 + 1) / (termFrequency + lengthNormalization);
+        }
+        qreal ageInDays = qMax(qint64(0), now - m_documentUpdatedTimes.at(documentNumber)) / (24.0 * 60 * 60 * 1000);
+        score *= (1 + RECENCY_BOOST * qPow(0.5, ageInDays / RECENCY_HALF_LIFE_DAYS));
+        scores.insert(noteId, score);
+    }
+    return scores;
+}
+
+QSet<QString> SearchIndex::notesWithTimeSince(TimeField field, qint64 time)
+{
+    QSet<QString> noteIds;
+    ensureLoaded();
+    QReadLocker locker(&m_lock);
+    QMutexLocker timesLocker(&m_documentTimesLock);
+    if (!m_areDocumentTimesSorted) {
+        sortDocumentTimes();
+    }
+    const QVector<QPair<qint64, int> > &documentsByTime = (field == CreatedTime? m_documentsByCreatedTime : m_documentsByUpdatedTime);
+    QVector<QPair<qint64, int> >::const_iterator it = qLowerBound(documentsByTime.constBegin(), documentsByTime.constEnd(), qMakePair(time, -1));
+    for (; it != documentsByTime.constEnd(); ++it) {
+        const QString &noteId = m_documentNoteIds.at(it->second);
+        if (!noteId.isEmpty()) {
+            noteIds.insert(noteId);
+        }
+    }
+    return noteIds;
+}
+
+// Should be called with m_documentTimesLock locked, and m_lock locked for reading, or with m_lock locked for writing
+void SearchIndex::sortDocumentTimes() const
+{
+    m_documentsByCreatedTime.clear();
+    m_documentsByUpdatedTime.clear();
+    m_documentsByCreatedTime.reserve(m_documentNoteIds.size() - m_removedDocumentCount);
+    m_documentsByUpdatedTime.reserve(m_documentNoteIds.size() - m_removedDocumentCount);
+    for (int i = 0; i < m_documentNoteIds.size(); i++) {
+        if (!m_documentNoteIds.at(i).isEmpty()) {
+            m_documentsByCreatedTime << qMakePair(m_documentCreatedTimes.at(i), i);
+            m_documentsByUpdatedTime << qMakePair(m_documentUpdatedTimes.at(i), i);
+        }
+    }
+    qSort(m_documentsByCreatedTime);
+    qSort(m_documentsByUpdatedTime);
+    m_areDocumentTimesSorted = true;
+}
+
+QSet<QString> SearchIndex::notesWithTodos(TodoState state)
+{
+    quint8 flags = (state == CheckedTodo? DOCUMENT_HAS_CHECKED_TODO :
+                    state == UncheckedTodo? DOCUMENT_HAS_UNCHECKED_TODO :
+                                            (DOCUMENT_HAS_CHECKED_TODO | DOCUMENT_HAS_UNCHECKED_TODO));
+    QSet<QString> noteIds;
+    ensureLoaded();
+    QReadLocker locker(&m_lock);
+    for (int i = 0; i < m_documentFlags.size(); i++) {
+        if ((m_documentFlags.at(i) & flags) && !m_documentNoteIds.at(i).isEmpty()) {
+            noteIds.insert(m_documentNoteIds.at(i));
+        }
+    }
+    return noteIds;
+}
+
+QSet<QString> SearchIndex::notesWithAttribute(const QString &attribute, const QString &value)
+{
+    bool isPrefix = value.endsWith('*');
+    QString key = attribute.toLower() % QLatin1Char(':') % (isPrefix? value.left(value.length() - 1) : value).toLower();
+    QSet<QString> noteIds;
+    ensureLoaded();
+    QReadLocker locker(&m_lock);
+    QMap<QString, QVector<int> >::const_iterator it = m_attributeDocuments.lowerBound(key);
+    for (; it != m_attributeDocuments.constEnd() && (isPrefix? it.key().startsWith(key) : it.key() == key); ++it) {
+        foreach (int documentNumber, it.value()) {
+            const QString &noteId = m_documentNoteIds.at(documentNumber);
+            if (!noteId.isEmpty()) {
+                noteIds.insert(noteId);
+            }
+        }
+    }
+    return noteIds;
+}
+
+// Should be called with m_lock locked for writing
+void SearchIndex::indexDocumentAttributes(int documentNumber)
+{
+    foreach (const QString &attribute, m_documentAttributes.at(documentNumber)) {
+        m_attributeDocuments[attribute].append(documentNumber);
+    }
+}
+
+// Returns the numbers of the live documents in any of the postings, having the term in any of the given fields, in ascending order
+QVector<int> SearchIndex::documentsInPostings(const QList<const Postings*> &postingsList, Fields fields) const
+{
+    QVector<int> documents;
+    if (postingsList.count() == 1) {
+        foreach (quint32 entry, postingsList.first()->entries) {
+            int documentNumber = static_cast<int>(entry >> 2);
+            if ((entry & static_cast<quint32>(fields)) && !m_documentNoteIds.at(documentNumber).isEmpty()) {
+                documents << documentNumber;
+            }
+        }
+        return documents;
+    }
+    QSet<int> documentSet;
+    foreach (const Postings *postings, postingsList) {
+        foreach (quint32 entry, postings->entries) {
+            int documentNumber = static_cast<int>(entry >> 2);
+            if ((entry & static_cast<quint32>(fields)) && !m_documentNoteIds.at(documentNumber).isEmpty()) {
+                documentSet.insert(documentNumber);
+            }
+        }
+    }
+    documents.reserve(documentSet.size());
+    foreach (int documentNumber, documentSet) {
+        documents << documentNumber;
+    }
+    qSort(documents);
+    return documents;
+}
+
+// Returns the documents having all the words, in ascending order. Also returns the postings looked up for each word.
+QVector<int> SearchIndex::documentsHavingAllWords(const QStringList &words, bool isLastWordPrefix, Fields fields, bool isMatchingSimilarWords,
+                                                  QList<QList<const Postings*> > *wordPostings) const
+{
+    QList<QVector<int> > documentLists;
+    for (int i = 0; i < words.count(); i++) {
+        bool isPrefix = (isLastWordPrefix && (i == words.count() - 1));
+        QList<const Postings*> postingsList = postingsForTerm(words.at(i), isPrefix, isMatchingSimilarWords);
+        (*wordPostings) << postingsList;
+        QVector<int> documents = documentsInPostings(postingsList, fields);
+        if (documents.isEmpty()) {
+            return QVector<int>();
+        }
+        // Keep the shortest list first, so that the intersection can't get any longer than that
+        if (!documentLists.isEmpty() && documents.size() < documentLists.first().size()) {
+            documentLists.prepend(documents);
+        } else {
+            documentLists.append(documents);
+        }
+    }
+
+    QVector<int> matchingDocuments = documentLists.takeFirst();
+    foreach (const QVector<int> &documents, documentLists) {
+        QVector<int> intersection;
+        int i = 0, j = 0;
+        while (i < matchingDocuments.size() && j < documents.size()) {
+            if (matchingDocuments.at(i) < documents.at(j)) {
+                i++;
+            } else if (matchingDocuments.at(i) > documents.at(j)) {
+                j++;
+            } else {
+                intersection << matchingDocuments.at(i);
+                i++;
+                j++;
+            }
+        }
+        matchingDocuments = intersection;
+        if (matchingDocuments.isEmpty()) {
+            break;
+        }
+    }
+    return matchingDocuments;
+}
+
+// Returns the word positions in the document of any of the terms whose postings are given, in ascending order
+QVector<quint32> SearchIndex::positionsInDocument(const QList<const Postings*> &postingsList, int documentNumber) const
+{
+    QVector<quint32> positions;
+    foreach (const Postings *postings, postingsList) {
+        const quint32 firstEntryForDocument = (static_cast<quint32>(documentNumber) << 2);
+        QVector<quint32>::const_iterator it = qLowerBound(postings->entries.constBegin(), postings->entries.constEnd(), firstEntryForDocument);
+        if (it == postings->entries.constEnd() || ((*it) >> 2) != static_cast<quint32>(documentNumber)) {
+            continue;
+        }
+        int entryIndex = (it - postings->entries.constBegin());
+        int start = postings->positionStarts.at(entryIndex);
+        int end = (entryIndex + 1 < postings->positionStarts.size()? postings->positionStarts.at(entryIndex + 1) : postings->positions.size());
+        for (int i = start; i < end; i++) {
+            positions << postings->positions.at(i);
+        }
+    }
+    if (postingsList.count() > 1) {
+        qSort(positions);
+    }
+    return positions;
+}
+
+QSet<QString> SearchIndex::noteIdsForDocuments(const QVector<int> &documents) const
+{
+    QSet<QString> noteIds;
+    noteIds.reserve(documents.size());
+    foreach (int documentNumber, documents) {
+        noteIds.insert(m_documentNoteIds.at(documentNumber));
+    }
+    return noteIds;
+}
+
+void SearchIndex::removeDocument(const QString &noteId)
+{
+    // The postings of a removed document are dropped only when the index is compacted
+    QHash<QString, int>::iterator it = m_documentNumbers.find(noteId);
+    if (it == m_documentNumbers.end()) {
+        return;
+    }
+    int documentNumber = it.value();
+    m_documentNumbers.erase(it);
+    m_documentNoteIds[documentNumber].clear();
+    m_documentFlags[documentNumber] = 0;
+    m_removedDocumentCount++;
+    m_totalDocumentLength -= m_documentLengths.at(documentNumber);
+}
+
+void SearchIndex::addDocument(const DocumentTerms &document)
+{
+    // Documents are always appended, so that the postings lists remain sorted without any effort
+    int documentNumber = m_documentNoteIds.size();
+    m_documentNoteIds.append(document.noteId);
+    m_documentFlags.append((document.isContentIndexed? DOCUMENT_CONTENT_INDEXED : 0) |
+                           (document.hasCheckedTodo? DOCUMENT_HAS_CHECKED_TODO : 0) |
+                           (document.hasUncheckedTodo? DOCUMENT_HAS_UNCHECKED_TODO : 0));
+    m_documentTitleLengths.append(document.titleLength);
+    m_documentLengths.append(document.length);
+    m_totalDocumentLength += document.length;
+    m_documentCreatedTimes.append(document.createdTime);
+    m_documentUpdatedTimes.append(document.updatedTime);
+    m_documentAttributes.append(document.attributes);
+    indexDocumentAttributes(documentNumber);
+    m_areDocumentTimesSorted = false;
+    m_documentNumbers.insert(document.noteId, documentNumber);
+    QHash<QString, TermOccurrences>::const_iterator it;
+    for (it = document.terms.constBegin(); it != document.terms.constEnd(); ++it) {
+        if (it.key().isEmpty()) {
+            continue;
+        }
+        QHash<QString, Postings>::iterator postingsIter = m_postings.find(it.key());
+        if (postingsIter == m_postings.end()) {
+            postingsIter = m_postings.insert(it.key(), Postings());
+            m_newTerms << it.key();
+        }
+        Postings &postings = postingsIter.value();
+        postings.entries.append((static_cast<quint32>(documentNumber) << 2) | it.value().fields);
+        postings.positionStarts.append(postings.positions.size());
+        postings.positions += it.value().positions;
+    }
+}
+
+// Renumbers the documents to drop the removed ones. Should be called with m_lock locked for writing.
+void SearchIndex::compact()
+{
+    if (m_removedDocumentCount == 0) {
+        return;
+    }
+    QVector<int> newNumbers(m_documentNoteIds.size(), -1);
+    QVector<QString> documentNoteIds;
+    QVector<quint8> documentFlags;
+    QVector<quint32> documentTitleLengths;
+    QVector<quint32> documentLengths;
+    QVector<qint64> documentCreatedTimes;
+    QVector<qint64> documentUpdatedTimes;
+    QVector<QStringList> documentAttributes;
+    documentNoteIds.reserve(m_documentNumbers.count());
+    documentFlags.reserve(m_documentNumbers.count());
+    documentTitleLengths.reserve(m_documentNumbers.count());
+    documentLengths.reserve(m_documentNumbers.count());
+    documentCreatedTimes.reserve(m_documentNumbers.count());
+    documentUpdatedTimes.reserve(m_documentNumbers.count());
+    documentAttributes.reserve(m_documentNumbers.count());
+    for (int i = 0; i < m_documentNoteIds.size(); i++) {
+        if (!m_documentNoteIds.at(i).isEmpty()) {
+            newNumbers[i] = documentNoteIds.size();
+            m_documentNumbers[m_documentNoteIds.at(i)] = documentNoteIds.size();
+            documentNoteIds << m_documentNoteIds.at(i);
+            documentFlags << m_documentFlags.at(i);
+            documentTitleLengths << m_documentTitleLengths.at(i);
+            documentLengths << m_documentLengths.at(i);
+            documentCreatedTimes << m_documentCreatedTimes.at(i);
+            documentUpdatedTimes << m_documentUpdatedTimes.at(i);
+            documentAttributes << m_documentAttributes.at(i);
+        }
+    }
+    QHash<QString, Postings>::iterator it = m_postings.begin();
+    while (it != m_postings.end()) {
+        const Postings &postings = it.value();
+        Postings compacted;
+        for (int i = 0; i < postings.entries.size(); i++) {
+            quint32 entry = postings.entries.at(i);
+            int newNumber = newNumbers.at(entry >> 2);
+            if (newNumber < 0) {
+                continue;
+            }
+            int start = postings.positionStarts.at(i);
+            int end = (i + 1 < postings.positionStarts.size()? postings.positionStarts.at(i + 1) : postings.positions.size());
+            compacted.entries << ((static_cast<quint32>(newNumber) << 2) | (entry & 0x3));
+            compacted.positionStarts << compacted.positions.size();
+            compacted.positions += postings.positions.mid(start, end - start);
+        }
+        if (compacted.entries.isEmpty()) {
+            it = m_postings.erase(it);
+        } else {
+            it.value() = compacted;
+            ++it;
+        }
+    }
+    mergeNewTerms();
+    QVector<QString> sortedTerms;
+    sortedTerms.reserve(m_postings.count());
+    foreach (const QString &term, m_sortedTerms) {
+        if (m_postings.contains(term)) {
+            sortedTerms << term;
+        }
+    }
+    if (sortedTerms.size() != m_sortedTerms.size()) {
+        // Some terms are gone; the trigrams will be rebuilt when needed
+        m_termTrigrams.clear();
+        m_areTermTrigramsBuilt = false;
+    }
+    m_sortedTerms = sortedTerms;
+    m_documentNoteIds = documentNoteIds;
+    m_documentFlags = documentFlags;
+    m_documentTitleLengths = documentTitleLengths;
+    m_documentLengths = documentLengths;
+    m_documentCreatedTimes = documentCreatedTimes;
+    m_documentUpdatedTimes = documentUpdatedTimes;
+    m_documentAttributes = documentAttributes;
+    m_attributeDocuments.clear();
+    for (int i = 0; i < m_documentAttributes.size(); i++) {
+        indexDocumentAttributes(i);
+    }
+    m_areDocumentTimesSorted = false;
+    m_removedDocumentCount = 0;
+}
+
+// Adds the terms added since the last call to the sorted dictionary. Should be called with m_lock locked for writing.
+void SearchIndex::mergeNewTerms()
+{
+    if (m_newTerms.isEmpty()) {
+        return;
+    }
+    qSort(m_newTerms);
+    QVector<QString> sortedTerms;
+    sortedTerms.reserve(m_sortedTerms.size() + m_newTerms.size());
+    int i = 0, j = 0;
+    while (i < m_sortedTerms.size() || j < m_newTerms.size()) {
+        if (j >= m_newTerms.size() || (i < m_sortedTerms.size() && m_sortedTerms.at(i) < m_newTerms.at(j))) {
+            sortedTerms << m_sortedTerms.at(i++);
+        } else {
+            sortedTerms << m_newTerms.at(j++);
+        }
+    }
+    m_sortedTerms = sortedTerms;
+    if (m_areTermTrigramsBuilt) {
+        foreach (const QString &term, m_newTerms) {
+            addTermTrigrams(term);
+        }
+    }
+    m_newTerms.clear();
+}
+
+void SearchIndex::clear()
+{
+    m_documentNoteIds.clear();
+    m_documentFlags.clear();
+    m_documentTitleLengths.clear();
+    m_documentLengths.clear();
+    m_totalDocumentLength = 0;
+    m_documentCreatedTimes.clear();
+    m_documentUpdatedTimes.clear();
+    m_documentAttributes.clear();
+    m_attributeDocuments.clear();
+    m_areDocumentTimesSorted = false;
+    m_documentNumbers.clear();
+    m_postings.clear();
+    m_sortedTerms.clear();
+    m_newTerms.clear();
+    m_termTrigrams.clear();
+    m_areTermTrigramsBuilt = false;
+    m_removedDocumentCount = 0;
+    m_changesSinceSave = 0;
+}
+
+void SearchIndex::ensureLoaded()
+{
+    {
+        QReadLocker locker(&m_lock);
+        if (m_isLoaded) {
+            return;
+        }
+    }
+    // If there's no usable index, all notes have to be indexed. They're listed from the store before taking
+    // the write lock, so that searches and completions aren't held up by the store.
+    QStringList allNoteIds;
+    bool isAllNoteIdsListed = false;
+    if (!QFile::exists(m_indexFilePath)) {
+        allNoteIds = m_storageManager->listNoteIds(StorageConstants::AllNotes);
+        isAllNoteIdsListed = true;
+    }
+    forever {
+        QWriteLocker locker(&m_lock);
+        if (m_isLoaded) {
+            return;
+        }
+#ifdef DEBUG
+        QTime time;
+        time.start();
+#endif
+        bool loaded = load();
+        if (!loaded) {
+            if (!isAllNoteIdsListed) {
+                // The index on disk is unusable. List the notes without the lock, and try again.
+                locker.unlock();
+                allNoteIds = m_storageManager->listNoteIds(StorageConstants::AllNotes);
+                isAllNoteIdsListed = true;
+                continue;
+            }
+            clear();
+            QMutexLocker changedNotesLocker(&m_changedNotesLock);
+            foreach (const QString &noteId, allNoteIds) {
+                if (!noteId.isEmpty()) {
+                    m_changedNoteIds.insert(noteId);
+                }
+            }
+            rewriteJournal(m_changedNoteIds);
+        }
+        {
+            // Notes that changed since the index was last saved
+            QMutexLocker changedNotesLocker(&m_changedNotesLock);
+            QFile journal(m_journalFilePath);
+            if (journal.open(QIODevice::ReadOnly)) {
+                while (!journal.atEnd()) {
+                    QString noteId = QString::fromLatin1(journal.readLine().trimmed());
+                    if (!noteId.isEmpty()) {
+                        m_changedNoteIds.insert(noteId);
+                    }
+                }
+                journal.close();
+            }
+        }
+        m_isLoaded = true;
+#ifdef DEBUG
+        qDebug() << "SearchIndex: loaded" << m_documentNumbers.count() << "notes," << m_postings.count() << "terms in" << time.elapsed() << "ms";
+#endif
+        return;
+    }
+}
+
+bool SearchIndex::load()
+{
+    if (!QFile::exists(m_indexFilePath)) {
+        return false;
+    }
+    QScopedPointer<QIODevice> device(EncryptedFile::openForReading(m_indexFilePath));
+    if (device.isNull()) {
+        return false;
+    }
+    QDataStream stream(device.data());
+    stream.setVersion(QDataStream::Qt_4_7);
+    quint32 magic, version, tokenizerOptions;
+    stream >> magic >> version;
+    if (magic != SEARCH_INDEX_MAGIC || version != SEARCH_INDEX_FORMAT_VERSION) {
+        return false;
+    }
+    stream >> tokenizerOptions;
+    if (tokenizerOptions != static_cast<quint32>(m_tokenizer.options())) {
+        return false; // the words were split differently
+    }
+    clear();
+    qint32 documentCount;
+    stream >> documentCount;
+    if (documentCount < 0 || qint64(documentCount) * MIN_SAVED_DOCUMENT_SIZE > device->size() - device->pos()) {
+        return false; // a corrupt count, which we shouldn't allocate for
+    }
+    m_documentNoteIds.resize(documentCount);
+    m_documentFlags.resize(documentCount);
+    m_documentTitleLengths.resize(documentCount);
+    m_documentLengths.resize(documentCount);
+    m_documentCreatedTimes.resize(documentCount);
+    m_documentUpdatedTimes.resize(documentCount);
+    m_documentAttributes.resize(documentCount);
+    for (int i = 0; i < documentCount; i++) {
+        stream >> m_documentNoteIds[i] >> m_documentFlags[i] >> m_documentTitleLengths[i] >> m_documentLengths[i]
+               >> m_documentCreatedTimes[i] >> m_documentUpdatedTimes[i] >> m_documentAttributes[i];
+        m_documentNumbers.insert(m_documentNoteIds.at(i), i);
+        indexDocumentAttributes(i);
+        if (!m_documentNoteIds.at(i).isEmpty()) {
+            m_totalDocumentLength += m_documentLengths.at(i);
+        }
+    }
+    QByteArray encodedTerms;
+    stream >> encodedTerms;
+    if (!decodeTerms(encodedTerms, &m_sortedTerms)) {
+        clear();
+        return false;
+    }
+    m_postings.reserve(m_sortedTerms.size());
+    foreach (const QString &term, m_sortedTerms) {
+        QByteArray encodedPostings;
+        stream >> encodedPostings;
+        if (!decodePostings(encodedPostings, documentCount, &m_postings[term])) {
+            clear();
+            return false;
+        }
+    }
+    if (stream.status() != QDataStream::Ok) {
+        clear();
+        return false;
+    }
+    return true;
+}
+
+// Should be called with m_lock locked for writing
+bool SearchIndex::save()
+{
+    compact();
+
+    // The index has the text of the notes, so it's encrypted whenever the notes are
+    QString tempFilePath = m_indexFilePath % QLatin1String(".tmp");
+    QScopedPointer<QIODevice> device;
+    if (m_storageManager->isAtRestEncryptionEnabled()) {
+        device.reset(new EncryptedFile(tempFilePath));
+    } else {
+        device.reset(new QFile(tempFilePath));
+    }
+    if (!device->open(QIODevice::WriteOnly)) {
+        return false;
+    }
+    QDataStream stream(device.data());
+    stream.setVersion(QDataStream::Qt_4_7);
+    stream << static_cast<quint32>(SEARCH_INDEX_MAGIC) << static_cast<quint32>(SEARCH_INDEX_FORMAT_VERSION);
+    stream << static_cast<quint32>(m_tokenizer.options());
+    stream << static_cast<qint32>(m_documentNoteIds.size());
+    for (int i = 0; i < m_documentNoteIds.size(); i++) {
+        stream << m_documentNoteIds.at(i) << m_documentFlags.at(i) << m_documentTitleLengths.at(i)
+               << m_documentLengths.at(i) << m_documentCreatedTimes.at(i) << m_documentUpdatedTimes.at(i)
+               << m_documentAttributes.at(i);
+    }
+    stream << encodedTerms(m_sortedTerms);
+    foreach (const QString &term, m_sortedTerms) {
+        stream << encodedPostings(m_postings.value(term));
+    }
+    bool ok = (stream.status() == QDataStream::Ok);
+    if (EncryptedFile *encryptedFile = qobject_cast<EncryptedFile*>(device.data())) {
+        ok = (ok && encryptedFile->commit());
+    }
+    device->close();
+    if (!ok) {
+        QFile::remove(tempFilePath);
+        return false;
+    }
+    QFile::remove(m_indexFilePath);
+    if (!QFile::rename(tempFilePath, m_indexFilePath)) {
+        return false;
+    }
+    m_changesSinceSave = 0;
+
+    // The journal now needs to list only the notes that changed after this
+    {
+        QMutexLocker locker(&m_changedNotesLock);
+        rewriteJournal(m_changedNoteIds);
+    }
+
+#ifdef DEBUG
+    qDebug() << "SearchIndex: saved" << m_documentNumbers.count() << "notes," << m_postings.count() << "terms," << QFileInfo(m_indexFilePath).size() << "bytes";
+#endif
+    return true;
+}
+
+// The sorted terms are front-coded on disk: for each term, the length of the prefix
+// it shares with the previous term, followed by the rest of the term in UTF-8
+QByteArray SearchIndex::encodedTerms(const QVector<QString> &sortedTerms)
+{
+    QByteArray data;
+    QString previousTerm;
+    foreach (const QString &term, sortedTerms) {
+        int sharedLength = 0;
+        int maxSharedLength = qMin(term.length(), previousTerm.length());
+        while (sharedLength < maxSharedLength && term.at(sharedLength) == previousTerm.at(sharedLength)) {
+            sharedLength++;
+        }
+        QByteArray suffix = term.mid(sharedLength).toUtf8();
+        appendVarUInt(&data, static_cast<quint32>(sharedLength));
+        appendVarUInt(&data, static_cast<quint32>(suffix.size()));
+        data.append(suffix);
+        previousTerm = term;
+    }
+    return data;
+}
+
+bool SearchIndex::decodeTerms(const QByteArray &data, QVector<QString> *sortedTerms)
+{
+    int pos = 0;
+    QString previousTerm;
+    quint32 sharedLength;
+    while (readVarUInt(data, &pos, &sharedLength)) {
+        quint32 suffixSize;
+        if (!readVarUInt(data, &pos, &suffixSize) || sharedLength > static_cast<quint32>(previousTerm.length()) ||
+            suffixSize > static_cast<quint32>(data.size() - pos)) {
+            return false;
+        }
+        QString term = previousTerm.left(sharedLength) + QString::fromUtf8(data.constData() + pos, suffixSize);
+        pos += suffixSize;
+        sortedTerms->append(term);
+        previousTerm = term;
+    }
+    return (pos == data.size());
+}
+
+// On disk, for each document: the delta from the previous document number (<< 2 | fields),
+// the number of positions, and the deltas between the positions
+QByteArray SearchIndex::encodedPostings(const Postings &postings)
+{
+    QByteArray data;
+    quint32 previousDocumentNumber = 0;
+    for (int i = 0; i < postings.entries.size(); i++) {
+        quint32 entry = postings.entries.at(i);
+        quint32 documentNumber = (entry >> 2);
+        appendVarUInt(&data, ((documentNumber - previousDocumentNumber) << 2) | (entry & 0x3));
+        previousDocumentNumber = documentNumber;
+        int start = postings.positionStarts.at(i);
+        int end = (i + 1 < postings.positionStarts.size()? postings.positionStarts.at(i + 1) : postings.positions.size());
+        appendVarUInt(&data, static_cast<quint32>(end - start));
+        quint32 previousPosition = 0;
+        for (int j = start; j < end; j++) {
+            appendVarUInt(&data, postings.positions.at(j) - previousPosition);
+            previousPosition = postings.positions.at(j);
+        }
+    }
+    return data;
+}
+
+bool SearchIndex::decodePostings(const QByteArray &data, int documentCount, Postings *postings)
+{
+    int pos = 0;
+    quint32 documentNumber = 0;
+    quint32 value;
+    while (readVarUInt(data, &pos, &value)) {
+        documentNumber += (value >> 2);
+        quint32 positionCount;
+        if (documentNumber >= static_cast<quint32>(documentCount) || !readVarUInt(data, &pos, &positionCount)) {
+            return false;
+        }
+        postings->entries << ((documentNumber << 2) | (value & 0x3));
+        postings->positionStarts << postings->positions.size();
+        quint32 position = 0;
+        for (quint32 i = 0; i < positionCount; i++) {
+            quint32 delta;
+            if (!readVarUInt(data, &pos, &delta)) {
+                return false;
+            }
+            position += delta;
+            postings->positions << position;
+        }
+    }
+    return (pos == data.size());
+}
+
+// Should be called with m_changedNotesLock locked
+void SearchIndex::appendToJournal(const QString &noteId)
+{
+    QFile journal(m_journalFilePath);
+    if (journal.open(QIODevice::WriteOnly | QIODevice::Append)) {
+        journal.write(noteId.toLatin1());
+        journal.write("\n");
+        journal.close();
+    }
+}
+
+// Should be called with m_changedNotesLock locked
+void SearchIndex::rewriteJournal(const QSet<QString> &noteIds)
+{
+    QFile journal(m_journalFilePath);
+    if (journal.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        foreach (const QString &noteId, noteIds) {
+            journal.write(noteId.toLatin1());
+            journal.write("\n");
+        }
+        journal.close();
+    }
+}
@@ -0,0 +1,243 @@
+/*
+  This file is part of Notekeeper Open and is licensed under the MIT License
+
+  Copyright (C) 2011-2015 Roopesh Chander <roop@roopc.net>
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject
+  to the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+  BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+  ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+  CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+
+#ifndef SEARCHINDEX_H
+#define SEARCHINDEX_H
+
+#include <QString>
+#include <QStringList>
+#include <QByteArray>
+#include <QHash>
+#include <QSet>
+#include <QVector>
+#include <QMap>
+#include <QPair>
+#include <QMutex>
+#include <QReadWriteLock>
+#include "searchtokenizer.h"
+
+class StorageManager;
+
+// SearchIndex is a persistent inverted index of the words in the notes of a
+// user's store, mapping each word to the notes it occurs in.
+// StorageManager records the notes that change as they get changed, and the
+// changed notes get reindexed before the index is next queried. The list of
+// changed notes is journalled to disk right away, so a reindex is never missed
+// even if the index itself hasn't been saved since.
+// Thread-safe.
+
+class SearchIndex
+{
+public:
+    enum Field {
+        TitleField = 0x1,
+        ContentField = 0x2
+    };
+    Q_DECLARE_FLAGS(Fields, Field)
+
+    struct Statistics {
+        int noteCount;
+        int termCount;
+        qint64 postingCount;
+        qint64 positionCount;
+        qint64 trigramEntryCount; // in memory, if the trigrams for similar words have been built
+        qint64 diskSize; // in bytes
+    };
+
+    // The notes are split into words with a tokenizer having the given options. An index saved
+    // with other options is discarded when loaded, and the notes are indexed again.
+    SearchIndex(StorageManager *storageManager, const QString &indexDirPath,
+                SearchTokenizer::Options tokenizerOptions = SearchTokenizer::NoOptions);
+    ~SearchIndex();
+
+    // Records that the searchable data of a note has changed or that the note was removed
+    void markNoteChanged(const QString &noteId);
+
+    // Reindexes at most maxNoteCount of the notes that need reindexing, reading the notes on all cores.
+    // If onlyNoteIds is given, only those of the notes are reindexed, and only those are counted as pending.
+    // If *cancelled becomes true, the notes not read by then are left for the next refresh.
+    // Returns the number of notes that still need reindexing after this.
+    int refresh(int maxNoteCount = -1, const volatile bool *cancelled = 0, const QSet<QString> *onlyNoteIds = 0);
+    int pendingNoteCount(const QSet<QString> *onlyNoteIds = 0);
+    bool isNotePending(const QString &noteId);
+
+    // Returns the ids of the notes that have all of the words in any of the given fields.
+    // The words should be in the form returned by SearchTokenizer::words() without stemming;
+    // the index stems them itself if it's stemming.
+    // If isMatchingSimilarWords is true, a word also matches words within a small edit distance of it, to tolerate typos.
+    QSet<QString> notesContainingWords(const QStringList &words, bool isLastWordPrefix, Fields fields = Fields(TitleField) | ContentField,
+                                       bool isMatchingSimilarWords = false);
+
+    // Returns the ids of the notes that have the words one after the other.
+    // A phrase in the title and the content is matched as if the content followed the title.
+    QSet<QString> notesContainingPhrase(const QStringList &words, bool isLastWordPrefix, Fields fields = Fields(TitleField) | ContentField,
+                                        bool isMatchingSimilarWords = false);
+
+    // Returns the indexed words that are within a small edit distance of the word, excluding the word itself
+    QStringList similarTerms(const QString &word);
+
+    // Metadata of the notes, answered from per-note columns rather than from the words
+    enum TimeField {
+        CreatedTime,
+        UpdatedTime
+    };
+    enum TodoState {
+        AnyTodo,
+        CheckedTodo,
+        UncheckedTodo
+    };
+    QSet<QString> notesWithTimeSince(TimeField field, qint64 time); // time in msecs since epoch; inclusive
+    QSet<QString> notesWithTodos(TodoState state);
+    // attribute is "resource" (for the MIME types of the attachments) or "source".
+    // Values are compared case-insensitively, and a value ending in '*' matches by prefix.
+    QSet<QString> notesWithAttribute(const QString &attribute, const QString &value);
+
+    // Returns up to maxCount terms that start with prefix (excluding prefix itself), most common first.
+    // Doesn't wait for the index to load; returns nothing if it isn't loaded yet.
+    QStringList termsWithPrefix(const QString &prefix, int maxCount);
+
+    // BM25 relevance of each of the notes for the words, with words in the title counting more
+    // and recently updated notes scoring higher. A word ending in '*' stands for all words starting with it.
+    // Notes that aren't in the index score 0.
+    QHash<QString, qreal> relevanceScores(const QStringList &words, const QStringList &noteIds, bool isMatchingSimilarWords = false);
+
+    // A short excerpt of the note's content around where the most of the different words occur together,
+    // and the (start, end) of the occurrences of the words in it. A word ending in '*' stands for all words
+    // starting with it. Reads only the excerpt, from the text stored when the note was indexed.
+    // Returns false if none of the words occur in the indexed content of the note. Doesn't wait for the index to load.
+    bool snippet(const QString &noteId, const QStringList &words, QString *text, QList<QPair<int, int> > *highlightRanges);
+
+    // Whether the content of the note was available locally when it was last indexed
+    bool isContentIndexed(const QString &noteId);
+
+    Statistics statistics();
+
+    // How words are compared. Both indexed words and search terms are normalized like this:
+    // case-folded, with accents and other combining marks removed, and without whitespace.
+    static QString normalizedWord(const QString &word);
+
+private:
+    // The documents having a term, in ascending order, and the word positions of the term in each of them
+    struct Postings {
+        QVector<quint32> entries;        // (document number << 2 | fields)
+        QVector<quint32> positionStarts; // by entry; where the entry's positions start in positions
+        QVector<quint32> positions;      // ascending within each entry
+    };
+    struct TermOccurrences {
+        TermOccurrences() : fields(0) { }
+        quint8 fields;
+        QVector<quint32> positions;
+    };
+    struct DocumentTerms {
+        QString noteId;
+        bool exists;
+        bool isContentIndexed;
+        quint32 titleLength; // in words
+        quint32 length;      // in words, including the title
+        qint64 createdTime;  // msecs since epoch
+        qint64 updatedTime;  // msecs since epoch
+        bool hasCheckedTodo;
+        bool hasUncheckedTodo;
+        QStringList attributes; // "name:value", lowercase
+        QHash<QString, TermOccurrences> terms;
+    };
+
+    int pendingNoteCountLocked(const QSet<QString> *noteIds) const;
+    QList<DocumentTerms> documentTermsForNotes(const QStringList &noteIds, const volatile bool *cancelled) const;
+    void ensureLoaded();
+    bool load();
+    bool save();
+    void clear();
+    void removeDocument(const QString &noteId);
+    void addDocument(const DocumentTerms &document);
+    void compact();
+    void mergeNewTerms();
+    void appendToJournal(const QString &noteId);
+    void rewriteJournal(const QSet<QString> &noteIds);
+    QList<const Postings*> postingsForTerm(const QString &term, bool isPrefix, bool isMatchingSimilarWords = false) const;
+    QStringList similarTermsLocked(const QString &word) const;
+    void buildTermTrigrams() const;
+    void addTermTrigrams(const QString &term) const;
+    void sortDocumentTimes() const;
+    void indexDocumentAttributes(int documentNumber);
+    QVector<int> documentsInPostings(const QList<const Postings*> &postingsList, Fields fields) const;
+    QVector<int> documentsHavingAllWords(const QStringList &words, bool isLastWordPrefix, Fields fields, bool isMatchingSimilarWords,
+                                         QList<QList<const Postings*> > *wordPostings) const;
+    QVector<quint32> positionsInDocument(const QList<const Postings*> &postingsList, int documentNumber) const;
+    QSet<QString> noteIdsForDocuments(const QVector<int> &documents) const;
+    static QByteArray encodedTerms(const QVector<QString> &sortedTerms);
+    static bool decodeTerms(const QByteArray &data, QVector<QString> *sortedTerms);
+    static QByteArray encodedPostings(const Postings &postings);
+    static bool decodePostings(const QByteArray &data, int documentCount, Postings *postings);
+
+    StorageManager * const m_storageManager;
+    const SearchTokenizer m_tokenizer;
+    const QString m_indexFilePath;
+    const QString m_journalFilePath;
+
+    // Guards the index data below
+    QReadWriteLock m_lock;
+    bool m_isLoaded;
+    QVector<QString> m_documentNoteIds;           // by document number; empty for removed documents
+    QVector<quint8> m_documentFlags;              // by document number
+    QVector<quint32> m_documentTitleLengths;      // by document number; in words
+    QVector<quint32> m_documentLengths;           // by document number; in words
+    QVector<qint64> m_documentCreatedTimes;       // by document number
+    QVector<qint64> m_documentUpdatedTimes;       // by document number
+    QVector<QStringList> m_documentAttributes;    // by document number
+    QMap<QString, QVector<int> > m_attributeDocuments; // key: attribute; sorted, for matching by prefix
+    QHash<QString, int> m_documentNumbers;        // key: noteId
+    QHash<QString, Postings> m_postings;          // key: term
+    QVector<QString> m_sortedTerms;               // the term dictionary, for looking up terms by prefix
+    QVector<QString> m_newTerms;                  // terms not yet merged into m_sortedTerms
+    int m_removedDocumentCount;
+    qint64 m_totalDocumentLength;                 // of the documents not removed; in words
+    int m_changesSinceSave;
+
+    // For finding similar words. Built when first needed, because most searches don't need it.
+    // Guarded by m_lock when locked for writing, and by m_termTrigramsLock when m_lock is locked for reading.
+    mutable QMutex m_termTrigramsLock;
+    mutable bool m_areTermTrigramsBuilt;
+    mutable QHash<quint64, QVector<QString> > m_termTrigrams; // key: three UTF-16 code units
+
+    // The documents ordered by time, for range scans. Sorted when first needed after a change,
+    // and guarded like the trigrams, with m_documentTimesLock.
+    mutable QMutex m_documentTimesLock;
+    mutable bool m_areDocumentTimesSorted;
+    mutable QVector<QPair<qint64, int> > m_documentsByCreatedTime; // (time, document number)
+    mutable QVector<QPair<qint64, int> > m_documentsByUpdatedTime;
+
+    // Guards the list of changed notes and the journal
+    QMutex m_changedNotesLock;
+    QSet<QString> m_changedNoteIds;
+
+    QMutex m_refreshLock; // so that notes taken up for reindexing are reindexed before the index is saved
+};
+
+Q_DECLARE_OPERATORS_FOR_FLAGS(SearchIndex::Fields)
+
+#endif // SEARCHINDEX_H
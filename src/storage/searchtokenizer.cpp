@@ -0,0 +1,197 @@
+/*
+  This file is part of Notekeeper Open and is licensed under the MIT License
+
+  Copyright (C) 2011-2015 Roopesh Chander <roop@roopc.net>
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject
+  to the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+  BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+  ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+  CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+
+#include "searchtokenizer.h"
+#include "searchindex.h"
+#include <QTextBoundaryFinder>
+
+static inline bool isSeparatorChar(const QChar &c)
+{
+    return (c.isSpace() || c.isPunct() || c.isSymbol());
+}
+
+// Han ideographs, kana and hangul; these are indexed as bigrams
+static inline bool isCjkChar(ushort c)
+{
+    return ((c >= 0x4E00 && c <= 0x9FFF) ||  // CJK unified ideographs
+            (c >= 0x3400 && c <= 0x4DBF) ||  // CJK unified ideographs extension A
+            (c >= 0xF900 && c <= 0xFAFF) ||  // CJK compatibility ideographs
+            (c >= 0x3040 && c <= 0x30FF) ||  // hiragana, katakana
+            (c >= 0x31F0 && c <= 0x31FF) ||  // katakana phonetic extensions
+            (c >= 0xFF66 && c <= 0xFF9F) ||  // halfwidth katakana
+            (c >= 0xAC00 && c <= 0xD7AF) ||  // hangul syllables
+            (c >= 0x1100 && c <= 0x11FF) ||  // hangul jamo
+            (c >= 0x3130 && c <= 0x318F));   // hangul compatibility jamo
+}
+
+// Scripts written without spaces between words, that QTextBoundaryFinder knows to break
+static inline bool isComplexScriptChar(ushort c)
+{
+    return ((c >= 0x0E00 && c <= 0x0FFF) ||  // thai, lao, tibetan
+            (c >= 0x1000 && c <= 0x109F) ||  // myanmar
+            (c >= 0x1780 && c <= 0x17FF));   // khmer
+}
+
+enum CharClass {
+    OtherChar,
+    CjkChar,
+    ComplexScriptChar
+};
+
+static inline CharClass charClass(ushort c)
+{
+    if (c < 0x0E00) {
+        return OtherChar; // most text
+    }
+    if (isCjkChar(c)) {
+        return CjkChar;
+    }
+    if (isComplexScriptChar(c)) {
+        return ComplexScriptChar;
+    }
+    return OtherChar;
+}
+
+SearchTokenizer::SearchTokenizer(Options options)
+    : m_options(options)
+{
+}
+
+SearchTokenizer::Options SearchTokenizer::options() const
+{
+    return m_options;
+}
+
+QStringList SearchTokenizer::words(const QString &text) const
+{
+    QStringList wordList;
+    appendWords(text, &wordList);
+    return wordList;
+}
+
+void SearchTokenizer::appendWords(const QString &text, QStringList *words, QVector<QPair<int, int> > *wordRanges, int textOffset) const
+{
+    const Output output = { words, wordRanges, textOffset };
+    const QChar *chars = text.constData();
+    const int length = text.length();
+    int tokenStart = -1;
+    for (int i = 0; i < length; i++) {
+        if (isSeparatorChar(chars[i])) {
+            if (tokenStart >= 0) {
+                appendToken(text, tokenStart, i, output);
+                tokenStart = -1;
+            }
+        } else if (tokenStart < 0) {
+            tokenStart = i;
+        }
+    }
+    if (tokenStart >= 0) {
+        appendToken(text, tokenStart, length, output);
+    }
+}
+
+// A token is a run of characters between separators; it can still have more than one word in it
+void SearchTokenizer::appendToken(const QString &text, int start, int end, const Output &output) const
+{
+    const QChar *chars = text.constData();
+    int runStart = start;
+    CharClass runClass = charClass(chars[start].unicode());
+    for (int i = start + 1; i <= end; i++) {
+        CharClass currentClass = (i < end? charClass(chars[i].unicode()) : runClass);
+        if (i < end && currentClass == runClass) {
+            continue;
+        }
+        if (runClass == CjkChar) {
+            if (i - runStart == 1) {
+                appendWord(text, runStart, i, output);
+            } else {
+                for (int j = runStart; j + 1 < i; j++) {
+                    appendWord(text, j, j + 2, output);
+                }
+            }
+        } else if (runClass == ComplexScriptChar) {
+            appendComplexScriptWords(text, runStart, i, output);
+        } else {
+            appendWord(text, runStart, i, output);
+        }
+        runStart = i;
+        runClass = currentClass;
+    }
+}
+
+void SearchTokenizer::appendComplexScriptWords(const QString &text, int start, int end, const Output &output) const
+{
+    QTextBoundaryFinder finder(QTextBoundaryFinder::Word, text.constData() + start, end - start);
+    int segmentStart = 0;
+    while (finder.toNextBoundary() >= 0) {
+        const int segmentEnd = finder.position();
+        appendWord(text, start + segmentStart, start + segmentEnd, output);
+        segmentStart = segmentEnd;
+    }
+    if (start + segmentStart < end) {
+        appendWord(text, start + segmentStart, end, output);
+    }
+}
+
+void SearchTokenizer::appendWord(const QString &text, int start, int end, const Output &output) const
+{
+    QString normalized = SearchIndex::normalizedWord(text.mid(start, end - start));
+    if (normalized.isEmpty()) {
+        return;
+    }
+    (*output.words) << stemmed(normalized);
+    if (output.wordRanges) {
+        output.wordRanges->append(qMakePair(output.textOffset + start, output.textOffset + end));
+    }
+}
+
+// A light "S-stemmer" (Harman, 1991) for English plurals. It only looks at the last few letters,
+// so it's cheap enough to run on every word while indexing.
+QString SearchTokenizer::stemmed(const QString &word) const
+{
+    if (!(m_options & Stemming) || word.length() <= 3) {
+        return word;
+    }
+    const QChar *chars = word.constData();
+    for (int i = 0; i < word.length(); i++) {
+        ushort c = chars[i].unicode();
+        if (c < 'a' || c > 'z') {
+            return word; // only latin words written without accents are stemmed
+        }
+    }
+    if (word.endsWith(QLatin1String("ies")) && !word.endsWith(QLatin1String("eies")) && !word.endsWith(QLatin1String("aies"))) {
+        return (word.left(word.length() - 3) + QLatin1Char('y'));
+    }
+    if (word.endsWith(QLatin1String("es")) && !word.endsWith(QLatin1String("aes")) && !word.endsWith(QLatin1String("ees")) &&
+        !word.endsWith(QLatin1String("oes"))) {
+        return word.left(word.length() - 1);
+    }
+    if (word.endsWith(QLatin1Char('s')) && !word.endsWith(QLatin1String("us")) && !word.endsWith(QLatin1String("ss"))) {
+        return word.left(word.length() - 1);
+    }
+    return word;
+}
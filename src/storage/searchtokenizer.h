@@ -0,0 +1,81 @@
+/*
+  This file is part of Notekeeper Open and is licensed under the MIT License
+
+  Copyright (C) 2011-2015 Roopesh Chander <roop@roopc.net>
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject
+  to the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+  BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+  ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+  CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+
+#ifndef SEARCHTOKENIZER_H
+#define SEARCHTOKENIZER_H
+
+#include <QString>
+#include <QStringList>
+#include <QFlags>
+#include <QVector>
+#include <QPair>
+
+// SearchTokenizer splits text into the words that get indexed and searched for.
+// Words are separated at whitespace, punctuation and symbols, and in scripts
+// that don't separate words that way (like Thai), at the word boundaries found
+// by QTextBoundaryFinder. Runs of Chinese, Japanese and Korean characters come
+// out as overlapping pairs of characters (bigrams), so that any part of a CJK
+// sentence can be searched for as a phrase.
+// Each word is normalized with SearchIndex::normalizedWord(), and with the
+// Stemming option, English plurals are reduced to their singular form.
+// The same tokenizer should be used for the notes and for the search terms.
+
+class SearchTokenizer
+{
+public:
+    enum Option {
+        NoOptions = 0x0,
+        Stemming = 0x1
+    };
+    Q_DECLARE_FLAGS(Options, Option)
+
+    explicit SearchTokenizer(Options options = NoOptions);
+    Options options() const;
+
+    QStringList words(const QString &text) const;
+    // If wordRanges is given, the (start, end) of each word in text, plus textOffset, is appended to it
+    void appendWords(const QString &text, QStringList *words, QVector<QPair<int, int> > *wordRanges = 0, int textOffset = 0) const;
+
+    // The form a normalized word is indexed in; the word itself unless stemming
+    QString stemmed(const QString &normalizedWord) const;
+
+private:
+    struct Output {
+        QStringList *words;
+        QVector<QPair<int, int> > *wordRanges;
+        int textOffset;
+    };
+    void appendToken(const QString &text, int start, int end, const Output &output) const;
+    void appendComplexScriptWords(const QString &text, int start, int end, const Output &output) const;
+    void appendWord(const QString &text, int start, int end, const Output &output) const;
+
+    Options m_options;
+};
+
+Q_DECLARE_OPERATORS_FOR_FLAGS(SearchTokenizer::Options)
+
+#endif // SEARCHTOKENIZER_H
@@ -26,6 +26,8 @@
 
 #include "storagemanager.h"
 #include "crypto/crypto.h"
+#include "crypto/encryptedfile.h"
+#include "searchindex.h"
 #include "cloud/evernote/evernotesync/evernotemarkup.h"
 #include "storage/diskcache/shareddiskcache.h"
 #include "logger.h"
@@ -42,11 +44,19 @@
 #include <QVariantMap>
 #include <QMap>
 #include <QMapIterator>
+#include <QHash>
 #include <QFile>
 #include <QDesktopServices>
+#include <QBuffer>
+#include <QDataStream>
+#include <QScopedPointer>
+#include <QtEndian>
 
 #define ID_PATH(id) pathFragmentFromObjectId(id)
 
+#define CONTENT_SUMMARY_LENGTH 100
+#define CONTENT_SUMMARY_VERSION 1 // content summaries stored with other versions get recomputed
+
 // #define DEBUG
 
 #ifdef DEBUG
@@ -93,9 +103,39 @@ StorageManager::StorageManager(QObject *parent)
     : QObject(parent)
     , m_encryptedSettingsFormat(QSettings::registerFormat("dat", Crypto::readEncryptedSettings, Crypto::writeEncryptedSettings))
     , m_loggingEnabledStatus(LoggingEnabledStatusUnknown)
+    , m_isStoreContextSet(false)
+    , m_notesDataLocation(resolvedNotesDataLocation())
+    , m_storeGeneration(0)
 {
     m_iniFileCache.setMaxCost(2 << 20); // 2MB
     writeStorageVersion("1.0");
+
+    // Direct connections, so that the generation has changed by the time the emitting method returns
+    connect(this, SIGNAL(notesListChanged(StorageConstants::NotesListType,QString)), SLOT(bumpStoreGeneration()), Qt::DirectConnection);
+    connect(this, SIGNAL(notebooksListChanged()), SLOT(bumpStoreGeneration()), Qt::DirectConnection);
+    connect(this, SIGNAL(tagsListChanged()), SLOT(bumpStoreGeneration()), Qt::DirectConnection);
+    connect(this, SIGNAL(noteCreated(QString)), SLOT(bumpStoreGeneration()), Qt::DirectConnection);
+    connect(this, SIGNAL(noteExpunged(QString)), SLOT(bumpStoreGeneration()), Qt::DirectConnection);
+    connect(this, SIGNAL(noteDisplayDataChanged(QString,bool)), SLOT(bumpStoreGeneration()), Qt::DirectConnection);
+    connect(this, SIGNAL(notebookForNoteChanged(QString,QString)), SLOT(bumpStoreGeneration()), Qt::DirectConnection);
+    connect(this, SIGNAL(tagsForNoteChanged(QString,QStringList)), SLOT(bumpStoreGeneration()), Qt::DirectConnection);
+    connect(this, SIGNAL(noteTrashednessChanged(QString,bool)), SLOT(bumpStoreGeneration()), Qt::DirectConnection);
+
+    // Changes that can change which saved searches a note matches, other than those to what's searched in the note
+    connect(this, SIGNAL(noteCreated(QString)), SLOT(markNoteChangedForSavedSearches(QString)), Qt::DirectConnection);
+    connect(this, SIGNAL(notebookForNoteChanged(QString,QString)), SLOT(markNoteChangedForSavedSearches(QString)), Qt::DirectConnection);
+    connect(this, SIGNAL(tagsForNoteChanged(QString,QStringList)), SLOT(markNoteChangedForSavedSearches(QString)), Qt::DirectConnection);
+    connect(this, SIGNAL(noteTrashednessChanged(QString,bool)), SLOT(markNoteChangedForSavedSearches(QString)), Qt::DirectConnection);
+}
+
+int StorageManager::storeGeneration() const
+{
+    return m_storeGeneration;
+}
+
+void StorageManager::bumpStoreGeneration()
+{
+    m_storeGeneration.ref();
 }
 
 void StorageManager::writeStorageVersion(const QString &versionString)
@@ -105,6 +145,11 @@ void StorageManager::writeStorageVersion(const QString &versionString)
 }
 
 QString StorageManager::notesDataLocation() const
+{
+    return m_notesDataLocation;
+}
+
+QString StorageManager::resolvedNotesDataLocation()
 {
     QString appExecName = "notekeeper-open";
 
@@ -154,13 +199,26 @@ QString StorageManager::createNote(const QString &title, const QByteArray &conte
     }
     gistData["CreatedHere"] = true;
     QVariantMap contentData;
-    contentData[QString::fromLatin1("Content")] = content;
+    bool isContentToBeEncrypted = isAtRestEncryptionEnabled();
+    if (!isContentToBeEncrypted) {
+        contentData[QString::fromLatin1("Content")] = content;
+    }
     contentData[QString::fromLatin1("ContentHash")] = QCryptographicHash::hash(content, QCryptographicHash::Md5).toHex();
     contentData[QString::fromLatin1("ContentValid")] = true;
     QString noteId = createStorageObject("Notes", "nt",
                                          "list.ini", "CurrentMaxLocalNoteIdNumber", "NoteIds",
                                          "gist.ini", gistData,
                                          "content.ini", contentData);
+    if (isContentToBeEncrypted) {
+        // So that the clear text content never gets written to content.ini
+        QVariantMap encryptedContentData;
+        encryptedContentData[QString::fromLatin1("Content")] = content;
+        IniFile noteContentsIni = notesDataIniFile("Notes/" % ID_PATH(noteId) % "/content.ini");
+        setNoteContentValues(noteId, noteContentsIni, encryptedContentData);
+    } else {
+        setNoteContentSummary(noteId, content);
+    }
+    markNoteChangedForSearch(noteId);
     emit noteCreated(noteId);
     setNotebookForNote(noteId, defaultNotebookId());
 
@@ -190,6 +248,7 @@ bool StorageManager::updateNoteTitle(const QString &noteId, const QString &_titl
         }
     }
     if (titleChanged) {
+        markNoteChangedForSearch(noteId);
         updateNotesListOrder(noteId);
         emit noteDisplayDataChanged(noteId, true);
     }
@@ -227,6 +286,9 @@ bool StorageManager::updateNoteTitleAndContent(const QString &noteId, const QStr
         }
         noteGistIni.setValues(gistData);
     }
+    if (titleChanged) {
+        markNoteChangedForSearch(noteId);
+    }
 
     // update note content
     bool contentChanged = false;
@@ -243,7 +305,7 @@ bool StorageManager::updateNoteTitleAndContent(const QString &noteId, const QStr
             contentData[QString::fromLatin1("Content")] = content;
             contentData[QString::fromLatin1("ContentHash")] = contentHash;
             contentData[QString::fromLatin1("ContentValid")] = true;
-            noteContentsIni.setValues(contentData);
+            setNoteContentValues(noteId, noteContentsIni, contentData);
         }
     }
 
@@ -326,6 +388,11 @@ QStringList StorageManager::listNoteIds(StorageConstants::NotesListType whichNot
             return QStringList();
         }
         return listNoteIds("Tags/" % ID_PATH(objectId) % "/list.ini", "NoteIds");
+    } else if (whichNotes == StorageConstants::SavedSearchNotes) {
+        if (objectId.isEmpty()) {
+            return QStringList();
+        }
+        return listNoteIds("SavedSearches/" % ID_PATH(objectId) % "/list.ini", "NoteIds");
     }
     return QStringList();
 }
@@ -391,7 +458,7 @@ QVariantMap StorageManager::noteData(const QString &noteId)
         if (contentValid) {
             // take content from content.ini
             data[QString::fromLatin1("ContentDataAvailable")] = true;
-            data[QString::fromLatin1("Content")] = noteContentIni.value("Content").toByteArray();
+            data[QString::fromLatin1("Content")] = noteContentValue(noteId, noteContentIni);
             data[QString::fromLatin1("ContentHash")] = noteContentIni.value("ContentHash").toByteArray();
         } else {
             Q_ASSERT(!guid.isEmpty());
@@ -421,7 +488,7 @@ QByteArray StorageManager::enmlContentFromContentIni(const QString &noteId, bool
     {
         IniFile noteContentIni = notesDataIniFile("Notes/" % ID_PATH(noteId) % "/content.ini");
         contentValid = noteContentIni.value("ContentValid").toBool();
-        content = noteContentIni.value("Content").toByteArray();
+        content = noteContentValue(noteId, noteContentIni);
     }
     if (ok) {
         (*ok) = contentValid;
@@ -432,6 +499,201 @@ QByteArray StorageManager::enmlContentFromContentIni(const QString &noteId, bool
     return QByteArray();
 }
 
+// Local search
+
+QSharedPointer<SearchIndex> StorageManager::searchIndex()
+{
+    return storeContext().searchIndex;
+}
+
+void StorageManager::markNoteChangedForSearch(const QString &noteId)
+{
+    storeContext().searchIndex->markNoteChanged(noteId);
+    markNoteChangedForSavedSearches(noteId);
+    bumpStoreGeneration(); // also for changes that don't show in the notes list, like to attachments
+}
+
+QString StorageManager::noteTitle(const QString &noteId)
+{
+    if (noteId.isEmpty()) {
+        return QString();
+    }
+    IniFile noteGistIni = notesDataIniFile("Notes/" % ID_PATH(noteId) % "/gist.ini");
+    return noteGistIni.value("Title").toString();
+}
+
+bool StorageManager::searchableNoteData(const QString &noteId, QString *title, QByteArray *content, bool *isContentAvailable, QVariantMap *metadata)
+{
+    if (noteId.isEmpty()) {
+        return false;
+    }
+    if (!QFile::exists(notesDataFullPath() % "/Notes/" % ID_PATH(noteId) % "/gist.ini")) {
+        return false; // expunged
+    }
+    QString guid;
+    QByteArray syncContentHash;
+    {
+        IniFile noteGistIni = notesDataIniFile("Notes/" % ID_PATH(noteId) % "/gist.ini");
+        (*title) = noteGistIni.value("Title").toString();
+        guid = noteGistIni.value("guid").toString();
+        if (metadata) {
+            (*metadata)[QString::fromLatin1("CreatedTime")] = noteGistIni.value("CreatedTime").toLongLong();
+            (*metadata)[QString::fromLatin1("UpdatedTime")] = noteGistIni.value("UpdatedTime").toLongLong();
+            (*metadata)[QString::fromLatin1("Source")] = noteGistIni.value("Attributes/Source").toString();
+        }
+        syncContentHash = noteGistIni.value("SyncContentHash").toByteArray();
+    }
+    if (metadata) {
+        QStringList mimeTypes;
+        QList<QByteArray> recognizedHashes;
+        IniFile noteAttachmentsIni = notesDataIniFile("Notes/" % ID_PATH(noteId) % "/attachments.ini");
+        int count = noteAttachmentsIni.beginReadArray("Attachments");
+        for (int i = 0; i < count; i++) {
+            noteAttachmentsIni.setArrayIndex(i);
+            QString mimeType = noteAttachmentsIni.value("MimeType").toString();
+            if (!mimeType.isEmpty() && !mimeTypes.contains(mimeType)) {
+                mimeTypes << mimeType;
+            }
+            if (noteAttachmentsIni.value("HasRecognition").toBool()) {
+                recognizedHashes << noteAttachmentsIni.value("Hash").toByteArray();
+            }
+        }
+        noteAttachmentsIni.endArray();
+        (*metadata)[QString::fromLatin1("AttachmentMimeTypes")] = mimeTypes;
+        if (!recognizedHashes.isEmpty()) {
+            QStringList searchTexts;
+            IniFile noteRecognitionIni = notesDataIniFile("Notes/" % ID_PATH(noteId) % "/recognition.ini");
+            foreach (const QByteArray &md5Hash, recognizedHashes) {
+                QString searchText = attachmentSearchText(noteId, noteRecognitionIni, md5Hash);
+                if (!searchText.isEmpty()) {
+                    searchTexts << searchText;
+                }
+            }
+            (*metadata)[QString::fromLatin1("AttachmentSearchTexts")] = searchTexts;
+        }
+    }
+    {
+        IniFile noteContentIni = notesDataIniFile("Notes/" % ID_PATH(noteId) % "/content.ini");
+        if (noteContentIni.value("ContentValid").toBool()) {
+            (*content) = noteContentValue(noteId, noteContentIni);
+            (*isContentAvailable) = true;
+            return true;
+        }
+    }
+    (*isContentAvailable) = false;
+    if (!guid.isEmpty()) {
+        QByteArray cachedContent, cachedContentHash;
+        SharedDiskCache::instance()->retrieveNoteContent(guid, &cachedContent, &cachedContentHash);
+        if (!cachedContentHash.isEmpty() && (cachedContentHash == syncContentHash)) {
+            (*content) = cachedContent;
+            (*isContentAvailable) = true;
+        }
+    }
+    return true;
+}
+
+// searchtext.dat has the word count, the (start, end) of each word as quint32s, the text length and then the text
+// as UTF-16, so that an excerpt can be read by seeking to it. It's encrypted whenever the note content is.
+#define SEARCH_TEXT_HEADER_SIZE 4
+#define SEARCH_TEXT_WORD_RANGE_SIZE 8
+
+void StorageManager::setNoteSearchText(const QString &noteId, const QString &plainText, const QVector<QPair<int, int> > &wordRanges)
+{
+    if (noteId.isEmpty()) {
+        return;
+    }
+    const QString searchTextPath = notesDataFullPath() % "/Notes/" % ID_PATH(noteId) % "/searchtext.dat";
+    if (plainText.isEmpty() || wordRanges.isEmpty()) {
+        QFile::remove(searchTextPath);
+        return;
+    }
+    const QString tempPath = searchTextPath % ".tmp";
+    QScopedPointer<QIODevice> device;
+    if (isAtRestEncryptionEnabled()) {
+        device.reset(new EncryptedFile(tempPath));
+    } else {
+        device.reset(new QFile(tempPath));
+    }
+    if (!device->open(QIODevice::WriteOnly)) {
+        return;
+    }
+    QDataStream stream(device.data());
+    stream.setVersion(QDataStream::Qt_4_7);
+    stream << static_cast<quint32>(wordRanges.size());
+    for (int i = 0; i < wordRanges.size(); i++) {
+        stream << static_cast<quint32>(wordRanges.at(i).first) << static_cast<quint32>(wordRanges.at(i).second);
+    }
+    stream << static_cast<quint32>(plainText.length());
+    QByteArray textData(plainText.length() * 2, Qt::Uninitialized);
+    uchar *textBytes = reinterpret_cast<uchar*>(textData.data());
+    for (int i = 0; i < plainText.length(); i++) {
+        qToBigEndian<quint16>(plainText.at(i).unicode(), textBytes + 2 * i);
+    }
+    stream.writeRawData(textData.constData(), textData.size());
+    bool ok = (stream.status() == QDataStream::Ok);
+    if (EncryptedFile *encryptedFile = qobject_cast<EncryptedFile*>(device.data())) {
+        ok = (ok && encryptedFile->commit());
+    }
+    device->close();
+    QFile::remove(searchTextPath);
+    if (!ok || !QFile::rename(tempPath, searchTextPath)) {
+        QFile::remove(tempPath);
+    }
+}
+
+bool StorageManager::noteSearchTextExcerpt(const QString &noteId, int firstWord, int lastWord,
+                                           QString *excerpt, QVector<QPair<int, int> > *wordRanges, int *wordCount)
+{
+    if (noteId.isEmpty() || firstWord < 0 || lastWord < firstWord) {
+        return false;
+    }
+    QScopedPointer<QIODevice> device(EncryptedFile::openForReading(notesDataFullPath() % "/Notes/" % ID_PATH(noteId) % "/searchtext.dat"));
+    if (device.isNull()) {
+        return false;
+    }
+    QDataStream stream(device.data());
+    stream.setVersion(QDataStream::Qt_4_7);
+    quint32 count;
+    stream >> count;
+    if (stream.status() != QDataStream::Ok || static_cast<quint32>(firstWord) >= count) {
+        return false;
+    }
+    lastWord = qMin(lastWord, static_cast<int>(count) - 1);
+    if (!device->seek(SEARCH_TEXT_HEADER_SIZE + qint64(firstWord) * SEARCH_TEXT_WORD_RANGE_SIZE)) {
+        return false;
+    }
+    QVector<QPair<int, int> > ranges(lastWord - firstWord + 1);
+    for (int i = 0; i < ranges.size(); i++) {
+        quint32 start, end;
+        stream >> start >> end;
+        ranges[i] = qMakePair(static_cast<int>(start), static_cast<int>(end));
+    }
+    const int excerptStart = ranges.first().first;
+    const int excerptEnd = ranges.last().second;
+    const qint64 textPos = SEARCH_TEXT_HEADER_SIZE + qint64(count) * SEARCH_TEXT_WORD_RANGE_SIZE + 4 /* text length */;
+    if (stream.status() != QDataStream::Ok || excerptEnd < excerptStart || !device->seek(textPos + qint64(excerptStart) * 2)) {
+        return false;
+    }
+    QByteArray textData(2 * (excerptEnd - excerptStart), Qt::Uninitialized);
+    if (stream.readRawData(textData.data(), textData.size()) != textData.size()) {
+        return false;
+    }
+    QString text(excerptEnd - excerptStart, Qt::Uninitialized);
+    QChar *textChars = text.data();
+    const uchar *textBytes = reinterpret_cast<const uchar*>(textData.constData());
+    for (int i = 0; i < text.length(); i++) {
+        textChars[i] = QChar(qFromBigEndian<quint16>(textBytes + 2 * i));
+    }
+    for (int i = 0; i < ranges.size(); i++) {
+        ranges[i].first -= excerptStart;
+        ranges[i].second -= excerptStart;
+    }
+    (*excerpt) = text;
+    (*wordRanges) = ranges;
+    (*wordCount) = static_cast<int>(count);
+    return true;
+}
+
 QString StorageManager::setSyncedNoteGist(const QString &guid, const QString &title, qint32 usn, const QByteArray &contentHash, qint64 createdTime, qint64 updatedTime,
                                           const QVariantMap &noteAttributes, bool *isUsnChanged)
 {
@@ -472,6 +734,7 @@ QString StorageManager::setSyncedNoteGist(const QString &guid, const QString &ti
         emit noteDisplayDataChanged(noteId, noteTimestampChanged);
     }
     setGuidMapping("Notes/byGuid.ini", guid, noteId);
+    markNoteChangedForSearch(noteId); // the title could have changed
     if (noteTimestampChanged) {
         updateNotesListOrder(noteId);
     }
@@ -515,7 +778,7 @@ bool StorageManager::setFetchedNoteContent(const QString &noteGuid, const QStrin
         {
             IniFile noteContentsIni = notesDataIniFile("Notes/" % ID_PATH(noteId) % "/content.ini");
             currentContentHash = noteContentsIni.value("ContentHash").toByteArray();
-            currentContent = noteContentsIni.value("Content").toByteArray();
+            currentContent = noteContentValue(noteId, noteContentsIni);
             currentContentValid = noteContentsIni.value("ContentValid").toBool();
         }
         if (currentBaseContentHash == contentHash) {
@@ -544,23 +807,26 @@ bool StorageManager::setFetchedNoteContent(const QString &noteGuid, const QStrin
     // update note content
     {
         IniFile noteContentsIni = notesDataIniFile("Notes/" % ID_PATH(noteId) % "/content.ini");
+        QVariantMap contentData;
         if (isConflict) {
             // if content has been changed by the user, save it in a file
-            noteContentsIni.setValue("Content", resolvedContent);
-            noteContentsIni.setValue("ContentHash", QCryptographicHash::hash(resolvedContent, QCryptographicHash::Md5).toHex());
-            noteContentsIni.setValue("ContentValid", true);
+            contentData[QString::fromLatin1("Content")] = resolvedContent;
+            contentData[QString::fromLatin1("ContentHash")] = QCryptographicHash::hash(resolvedContent, QCryptographicHash::Md5).toHex();
+            contentData[QString::fromLatin1("ContentValid")] = true;
         } else if (noteNeedsToBeAvailableOffline(noteId)) {
             // if content needs to be available offline, save it in a file
-            noteContentsIni.setValue("Content", content);
-            noteContentsIni.setValue("ContentHash", contentHash);
-            noteContentsIni.setValue("ContentValid", true);
+            contentData[QString::fromLatin1("Content")] = content;
+            contentData[QString::fromLatin1("ContentHash")] = contentHash;
+            contentData[QString::fromLatin1("ContentValid")] = true;
         } else {
             // else, save it in the disk cache (if it gets uncached, we can always re-fetch it)
-            noteContentsIni.setValue("ContentValid", false);
-            noteContentsIni.setValue("Content", QByteArray());
-            noteContentsIni.setValue("ContentHash", QByteArray());
+            contentData[QString::fromLatin1("ContentValid")] = false;
+            contentData[QString::fromLatin1("Content")] = QByteArray();
+            contentData[QString::fromLatin1("ContentHash")] = QByteArray();
             SharedDiskCache::instance()->insertNoteContent(noteGuid, content, contentHash);
+            setNoteContentSummary(noteId, content); // the summary stays even if the content is pushed out of the cache
         }
+        setNoteContentValues(noteId, noteContentsIni, contentData);
     }
 
     // update note gist
@@ -576,6 +842,9 @@ bool StorageManager::setFetchedNoteContent(const QString &noteGuid, const QStrin
         titleChanged = (noteGistIni.value("Title") != title);
         noteGistIni.setValues(data);
     }
+    if (titleChanged) {
+        markNoteChangedForSearch(noteId);
+    }
     emit noteDisplayDataChanged(noteId, (lastUpdatedTime != updatedTime));
 #ifdef DEBUG
     qDebug() << "Note " << noteId << " content updated from server";
@@ -600,6 +869,7 @@ bool StorageManager::setPushedNote(const QString &noteId, const QString &title,
         lastUpdatedTime = noteGistIni.value("UpdatedTime").toLongLong();
         noteGistIni.setValues(gistData);
     }
+    markNoteChangedForSearch(noteId); // the title could have changed
     QByteArray currentContentHash; // md5sum of the content, including any local edits
     bool currentContentValid = false;
     {
@@ -618,7 +888,7 @@ bool StorageManager::setPushedNote(const QString &noteId, const QString &title,
             contentData[QString::fromLatin1("Content")] = QByteArray();
             {
                 IniFile noteContentsIni = notesDataIniFile("Notes/" % ID_PATH(noteId) % "/content.ini");
-                noteContentsIni.setValues(contentData);
+                setNoteContentValues(noteId, noteContentsIni, contentData);
             }
             // store in cache
             QString noteGuid = guidForNoteId(noteId);
@@ -864,7 +1134,10 @@ QString StorageManager::setSyncedNotebookData(const QString &guid, const QString
     if (notebookId.isEmpty()) {
         notebookId = createNotebook(name);
     } else {
-        setNotebookName(notebookId, name);
+        if (notebookName(notebookId) != name) {
+            setNotebookName(notebookId, name);
+            unsetSavedSearchesReferringToCollections();
+        }
         emit notebooksListChanged();
     }
     setNotebookGuid(notebookId, guid);
@@ -943,6 +1216,23 @@ QVariantList StorageManager::listNotebooks(StorageConstants::NotebookTypes noteb
         toReturn.append(orderedNotebooks.values());
     }
 
+    // add saved searches
+    if ((notebookTypes & StorageConstants::SavedSearchNotebook) == StorageConstants::SavedSearchNotebook) {
+        QMap<QString, QVariant> orderedSavedSearches;
+        QStringList savedSearchIds = listSavedSearchIds();
+        foreach (const QString &savedSearchId, savedSearchIds) {
+            IniFile savedSearchIni = notesDataIniFile("SavedSearches/" % ID_PATH(savedSearchId) % "/list.ini");
+            QVariantMap savedSearchData;
+            savedSearchData[QString::fromLatin1("NotebookId")] = savedSearchId;
+            QString savedSearchName = savedSearchIni.value("Name").toString();
+            savedSearchData[QString::fromLatin1("Name")] = savedSearchName;
+            savedSearchData[QString::fromLatin1("Query")] = savedSearchIni.value("Query").toString();
+            savedSearchData[QString::fromLatin1("NotebookType")] = StorageConstants::SavedSearchNotebook;
+            orderedSavedSearches.insert(savedSearchName.toLower(), savedSearchData);
+        }
+        toReturn.append(orderedSavedSearches.values());
+    }
+
     // add trash notebook
     if ((notebookTypes & StorageConstants::TrashNotebook) == StorageConstants::TrashNotebook) {
         QVariantMap notebookData;
@@ -1031,6 +1321,7 @@ bool StorageManager::renameNotebook(const QString &notebookId, const QString &_n
         notebookNameMap.setValue(name.toUpper(), notebookId);
     }
 
+    unsetSavedSearchesReferringToCollections();
     emit notebooksListChanged();
     return true;
 }
@@ -1203,7 +1494,10 @@ QString StorageManager::setSyncedTagData(const QString &guid, const QString &nam
     if (tagId.isEmpty()) {
         tagId = createTag(name);
     } else {
-        setTagName(tagId, name);
+        if (tagName(tagId) != name) {
+            setTagName(tagId, name);
+            unsetSavedSearchesReferringToCollections();
+        }
         emit tagsListChanged();
     }
     Q_ASSERT(!tagId.isEmpty());
@@ -1374,6 +1668,7 @@ bool StorageManager::renameTag(const QString &tagId, const QString &_name)
         tagNameMap.setValue(name.toUpper(), tagId);
     }
 
+    unsetSavedSearchesReferringToCollections();
     emit tagsListChanged();
     return true;
 }
@@ -1559,6 +1854,7 @@ bool StorageManager::expungeNoteFromTrash(const QString &noteId)
     if (removed) {
         removeGuidMapping("Notes/byGuid.ini", guid);
         rmMinusR(notesDataFullPath() % "/Notes/" % ID_PATH(noteId));
+        markNoteChangedForSearch(noteId);
 #ifdef DEBUG
         qDebug() << "Note " << noteId << " expunged";
 #endif
@@ -1585,6 +1881,7 @@ void StorageManager::expungeNote(const QString &noteId)
         removeGuidMapping("Notes/byGuid.ini", guid);
     }
     rmMinusR(notesDataFullPath() % "/Notes/" % ID_PATH(noteId));
+    markNoteChangedForSearch(noteId);
     setNoteHasUnpushedChanges(noteId, false);
     emit noteExpunged(noteId);
 }
@@ -1652,6 +1949,7 @@ void StorageManager::expungeNotebook(const QString &notebookId)
 
     // remove notebook directory
     rmMinusR(notesDataFullPath() % "/Notebooks/" % ID_PATH(notebookId));
+    unsetSavedSearchesReferringToCollections();
     emit notebooksListChanged();
 }
 
@@ -1689,10 +1987,189 @@ void StorageManager::expungeTag(const QString &tagId)
 
     // remove tag directory
     rmMinusR(notesDataFullPath() % "/Tags/" % ID_PATH(tagId));
+    unsetSavedSearchesReferringToCollections();
 
     emit tagsListChanged();
 }
 
+QString StorageManager::setSyncedSavedSearchData(const QString &guid, const QString &name, const QString &query)
+{
+    Q_ASSERT(!guid.isEmpty());
+    QString savedSearchId = savedSearchIdForGuid(guid);
+    if (savedSearchId.isEmpty()) {
+        QVariantMap data;
+        data[QString::fromLatin1("Name")] = name;
+        data[QString::fromLatin1("Query")] = query;
+        data[QString::fromLatin1("guid")] = guid;
+        savedSearchId = createStorageObject("SavedSearches", "ss",
+                                            "list.ini", "CurrentMaxLocalSavedSearchIdNumber", "SavedSearchIds",
+                                            "list.ini", data);
+        setGuidMapping("SavedSearches/byGuid.ini", guid, savedSearchId);
+    } else {
+        IniFile savedSearchIni = notesDataIniFile("SavedSearches/" % ID_PATH(savedSearchId) % "/list.ini");
+        savedSearchIni.setValue("Name", name);
+        if (savedSearchIni.value("Query").toString() != query) {
+            // the stored matching notes are of the earlier query
+            savedSearchIni.setValue("Query", query);
+            savedSearchIni.removeKey("NoteIds");
+            savedSearchIni.removeKey("NoteIdsStored");
+        }
+    }
+    Q_ASSERT(!savedSearchId.isEmpty());
+    emit savedSearchesListChanged();
+    return savedSearchId;
+}
+
+QString StorageManager::savedSearchIdForGuid(const QString &guid)
+{
+    Q_ASSERT(!guid.isEmpty());
+    if (guid.isEmpty()) {
+        return QString();
+    }
+    return localIdForGenericGuid("SavedSearches/byGuid.ini", guid);
+}
+
+QStringList StorageManager::listSavedSearchIds()
+{
+    return idsList("SavedSearches/list.ini", "SavedSearchIds");
+}
+
+QString StorageManager::savedSearchQuery(const QString &savedSearchId)
+{
+    if (savedSearchId.isEmpty()) {
+        return QString();
+    }
+    IniFile savedSearchIni = notesDataIniFile("SavedSearches/" % ID_PATH(savedSearchId) % "/list.ini");
+    return savedSearchIni.value("Query").toString();
+}
+
+bool StorageManager::savedSearchMatchingNoteIds(const QString &savedSearchId, QStringList *noteIds)
+{
+    if (savedSearchId.isEmpty()) {
+        return false;
+    }
+    QString noteIdsStr;
+    {
+        IniFile savedSearchIni = notesDataIniFile("SavedSearches/" % ID_PATH(savedSearchId) % "/list.ini");
+        if (!savedSearchIni.value("NoteIdsStored").toBool()) {
+            return false;
+        }
+        noteIdsStr = savedSearchIni.value("NoteIds").toString();
+    }
+    noteIds->clear();
+    if (!noteIdsStr.isEmpty()) {
+        (*noteIds) = noteIdsStr.split(",");
+    }
+    return true;
+}
+
+void StorageManager::setSavedSearchMatchingNoteIds(const QString &savedSearchId, const QStringList &noteIds)
+{
+    if (savedSearchId.isEmpty()) {
+        return;
+    }
+    IniFile savedSearchIni = notesDataIniFile("SavedSearches/" % ID_PATH(savedSearchId) % "/list.ini");
+    savedSearchIni.setValue("NoteIds", noteIds.join(","));
+    savedSearchIni.setValue("NoteIdsStored", true);
+}
+
+void StorageManager::expungeSavedSearch(const QString &savedSearchId)
+{
+    Q_ASSERT(!savedSearchId.isEmpty());
+    if (savedSearchId.isEmpty()) {
+        return;
+    }
+
+    // remove from guid map
+    QString guid;
+    {
+        IniFile savedSearchIni = notesDataIniFile("SavedSearches/" % ID_PATH(savedSearchId) % "/list.ini");
+        guid = savedSearchIni.value("guid").toString();
+    }
+    if (!guid.isEmpty()) {
+        removeGuidMapping("SavedSearches/byGuid.ini", guid);
+    }
+
+    // remove from saved searches list
+    removeObjectIdFromCollectionData("SavedSearches/list.ini", "SavedSearchIds", savedSearchId);
+
+    // remove saved search directory
+    rmMinusR(notesDataFullPath() % "/SavedSearches/" % ID_PATH(savedSearchId));
+
+    emit savedSearchesListChanged();
+}
+
+bool StorageManager::hasNotesChangedForSavedSearches()
+{
+    IniFile savedSearchesIni = notesDataIniFile("SavedSearches/list.ini");
+    return (!savedSearchesIni.value("ChangedNoteIds").toString().isEmpty() ||
+            !savedSearchesIni.value("RefreshingNoteIds").toString().isEmpty());
+}
+
+QStringList StorageManager::takeNotesChangedForSavedSearches()
+{
+    IniFile savedSearchesIni = notesDataIniFile("SavedSearches/list.ini");
+    QString changedNoteIdsStr = savedSearchesIni.value("ChangedNoteIds").toString();
+    QString refreshingNoteIdsStr = savedSearchesIni.value("RefreshingNoteIds").toString();
+    // Notes taken by an earlier refresh that didn't get done are taken again
+    QSet<QString> noteIds;
+    if (!changedNoteIdsStr.isEmpty()) {
+        noteIds += changedNoteIdsStr.split(",").toSet();
+    }
+    if (!refreshingNoteIdsStr.isEmpty()) {
+        noteIds += refreshingNoteIdsStr.split(",").toSet();
+    }
+    QStringList noteIdsList = noteIds.toList();
+    savedSearchesIni.setValue("RefreshingNoteIds", noteIdsList.join(","));
+    savedSearchesIni.removeKey("ChangedNoteIds");
+    return noteIdsList;
+}
+
+void StorageManager::doneRefreshingSavedSearches()
+{
+    IniFile savedSearchesIni = notesDataIniFile("SavedSearches/list.ini");
+    savedSearchesIni.removeKey("RefreshingNoteIds");
+}
+
+void StorageManager::markNoteChangedForSavedSearches(const QString &noteId)
+{
+    if (noteId.isEmpty()) {
+        return;
+    }
+    bool added = false;
+    {
+        IniFile savedSearchesIni = notesDataIniFile("SavedSearches/list.ini");
+        if (savedSearchesIni.value("SavedSearchIds").toString().isEmpty()) {
+            return; // there's nothing to keep up-to-date
+        }
+        QString changedNoteIdsStr = savedSearchesIni.value("ChangedNoteIds").toString();
+        if (changedNoteIdsStr.isEmpty()) {
+            savedSearchesIni.setValue("ChangedNoteIds", noteId);
+            added = true;
+        } else if (!changedNoteIdsStr.split(",").contains(noteId)) {
+            savedSearchesIni.setValue("ChangedNoteIds", QString(changedNoteIdsStr % "," % noteId));
+            added = true;
+        }
+    }
+    if (added) {
+        emit notesChangedForSavedSearches();
+    }
+}
+
+// Renaming or removing a notebook or tag can change which notes match "notebook:" and "tag:" terms, without any
+// note changing, so saved searches with those terms are searched in full the next time
+void StorageManager::unsetSavedSearchesReferringToCollections()
+{
+    foreach (const QString &savedSearchId, listSavedSearchIds()) {
+        IniFile savedSearchIni = notesDataIniFile("SavedSearches/" % ID_PATH(savedSearchId) % "/list.ini");
+        QString query = savedSearchIni.value("Query").toString();
+        if (query.contains("notebook:", Qt::CaseInsensitive) || query.contains("tag:", Qt::CaseInsensitive)) {
+            savedSearchIni.removeKey("NoteIds");
+            savedSearchIni.removeKey("NoteIdsStored");
+        }
+    }
+}
+
 bool StorageManager::setNoteThumbnail(const QString &noteId, const QImage &image, const QByteArray &sourceImageHash)
 {
     if (noteId.isEmpty()) {
@@ -1727,7 +2204,16 @@ bool StorageManager::setNoteThumbnail(const QString &noteId, const QImage &image
     QLatin1String imageHashSuffix(thumbnailHash.constData());
     QString imageFilename(notesDataRelativePath() % "/Notes/" % ID_PATH(noteId) % "/note_thumbnail_" % imageHashSuffix % ".jpg");
 
-    bool ok = image.save(notesDataLocation() % "/" % imageFilename, "JPG");
+    QString imageFileAbsolutePath = notesDataLocation() % "/" % imageFilename;
+    bool isThumbnailEncrypted = isAtRestEncryptionEnabled();
+    bool ok = false;
+    if (isThumbnailEncrypted) {
+        QBuffer imageBuffer;
+        ok = (imageBuffer.open(QIODevice::ReadWrite) && image.save(&imageBuffer, "JPG") &&
+              imageBuffer.seek(0) && EncryptedFile::encryptToFile(&imageBuffer, imageFileAbsolutePath));
+    } else {
+        ok = image.save(imageFileAbsolutePath, "JPG");
+    }
 
     if (ok) {
         IniFile noteGistIni = notesDataIniFile("Notes/" % ID_PATH(noteId) % "/gist.ini");
@@ -1739,6 +2225,7 @@ bool StorageManager::setNoteThumbnail(const QString &noteId, const QImage &image
             }
         }
         noteGistIni.setValue("ThumbnailPath", imageFilename);
+        noteGistIni.setValue("ThumbnailEncrypted", isThumbnailEncrypted);
         noteGistIni.setValue("ThumbnailWidth", image.width());
         noteGistIni.setValue("ThumbnailHeight", image.height());
         if (noteGistIni.value("ThumbnailSourceImageHash").toByteArray().isEmpty() && sourceImageHash.isEmpty()) {
@@ -1807,6 +2294,116 @@ QString StorageManager::retrieveStringSetting(const QString &key)
     return settingsIni.value(key).toString();
 }
 
+bool StorageManager::isAtRestEncryptionEnabled()
+{
+    return retrieveSetting("Storage/atRestEncryptionEnabled");
+}
+
+// Note content is stored in content.ini, or, when it's encrypted, in content.enc
+// (with content.ini still holding the hash and validity). content.enc is accessed only
+// while content.ini is held open, so the lock on content.ini covers content.enc as well.
+
+void StorageManager::setNoteContentValues(const QString &noteId, IniFile &noteContentsIni, const QVariantMap &_contentData)
+{
+    QVariantMap contentData = _contentData;
+    if (contentData.contains("Content")) {
+        const QByteArray content = contentData.value("Content").toByteArray();
+        const QString encryptedContentPath = notesDataFullPath() % "/Notes/" % ID_PATH(noteId) % "/content.enc";
+        bool isEncrypted = false;
+        if (!content.isEmpty() && isAtRestEncryptionEnabled()) {
+            QByteArray contentCopy(content);
+            QBuffer contentBuffer(&contentCopy);
+            const QString tempPath = encryptedContentPath % ".tmp";
+            if (contentBuffer.open(QIODevice::ReadOnly) && EncryptedFile::encryptToFile(&contentBuffer, tempPath)) {
+                QFile::remove(encryptedContentPath);
+                isEncrypted = QFile::rename(tempPath, encryptedContentPath);
+            }
+        }
+        if (isEncrypted) {
+            contentData[QString::fromLatin1("Content")] = QByteArray();
+        } else if (QFile::exists(encryptedContentPath)) {
+            QFile::remove(encryptedContentPath);
+        }
+        contentData[QString::fromLatin1("ContentEncrypted")] = isEncrypted;
+        if (!content.isEmpty()) {
+            setNoteContentSummary(noteId, content);
+        }
+    }
+    noteContentsIni.setValues(contentData);
+    markNoteChangedForSearch(noteId);
+}
+
+// The summary shown in the notes list is stored in gist.ini, so that listing notes doesn't read their content.
+// When the store is encrypted at rest, only the counts are stored, because gist.ini isn't encrypted.
+// Notes stored before there were summaries get theirs when they're first listed (see noteSummaryData()).
+
+void StorageManager::setNoteContentSummary(const QString &noteId, const QByteArray &content)
+{
+    QString summaryText;
+    int checkedTodoCount = 0, uncheckedTodoCount = 0, attachmentCount = 0;
+    bool parsed = EvernoteMarkup::contentSummaryFromEnml(content, CONTENT_SUMMARY_LENGTH, &summaryText,
+                                                         &checkedTodoCount, &uncheckedTodoCount, &attachmentCount);
+    storeNoteContentSummary(noteId, parsed, summaryText, checkedTodoCount, uncheckedTodoCount, attachmentCount);
+}
+
+void StorageManager::storeNoteContentSummary(const QString &noteId, bool isParsed, const QString &summaryText,
+                                             int checkedTodoCount, int uncheckedTodoCount, int attachmentCount)
+{
+    bool isSummaryTextStorable = (!isAtRestEncryptionEnabled());
+    IniFile noteGistIni = notesDataIniFile("Notes/" % ID_PATH(noteId) % "/gist.ini");
+    if (!isParsed) {
+        noteGistIni.removeKey("ContentSummaryVersion"); // to be tried again when listed
+        return;
+    }
+    QVariantMap summaryData;
+    summaryData[QString::fromLatin1("ContentSummaryVersion")] = CONTENT_SUMMARY_VERSION;
+    summaryData[QString::fromLatin1("CheckedTodoCount")] = checkedTodoCount;
+    summaryData[QString::fromLatin1("UncheckedTodoCount")] = uncheckedTodoCount;
+    summaryData[QString::fromLatin1("AttachmentCount")] = attachmentCount;
+    if (isSummaryTextStorable) {
+        summaryData[QString::fromLatin1("ContentSummary")] = summaryText;
+    }
+    noteGistIni.setValues(summaryData);
+    if (!isSummaryTextStorable) {
+        noteGistIni.removeKey("ContentSummary");
+    }
+}
+
+QByteArray StorageManager::noteContentValue(const QString &noteId, const IniFile &noteContentsIni, int maxLength)
+{
+    if (!noteContentsIni.value("ContentEncrypted").toBool()) {
+        return noteContentsIni.value("Content").toByteArray();
+    }
+    EncryptedFile encryptedContentFile(notesDataFullPath() % "/Notes/" % ID_PATH(noteId) % "/content.enc");
+    if (!encryptedContentFile.open(QIODevice::ReadOnly)) {
+        return QByteArray();
+    }
+    if (maxLength >= 0) {
+        return encryptedContentFile.read(maxLength);
+    }
+    return encryptedContentFile.readAll();
+}
+
+bool StorageManager::encryptFileIfRequired(const QString &filePath)
+{
+    if (!isAtRestEncryptionEnabled() || EncryptedFile::isEncryptedFile(filePath)) {
+        return true;
+    }
+    const QString tempPath = filePath % ".tmp";
+    bool encrypted = false;
+    {
+        QFile clearTextFile(filePath);
+        if (clearTextFile.open(QIODevice::ReadOnly)) {
+            encrypted = EncryptedFile::encryptToFile(&clearTextFile, tempPath);
+        }
+    }
+    if (!encrypted) {
+        return false;
+    }
+    QFile::remove(filePath);
+    return QFile::rename(tempPath, filePath);
+}
+
 
 void StorageManager::setNoteHasUnpushedChanges(const QString &noteId, bool hasUnpushedChanges)
 {
@@ -1897,6 +2494,7 @@ void StorageManager::setAttachmentsDataFromServer(const QString &noteId, const Q
     if (noteId.isEmpty()) {
         return;
     }
+    markNoteChangedForSearch(noteId); // the types of attachments could change
     IniFile noteAttachmentsIni = notesDataIniFile("Notes/" % ID_PATH(noteId) % "/attachments.ini");
     bool isMarkedOffline = noteNeedsToBeAvailableOffline(noteId);
 
@@ -1929,6 +2527,9 @@ void StorageManager::setAttachmentsDataFromServer(const QString &noteId, const Q
         unpushedRemovedGuids = unpushedRemovedGuidsStr.split(',');
     }
 
+    QSet<QString> presentFiles = presentAttachmentFiles(noteId, noteAttachmentsIni);
+    bool hasUnfetchedSearchText = false;
+
     // set new attachments data
     noteAttachmentsIni.beginWriteArray("Attachments");
     int i = 0;
@@ -1955,14 +2556,22 @@ void StorageManager::setAttachmentsDataFromServer(const QString &noteId, const Q
             noteAttachmentsIni.setValue("Dimensions", map.value("Dimensions").toSize());
             noteAttachmentsIni.setValue("Duration", map.value("Duration").toInt());
             noteAttachmentsIni.setValue("FileName", map.value("FileName").toString());
+            bool hasRecognition = map.value("HasRecognition").toBool();
+            noteAttachmentsIni.setValue("HasRecognition", hasRecognition);
+            if (hasRecognition && !attachmentGuid.isEmpty()) {
+                hasUnfetchedSearchText = true; // attachmentsWithUnfetchedSearchText() will tell which ones
+            }
 
             // Get existing attachment fileName
-            QString attachmentFullLocalPath = notesDataFullPath() % "/Notes/" % ID_PATH(noteId) % "/Attachments/" % md5Hash;
-            if (!QFile::exists(attachmentFullLocalPath)) {
-                attachmentFullLocalPath = notesDataFullPath() % "/Notes/" % ID_PATH(noteId) % "/Attachments/" % attachmentGuid; // v1.3 and earlier
-                if (!QFile::exists(attachmentFullLocalPath)) {
-                    attachmentFullLocalPath = "";
-                }
+            QString attachmentFileName;
+            if (presentFiles.contains(QLatin1String(md5Hash.constData()))) {
+                attachmentFileName = QLatin1String(md5Hash.constData());
+            } else if (!attachmentGuid.isEmpty() && presentFiles.contains(attachmentGuid)) {
+                attachmentFileName = attachmentGuid; // v1.3 and earlier
+            }
+            QString attachmentFullLocalPath;
+            if (!attachmentFileName.isEmpty()) {
+                attachmentFullLocalPath = notesDataFullPath() % "/Notes/" % ID_PATH(noteId) % "/Attachments/" % attachmentFileName;
             }
 
             // Remove attachment file if applicable
@@ -1970,10 +2579,11 @@ void StorageManager::setAttachmentsDataFromServer(const QString &noteId, const Q
                 // attachment was pushed to the server, can remove local copy now
                 QString webApiUrlPrefix = retrieveEvernoteAuthData("webApiUrlPrefix");
                 QFile attachmentLocalFile(attachmentFullLocalPath);
-                if (!webApiUrlPrefix.isEmpty()) {
+                if (!webApiUrlPrefix.isEmpty() && !EncryptedFile::isEncryptedFile(attachmentFullLocalPath)) { // encrypted data doesn't go into the cache
                     SharedDiskCache::instance()->insertEvernoteNoteAttachment(webApiUrlPrefix, attachmentGuid, &attachmentLocalFile, static_cast<qint64>(attachmentSize));
                 }
                 attachmentLocalFile.remove();
+                presentFiles.remove(attachmentFileName);
             }
 
             // Remove from the QHash
@@ -1992,16 +2602,15 @@ void StorageManager::setAttachmentsDataFromServer(const QString &noteId, const Q
         QString mimeType = map.value("MimeType").toString();
 
         // Get existing attachment fileName
-        QString attachmentFullLocalPath = notesDataFullPath() % "/Notes/" % ID_PATH(noteId) % "/Attachments/" % md5Hash;
-        if (!QFile::exists(attachmentFullLocalPath)) {
-            attachmentFullLocalPath = notesDataFullPath() % "/Notes/" % ID_PATH(noteId) % "/Attachments/" % attachmentGuid;
-            if (attachmentGuid.isEmpty() || !QFile::exists(attachmentFullLocalPath)) {
-                attachmentFullLocalPath = "";
-            }
+        QString attachmentFileName;
+        if (presentFiles.contains(QLatin1String(md5Hash.constData()))) {
+            attachmentFileName = QLatin1String(md5Hash.constData());
+        } else if (!attachmentGuid.isEmpty() && presentFiles.contains(attachmentGuid)) {
+            attachmentFileName = attachmentGuid;
         }
 
         // Make sure files under Attachments/ dir are in accordance with attachments.ini
-        if (!attachmentFullLocalPath.isEmpty()) {
+        if (!attachmentFileName.isEmpty()) {
             // if the attachment exists as a file in Attachments/
             if (attachmentGuid.isEmpty()) {
                 // attachment is not pushed yet; this should remain in attachments.ini
@@ -2016,7 +2625,8 @@ void StorageManager::setAttachmentsDataFromServer(const QString &noteId, const Q
                 i++;
             } else {
                 // attachment was probably removed in the server; we don't need the file anymore
-                QFile::remove(attachmentFullLocalPath);
+                QFile::remove(notesDataFullPath() % "/Notes/" % ID_PATH(noteId) % "/Attachments/" % attachmentFileName);
+                presentFiles.remove(attachmentFileName);
                 if (mimeType.startsWith("image/")) {
                     removedImagesCount++;
                 }
@@ -2026,6 +2636,12 @@ void StorageManager::setAttachmentsDataFromServer(const QString &noteId, const Q
 
     noteAttachmentsIni.endArray();
 
+    setPresentAttachmentFiles(noteAttachmentsIni, presentFiles);
+
+    if (hasUnfetchedSearchText && !attachmentsWithUnfetchedSearchText(noteId).isEmpty()) {
+        addToEvernoteSyncIdsList("NoteIdsWithUnfetchedSearchText", noteId);
+    }
+
     if (_removedImagesCount) {
         (*_removedImagesCount) = removedImagesCount;
     }
@@ -2094,6 +2710,7 @@ bool StorageManager::removeAttachmentData(const QString &noteId, const QByteArra
     if (md5HashToRemove.isEmpty()) {
         return false;
     }
+    markNoteChangedForSearch(noteId);
 
     IniFile noteAttachmentsIni = notesDataIniFile("Notes/" % ID_PATH(noteId) % "/attachments.ini");
     bool removed = false;
@@ -2155,6 +2772,76 @@ bool StorageManager::removeAttachmentData(const QString &noteId, const QByteArra
     return removed;
 }
 
+// The size of an attachment's data, whether or not the file is encrypted
+static qint64 attachmentFileSize(const QFileInfo &fileInfo)
+{
+    qint64 clearTextSize = EncryptedFile::clearTextSize(fileInfo.absoluteFilePath());
+    return (clearTextSize >= 0? clearTextSize : fileInfo.size());
+}
+
+// The names of the files under the note's Attachments/ dir are recorded in attachments.ini
+// whenever a file is added or removed there, so that listing the attachments doesn't need
+// to stat each file. For data stored before this was recorded, we list the dir once.
+QSet<QString> StorageManager::presentAttachmentFiles(const QString &noteId, IniFile &noteAttachmentsIni)
+{
+    QVariant presentFilesValue = noteAttachmentsIni.value("AttachmentFiles/present");
+    if (presentFilesValue.isValid()) {
+        QString presentFilesStr = presentFilesValue.toString();
+        if (presentFilesStr.isEmpty()) {
+            return QSet<QString>();
+        }
+        return presentFilesStr.split(',').toSet();
+    }
+    QSet<QString> presentFiles;
+    QDir attachmentsDir(notesDataFullPath() % "/Notes/" % ID_PATH(noteId) % "/Attachments");
+    int count = noteAttachmentsIni.beginReadArray("Attachments");
+    if (count > 0 && attachmentsDir.exists()) {
+        QSet<QString> existingFiles = attachmentsDir.entryList(QDir::Files).toSet();
+        for (int i = 0; i < count; i++) {
+            noteAttachmentsIni.setArrayIndex(i);
+            QString md5Hash = noteAttachmentsIni.value("Hash").toString();
+            QString attachmentGuid = noteAttachmentsIni.value("guid").toString();
+            qint32 attachmentSize = noteAttachmentsIni.value("Size").toInt();
+            // Sizes are checked only here; files are marked present only after they're completely written
+            if (existingFiles.contains(md5Hash) &&
+                attachmentFileSize(QFileInfo(attachmentsDir.filePath(md5Hash))) == attachmentSize) {
+                presentFiles << md5Hash;
+            } else if (!attachmentGuid.isEmpty() && existingFiles.contains(attachmentGuid) &&
+                attachmentFileSize(QFileInfo(attachmentsDir.filePath(attachmentGuid))) == attachmentSize) {
+                presentFiles << attachmentGuid;
+            }
+        }
+    }
+    noteAttachmentsIni.endArray();
+    setPresentAttachmentFiles(noteAttachmentsIni, presentFiles);
+    return presentFiles;
+}
+
+void StorageManager::setPresentAttachmentFiles(IniFile &noteAttachmentsIni, const QSet<QString> &fileNames)
+{
+    QStringList fileNamesList = fileNames.toList();
+    fileNamesList.sort();
+    noteAttachmentsIni.setValue("AttachmentFiles/present", fileNamesList.join(","));
+}
+
+void StorageManager::setAttachmentFilePresent(const QString &noteId, const QString &fileName, bool isPresent)
+{
+    if (noteId.isEmpty() || fileName.isEmpty()) {
+        return;
+    }
+    IniFile noteAttachmentsIni = notesDataIniFile("Notes/" % ID_PATH(noteId) % "/attachments.ini");
+    QSet<QString> presentFiles = presentAttachmentFiles(noteId, noteAttachmentsIni);
+    if (presentFiles.contains(fileName) == isPresent) {
+        return;
+    }
+    if (isPresent) {
+        presentFiles.insert(fileName);
+    } else {
+        presentFiles.remove(fileName);
+    }
+    setPresentAttachmentFiles(noteAttachmentsIni, presentFiles);
+}
+
 QVariantList StorageManager::attachmentsData(const QString &noteId)
 {
     if (noteId.isEmpty()) {
@@ -2162,6 +2849,9 @@ QVariantList StorageManager::attachmentsData(const QString &noteId)
     }
     QVariantList returnAttachmentsList;
     IniFile noteAttachmentsIni = notesDataIniFile("Notes/" % ID_PATH(noteId) % "/attachments.ini");
+    QSet<QString> presentFiles = presentAttachmentFiles(noteId, noteAttachmentsIni);
+    QSet<QString> missingFiles;
+    const QString attachmentsDirPath = notesDataFullPath() % "/Notes/" % ID_PATH(noteId) % "/Attachments/";
     int count = noteAttachmentsIni.beginReadArray("Attachments");
     for (int i = 0; i < count; i++) {
         noteAttachmentsIni.setArrayIndex(i);
@@ -2176,19 +2866,28 @@ QVariantList StorageManager::attachmentsData(const QString &noteId)
         qint32 attachmentSize = noteAttachmentsIni.value("Size").toInt();
         map["Size"] = attachmentSize;
         map["FileName"] = noteAttachmentsIni.value("FileName").toString();
-        QFileInfo fileInfo(notesDataFullPath() % "/Notes/" % ID_PATH(noteId) % "/Attachments/" % QLatin1String(md5Hash.constData()));
-        if (fileInfo.exists() && (fileInfo.size() == attachmentSize)) {
-            map["FilePath"] = fileInfo.absoluteFilePath();
-        } else if (!attachmentGuid.isEmpty()) {
+        QString presentFileName;
+        if (presentFiles.contains(QLatin1String(md5Hash.constData()))) {
+            presentFileName = QLatin1String(md5Hash.constData());
+        } else if (!attachmentGuid.isEmpty() && presentFiles.contains(attachmentGuid)) {
             // In v1.3 and earlier, we used attachmentGuid as the filename
-            QFileInfo fileInfo(notesDataFullPath() % "/Notes/" % ID_PATH(noteId) % "/Attachments/" % attachmentGuid);
-            if (fileInfo.exists() && (fileInfo.size() == attachmentSize)) {
-                map["FilePath"] = fileInfo.absoluteFilePath();
+            presentFileName = attachmentGuid;
+        }
+        if (!presentFileName.isEmpty()) {
+            // The file could have been deleted outside the app since it was recorded as present
+            QString filePath = attachmentsDirPath % presentFileName;
+            if (QFile::exists(filePath)) {
+                map["FilePath"] = filePath;
+            } else {
+                missingFiles << presentFileName;
             }
         }
         returnAttachmentsList << map;
     }
     noteAttachmentsIni.endArray();
+    if (!missingFiles.isEmpty()) {
+        setPresentAttachmentFiles(noteAttachmentsIni, presentFiles.subtract(missingFiles));
+    }
     return returnAttachmentsList;
 }
 
@@ -2209,6 +2908,87 @@ qint64 StorageManager::noteAttachmentsTotalSize(const QString &noteId)
     return totalSize;
 }
 
+QVariantList StorageManager::attachmentsWithUnfetchedSearchText(const QString &noteId)
+{
+    if (noteId.isEmpty()) {
+        return QVariantList();
+    }
+    QVariantList unfetchedAttachments;
+    IniFile noteAttachmentsIni = notesDataIniFile("Notes/" % ID_PATH(noteId) % "/attachments.ini");
+    IniFile noteRecognitionIni = notesDataIniFile("Notes/" % ID_PATH(noteId) % "/recognition.ini");
+    int count = noteAttachmentsIni.beginReadArray("Attachments");
+    for (int i = 0; i < count; i++) {
+        noteAttachmentsIni.setArrayIndex(i);
+        QString attachmentGuid = noteAttachmentsIni.value("guid").toString();
+        if (attachmentGuid.isEmpty() || !noteAttachmentsIni.value("HasRecognition").toBool()) {
+            continue;
+        }
+        QByteArray md5Hash = noteAttachmentsIni.value("Hash").toByteArray();
+        if (noteRecognitionIni.value("SearchText/" % QLatin1String(md5Hash.constData())).isValid() ||
+            noteRecognitionIni.value("SearchTextEncrypted/" % QLatin1String(md5Hash.constData())).toBool()) {
+            continue; // already fetched, even if there was no text to be found
+        }
+        QVariantMap map;
+        map["guid"] = attachmentGuid;
+        map["Hash"] = md5Hash;
+        unfetchedAttachments << map;
+    }
+    noteAttachmentsIni.endArray();
+    return unfetchedAttachments;
+}
+
+// The text recognized in an attachment is stored in recognition.ini. When the store is encrypted at rest, it's
+// stored instead in an encrypted recognition_<hash>.enc file, because recognition.ini isn't encrypted.
+
+void StorageManager::setAttachmentSearchText(const QString &noteId, const QByteArray &md5Hash, const QString &searchText)
+{
+    if (noteId.isEmpty() || md5Hash.isEmpty()) {
+        return;
+    }
+    const QString hashStr = QLatin1String(md5Hash.constData());
+    const QString encryptedTextPath = notesDataFullPath() % "/Notes/" % ID_PATH(noteId) % "/recognition_" % hashStr % ".enc";
+    IniFile noteRecognitionIni = notesDataIniFile("Notes/" % ID_PATH(noteId) % "/recognition.ini");
+    if (!searchText.isEmpty() && isAtRestEncryptionEnabled()) {
+        const QString tempPath = encryptedTextPath % ".tmp";
+        bool ok = false;
+        {
+            EncryptedFile encryptedFile(tempPath);
+            if (encryptedFile.open(QIODevice::WriteOnly)) {
+                QByteArray textData = searchText.toUtf8();
+                ok = (encryptedFile.write(textData) == textData.size() && encryptedFile.commit());
+                encryptedFile.close();
+            }
+        }
+        QFile::remove(encryptedTextPath);
+        if (!ok || !QFile::rename(tempPath, encryptedTextPath)) {
+            QFile::remove(tempPath);
+            return; // left unfetched, to be fetched again in the next sync
+        }
+        noteRecognitionIni.removeKey("SearchText/" % hashStr);
+        noteRecognitionIni.setValue("SearchTextEncrypted/" % hashStr, true);
+    } else {
+        noteRecognitionIni.setValue("SearchText/" % hashStr, searchText);
+        noteRecognitionIni.removeKey("SearchTextEncrypted/" % hashStr);
+        QFile::remove(encryptedTextPath);
+    }
+    if (!searchText.isEmpty()) {
+        markNoteChangedForSearch(noteId);
+    }
+}
+
+QString StorageManager::attachmentSearchText(const QString &noteId, const IniFile &noteRecognitionIni, const QByteArray &md5Hash)
+{
+    const QString hashStr = QLatin1String(md5Hash.constData());
+    if (!noteRecognitionIni.value("SearchTextEncrypted/" % hashStr).toBool()) {
+        return noteRecognitionIni.value("SearchText/" % hashStr).toString();
+    }
+    QScopedPointer<QIODevice> device(EncryptedFile::openForReading(notesDataFullPath() % "/Notes/" % ID_PATH(noteId) % "/recognition_" % hashStr % ".enc"));
+    if (device.isNull()) {
+        return QString();
+    }
+    return QString::fromUtf8(device->readAll());
+}
+
 bool StorageManager::saveCheckboxStates(const QString &noteId, const QVariantList &checkboxStates,  const QByteArray &enmlContent,const QByteArray &baseContentHash)
 {
     if (noteId.isEmpty()) {
@@ -2237,7 +3017,7 @@ bool StorageManager::saveCheckboxStates(const QString &noteId, const QVariantLis
             contentData[QString::fromLatin1("Content")] = newContent;
             contentData[QString::fromLatin1("ContentHash")] = newContentHash;
             contentData[QString::fromLatin1("ContentValid")] = true;
-            noteContentsIni.setValues(contentData);
+            setNoteContentValues(noteId, noteContentsIni, contentData);
         }
     }
 
@@ -2298,7 +3078,7 @@ bool StorageManager::appendTextToNote(const QString &noteId, const QString &text
             contentData[QString::fromLatin1("Content")] = newContent;
             contentData[QString::fromLatin1("ContentHash")] = newContentHash;
             contentData[QString::fromLatin1("ContentValid")] = true;
-            noteContentsIni.setValues(contentData);
+            setNoteContentValues(noteId, noteContentsIni, contentData);
             if (updatedEnml) {
                 (*updatedEnml) = newContent;
             }
@@ -2339,6 +3119,7 @@ bool StorageManager::appendAttachmentToNote(const QString &noteId, const QString
 
     IniFile noteContentEditLock = notesDataIniFile("Notes/" % ID_PATH(noteId) % "/note_content_edit_lock");
     Q_UNUSED(noteContentEditLock);
+    markNoteChangedForSearch(noteId);
 
     // Create a copy and compute md5sum
 
@@ -2377,7 +3158,7 @@ bool StorageManager::appendAttachmentToNote(const QString &noteId, const QString
     bool attachmentAlreadyExists = false;
     if (QFile::exists(targetFileAbsolutePath)) {
         QFile alreadyExistingFile(targetFileAbsolutePath);
-        if (alreadyExistingFile.size() == fileSize) {
+        if (attachmentFileSize(QFileInfo(targetFileAbsolutePath)) == fileSize) {
             attachmentAlreadyExists = true;
         } else {
             alreadyExistingFile.remove();
@@ -2400,8 +3181,10 @@ bool StorageManager::appendAttachmentToNote(const QString &noteId, const QString
             return false;
         }
         tempFile.setAutoRemove(false);
+        encryptFileIfRequired(targetFileAbsolutePath);
     }
     addAttachmentData(noteId, attachmentPropertiesMap); // add to attachments.ini
+    setAttachmentFilePresent(noteId, QLatin1String(md5Hash.constData()), true);
 
     // Get the updated enml
 
@@ -2427,7 +3210,7 @@ bool StorageManager::appendAttachmentToNote(const QString &noteId, const QString
             contentData[QString::fromLatin1("Content")] = newContent;
             contentData[QString::fromLatin1("ContentHash")] = newContentHash;
             contentData[QString::fromLatin1("ContentValid")] = true;
-            noteContentsIni.setValues(contentData);
+            setNoteContentValues(noteId, noteContentsIni, contentData);
             if (updatedEnml) {
                 (*updatedEnml) = newContent;
             }
@@ -2470,9 +3253,11 @@ bool StorageManager::removeAttachmentFile(const QString &noteId, const QVariantM
         return false;
     }
     QString attachmentGuid = attachmentData.value("guid").toString();
-    QString attachmentFullLocalPath = notesDataFullPath() % "/Notes/" % ID_PATH(noteId) % "/Attachments/" % md5Hash;
+    QString attachmentFileName = QLatin1String(md5Hash.constData());
+    QString attachmentFullLocalPath = notesDataFullPath() % "/Notes/" % ID_PATH(noteId) % "/Attachments/" % attachmentFileName;
     if (!QFile::exists(attachmentFullLocalPath)) {
-        attachmentFullLocalPath = notesDataFullPath() % "/Notes/" % ID_PATH(noteId) % "/Attachments/" % attachmentGuid;
+        attachmentFileName = attachmentGuid;
+        attachmentFullLocalPath = notesDataFullPath() % "/Notes/" % ID_PATH(noteId) % "/Attachments/" % attachmentFileName;
         if (attachmentGuid.isEmpty() || !QFile::exists(attachmentFullLocalPath)) {
             attachmentFullLocalPath = "";
         }
@@ -2481,6 +3266,9 @@ bool StorageManager::removeAttachmentFile(const QString &noteId, const QVariantM
         QFile file(attachmentFullLocalPath);
         if (file.exists()) {
             bool removed = file.remove();
+            if (removed) {
+                setAttachmentFilePresent(noteId, attachmentFileName, false);
+            }
             return removed;
         }
     }
@@ -2525,6 +3313,248 @@ QStringList StorageManager::unremovedTempFiles()
     return tempFilesList;
 }
 
+// Bulk import
+// Notes are written in batches: each note's own files are written one by one, but the
+// shared list files (all-notes, notebook, tags, notes-to-push) are updated once per batch.
+
+QStringList StorageManager::createImportedNotes(const QList<QVariantMap> &notesData, const QString &_notebookId)
+{
+    if (notesData.isEmpty()) {
+        return QStringList();
+    }
+    QString notebookId = (_notebookId.isEmpty()? defaultNotebookId() : _notebookId);
+
+    // Reserve a range of noteIds for the whole batch
+    int firstIdNumber;
+    {
+        IniFile notesListIni = notesDataIniFile("Notes/list.ini");
+        firstIdNumber = notesListIni.value("CurrentMaxLocalNoteIdNumber", 0).toInt() + 1;
+        notesListIni.setValue("CurrentMaxLocalNoteIdNumber", firstIdNumber + notesData.count() - 1);
+    }
+
+    QStringList noteIds;
+    QList<QPair<qint64, QString> > noteIdsWithTimestamps;
+    QHash<QString, QString> tagIdsByName; // uppercased tag name -> tagId
+    QMap<QString, QStringList> noteIdsByTagId;
+    for (int i = 0; i < notesData.count(); i++) {
+        const QVariantMap &noteData = notesData.at(i);
+        QString numStr;
+        const QString noteId = QLatin1String("nt") % numStr.sprintf("%06x", firstIdNumber + i);
+
+        // Resolve tags by name, creating the ones we don't have yet
+        QStringList tagIds;
+        foreach (const QString &_tagName, noteData.value("TagNames").toStringList()) {
+            const QString name = legalizedTagName(_tagName);
+            if (name.isEmpty()) {
+                continue;
+            }
+            QString tagId = tagIdsByName.value(name.toUpper());
+            if (tagId.isEmpty()) {
+                {
+                    IniFile tagNameMap = notesDataIniFile("Tags/names.ini");
+                    tagId = tagNameMap.value(name.toUpper()).toString();
+                }
+                if (tagId.isEmpty()) {
+                    tagId = createTag(name);
+                }
+                tagIdsByName.insert(name.toUpper(), tagId);
+            }
+            if (!tagId.isEmpty() && !tagIds.contains(tagId)) {
+                tagIds << tagId;
+                noteIdsByTagId[tagId].prepend(noteId);
+            }
+        }
+
+        // Note gist
+        QVariantMap gistData;
+        QMapIterator<QString, QVariant> iter(noteData);
+        while (iter.hasNext()) {
+            iter.next();
+            if (iter.key().startsWith(QLatin1String("Attributes/"))) {
+                gistData[iter.key()] = iter.value();
+            }
+        }
+        qint64 now = QDateTime::currentDateTime().toMSecsSinceEpoch();
+        qint64 createdTime = noteData.value("CreatedTime", now).toLongLong();
+        qint64 updatedTime = noteData.value("UpdatedTime", createdTime).toLongLong();
+        gistData[QString::fromLatin1("Title")] = legalizedNoteTitle(noteData.value("Title").toString());
+        gistData[QString::fromLatin1("CreatedTime")] = createdTime;
+        gistData[QString::fromLatin1("UpdatedTime")] = updatedTime;
+        gistData[QString::fromLatin1("CreatedHere")] = true;
+        if (!notebookId.isEmpty()) {
+            gistData[QString::fromLatin1("NotebookId")] = notebookId;
+        }
+        if (!tagIds.isEmpty()) {
+            gistData[QString::fromLatin1("TagIds")] = tagIds.join(",");
+        }
+        {
+            IniFile noteGistIni = notesDataIniFile("Notes/" % ID_PATH(noteId) % "/gist.ini");
+            noteGistIni.setValues(gistData);
+        }
+
+        // Note content
+        {
+            const QByteArray content = noteData.value("Content").toByteArray();
+            QVariantMap contentData;
+            contentData[QString::fromLatin1("Content")] = content;
+            contentData[QString::fromLatin1("ContentHash")] = QCryptographicHash::hash(content, QCryptographicHash::Md5).toHex();
+            contentData[QString::fromLatin1("ContentValid")] = true;
+            IniFile noteContentsIni = notesDataIniFile("Notes/" % ID_PATH(noteId) % "/content.ini");
+            setNoteContentValues(noteId, noteContentsIni, contentData);
+        }
+
+        // Note attachments: the attachment data is expected to be already decoded into temporary files
+        const QVariantList attachments = noteData.value("Attachments").toList();
+        if (!attachments.isEmpty()) {
+            QString attachmentsDirPath = notesDataRelativePath() % "/Notes/" % ID_PATH(noteId) % "/Attachments";
+            QDir(notesDataLocation()).mkpath(attachmentsDirPath);
+            QList<QVariantMap> storedAttachments;
+            QSet<QString> presentFiles;
+            foreach (const QVariant &attachment, attachments) {
+                QVariantMap map = attachment.toMap();
+                const QByteArray md5Hash = map.value("Hash").toByteArray();
+                const QString tempFilePath = map.take("TempFilePath").toString();
+                if (md5Hash.isEmpty() || tempFilePath.isEmpty()) {
+                    continue;
+                }
+                QString targetFileAbsolutePath = notesDataLocation() % "/" % attachmentsDirPath % "/" % QLatin1String(md5Hash.constData());
+                if (QFile::exists(targetFileAbsolutePath)) {
+                    // Same attachment occurring twice in the same note
+                    QFile::remove(tempFilePath);
+                } else if (!QFile::rename(tempFilePath, targetFileAbsolutePath)) {
+                    QFile::remove(tempFilePath);
+                    continue;
+                } else {
+                    encryptFileIfRequired(targetFileAbsolutePath);
+                }
+                map["guid"] = QString("");
+                storedAttachments << map;
+                presentFiles << QLatin1String(md5Hash.constData());
+            }
+            IniFile noteAttachmentsIni = notesDataIniFile("Notes/" % ID_PATH(noteId) % "/attachments.ini");
+            noteAttachmentsIni.beginWriteArray("Attachments", storedAttachments.count());
+            for (int j = 0; j < storedAttachments.count(); j++) {
+                const QVariantMap &map = storedAttachments[j];
+                noteAttachmentsIni.setArrayIndex(j);
+                noteAttachmentsIni.setValue("guid", map.value("guid").toString());
+                noteAttachmentsIni.setValue("Hash", map.value("Hash").toByteArray());
+                noteAttachmentsIni.setValue("MimeType", map.value("MimeType").toString());
+                noteAttachmentsIni.setValue("Dimensions", map.value("Dimensions").toSize());
+                noteAttachmentsIni.setValue("Duration", map.value("Duration").toInt());
+                noteAttachmentsIni.setValue("Size", map.value("Size").toInt());
+                noteAttachmentsIni.setValue("FileName", map.value("FileName").toString());
+            }
+            noteAttachmentsIni.endArray();
+            setPresentAttachmentFiles(noteAttachmentsIni, presentFiles);
+        }
+
+        noteIds.prepend(noteId); // most recently imported first, like createNote() does
+        noteIdsWithTimestamps << qMakePair((updatedTime > 0? updatedTime : createdTime), noteId);
+    }
+
+    // Update the shared lists once for the whole batch
+    insertNoteIdsInNotesListByTimestamp(noteIdsWithTimestamps);
+    if (!notebookId.isEmpty()) {
+        addObjectIdsToCollectionData("Notebooks/" % ID_PATH(notebookId) % "/list.ini", "NoteIds", noteIds);
+    }
+    QMapIterator<QString, QStringList> tagIter(noteIdsByTagId);
+    while (tagIter.hasNext()) {
+        tagIter.next();
+        addObjectIdsToCollectionData("Tags/" % ID_PATH(tagIter.key()) % "/list.ini", "NoteIds", tagIter.value());
+    }
+
+    // Imported notes are pushed in the next sync, just like notes created in the app
+    addObjectIdsToCollectionData("list.ini", "NotesToPush", noteIds);
+
+    // The notes were marked changed one by one before the lists above had them, so a search that started
+    // in between could be cached as current without them
+    bumpStoreGeneration();
+
+#ifdef DEBUG
+    qDebug() << "Imported notes" << noteIds;
+#endif
+    return noteIds;
+}
+
+// Imported notes have their own timestamps, so they're inserted where those put them in the
+// most-recently-updated-first notes list, rather than at its top. Since the list is already in order,
+// each note's position is found with a binary search, reading only a few of the existing notes' gists.
+// The gists are read without holding the lock on the list, because opening another IniFile can need
+// the cache lock for writing. The merged list is written only if the list hasn't changed meanwhile,
+// so that notes added or removed meanwhile aren't lost or brought back. Otherwise, it's merged again.
+
+void StorageManager::insertNoteIdsInNotesListByTimestamp(QList<QPair<qint64, QString> > noteIdsWithTimestamps)
+{
+    if (noteIdsWithTimestamps.isEmpty()) {
+        return;
+    }
+    qSort(noteIdsWithTimestamps.begin(), noteIdsWithTimestamps.end(), qGreater<QPair<qint64, QString> >());
+
+    QHash<QString, qint64> existingTimestamps; // noteId -> timestamp, as read so far
+    forever {
+        QString noteIdsStr;
+        {
+            IniFile notesListIni = notesDataIniFile("Notes/list.ini");
+            noteIdsStr = notesListIni.value("NoteIds").toString();
+        }
+        QStringList existingNoteIds;
+        if (!noteIdsStr.isEmpty()) {
+            existingNoteIds = noteIdsStr.split(",");
+        }
+        const QSet<QString> existingNoteIdsSet = existingNoteIds.toSet();
+
+        QStringList mergedNoteIds;
+        int unmergedStartIndex = 0;
+        for (int i = 0; i < noteIdsWithTimestamps.count(); i++) {
+            const qint64 timestamp = noteIdsWithTimestamps.at(i).first;
+            const QString &noteId = noteIdsWithTimestamps.at(i).second;
+            if (existingNoteIdsSet.contains(noteId)) {
+                continue;
+            }
+            // Find the first of the remaining existing notes that's older than this note
+            int low = unmergedStartIndex, high = existingNoteIds.count();
+            while (low < high) {
+                int mid = (low + high) / 2;
+                const QString &existingNoteId = existingNoteIds.at(mid);
+                if (!existingTimestamps.contains(existingNoteId)) {
+                    existingTimestamps[existingNoteId] = noteTimestamp(existingNoteId);
+                }
+                if (existingTimestamps.value(existingNoteId) >= timestamp) {
+                    low = mid + 1;
+                } else {
+                    high = mid;
+                }
+            }
+            mergedNoteIds += existingNoteIds.mid(unmergedStartIndex, low - unmergedStartIndex);
+            mergedNoteIds << noteId;
+            unmergedStartIndex = low;
+        }
+        mergedNoteIds += existingNoteIds.mid(unmergedStartIndex);
+
+        IniFile notesListIni = notesDataIniFile("Notes/list.ini");
+        if (notesListIni.value("NoteIds").toString() == noteIdsStr) {
+            notesListIni.setValue("NoteIds", mergedNoteIds.join(","));
+            return;
+        }
+        // The list changed while the gists were read. A note that moved to the top of the list has a new
+        // timestamp, so forget the ones read so far.
+        existingTimestamps.clear();
+    }
+}
+
+qint64 StorageManager::noteTimestamp(const QString &noteId)
+{
+    if (noteId.isEmpty()) {
+        return 0;
+    }
+    IniFile noteGistIni = notesDataIniFile("Notes/" % ID_PATH(noteId) % "/gist.ini");
+    qint64 timestamp = noteGistIni.value("UpdatedTime").toLongLong();
+    if (timestamp == 0) {
+        timestamp = noteGistIni.value("CreatedTime").toLongLong();
+    }
+    return timestamp;
+}
+
 // Offline notes
 
 bool StorageManager::noteNeedsToBeAvailableOffline(const QString &noteId)
@@ -2579,7 +3609,7 @@ bool StorageManager::noteAttachmentsAvailableOffline(const QString &noteId)
     foreach (const QVariant &map, attachmentsData(noteId)) {
         QVariantMap attachment = map.toMap();
         QString absoluteFilePath = attachment.value("FilePath").toString();
-        if (absoluteFilePath.isEmpty() || !QFileInfo(absoluteFilePath).exists()) {
+        if (absoluteFilePath.isEmpty()) {
             return false;
         }
     }
@@ -2620,9 +3650,11 @@ bool StorageManager::tryMakeNoteContentAvailableOfflineWithCachedData(const QStr
     }
     bool retrieved = SharedDiskCache::instance()->retrieveNoteContent(noteGuid, &content, &contentHash);
     if (retrieved) {
-        noteContentsIni.setValue("Content", content);
-        noteContentsIni.setValue("ContentHash", contentHash);
-        noteContentsIni.setValue("ContentValid", true);
+        QVariantMap contentData;
+        contentData[QString::fromLatin1("Content")] = content;
+        contentData[QString::fromLatin1("ContentHash")] = contentHash;
+        contentData[QString::fromLatin1("ContentValid")] = true;
+        setNoteContentValues(noteId, noteContentsIni, contentData);
         return true;
     }
     return false;
@@ -2657,13 +3689,15 @@ void StorageManager::makeNoteContentUnavailableOfflineIfUnedited(const QString &
         }
         bool alreadyInCache = SharedDiskCache::instance()->containsNoteContent(noteGuid, contentHash);
         if (!alreadyInCache) {
-            QByteArray content = noteContentsIni.value("Content").toByteArray();
+            QByteArray content = noteContentValue(noteId, noteContentsIni);
             SharedDiskCache::instance()->insertNoteContent(noteGuid, content, contentHash);
         }
         // remove from content ini file
-        noteContentsIni.setValue("ContentValid", false);
-        noteContentsIni.setValue("Content", QByteArray());
-        noteContentsIni.setValue("ContentHash", QByteArray());
+        QVariantMap contentData;
+        contentData[QString::fromLatin1("ContentValid")] = false;
+        contentData[QString::fromLatin1("Content")] = QByteArray();
+        contentData[QString::fromLatin1("ContentHash")] = QByteArray();
+        setNoteContentValues(noteId, noteContentsIni, contentData);
     }
 }
 
@@ -2681,9 +3715,8 @@ bool StorageManager::tryMakeNoteAttachmentsAvailableOfflineWithCachedData(const
         QVariantMap attachment = map.toMap();
         QString attachmentGuid = attachment.value("guid").toString();
         int attachmentSize = attachment.value("Size").toInt();
-        QString offlineAttachmentPath(notesDataFullPath() % "/Notes/" % ID_PATH(noteId) % "/Attachments/" % attachmentGuid);
-        QFileInfo fileInfo(offlineAttachmentPath);
-        if (!fileInfo.exists() || (fileInfo.size() != attachmentSize)) {
+        if (attachment.value("FilePath").toString().isEmpty()) {
+            QString offlineAttachmentPath(notesDataFullPath() % "/Notes/" % ID_PATH(noteId) % "/Attachments/" % attachmentGuid);
             // doesn't exist offline, so let's try to get it from the cache
             QDir(notesDataFullPath()).mkpath("Notes/" % ID_PATH(noteId) % "/Attachments/"); // make sure the dir exists
             QFile file(offlineAttachmentPath);
@@ -2694,6 +3727,10 @@ bool StorageManager::tryMakeNoteAttachmentsAvailableOfflineWithCachedData(const
             }
             if (!retrievedFromCache) {
                 allAttachmentsMadeAvailable = false;
+            } else {
+                file.close();
+                encryptFileIfRequired(offlineAttachmentPath);
+                setAttachmentFilePresent(noteId, attachmentGuid, true);
             }
         }
     }
@@ -2717,10 +3754,11 @@ void StorageManager::makeNoteAttachmentsUnavailableOffline(const QString &noteId
         QFileInfo fileInfo(offlineAttachmentPath);
         if (fileInfo.exists()) {
             QFile file(offlineAttachmentPath);
-            if (fileInfo.size() == attachmentSize) {
+            if (fileInfo.size() == attachmentSize && !EncryptedFile::isEncryptedFile(offlineAttachmentPath)) { // encrypted data doesn't go into the cache
                 SharedDiskCache::instance()->insertEvernoteNoteAttachment(webApiUrlPrefix, attachmentGuid, &file, attachmentSize);
             }
             file.remove();
+            setAttachmentFilePresent(noteId, attachmentGuid, false);
         }
     }
 }
@@ -2794,6 +3832,9 @@ bool StorageManager::setOfflineNoteAttachmentContent(const QString &noteId, cons
         return false;
     }
     attachmentFile->setAutoRemove(false);
+    attachmentFile->close();
+    encryptFileIfRequired(fileFullName);
+    setAttachmentFilePresent(noteId, QLatin1String(attachmentHash.constData()), true);
     return true;
 }
 
@@ -2913,6 +3954,25 @@ QStringList StorageManager::retrieveEvernoteSyncIdsList(const QString &key)
     return idsList;
 }
 
+bool StorageManager::removeFromEvernoteSyncIdsList(const QString &key, const QString &id)
+{
+    IniFile syncIni = evernoteDataIniFile("sync.ini");
+    QString idsListStr = syncIni.value(key).toString();
+    QStringList idsList;
+    if (!idsListStr.isEmpty()) {
+        idsList = idsListStr.split(',');
+    }
+    if (idsList.removeAll(id) > 0) {
+        if (idsList.isEmpty()) {
+            syncIni.removeKey(key);
+        } else {
+            syncIni.setValue(key, idsList.join(","));
+        }
+        return true;
+    }
+    return false;
+}
+
 void StorageManager::clearEvernoteSyncIdsList(const QString &key)
 {
     IniFile syncIni = evernoteDataIniFile("sync.ini");
@@ -2926,14 +3986,20 @@ void StorageManager::setActiveUser(const QString &username)
     {
         IniFile currentUserIni = sessionDataIniFile("session.ini");
         currentUserIni.setValue("Username", username);
-        if (username.isEmpty()) {
-            currentUserIni.setValue("UserDirName", "");
-        } else {
-            QByteArray userHash = QCryptographicHash::hash(username.toLower().toLatin1(), QCryptographicHash::Sha1).toHex().left(8);
-            m_activeUserDirName = QString("ev" % userHash);
-            currentUserIni.setValue("UserDirName", m_activeUserDirName);
-        }
+        currentUserIni.setValue("UserDirName", userDirNameForUser(username));
+    }
+    // Done outside the session.ini block, because storeContext() locks session.ini
+    // before the store context lock
+    switchStoreContext(userDirNameForUser(username));
+}
+
+QString StorageManager::userDirNameForUser(const QString &username)
+{
+    if (username.isEmpty()) {
+        return QString();
     }
+    QByteArray userHash = QCryptographicHash::hash(username.toLower().toLatin1(), QCryptographicHash::Sha1).toHex().left(8);
+    return QString("ev" % userHash);
 }
 
 QString StorageManager::activeUser()
@@ -2944,11 +4010,7 @@ QString StorageManager::activeUser()
 
 QString StorageManager::activeUserDirName()
 {
-    if (m_activeUserDirName.isEmpty()) {
-        IniFile currentUserIni = sessionDataIniFile("session.ini");
-        m_activeUserDirName = currentUserIni.value("UserDirName").toString();
-    }
-    return m_activeUserDirName;
+    return storeContext().userDirName;
 }
 
 void StorageManager::purgeActiveUserData()
@@ -2958,6 +4020,12 @@ void StorageManager::purgeActiveUserData()
         if (QFile::exists(notesDataLocation() % "/Store/Data/" % userDirName)) {
             rmMinusR(notesDataLocation() % "/Store/Data/" % userDirName);
         }
+        {
+#ifdef THREAD_SAFE_STORE
+            QMutexLocker locker(&m_storeContextLock);
+#endif
+            m_resolvedStoreContexts.remove(userDirName); // so that the dirs get recreated if this user logs in again
+        }
         setActiveUser("");
     }
 }
@@ -3124,11 +4192,14 @@ QVariantList StorageManager::listNotes(const QString &metaListFile, const QStrin
     return listNotesFromNoteIds(noteIdsList);
 }
 
-QVariantMap StorageManager::noteSummaryData(const QString &noteId)
+QVariantMap StorageManager::noteSummaryData(const QString &noteId, bool isContentSummaryNeeded)
 {
     QVariantMap noteDataMap;
     QString guid;
     qint64 timestamp;
+    QByteArray syncContentHash;
+    bool isContentSummaryStored = false;
+    QVariant storedSummaryText;
     {
         IniFile noteGistIni = notesDataIniFile("Notes/" % ID_PATH(noteId) % "/gist.ini");
         guid = noteGistIni.value("guid").toString();
@@ -3138,7 +4209,12 @@ QVariantMap StorageManager::noteSummaryData(const QString &noteId)
 
         QString thumbnailPath = noteGistIni.value("ThumbnailPath").toString();
         if (!thumbnailPath.isEmpty() && QFile::exists(notesDataLocation() % "/" % thumbnailPath)) {
-            noteDataMap[QString::fromLatin1("ThumbnailPath")] = QString("file:///" % notesDataLocation() % "/" % thumbnailPath);
+            if (noteGistIni.value("ThumbnailEncrypted").toBool()) {
+                // QmlNoteImageProvider can decrypt it
+                noteDataMap[QString::fromLatin1("ThumbnailPath")] = QString("image://noteimage/file:///" % notesDataLocation() % "/" % thumbnailPath);
+            } else {
+                noteDataMap[QString::fromLatin1("ThumbnailPath")] = QString("file:///" % notesDataLocation() % "/" % thumbnailPath);
+            }
             noteDataMap[QString::fromLatin1("ThumbnailWidth")] = noteGistIni.value("ThumbnailWidth").toInt();
             noteDataMap[QString::fromLatin1("ThumbnailHeight")] = noteGistIni.value("ThumbnailHeight").toInt();
         } else {
@@ -3153,25 +4229,65 @@ QVariantMap StorageManager::noteSummaryData(const QString &noteId)
         }
         noteDataMap[QString::fromLatin1("MillisecondsSinceEpoch")] = timestamp;
         noteDataMap[QString::fromLatin1("Timestamp")] = QDateTime::fromMSecsSinceEpoch(timestamp);
+
+        syncContentHash = noteGistIni.value("SyncContentHash").toByteArray();
+        // The counts are 0 till the summary is stored, when the content isn't read here
+        isContentSummaryStored = (noteGistIni.value("ContentSummaryVersion").toInt() == CONTENT_SUMMARY_VERSION);
+        noteDataMap[QString::fromLatin1("CheckedTodoCount")] = (isContentSummaryStored? noteGistIni.value("CheckedTodoCount").toInt() : 0);
+        noteDataMap[QString::fromLatin1("UncheckedTodoCount")] = (isContentSummaryStored? noteGistIni.value("UncheckedTodoCount").toInt() : 0);
+        noteDataMap[QString::fromLatin1("AttachmentCount")] = (isContentSummaryStored? noteGistIni.value("AttachmentCount").toInt() : 0);
+        if (isContentSummaryStored) {
+            storedSummaryText = noteGistIni.value("ContentSummary");
+        }
+    }
+    if (!isContentSummaryNeeded) {
+        noteDataMap[QString::fromLatin1("ContentSummary")] = QString("");
+        return noteDataMap;
+    }
+    if (isContentSummaryStored && storedSummaryText.isValid()) {
+        noteDataMap[QString::fromLatin1("ContentSummary")] = storedSummaryText.toString();
+        return noteDataMap;
     }
+    QByteArray enmlContent;
+    bool isContentCurrentAndComplete = true;
     {
         IniFile noteContentIni = notesDataIniFile("Notes/" % ID_PATH(noteId) % "/content.ini");
         bool contentValid = noteContentIni.value("ContentValid").toBool();
-        QByteArray enmlContent;
-        QString contentSummary;
         if (contentValid) {
-            enmlContent = noteContentIni.value("Content").toByteArray();
+            if (isContentSummaryStored) {
+                // Only the summary text is missing, because the content is encrypted. Decrypt only the first
+                // chunk or so. That usually has enough text for a summary.
+                enmlContent = noteContentValue(noteId, noteContentIni, 16 * 1024);
+                isContentCurrentAndComplete = false;
+            } else {
+                enmlContent = noteContentValue(noteId, noteContentIni);
+            }
         } else {
             Q_ASSERT(!guid.isEmpty());
             QByteArray cachedContent, cachedContentHash;
             SharedDiskCache::instance()->retrieveNoteContent(guid, &cachedContent, &cachedContentHash);
             enmlContent = cachedContent;
+            isContentCurrentAndComplete = (!cachedContentHash.isEmpty() && cachedContentHash == syncContentHash);
         }
-        if (!enmlContent.isEmpty()) {
-            contentSummary = EvernoteMarkup::plainTextFromEnml(enmlContent, 100);
+    }
+    QString contentSummary;
+    if (!enmlContent.isEmpty()) {
+        if (isContentSummaryStored) {
+            contentSummary = EvernoteMarkup::plainTextFromEnml(enmlContent, CONTENT_SUMMARY_LENGTH);
+        } else {
+            int checkedTodoCount = 0, uncheckedTodoCount = 0, attachmentCount = 0;
+            bool parsed = EvernoteMarkup::contentSummaryFromEnml(enmlContent, CONTENT_SUMMARY_LENGTH, &contentSummary,
+                                                                 &checkedTodoCount, &uncheckedTodoCount, &attachmentCount);
+            noteDataMap[QString::fromLatin1("CheckedTodoCount")] = checkedTodoCount;
+            noteDataMap[QString::fromLatin1("UncheckedTodoCount")] = uncheckedTodoCount;
+            noteDataMap[QString::fromLatin1("AttachmentCount")] = attachmentCount;
+            if (isContentCurrentAndComplete) {
+                // Backfill the summary of a note stored before there were summaries
+                storeNoteContentSummary(noteId, parsed, contentSummary, checkedTodoCount, uncheckedTodoCount, attachmentCount);
+            }
         }
-        noteDataMap[QString::fromLatin1("ContentSummary")] = contentSummary;
     }
+    noteDataMap[QString::fromLatin1("ContentSummary")] = contentSummary;
     return noteDataMap;
 }
 
@@ -3279,6 +4395,30 @@ bool StorageManager::addObjectIdToCollectionData(const QString &collectionIniFil
     return false;
 }
 
+void StorageManager::addObjectIdsToCollectionData(const QString &collectionIniFilename, const QString &objectListKey, const QStringList &objectIdsToAdd)
+{
+    if (objectIdsToAdd.isEmpty()) {
+        return;
+    }
+    IniFile collectionIni = notesDataIniFile(collectionIniFilename);
+    QString objectIdsStr = collectionIni.value(objectListKey).toString();
+    QStringList objectIds;
+    if (!objectIdsStr.isEmpty()) {
+        objectIds = objectIdsStr.split(",");
+    }
+    QSet<QString> existingObjectIds = objectIds.toSet();
+    QStringList newObjectIds;
+    foreach (const QString &objectId, objectIdsToAdd) {
+        if (!objectId.isEmpty() && !existingObjectIds.contains(objectId)) {
+            newObjectIds << objectId;
+            existingObjectIds << objectId;
+        }
+    }
+    if (!newObjectIds.isEmpty()) {
+        collectionIni.setValue(objectListKey, (newObjectIds + objectIds).join(","));
+    }
+}
+
 bool StorageManager::removeObjectIdFromCollectionData(const QString &collectionIniFilename, const QString &objectListKey, const QString &objectId)
 {
 #ifdef DEBUG
@@ -3438,23 +4578,76 @@ StorageManager::IniFile StorageManager::sessionDataIniFile(const QString &fileNa
     return IniFile(rawSettings("Store/Session/" % fileName));
 }
 
+StorageManager::StoreContext StorageManager::storeContext()
+{
+    {
+#ifdef THREAD_SAFE_STORE
+        QMutexLocker locker(&m_storeContextLock);
+#endif
+        if (m_isStoreContextSet) {
+            return m_storeContext;
+        }
+    }
+    QString userDirName;
+    {
+        IniFile currentUserIni = sessionDataIniFile("session.ini");
+        userDirName = currentUserIni.value("UserDirName").toString();
+    }
+#ifdef THREAD_SAFE_STORE
+    QMutexLocker locker(&m_storeContextLock);
+#endif
+    if (!m_isStoreContextSet) { // could have been set by setActiveUser() in the meantime
+        m_storeContext = resolvedStoreContext(userDirName);
+        m_isStoreContextSet = true;
+    }
+    return m_storeContext;
+}
+
+void StorageManager::switchStoreContext(const QString &userDirName)
+{
+#ifdef THREAD_SAFE_STORE
+    QMutexLocker locker(&m_storeContextLock);
+#endif
+    m_storeContext = resolvedStoreContext(userDirName);
+    m_isStoreContextSet = true;
+    bumpStoreGeneration();
+}
+
+// Should be called with m_storeContextLock locked
+StorageManager::StoreContext StorageManager::resolvedStoreContext(const QString &userDirName)
+{
+    QHash<QString, StoreContext>::const_iterator it = m_resolvedStoreContexts.constFind(userDirName);
+    if (it != m_resolvedStoreContexts.constEnd()) {
+        return it.value();
+    }
+    QString dirName = userDirName;
+    if (dirName.isEmpty()) {
+        dirName = "UNKNOWNUSER"; // Just in case
+    }
+    StoreContext context;
+    context.userDirName = userDirName;
+    context.notesDataRelativePath = "Store/Data/" % dirName % "/notedata";
+    context.notesDataFullPath = notesDataLocation() % "/" % context.notesDataRelativePath;
+    context.evernoteDataRelativePath = "Store/Data/" % dirName % "/evernote";
+    bool ok = QDir(notesDataLocation()).mkpath(context.notesDataRelativePath);
+    Q_ASSERT(ok);
+    Q_UNUSED(ok);
+    // Changing the stemming setting takes effect when the index is next created, and causes a reindex
+    SearchTokenizer::Options tokenizerOptions = ((retrieveStringSetting("Search/stemWords") == "true")?
+                                                     SearchTokenizer::Stemming : SearchTokenizer::NoOptions);
+    context.searchIndex = QSharedPointer<SearchIndex>(new SearchIndex(this, context.notesDataFullPath, tokenizerOptions));
+    m_resolvedStoreContexts.insert(userDirName, context);
+    return context;
+}
+
 QString StorageManager::notesDataFullPath()
 {
-    return notesDataLocation() % "/" % notesDataRelativePath();
+    return storeContext().notesDataFullPath;
 }
 
 QString StorageManager::notesDataRelativePath()
 {
-    QString userDirName = activeUserDirName();
-    if (userDirName.isEmpty()) {
-        userDirName = "UNKNOWNUSER"; // Just in case
-    }
-    QString path = "Store/Data/" % userDirName % "/notedata";
-    if (!QFile::exists(notesDataLocation() % "/" % path)) {
-        bool ok = QDir(notesDataLocation()).mkpath(path);
-        Q_ASSERT(ok);
-    }
-    return path;
+    return storeContext().notesDataRelativePath;
 }
 
 StorageManager::IniFile StorageManager::notesDataIniFile(const QString &fileName)
@@ -3464,19 +4657,14 @@ StorageManager::IniFile StorageManager::notesDataIniFile(const QString &fileName
 
 QString StorageManager::evernoteDataIniFilePath(const QString &fileName)
 {
-    QString userDirName = activeUserDirName();
-    if (userDirName.isEmpty()) {
-        userDirName = "UNKNOWNUSER"; // Just in case
-    }
-    return ("Store/Data/" % userDirName % "/evernote/" % fileName);
+    return (storeContext().evernoteDataRelativePath % "/" % fileName);
 }
 
 QString StorageManager::evernoteDataIniFilePathForUser(const QString &username, const QString &fileName)
 {
-    QString userDirName("UNKNOWNUSER");
-    if (!username.isEmpty()) {
-        QByteArray userHash = QCryptographicHash::hash(username.toLower().toLatin1(), QCryptographicHash::Sha1).toHex().left(8);
-        userDirName = QString("ev" % userHash);
+    QString userDirName = userDirNameForUser(username);
+    if (userDirName.isEmpty()) {
+        userDirName = "UNKNOWNUSER";
     }
     return ("Store/Data/" % userDirName % "/evernote/" % fileName);
 }
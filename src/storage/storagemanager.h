@@ -33,16 +33,22 @@
 #include <QVariant>
 #include <QDeclarativeContext> // for Q_DECLARE_METATYPE(QList<QObject*>)
 #include <QSet>
+#include <QHash>
 #include <QDeclarativeItem>
 #include <QExplicitlySharedDataPointer>
 #include <QMutex>
 #include <QReadWriteLock>
 #include <QTemporaryFile>
+#include <QSharedPointer>
+#include <QAtomicInt>
+#include <QVector>
+#include <QPair>
 
 #define THREAD_SAFE_STORE
 
 class StorageManager;
 class Logger;
+class SearchIndex;
 
 class StorageConstants : public QDeclarativeItem
 {
@@ -54,7 +60,8 @@ public:
         NoNotebook = 0x0,
         NormalNotebook = 0x1,
         FavouritesNotebook = 0x2,
-        TrashNotebook = 0x4
+        TrashNotebook = 0x4,
+        SavedSearchNotebook = 0x8
     };
     enum NotesListType {
         NoNotes = 0x0,
@@ -63,7 +70,8 @@ public:
         NotesWithTag = 0x4,
         FavouriteNotes = 0x8,
         TrashNotes = 0x10,
-        SearchResultNotes = 0x20
+        SearchResultNotes = 0x20,
+        SavedSearchNotes = 0x40
     };
     Q_DECLARE_FLAGS(NotebookTypes, NotebookType)
     Q_DECLARE_FLAGS(NotesListTypes, NotesListType)
@@ -94,11 +102,27 @@ public:
                                    const QByteArray &contentBaseHash /* value of contentBaseHash when the user opened this note */);
     QVariantList listNotes(StorageConstants::NotesListType whichNotes, const QString &objectId = QString() /* notebook/tag id */);
     QStringList listNoteIds(StorageConstants::NotesListType whichNotes, const QString &objectId = QString() /* notebook/tag id */);
-    QVariantMap noteSummaryData(const QString &noteId);
+    QVariantMap noteSummaryData(const QString &noteId, bool isContentSummaryNeeded = true);
     QVariantList listNotesFromNoteIds(const QStringList &noteIdsList);
     QVariantMap noteData(const QString &noteId); // returns Title, ContentFetched, Content, Favourite, Trashed
     QByteArray enmlContentFromContentIni(const QString &noteId, bool *ok = 0);
 
+    // Local search
+    QSharedPointer<SearchIndex> searchIndex(); // of the active user's store
+    bool searchableNoteData(const QString &noteId, QString *title, QByteArray *content, bool *isContentAvailable,
+                            QVariantMap *metadata = 0 /* CreatedTime, UpdatedTime, Source, AttachmentMimeTypes, AttachmentSearchTexts */); // returns false if the note doesn't exist
+    QString noteTitle(const QString &noteId); // reads only the gist
+    // The plain text of a note's content and the (start, end) of each indexed word in it, stored when the note is
+    // indexed, so that search results can show an excerpt around the matching words without reading the content
+    void setNoteSearchText(const QString &noteId, const QString &plainText, const QVector<QPair<int, int> > &wordRanges);
+    // Reads the text from the start of firstWord to the end of lastWord (clamped to the last word), and the ranges of
+    // those words relative to the excerpt. Returns false if the note has no stored text or firstWord is out of range.
+    bool noteSearchTextExcerpt(const QString &noteId, int firstWord, int lastWord,
+                               QString *excerpt, QVector<QPair<int, int> > *wordRanges, int *wordCount);
+    // Goes up whenever notes, notebooks or tags change, or the store is switched, so that results computed
+    // from the store can be reused for as long as it stays the same
+    int storeGeneration() const;
+
     QString setSyncedNoteGist(const QString &guid, const QString &title, qint32 usn, const QByteArray &contentHash, qint64 createdTime, qint64 updatedTime,
                               const QVariantMap &noteAttributes, bool *usnChanged = 0);
     bool setFetchedNoteContent(const QString &noteGuid, const QString &title, const QByteArray &content, const QByteArray &contentHash, qint32 usn, qint64 updatedTime,
@@ -149,6 +173,21 @@ public:
     QString guidForTagId(const QString &tagId);
     QString tagIdForGuid(const QString &guid);
 
+    // Saved searches are listed with the notebooks. The notes matching a saved search are stored with it, and are
+    // brought up-to-date by searching only the notes that changed since (see RefreshSavedSearchesThread).
+    QString setSyncedSavedSearchData(const QString &guid, const QString &name, const QString &query); // returns savedSearchId
+    QString savedSearchIdForGuid(const QString &guid);
+    QStringList listSavedSearchIds();
+    QString savedSearchQuery(const QString &savedSearchId);
+    bool savedSearchMatchingNoteIds(const QString &savedSearchId, QStringList *noteIds); // returns false if not stored yet
+    void setSavedSearchMatchingNoteIds(const QString &savedSearchId, const QStringList &noteIds);
+    void expungeSavedSearch(const QString &savedSearchId);
+    // The notes changed since the saved searches were last refreshed. The notes taken are returned again by the next
+    // call, unless doneRefreshingSavedSearches() is called in between.
+    bool hasNotesChangedForSavedSearches();
+    QStringList takeNotesChangedForSavedSearches();
+    void doneRefreshingSavedSearches();
+
     bool setFavouriteNote(const QString &noteId, bool isFavourite);
     bool isFavouriteNote(const QString &noteId);
 
@@ -169,6 +208,10 @@ public:
     void saveStringSetting(const QString &key, const QString &value);
     QString retrieveStringSetting(const QString &key);
 
+    // At-rest encryption is opt-in. When enabled, note content, attachments and thumbnails
+    // are stored encrypted as and when they get written.
+    bool isAtRestEncryptionEnabled();
+
     void setNoteHasUnpushedChanges(const QString &noteId, bool hasUnpushedChanges = true);
     QStringList notesWithUnpushedChanges();
     bool noteHasUnpushedChanges(const QString &noteId);
@@ -183,6 +226,9 @@ public:
     bool removeAttachmentData(const QString &noteId, const QByteArray &md5Hash);
     QVariantList attachmentsData(const QString &noteId);
     qint64 noteAttachmentsTotalSize(const QString &noteId);
+    // Text recognized by the server in attachments (like images of handwriting), used only for search
+    QVariantList attachmentsWithUnfetchedSearchText(const QString &noteId); // maps with "guid" and "Hash"
+    void setAttachmentSearchText(const QString &noteId, const QByteArray &md5Hash, const QString &searchText);
 
     bool saveCheckboxStates(const QString &noteId, const QVariantList &checkboxStates, const QByteArray &enmlContent, const QByteArray &previousBaseContentHash);
     bool appendTextToNote(const QString &noteId, const QString &text, const QByteArray &enmlContent, const QByteArray &previousBaseContentHash, QByteArray *updatedEnml, QByteArray *htmlToAdd);
@@ -193,6 +239,9 @@ public:
     bool setUnremovedTempFile(const QString &tempFilePath, bool unremoved = true);
     QStringList unremovedTempFiles();
 
+    // Bulk import
+    QStringList createImportedNotes(const QList<QVariantMap> &notesData, const QString &notebookId = QString()); // returns noteIds
+
     // Offline notes
     bool noteNeedsToBeAvailableOffline(const QString &noteId);
     bool noteContentAvailableOffline(const QString &noteId);
@@ -223,6 +272,7 @@ public:
     QVariant retrieveEvernoteSyncDataForUser(const QString &username, const QString &key);
     bool addToEvernoteSyncIdsList(const QString &key, const QString &id);
     QStringList retrieveEvernoteSyncIdsList(const QString &key);
+    bool removeFromEvernoteSyncIdsList(const QString &key, const QString &id);
     void clearEvernoteSyncIdsList(const QString &key);
 
     // User management: Different users have stuff stored separately
@@ -247,6 +297,8 @@ signals:
     void notesListChanged(StorageConstants::NotesListType whichNotes, const QString &objectId /* notebook/tag id */);
     void notebooksListChanged();
     void tagsListChanged();
+    void savedSearchesListChanged();
+    void notesChangedForSavedSearches();
     void noteCreated(const QString &noteId);
     void noteExpunged(const QString &noteId);
     void noteDisplayDataChanged(const QString &noteId, bool timestampChanged);
@@ -257,6 +309,10 @@ signals:
     void textAddedToLog(const QString &text);
     void logCleared();
 
+private slots:
+    void bumpStoreGeneration();
+    void markNoteChangedForSavedSearches(const QString &noteId);
+
 private:
 
     struct ThreadSafeSettings {
@@ -301,12 +357,41 @@ private:
     bool addNoteIdToTagData(const QString &noteId, const QString &tagId);
     bool removeNoteIdFromTagData(const QString &noteId, const QString &tagId);
     bool addObjectIdToCollectionData(const QString &collectionIniFilename, const QString &objectListKey, const QString &objectId);
+    void addObjectIdsToCollectionData(const QString &collectionIniFilename, const QString &objectListKey, const QStringList &objectIdsToAdd);
+    void insertNoteIdsInNotesListByTimestamp(QList<QPair<qint64, QString> > noteIdsWithTimestamps); // pairs of (timestamp, noteId)
+    qint64 noteTimestamp(const QString &noteId); // updated time, or created time if not updated
     bool removeObjectIdFromCollectionData(const QString &collectionIniFilename, const QString &objectListKey, const QString &objectId);
     void removeCollectionKey(const QString &collectionIniFilename, const QString &objectListKeyToRemove);
     void setGuidMapping(const QString &guidMapFile, const QString &guid, const QString &localId);
     void removeGuidMapping(const QString &guidMapFile, const QString &guid);
     QString localIdForGenericGuid(const QString &guidMapFile, const QString &guid);
     void removeNoteReferences(const QString &noteId, StorageConstants::NotesListTypes referencesInWhatLists);
+    void setNoteContentValues(const QString &noteId, IniFile &noteContentsIni, const QVariantMap &contentData);
+    QByteArray noteContentValue(const QString &noteId, const IniFile &noteContentsIni, int maxLength = -1);
+    QString attachmentSearchText(const QString &noteId, const IniFile &noteRecognitionIni, const QByteArray &md5Hash);
+    void setNoteContentSummary(const QString &noteId, const QByteArray &content); // should be called whenever the content changes
+    void storeNoteContentSummary(const QString &noteId, bool isParsed, const QString &summaryText,
+                                 int checkedTodoCount, int uncheckedTodoCount, int attachmentCount);
+    bool encryptFileIfRequired(const QString &filePath);
+    void markNoteChangedForSearch(const QString &noteId);
+    void unsetSavedSearchesReferringToCollections(); // should be called when a notebook or tag is renamed or removed
+    QSet<QString> presentAttachmentFiles(const QString &noteId, IniFile &noteAttachmentsIni);
+    void setPresentAttachmentFiles(IniFile &noteAttachmentsIni, const QSet<QString> &fileNames);
+    void setAttachmentFilePresent(const QString &noteId, const QString &fileName, bool isPresent);
+
+    // Paths for a user's store, resolved once and reused till the active user changes
+    struct StoreContext {
+        QString userDirName;
+        QString notesDataRelativePath;    // Store/Data/<userDirName>/notedata
+        QString notesDataFullPath;        // = notesDataLocation() + notesDataRelativePath
+        QString evernoteDataRelativePath; // Store/Data/<userDirName>/evernote
+        QSharedPointer<SearchIndex> searchIndex;
+    };
+    StoreContext storeContext();
+    StoreContext resolvedStoreContext(const QString &userDirName);
+    void switchStoreContext(const QString &userDirName);
+    static QString userDirNameForUser(const QString &username);
+    static QString resolvedNotesDataLocation();
 
     IniFile sessionDataIniFile(const QString &fileName);
     QString notesDataRelativePath();
@@ -333,9 +418,16 @@ private:
     QReadWriteLock m_cacheLock; // Ensures that the cache retains the data used in the IniFile object
                                 // for the lifetime of the IniFile object
 #endif
-    QString m_activeUserDirName;
     const QSettings::Format m_encryptedSettingsFormat;
     LoggingEnabledStatus m_loggingEnabledStatus;
+    StoreContext m_storeContext;
+    bool m_isStoreContextSet;
+    QHash<QString, StoreContext> m_resolvedStoreContexts; // key: userDirName
+#ifdef THREAD_SAFE_STORE
+    QMutex m_storeContextLock;
+#endif
+    const QString m_notesDataLocation;
+    QAtomicInt m_storeGeneration;
 
     static Logger *s_logger;                                           // static so that it can be used ...
     friend void redirectMessageToLog(QtMsgType type, const char *msg); // ... in this message handler